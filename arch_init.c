@@ -27,12 +27,14 @@
 #ifndef _WIN32
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <zlib.h>
 #endif
 #include "config.h"
 #include "monitor/monitor.h"
 #include "sysemu/sysemu.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
+#include "qemu/hbitmap.h"
 #include "sysemu/arch_init.h"
 #include "audio/audio.h"
 #include "hw/i386/pc.h"
@@ -40,6 +42,7 @@
 #include "hw/audio/audio.h"
 #include "sysemu/kvm.h"
 #include "migration/migration.h"
+#include "migration/postcopy-ram.h"
 #include "hw/i386/smbios.h"
 #include "exec/address-spaces.h"
 #include "hw/audio/pcspk.h"
@@ -127,6 +130,7 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
+#define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
 
 static struct defconfig_file {
     const char *filename;
@@ -160,7 +164,7 @@ int qemu_read_default_config_files(bool userconfig)
 
 static inline bool is_zero_range(uint8_t *p, uint64_t size)
 {
-    return buffer_find_nonzero_offset(p, size) == size;
+    return buffer_is_zero(p, size);
 }
 
 /* struct contains XBZRLE cache and a static page
@@ -170,7 +174,10 @@ static struct {
     uint8_t *encoded_buf;
     /* buffer for storing page content */
     uint8_t *current_buf;
-    /* Cache for XBZRLE, Protected by lock. */
+    /*
+     * Cache for XBZRLE, read under RCU; replaced with lock held. Pages
+     * are locked in the cache itself while they are used.
+     */
     PageCache *cache;
     QemuMutex lock;
 } XBZRLE;
@@ -178,23 +185,71 @@ static struct {
 /* buffer used for XBZRLE decoding */
 static uint8_t *xbzrle_decoded_buf;
 
-static void XBZRLE_cache_lock(void)
+/* Statistics of the caches replaced during this migration */
+static PageCacheStats xbzrle_cache_retired;
+
+typedef struct XBZRLECacheFree {
+    struct rcu_head rcu;
+    PageCache *cache;
+} XBZRLECacheFree;
+
+static void xbzrle_cache_free_rcu(XBZRLECacheFree *f)
 {
-    if (migrate_use_xbzrle())
-        qemu_mutex_lock(&XBZRLE.lock);
+    cache_fini(f->cache);
+    g_free(f);
 }
 
-static void XBZRLE_cache_unlock(void)
+/*
+ * Called with XBZRLE.lock held. The old cache may still be in use by
+ * the migration thread, it is freed once it is done with it.
+ */
+static void xbzrle_cache_replace(PageCache *new_cache)
 {
-    if (migrate_use_xbzrle())
-        qemu_mutex_unlock(&XBZRLE.lock);
+    PageCache *old_cache = XBZRLE.cache;
+    XBZRLECacheFree *f;
+    PageCacheStats stats;
+
+    atomic_rcu_set(&XBZRLE.cache, new_cache);
+    if (!old_cache) {
+        return;
+    }
+
+    cache_get_stats(old_cache, &stats);
+    xbzrle_cache_retired.hits += stats.hits;
+    xbzrle_cache_retired.misses += stats.misses;
+    xbzrle_cache_retired.evictions += stats.evictions;
+    xbzrle_cache_retired.insert_fails += stats.insert_fails;
+
+    f = g_new(XBZRLECacheFree, 1);
+    f->cache = old_cache;
+    call_rcu(f, xbzrle_cache_free_rcu, rcu);
+}
+
+void xbzrle_mig_cache_stats(PageCacheStats *stats)
+{
+    PageCache *cache;
+
+    rcu_read_lock();
+    cache = atomic_rcu_read(&XBZRLE.cache);
+    if (cache) {
+        cache_get_stats(cache, stats);
+    } else {
+        memset(stats, 0, sizeof(*stats));
+    }
+    rcu_read_unlock();
+
+    stats->hits += xbzrle_cache_retired.hits;
+    stats->misses += xbzrle_cache_retired.misses;
+    stats->evictions += xbzrle_cache_retired.evictions;
+    stats->insert_fails += xbzrle_cache_retired.insert_fails;
 }
 
 /*
  * called from qmp_migrate_set_cache_size in main thread, possibly while
  * a migration is in progress.
  * A running migration maybe using the cache and might finish during this
- * call, hence changes to the cache are protected by XBZRLE.lock().
+ * call, hence changes to the cache are protected by XBZRLE.lock(); the
+ * migration thread itself does not need it.
  */
 int64_t xbzrle_cache_resize(int64_t new_size)
 {
@@ -205,7 +260,7 @@ int64_t xbzrle_cache_resize(int64_t new_size)
         return -1;
     }
 
-    XBZRLE_cache_lock();
+    qemu_mutex_lock(&XBZRLE.lock);
 
     if (XBZRLE.cache != NULL) {
         if (pow2floor(new_size) == migrate_xbzrle_cache_size()) {
@@ -219,14 +274,13 @@ int64_t xbzrle_cache_resize(int64_t new_size)
             goto out;
         }
 
-        cache_fini(XBZRLE.cache);
-        XBZRLE.cache = new_cache;
+        xbzrle_cache_replace(new_cache);
     }
 
 out_new_size:
     ret = pow2floor(new_size);
 out:
-    XBZRLE_cache_unlock();
+    qemu_mutex_unlock(&XBZRLE.lock);
     return ret;
 }
 
@@ -237,6 +291,7 @@ typedef struct AccountingInfo {
     uint64_t norm_pages;
     uint64_t iterations;
     uint64_t log_dirty_time;
+    /* in microseconds */
     uint64_t migration_bitmap_time;
     uint64_t xbzrle_bytes;
     uint64_t xbzrle_pages;
@@ -289,7 +344,7 @@ uint64_t norm_mig_log_dirty_time(void)
 
 uint64_t norm_mig_bitmap_time(void)
 {
-    return acct_info.migration_bitmap_time;
+    return acct_info.migration_bitmap_time / 1000;
 }
 
 uint64_t xbzrle_mig_bytes_transferred(void)
@@ -323,10 +378,16 @@ static RAMBlock *last_seen_block;
 /* This is the last block from where we have sent data */
 static RAMBlock *last_sent_block;
 static ram_addr_t last_offset;
-static unsigned long *migration_bitmap;
+/*
+ * One bit per target page, indexed by ram_addr_t. Hierarchical, so that
+ * finding the next dirty page costs about the same however little is left.
+ */
+static HBitmap *migration_bitmap;
 static uint64_t migration_dirty_pages;
 static uint32_t last_version;
 static bool ram_bulk_stage;
+/* Set once the VM runs on the destination: pages are sent as they are */
+static bool ram_postcopy_active;
 
 /**
  * save_page_header: Write page header to wire
@@ -364,14 +425,18 @@ static size_t save_page_header(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
  */
 static void xbzrle_cache_zero_page(ram_addr_t current_addr)
 {
+    PageCache *cache;
+
     if (ram_bulk_stage || !migrate_use_xbzrle()) {
         return;
     }
 
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
-    cache_insert(XBZRLE.cache, current_addr, ZERO_TARGET_PAGE,
-                 bitmap_sync_count);
+    cache = atomic_rcu_read(&XBZRLE.cache);
+    cache_lock_page(cache, current_addr);
+    cache_insert(cache, current_addr, ZERO_TARGET_PAGE, bitmap_sync_count);
+    cache_unlock_page(cache, current_addr);
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -396,34 +461,39 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
                             ram_addr_t offset, bool last_stage,
                             uint64_t *bytes_transferred)
 {
+    PageCache *cache = atomic_rcu_read(&XBZRLE.cache);
     int encoded_len = 0, bytes_xbzrle;
     uint8_t *prev_cached_page;
 
-    if (!cache_is_cached(XBZRLE.cache, current_addr, bitmap_sync_count)) {
+    /* save current buffer into memory */
+    memcpy(XBZRLE.current_buf, *current_data, TARGET_PAGE_SIZE);
+
+    /*
+     * What is sent must be what is cached, and the cached page can only
+     * be used with the page locked: send from the copy instead.
+     */
+    cache_lock_page(cache, current_addr);
+    if (!cache_is_cached(cache, current_addr, bitmap_sync_count)) {
         acct_info.xbzrle_cache_miss++;
-        if (!last_stage) {
-            if (cache_insert(XBZRLE.cache, current_addr, *current_data,
-                             bitmap_sync_count) == -1) {
-                return -1;
-            } else {
-                /* update *current_data when the page has been
-                   inserted into cache */
-                *current_data = get_cached_data(XBZRLE.cache, current_addr);
-            }
+        if (!last_stage &&
+            cache_insert(cache, current_addr, XBZRLE.current_buf,
+                         bitmap_sync_count) != -1) {
+            /* update *current_data when the page has been
+               inserted into cache */
+            *current_data = XBZRLE.current_buf;
         }
+        cache_unlock_page(cache, current_addr);
         return -1;
     }
 
-    prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
-
-    /* save current buffer into memory */
-    memcpy(XBZRLE.current_buf, *current_data, TARGET_PAGE_SIZE);
+    prev_cached_page = get_cached_data(cache, current_addr);
 
     /* XBZRLE encoding (if there is no overflow) */
     encoded_len = xbzrle_encode_buffer(prev_cached_page, XBZRLE.current_buf,
                                        TARGET_PAGE_SIZE, XBZRLE.encoded_buf,
                                        TARGET_PAGE_SIZE);
     if (encoded_len == 0) {
+        cache_unlock_page(cache, current_addr);
         DPRINTF("Skipping unmodified page\n");
         return 0;
     } else if (encoded_len == -1) {
@@ -431,9 +501,10 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
         acct_info.xbzrle_overflows++;
         /* update data in the cache */
         if (!last_stage) {
-            memcpy(prev_cached_page, *current_data, TARGET_PAGE_SIZE);
-            *current_data = prev_cached_page;
+            memcpy(prev_cached_page, XBZRLE.current_buf, TARGET_PAGE_SIZE);
+            *current_data = XBZRLE.current_buf;
         }
+        cache_unlock_page(cache, current_addr);
         return -1;
     }
 
@@ -441,6 +512,7 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
     if (!last_stage) {
         memcpy(prev_cached_page, XBZRLE.current_buf, TARGET_PAGE_SIZE);
     }
+    cache_unlock_page(cache, current_addr);
 
     /* Send XBZRLE based compressed page */
     bytes_xbzrle = save_page_header(f, block, offset | RAM_SAVE_FLAG_XBZRLE);
@@ -468,12 +540,19 @@ ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
 
     if (ram_bulk_stage && nr > base) {
         next = nr + 1;
+    } else if (nr < size) {
+        HBitmapIter hbi;
+        int64_t item;
+
+        hbitmap_iter_init(&hbi, migration_bitmap, nr);
+        item = hbitmap_iter_next(&hbi);
+        next = item < 0 ? size : MIN(item, size);
     } else {
-        next = find_next_bit(migration_bitmap, size, nr);
+        next = size;
     }
 
     if (next < size) {
-        clear_bit(next, migration_bitmap);
+        hbitmap_reset(migration_bitmap, next, 1);
         migration_dirty_pages--;
     }
     return (next - base) << TARGET_PAGE_BITS;
@@ -481,52 +560,240 @@ ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
 
 static inline bool migration_bitmap_set_dirty(ram_addr_t addr)
 {
-    bool ret;
-    int nr = addr >> TARGET_PAGE_BITS;
+    uint64_t nr = addr >> TARGET_PAGE_BITS;
 
-    ret = test_and_set_bit(nr, migration_bitmap);
+    if (hbitmap_get(migration_bitmap, nr)) {
+        return true;
+    }
+    hbitmap_set(migration_bitmap, nr, 1);
+    migration_dirty_pages++;
+    return false;
+}
 
-    if (!ret) {
-        migration_dirty_pages++;
+/*
+ * Make sure the next pass (or MC checkpoint) sends this range again.
+ * Called with the iothread lock held.
+ */
+void ram_mark_dirty(ram_addr_t addr, ram_addr_t length)
+{
+    uint64_t first = addr >> TARGET_PAGE_BITS;
+    uint64_t end = (addr + length + TARGET_PAGE_SIZE - 1) >> TARGET_PAGE_BITS;
+    uint64_t count = hbitmap_count(migration_bitmap);
+
+    if (end > first) {
+        hbitmap_set(migration_bitmap, first, end - first);
+        migration_dirty_pages += hbitmap_count(migration_bitmap) - count;
     }
-    return ret;
 }
 
-static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
+/*
+ * With a lot of guest RAM, the merge is split in chunks of this many pages
+ * (1 GiB with 4 KiB pages), which helper threads and the migration thread
+ * pick up until there are none left.
+ */
+#define BITMAP_SYNC_CHUNK_PAGES  (1 << 18)
+#define BITMAP_SYNC_MAX_THREADS  8
+
+typedef struct BitmapSyncChunk {
+    unsigned long first;
+    unsigned long end;
+} BitmapSyncChunk;
+
+static struct {
+    QemuThread *threads;
+    int nr_threads;
+    QemuMutex lock;
+    /* workers wait for the generation to change, or for quit */
+    QemuCond work_cond;
+    QemuCond done_cond;
+    unsigned int gen;
+    bool quit;
+    /* workers still on the current sync */
+    int busy;
+    unsigned long *src;
+    BitmapSyncChunk *chunks;
+    int nr_chunks;
+    /* next chunk to pick up, atomic */
+    int next_chunk;
+    uint64_t num_dirty;
+} bitmap_sync;
+
+static uint64_t migration_bitmap_sync_chunks(void)
 {
-    ram_addr_t addr;
-    unsigned long page = BIT_WORD(start >> TARGET_PAGE_BITS);
+    uint64_t num = 0;
+    int i;
 
-    /* start address is aligned at the start of a word? */
-    if (((page * BITS_PER_LONG) << TARGET_PAGE_BITS) == start) {
-        int k;
-        int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
-        unsigned long *src = ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION];
+    while ((i = atomic_fetch_inc(&bitmap_sync.next_chunk)) <
+           bitmap_sync.nr_chunks) {
+        num += hbitmap_merge_clear_flat(migration_bitmap, bitmap_sync.src,
+                                        bitmap_sync.chunks[i].first,
+                                        bitmap_sync.chunks[i].end -
+                                        bitmap_sync.chunks[i].first);
+    }
+    return num;
+}
 
-        for (k = page; k < page + nr; k++) {
-            if (src[k]) {
-                unsigned long new_dirty;
-                new_dirty = ~migration_bitmap[k];
-                migration_bitmap[k] |= src[k];
-                new_dirty &= src[k];
-                migration_dirty_pages += ctpopl(new_dirty);
-                src[k] = 0;
-            }
+static void *migration_bitmap_sync_thread(void *opaque)
+{
+    unsigned int gen;
+    uint64_t num;
+
+    qemu_mutex_lock(&bitmap_sync.lock);
+    gen = bitmap_sync.gen;
+    while (true) {
+        while (bitmap_sync.gen == gen && !bitmap_sync.quit) {
+            qemu_cond_wait(&bitmap_sync.work_cond, &bitmap_sync.lock);
         }
-    } else {
-        for (addr = 0; addr < length; addr += TARGET_PAGE_SIZE) {
-            if (cpu_physical_memory_get_dirty(start + addr,
-                                              TARGET_PAGE_SIZE,
-                                              DIRTY_MEMORY_MIGRATION)) {
-                cpu_physical_memory_reset_dirty(start + addr,
-                                                TARGET_PAGE_SIZE,
-                                                DIRTY_MEMORY_MIGRATION);
-                migration_bitmap_set_dirty(start + addr);
-            }
+        if (bitmap_sync.quit) {
+            break;
+        }
+        gen = bitmap_sync.gen;
+        qemu_mutex_unlock(&bitmap_sync.lock);
+
+        num = migration_bitmap_sync_chunks();
+
+        qemu_mutex_lock(&bitmap_sync.lock);
+        bitmap_sync.num_dirty += num;
+        if (--bitmap_sync.busy == 0) {
+            qemu_cond_signal(&bitmap_sync.done_cond);
         }
     }
+    qemu_mutex_unlock(&bitmap_sync.lock);
+
+    return NULL;
+}
+
+static int migration_bitmap_sync_nr_threads(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    /* the migration thread does its share */
+    return MIN(cpus, BITMAP_SYNC_MAX_THREADS) - 1;
+#else
+    return 0;
+#endif
+}
+
+static void migration_bitmap_sync_threads_create(void)
+{
+    int i, n = migration_bitmap_sync_nr_threads();
+
+    if (n <= 0 || bitmap_sync.threads) {
+        return;
+    }
+
+    qemu_mutex_init(&bitmap_sync.lock);
+    qemu_cond_init(&bitmap_sync.work_cond);
+    qemu_cond_init(&bitmap_sync.done_cond);
+    bitmap_sync.quit = false;
+    bitmap_sync.threads = g_new0(QemuThread, n);
+    bitmap_sync.nr_threads = n;
+    for (i = 0; i < n; i++) {
+        qemu_thread_create(&bitmap_sync.threads[i], "bitmap_sync",
+                           migration_bitmap_sync_thread, NULL,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void migration_bitmap_sync_threads_join(void)
+{
+    int i;
+
+    if (!bitmap_sync.threads) {
+        return;
+    }
+
+    qemu_mutex_lock(&bitmap_sync.lock);
+    bitmap_sync.quit = true;
+    qemu_cond_broadcast(&bitmap_sync.work_cond);
+    qemu_mutex_unlock(&bitmap_sync.lock);
+
+    for (i = 0; i < bitmap_sync.nr_threads; i++) {
+        qemu_thread_join(&bitmap_sync.threads[i]);
+    }
+    g_free(bitmap_sync.threads);
+    bitmap_sync.threads = NULL;
+    bitmap_sync.nr_threads = 0;
+    g_free(bitmap_sync.chunks);
+    bitmap_sync.chunks = NULL;
+
+    qemu_cond_destroy(&bitmap_sync.done_cond);
+    qemu_cond_destroy(&bitmap_sync.work_cond);
+    qemu_mutex_destroy(&bitmap_sync.lock);
 }
 
+/*
+ * Merge the dirty log into migration_bitmap, with the helper threads if
+ * there is enough RAM for it. Called with the iothread lock held, which
+ * the helpers rely on as well. Returns the number of new dirty pages.
+ */
+static uint64_t migration_bitmap_sync_blocks(void)
+{
+    unsigned long *src = ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION];
+    uint64_t total_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
+    uint64_t num = 0;
+    RAMBlock *block;
+    int n = 0;
+
+    if (!bitmap_sync.threads || total_pages < 2 * BITMAP_SYNC_CHUNK_PAGES) {
+        rcu_read_lock();
+        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+            unsigned long first = block->mr->ram_addr >> TARGET_PAGE_BITS;
+
+            num += hbitmap_merge_clear_flat(migration_bitmap, src, first,
+                                            block->used_length >>
+                                            TARGET_PAGE_BITS);
+        }
+        rcu_read_unlock();
+        return num;
+    }
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        /* at most one more chunk than the whole ones it spans */
+        n += (block->used_length >> TARGET_PAGE_BITS) /
+             BITMAP_SYNC_CHUNK_PAGES + 2;
+    }
+    bitmap_sync.chunks = g_renew(BitmapSyncChunk, bitmap_sync.chunks, n);
+
+    n = 0;
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        unsigned long first = block->mr->ram_addr >> TARGET_PAGE_BITS;
+        unsigned long end = first + (block->used_length >> TARGET_PAGE_BITS);
+
+        while (first < end) {
+            unsigned long next = QEMU_ALIGN_UP(first + 1,
+                                               BITMAP_SYNC_CHUNK_PAGES);
+
+            bitmap_sync.chunks[n].first = first;
+            bitmap_sync.chunks[n].end = MIN(next, end);
+            first = bitmap_sync.chunks[n++].end;
+        }
+    }
+    rcu_read_unlock();
+
+    qemu_mutex_lock(&bitmap_sync.lock);
+    bitmap_sync.src = src;
+    bitmap_sync.nr_chunks = n;
+    bitmap_sync.next_chunk = 0;
+    bitmap_sync.num_dirty = 0;
+    bitmap_sync.busy = bitmap_sync.nr_threads;
+    bitmap_sync.gen++;
+    qemu_cond_broadcast(&bitmap_sync.work_cond);
+    qemu_mutex_unlock(&bitmap_sync.lock);
+
+    num = migration_bitmap_sync_chunks();
+
+    qemu_mutex_lock(&bitmap_sync.lock);
+    while (bitmap_sync.busy) {
+        qemu_cond_wait(&bitmap_sync.done_cond, &bitmap_sync.lock);
+    }
+    num += bitmap_sync.num_dirty;
+    qemu_mutex_unlock(&bitmap_sync.lock);
+
+    return num;
+}
 
 /* Fix me: there are too many global variables used in migration process. */
 static int64_t start_time;
@@ -538,18 +805,19 @@ static void migration_bitmap_sync_init(void)
     start_time = 0;
     bytes_xfer_prev = 0;
     num_dirty_pages_period = 0;
+    migration_bitmap_sync_threads_create();
 }
 
 /* Called with iothread lock held, to protect ram_list.dirty_memory[] */
 static void migration_bitmap_sync(void)
 {
-    RAMBlock *block;
     uint64_t num_dirty_pages_init = migration_dirty_pages;
     MigrationState *s = migrate_get_current();
     int64_t end_time;
     int64_t bytes_xfer_now;
     int64_t begin_time;
     int64_t dirty_time;
+    int64_t bitmap_time;
     static uint64_t xbzrle_cache_miss_prev;
     static uint64_t iterations_prev;
 
@@ -567,19 +835,18 @@ static void migration_bitmap_sync(void)
     address_space_sync_dirty_bitmap(&address_space_memory);
 
     dirty_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    rcu_read_lock();
-    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        migration_bitmap_sync_range(block->mr->ram_addr, block->used_length);
-    }
-    rcu_read_unlock();
+    bitmap_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    migration_dirty_pages += migration_bitmap_sync_blocks();
+    bitmap_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - bitmap_time;
 
     trace_migration_bitmap_sync_end(migration_dirty_pages
-                                    - num_dirty_pages_init);
+                                    - num_dirty_pages_init, bitmap_time);
     num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
     acct_info.log_dirty_time += dirty_time - begin_time;
-    acct_info.migration_bitmap_time += end_time - dirty_time;
+    acct_info.migration_bitmap_time += bitmap_time;
+    s->bitmap_sync_time = bitmap_time;
 
     /* more than 1 second = 1000 milliseconds */
     if (end_time > start_time + 1000) {
@@ -612,13 +879,440 @@ static void migration_bitmap_sync(void)
             iterations_prev = acct_info.iterations;
             xbzrle_cache_miss_prev = acct_info.xbzrle_cache_miss;
         }
-        s->dirty_pages_rate = num_dirty_pages_period * 1000
-            / (end_time - start_time);
-        s->dirty_bytes_rate = s->dirty_pages_rate * TARGET_PAGE_SIZE;
-        start_time = end_time;
-        num_dirty_pages_period = 0;
-        s->dirty_sync_count = bitmap_sync_count;
+        s->dirty_pages_rate = num_dirty_pages_period * 1000
+            / (end_time - start_time);
+        s->dirty_bytes_rate = s->dirty_pages_rate * TARGET_PAGE_SIZE;
+        start_time = end_time;
+        num_dirty_pages_period = 0;
+        s->dirty_sync_count = bitmap_sync_count;
+    }
+}
+
+/* Multiple-thread page compression (compress capability) */
+
+struct CompressParam {
+    bool start;
+    bool done;
+    QEMUFile *file;
+    QemuMutex mutex;
+    QemuCond cond;
+    RAMBlock *block;
+    ram_addr_t offset;
+    /* the page is compressed from this copy, which the guest cannot
+     * change meanwhile, so that the destination can check the result */
+    uint8_t *originbuf;
+};
+typedef struct CompressParam CompressParam;
+
+struct DecompressParam {
+    bool start;
+    bool done;
+    QemuMutex mutex;
+    QemuCond cond;
+    void *des;
+    uint8_t *compbuf;
+    int len;
+};
+typedef struct DecompressParam DecompressParam;
+
+static CompressParam *comp_param;
+static QemuThread *compress_threads;
+static int compress_thread_count;
+/* comp_done_cond wakes up the migration thread when one of the
+ * compression threads is done; comp_done_lock protects the done flags.
+ */
+static QemuMutex comp_done_lock;
+static QemuCond comp_done_cond;
+/* The file of each CompressParam only collects data */
+static const QEMUFileOps empty_ops = { };
+
+/* Cleared once XBZRLE, which does better, can take over */
+static bool compression_switch;
+static bool quit_comp_thread;
+static bool quit_decomp_thread;
+static DecompressParam *decomp_param;
+static QemuThread *decompress_threads;
+static int decompress_thread_count;
+static QemuMutex decomp_done_lock;
+static QemuCond decomp_done_cond;
+/* First decompression error of the threads, protected by decomp_done_lock */
+static int decomp_error;
+static uint8_t *compressed_data_buf;
+
+static int do_compress_ram_page(CompressParam *param);
+
+static void *do_data_compress(void *opaque)
+{
+    CompressParam *param = opaque;
+
+    while (!atomic_mb_read(&quit_comp_thread)) {
+        qemu_mutex_lock(&param->mutex);
+        /* Re-check quit_comp_thread, which may have been set before the
+         * lock was taken, so that the thread terminates as expected.
+         */
+        while (!param->start && !atomic_mb_read(&quit_comp_thread)) {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+        if (!atomic_mb_read(&quit_comp_thread)) {
+            do_compress_ram_page(param);
+        }
+        param->start = false;
+        qemu_mutex_unlock(&param->mutex);
+
+        qemu_mutex_lock(&comp_done_lock);
+        param->done = true;
+        qemu_cond_signal(&comp_done_cond);
+        qemu_mutex_unlock(&comp_done_lock);
+    }
+
+    return NULL;
+}
+
+static void migrate_compress_threads_create(void)
+{
+    int i;
+
+    compress_thread_count = migrate_compress_threads();
+    compress_threads = g_new0(QemuThread, compress_thread_count);
+    comp_param = g_new0(CompressParam, compress_thread_count);
+    qemu_mutex_init(&comp_done_lock);
+    qemu_cond_init(&comp_done_cond);
+    quit_comp_thread = false;
+    compression_switch = true;
+
+    for (i = 0; i < compress_thread_count; i++) {
+        comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
+        comp_param[i].originbuf = g_malloc(TARGET_PAGE_SIZE);
+        comp_param[i].done = true;
+        qemu_mutex_init(&comp_param[i].mutex);
+        qemu_cond_init(&comp_param[i].cond);
+        qemu_thread_create(compress_threads + i, "compress",
+                           do_data_compress, comp_param + i,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void migrate_compress_threads_join(void)
+{
+    int i;
+
+    if (!comp_param) {
+        return;
+    }
+
+    atomic_mb_set(&quit_comp_thread, true);
+    for (i = 0; i < compress_thread_count; i++) {
+        qemu_mutex_lock(&comp_param[i].mutex);
+        qemu_cond_signal(&comp_param[i].cond);
+        qemu_mutex_unlock(&comp_param[i].mutex);
+    }
+
+    for (i = 0; i < compress_thread_count; i++) {
+        qemu_thread_join(compress_threads + i);
+        qemu_fclose(comp_param[i].file);
+        g_free(comp_param[i].originbuf);
+        qemu_mutex_destroy(&comp_param[i].mutex);
+        qemu_cond_destroy(&comp_param[i].cond);
+    }
+
+    qemu_mutex_destroy(&comp_done_lock);
+    qemu_cond_destroy(&comp_done_cond);
+    g_free(compress_threads);
+    g_free(comp_param);
+    compress_threads = NULL;
+    comp_param = NULL;
+    compression_switch = false;
+}
+
+/* Called within an RCU critical section */
+static int do_compress_ram_page(CompressParam *param)
+{
+    int bytes_sent, blen;
+    uint8_t *p;
+    RAMBlock *block = param->block;
+    ram_addr_t offset = param->offset;
+
+    p = memory_region_get_ram_ptr(block->mr) + (offset & TARGET_PAGE_MASK);
+
+    bytes_sent = save_page_header(param->file, block, offset |
+                                  RAM_SAVE_FLAG_COMPRESS_PAGE);
+    memcpy(param->originbuf, p, TARGET_PAGE_SIZE);
+    blen = qemu_put_compression_data(param->file, param->originbuf,
+                                     TARGET_PAGE_SIZE,
+                                     migrate_compress_level());
+    bytes_sent += blen;
+
+    return bytes_sent;
+}
+
+static inline void start_compression(CompressParam *param)
+{
+    param->done = false;
+    qemu_mutex_lock(&param->mutex);
+    param->start = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+}
+
+static inline void set_compress_params(CompressParam *param, RAMBlock *block,
+                                       ram_addr_t offset)
+{
+    param->block = block;
+    param->offset = offset;
+}
+
+static uint64_t bytes_transferred;
+
+/* Wait for all compression threads and write out what they produced */
+static void flush_compressed_data(QEMUFile *f)
+{
+    int idx, len;
+
+    if (!comp_param) {
+        return;
+    }
+
+    for (idx = 0; idx < compress_thread_count; idx++) {
+        if (!comp_param[idx].done) {
+            qemu_mutex_lock(&comp_done_lock);
+            while (!comp_param[idx].done && !quit_comp_thread) {
+                qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+            }
+            qemu_mutex_unlock(&comp_done_lock);
+        }
+        if (!quit_comp_thread) {
+            len = qemu_put_qemu_file(f, comp_param[idx].file);
+            bytes_transferred += len;
+        }
+    }
+}
+
+static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
+                                           ram_addr_t offset,
+                                           uint64_t *bytes_transferred)
+{
+    int idx, bytes_xmit = -1, pages = -1;
+
+    qemu_mutex_lock(&comp_done_lock);
+    while (true) {
+        for (idx = 0; idx < compress_thread_count; idx++) {
+            if (comp_param[idx].done) {
+                /* Write out the previous page of this thread first */
+                bytes_xmit = qemu_put_qemu_file(f, comp_param[idx].file);
+                set_compress_params(&comp_param[idx], block, offset);
+                start_compression(&comp_param[idx]);
+                if (bytes_xmit > 0) {
+                    acct_info.norm_pages++;
+                    *bytes_transferred += bytes_xmit;
+                }
+                pages = 1;
+                break;
+            }
+        }
+        if (pages > 0) {
+            break;
+        } else {
+            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&comp_done_lock);
+
+    return pages;
+}
+
+/* Returns 0 if @len bytes at @compbuf inflate to exactly one page */
+static int decompress_page(void *host, const uint8_t *compbuf, int len)
+{
+    unsigned long pagesize = TARGET_PAGE_SIZE;
+    int ret;
+
+    ret = uncompress((Bytef *)host, &pagesize, (const Bytef *)compbuf, len);
+    if (ret != Z_OK || pagesize != TARGET_PAGE_SIZE) {
+        error_report("Failed to decompress page (zlib error %d)", ret);
+        return -EIO;
+    }
+    return 0;
+}
+
+static void *do_data_decompress(void *opaque)
+{
+    DecompressParam *param = opaque;
+    int ret = 0;
+
+    while (!atomic_mb_read(&quit_decomp_thread)) {
+        qemu_mutex_lock(&param->mutex);
+        while (!param->start && !atomic_mb_read(&quit_decomp_thread)) {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+        if (!atomic_mb_read(&quit_decomp_thread)) {
+            ret = decompress_page(param->des, param->compbuf, param->len);
+        }
+        param->start = false;
+        qemu_mutex_unlock(&param->mutex);
+
+        qemu_mutex_lock(&decomp_done_lock);
+        if (ret < 0 && !decomp_error) {
+            decomp_error = ret;
+        }
+        ret = 0;
+        param->done = true;
+        qemu_cond_signal(&decomp_done_cond);
+        qemu_mutex_unlock(&decomp_done_lock);
+    }
+
+    return NULL;
+}
+
+void migrate_decompress_threads_create(void)
+{
+    int i;
+
+    decompress_thread_count = migrate_decompress_threads();
+    decompress_threads = g_new0(QemuThread, decompress_thread_count);
+    decomp_param = g_new0(DecompressParam, decompress_thread_count);
+    qemu_mutex_init(&decomp_done_lock);
+    qemu_cond_init(&decomp_done_cond);
+    quit_decomp_thread = false;
+    decomp_error = 0;
+
+    for (i = 0; i < decompress_thread_count; i++) {
+        qemu_mutex_init(&decomp_param[i].mutex);
+        qemu_cond_init(&decomp_param[i].cond);
+        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+        decomp_param[i].done = true;
+        qemu_thread_create(decompress_threads + i, "decompress",
+                           do_data_decompress, decomp_param + i,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+/*
+ * Wait until all pages handed to the decompression threads have landed.
+ * Returns the first decompression error, if any.
+ */
+static int wait_for_decompress_done(void)
+{
+    int idx, ret;
+
+    if (!decomp_param) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&decomp_done_lock);
+    for (idx = 0; idx < decompress_thread_count; idx++) {
+        while (!decomp_param[idx].done) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        }
+    }
+    ret = decomp_error;
+    qemu_mutex_unlock(&decomp_done_lock);
+
+    return ret;
+}
+
+void migrate_decompress_threads_join(void)
+{
+    int i;
+
+    if (!decomp_param) {
+        return;
+    }
+
+    wait_for_decompress_done();
+
+    atomic_mb_set(&quit_decomp_thread, true);
+    for (i = 0; i < decompress_thread_count; i++) {
+        qemu_mutex_lock(&decomp_param[i].mutex);
+        qemu_cond_signal(&decomp_param[i].cond);
+        qemu_mutex_unlock(&decomp_param[i].mutex);
+    }
+
+    for (i = 0; i < decompress_thread_count; i++) {
+        qemu_thread_join(decompress_threads + i);
+        qemu_mutex_destroy(&decomp_param[i].mutex);
+        qemu_cond_destroy(&decomp_param[i].cond);
+        g_free(decomp_param[i].compbuf);
+    }
+
+    qemu_mutex_destroy(&decomp_done_lock);
+    qemu_cond_destroy(&decomp_done_cond);
+    g_free(decompress_threads);
+    g_free(decomp_param);
+    decompress_threads = NULL;
+    decomp_param = NULL;
+}
+
+/*
+ * The decompression threads only exist during an incoming migration with
+ * the compress capability set. Otherwise (capability off on this side,
+ * or micro-checkpoints loading RAM once the threads are gone) decompress
+ * those pages inline.
+ *
+ * Returns an error if this page, or one handed to the threads before,
+ * could not be decompressed.
+ */
+static int decompress_data_with_multi_threads(uint8_t *compbuf,
+                                              void *host, int len)
+{
+    int idx, ret;
+
+    if (!decomp_param) {
+        return decompress_page(host, compbuf, len);
+    }
+
+    qemu_mutex_lock(&decomp_done_lock);
+    ret = decomp_error;
+    while (!ret) {
+        for (idx = 0; idx < decompress_thread_count; idx++) {
+            if (decomp_param[idx].done) {
+                decomp_param[idx].done = false;
+                qemu_mutex_lock(&decomp_param[idx].mutex);
+                memcpy(decomp_param[idx].compbuf, compbuf, len);
+                decomp_param[idx].des = host;
+                decomp_param[idx].len = len;
+                decomp_param[idx].start = true;
+                qemu_cond_signal(&decomp_param[idx].cond);
+                qemu_mutex_unlock(&decomp_param[idx].mutex);
+                break;
+            }
+        }
+        if (idx < decompress_thread_count) {
+            break;
+        }
+        qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        ret = decomp_error;
+    }
+    qemu_mutex_unlock(&decomp_done_lock);
+
+    return ret;
+}
+
+/**
+ * save_zero_page: Send the zero page to the stream
+ *
+ * Returns: Number of pages written, -1 if the page is not zero.
+ *
+ * @f: QEMUFile where to send the data
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ * @p: pointer to the page
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int save_zero_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                          uint8_t *p, uint64_t *bytes_transferred)
+{
+    int pages = -1;
+
+    if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+        acct_info.dup_pages++;
+        *bytes_transferred += save_page_header(f, block,
+                                               offset | RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, 0);
+        *bytes_transferred += 1;
+        pages = 1;
     }
+
+    return pages;
 }
 
 /**
@@ -654,8 +1348,6 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
         pages = 1;
     }
 
-    XBZRLE_cache_lock();
-
     current_addr = block->offset + offset;
 
     if (block == last_sent_block) {
@@ -669,26 +1361,38 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
                 acct_info.dup_pages++;
             }
         }
-    } else if (is_zero_range(p, TARGET_PAGE_SIZE)) {
-        acct_info.dup_pages++;
-        *bytes_transferred += save_page_header(f, block,
-                                               offset | RAM_SAVE_FLAG_COMPRESS);
-        qemu_put_byte(f, 0);
-        *bytes_transferred += 1;
-        pages = 1;
-        /* Must let xbzrle know, otherwise a previous (now 0'd) cached
-         * page would be stale
-         */
-        xbzrle_cache_zero_page(current_addr);
-    } else if (!ram_bulk_stage && migrate_use_xbzrle()) {
-        pages = save_xbzrle_page(f, &p, current_addr, block,
-                                 offset, last_stage, bytes_transferred);
-        if (!last_stage) {
-            /* Can't send this cached data async, since the cache page
-             * might get updated before it gets to the wire
+    } else {
+        pages = save_zero_page(f, block, offset, p, bytes_transferred);
+        if (pages > 0) {
+            /* Must let xbzrle know, otherwise a previous (now 0'd) cached
+             * page would be stale
              */
-            send_async = false;
+            xbzrle_cache_zero_page(current_addr);
+        } else if (!ram_bulk_stage && migrate_use_xbzrle() &&
+                   !ram_postcopy_active) {
+            pages = save_xbzrle_page(f, &p, current_addr, block,
+                                     offset, last_stage, bytes_transferred);
+            if (!last_stage) {
+                /* Can't send this data async, since XBZRLE.current_buf
+                 * gets reused before it gets to the wire
+                 */
+                send_async = false;
+            }
+        }
+    }
+
+    /* Sent on a multifd channel: nothing goes on f */
+    if (pages == -1 && send_async && multifd_send_active() &&
+        !ram_postcopy_active) {
+        ret = multifd_queue_page(block->idstr, offset & TARGET_PAGE_MASK,
+                                 p, TARGET_PAGE_SIZE);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
         }
+        qemu_file_credit_transfer(f, TARGET_PAGE_SIZE);
+        *bytes_transferred += TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+        return 1;
     }
 
     /* XBZRLE overflow or normal page */
@@ -705,7 +1409,81 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
         acct_info.norm_pages++;
     }
 
-    XBZRLE_cache_unlock();
+    if (pages > 0) {
+        last_sent_block = block;
+    }
+
+    return pages;
+}
+
+/**
+ * ram_save_compressed_page: compress the given page and send it to the stream
+ *
+ * Returns: Number of pages written.
+ *
+ * @f: QEMUFile where to send the data
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ * @last_stage: if we are at the completion stage
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int ram_save_compressed_page(QEMUFile *f, RAMBlock *block,
+                                    ram_addr_t offset, bool last_stage,
+                                    uint64_t *bytes_transferred)
+{
+    int pages = -1;
+    uint64_t bytes_xmit;
+    MemoryRegion *mr = block->mr;
+    uint8_t *p;
+    int ret;
+
+    p = memory_region_get_ram_ptr(mr) + offset;
+
+    bytes_xmit = 0;
+    ret = ram_control_save_page(f, block->offset,
+                                offset, TARGET_PAGE_SIZE, &bytes_xmit);
+    if (bytes_xmit) {
+        *bytes_transferred += bytes_xmit;
+        pages = 1;
+    }
+    if (block == last_sent_block) {
+        offset |= RAM_SAVE_FLAG_CONTINUE;
+    }
+    if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
+        if (ret != RAM_SAVE_CONTROL_DELAYED) {
+            if (bytes_xmit > 0) {
+                acct_info.norm_pages++;
+            } else if (bytes_xmit == 0) {
+                acct_info.dup_pages++;
+            }
+        }
+    } else if (block != last_sent_block) {
+        /* The first page of a block carries the block name, which the
+         * following pages omit: it must go out after all pages of the
+         * previous block and before the other pages of this one.
+         */
+        flush_compressed_data(f);
+        pages = save_zero_page(f, block, offset, p, bytes_transferred);
+        if (pages == -1) {
+            set_compress_params(&comp_param[0], block, offset);
+            /* Compress it in this thread so that it is sent first */
+            bytes_xmit = do_compress_ram_page(&comp_param[0]);
+            acct_info.norm_pages++;
+            qemu_put_qemu_file(f, comp_param[0].file);
+            *bytes_transferred += bytes_xmit;
+            pages = 1;
+        }
+    } else {
+        pages = save_zero_page(f, block, offset, p, bytes_transferred);
+        if (pages == -1) {
+            pages = compress_page_with_multi_thread(f, block, offset,
+                                                    bytes_transferred);
+        }
+    }
+
+    if (pages > 0) {
+        last_sent_block = block;
+    }
 
     return pages;
 }
@@ -753,13 +1531,24 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
                 block = QLIST_FIRST_RCU(&ram_list.blocks);
                 complete_round = true;
                 ram_bulk_stage = false;
+                if (migrate_use_xbzrle()) {
+                    /* XBZRLE does better than compression once the
+                     * cache is warm: stop compressing from now on.
+                     */
+                    flush_compressed_data(f);
+                    compression_switch = false;
+                }
             }
         } else {
-            pages = ram_save_page(f, block, offset, last_stage,
-                                  bytes_transferred);
+            if (compression_switch) {
+                pages = ram_save_compressed_page(f, block, offset, last_stage,
+                                                 bytes_transferred);
+            } else {
+                pages = ram_save_page(f, block, offset, last_stage,
+                                      bytes_transferred);
+            }
             /* if page is unmodified, continue to the next */
             if (pages > 0) {
-                last_sent_block = block;
                 break;
             }
         }
@@ -771,7 +1560,201 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
     return pages;
 }
 
-static uint64_t bytes_transferred;
+/* Postcopy (postcopy-ram capability) */
+
+/* Ranges of dirty pages per POSTCOPY_CMD_DISCARD */
+#define POSTCOPY_DISCARD_MAX 256
+
+typedef struct RAMPageRequest {
+    RAMBlock *block;
+    ram_addr_t offset;
+    QSIMPLEQ_ENTRY(RAMPageRequest) next;
+} RAMPageRequest;
+
+static QemuMutex page_requests_lock;
+static QSIMPLEQ_HEAD(, RAMPageRequest) page_requests =
+    QSIMPLEQ_HEAD_INITIALIZER(page_requests);
+static uint64_t postcopy_requests;
+
+/* Every page has been sent at least once */
+bool ram_postcopy_ready(void)
+{
+    return !ram_bulk_stage;
+}
+
+uint64_t ram_postcopy_requests(void)
+{
+    return postcopy_requests;
+}
+
+/*
+ * Switch to postcopy, with the VM stopped: tell the destination which
+ * pages changed after they were sent, so that it drops them. They are
+ * sent again later, in the background or when the guest asks for them.
+ * Called with the iothread lock held.
+ */
+void ram_postcopy_send_discard(QEMUFile *f)
+{
+    uint64_t start[POSTCOPY_DISCARD_MAX], length[POSTCOPY_DISCARD_MAX];
+    RAMBlock *block;
+
+    rcu_read_lock();
+    migration_bitmap_sync();
+
+    /* The destination places pages one at a time, from the main stream */
+    compression_switch = false;
+    multifd_save_cleanup();
+
+    qemu_mutex_lock(&page_requests_lock);
+    ram_postcopy_active = true;
+    postcopy_requests = 0;
+    qemu_mutex_unlock(&page_requests_lock);
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        unsigned long base = block->offset >> TARGET_PAGE_BITS;
+        unsigned long end = base + (block->used_length >> TARGET_PAGE_BITS);
+        int64_t run = -1, run_end = -1, item = -1;
+        HBitmapIter hbi;
+        uint32_t nr = 0;
+
+        if (base >= end) {
+            continue;
+        }
+
+        /* Runs of dirty pages, one past the end flushes the last one */
+        hbitmap_iter_init(&hbi, migration_bitmap, base);
+        do {
+            item = hbitmap_iter_next(&hbi);
+            if (item < 0 || item > end) {
+                item = end;
+            }
+            if (item == run_end && item < end) {
+                run_end++;
+                continue;
+            }
+            if (run >= 0) {
+                start[nr] = (uint64_t) (run - base) << TARGET_PAGE_BITS;
+                length[nr] = (uint64_t) (run_end - run) << TARGET_PAGE_BITS;
+                if (++nr == POSTCOPY_DISCARD_MAX) {
+                    qemu_savevm_send_postcopy_discard(f, block->idstr, nr,
+                                                      start, length);
+                    nr = 0;
+                }
+            }
+            run = item;
+            run_end = item + 1;
+        } while (item < end);
+
+        if (nr) {
+            qemu_savevm_send_postcopy_discard(f, block->idstr, nr,
+                                              start, length);
+        }
+    }
+    rcu_read_unlock();
+}
+
+/*
+ * Called on the return path thread for each page the guest is waiting
+ * for on the destination.
+ */
+int ram_save_queue_page(const char *idstr, ram_addr_t offset)
+{
+    RAMPageRequest *req;
+    RAMBlock *block;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (!strcmp(idstr, block->idstr)) {
+            break;
+        }
+    }
+
+    if (!block || offset >= block->used_length) {
+        rcu_read_unlock();
+        error_report("postcopy: request for bad page %s " RAM_ADDR_FMT,
+                     idstr, offset);
+        return -EINVAL;
+    }
+
+    req = g_malloc0(sizeof(*req));
+    req->block = block;
+    req->offset = offset & TARGET_PAGE_MASK;
+    memory_region_ref(block->mr);
+    rcu_read_unlock();
+
+    qemu_mutex_lock(&page_requests_lock);
+    if (ram_postcopy_active) {
+        QSIMPLEQ_INSERT_TAIL(&page_requests, req, next);
+        postcopy_requests++;
+        req = NULL;
+    }
+    qemu_mutex_unlock(&page_requests_lock);
+
+    if (req) {
+        /* Too late, everything has been sent */
+        memory_region_unref(req->block->mr);
+        g_free(req);
+    }
+
+    return 0;
+}
+
+static RAMPageRequest *ram_next_page_request(void)
+{
+    RAMPageRequest *req;
+
+    qemu_mutex_lock(&page_requests_lock);
+    req = QSIMPLEQ_FIRST(&page_requests);
+    if (req) {
+        QSIMPLEQ_REMOVE_HEAD(&page_requests, next);
+    }
+    qemu_mutex_unlock(&page_requests_lock);
+
+    return req;
+}
+
+/*
+ * Send the pages the destination asked for, ahead of the others. They
+ * are sent whether they are dirty or not: a page which was zero when it
+ * was sent was never written on the destination, and the guest may well
+ * be waiting for it. Called within an RCU critical section.
+ */
+static int ram_save_queued_pages(QEMUFile *f)
+{
+    RAMPageRequest *req;
+    int pages = 0;
+
+    while ((req = ram_next_page_request())) {
+        unsigned long nr = (req->block->offset + req->offset)
+                           >> TARGET_PAGE_BITS;
+
+        if (hbitmap_get(migration_bitmap, nr)) {
+            hbitmap_reset(migration_bitmap, nr, 1);
+            migration_dirty_pages--;
+        }
+        pages += ram_save_page(f, req->block, req->offset, true,
+                               &bytes_transferred);
+
+        memory_region_unref(req->block->mr);
+        g_free(req);
+    }
+
+    return pages;
+}
+
+static void ram_postcopy_end(void)
+{
+    RAMPageRequest *req;
+
+    qemu_mutex_lock(&page_requests_lock);
+    ram_postcopy_active = false;
+    qemu_mutex_unlock(&page_requests_lock);
+
+    while ((req = ram_next_page_request())) {
+        memory_region_unref(req->block->mr);
+        g_free(req);
+    }
+}
 
 void acct_update_position(QEMUFile *f, size_t size, bool zero)
 {
@@ -820,22 +1803,26 @@ void free_xbzrle_decoded_buf(void)
 
 static void migration_end(void)
 {
+    multifd_save_cleanup();
+    migrate_compress_threads_join();
+    migration_bitmap_sync_threads_join();
+    ram_postcopy_end();
+
     if (migration_bitmap) {
         memory_global_dirty_log_stop();
-        g_free(migration_bitmap);
+        hbitmap_free(migration_bitmap);
         migration_bitmap = NULL;
     }
 
-    XBZRLE_cache_lock();
+    qemu_mutex_lock(&XBZRLE.lock);
     if (XBZRLE.cache) {
-        cache_fini(XBZRLE.cache);
+        xbzrle_cache_replace(NULL);
         g_free(XBZRLE.encoded_buf);
         g_free(XBZRLE.current_buf);
-        XBZRLE.cache = NULL;
         XBZRLE.encoded_buf = NULL;
         XBZRLE.current_buf = NULL;
     }
-    XBZRLE_cache_unlock();
+    qemu_mutex_unlock(&XBZRLE.lock);
 }
 
 static void ram_migration_cancel(void *opaque)
@@ -887,16 +1874,18 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     migration_bitmap_sync_init();
 
     if (migrate_use_xbzrle()) {
-        XBZRLE_cache_lock();
-        XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
-                                  TARGET_PAGE_SIZE,
-                                  TARGET_PAGE_SIZE);
-        if (!XBZRLE.cache) {
-            XBZRLE_cache_unlock();
+        PageCache *cache = cache_init(migrate_xbzrle_cache_size() /
+                                      TARGET_PAGE_SIZE,
+                                      TARGET_PAGE_SIZE);
+
+        if (!cache) {
             error_report("Error creating cache");
             return -1;
         }
-        XBZRLE_cache_unlock();
+        qemu_mutex_lock(&XBZRLE.lock);
+        memset(&xbzrle_cache_retired, 0, sizeof(xbzrle_cache_retired));
+        atomic_rcu_set(&XBZRLE.cache, cache);
+        qemu_mutex_unlock(&XBZRLE.lock);
 
         /* We prefer not to abort if there is no memory */
         XBZRLE.encoded_buf = g_try_malloc0(TARGET_PAGE_SIZE);
@@ -916,6 +1905,16 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         acct_clear();
     }
 
+    /* Micro-checkpoints are sent on the main stream only */
+    if (migrate_use_multifd() && !migrate_use_mc()) {
+        multifd_save_setup(f);
+    }
+
+    /* Pages on multifd channels are sent as they are */
+    if (migrate_use_compression() && !multifd_send_active()) {
+        migrate_compress_threads_create();
+    }
+
     /* iothread lock needed for ram_list.dirty_memory[] */
     qemu_mutex_lock_iothread();
     qemu_mutex_lock_ramlist();
@@ -924,8 +1923,8 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     reset_ram_globals(true);
 
     ram_bitmap_pages = last_ram_offset() >> TARGET_PAGE_BITS;
-    migration_bitmap = bitmap_new(ram_bitmap_pages);
-    bitmap_set(migration_bitmap, 0, ram_bitmap_pages);
+    migration_bitmap = hbitmap_alloc(ram_bitmap_pages, 0);
+    hbitmap_set(migration_bitmap, 0, ram_bitmap_pages);
 
     /*
      * Count the total number of pages used by ram blocks not including any
@@ -980,6 +1979,10 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     while ((ret = qemu_file_rate_limit(f)) == 0) {
         int pages;
 
+        if (ram_postcopy_active) {
+            pages_sent += ram_save_queued_pages(f);
+        }
+
         pages = ram_find_and_save_block(f, false, &bytes_transferred);
         /* no more pages to sent */
         if (pages == 0) {
@@ -1003,6 +2006,13 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         }
         i++;
     }
+
+    /* Pages still queued must land before the next bitmap sync */
+    flush_compressed_data(f);
+    ret = multifd_send_sync_main(f);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
     rcu_read_unlock();
 
     /*
@@ -1025,12 +2035,18 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 /* Called with iothread lock */
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
+    int ret;
+
     rcu_read_lock();
 
     migration_bitmap_sync();
 
     ram_control_before_iterate(f, RAM_CONTROL_FINISH);
 
+    if (ram_postcopy_active) {
+        ram_save_queued_pages(f);
+    }
+
     /* try transferring iterative blocks of memory */
 
     /* flush all remaining blocks regardless of rate limiting */
@@ -1044,8 +2060,14 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         }
     }
 
+    flush_compressed_data(f);
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
+    ret = multifd_send_sync_main(f);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+
     /*
      * Only cleanup at the end of normal migrations
      * or if the MC destination failed and we got an error.
@@ -1148,6 +2170,47 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     return NULL;
 }
 
+/*
+ * Host address of @size bytes at @offset in the RAMBlock @idstr, for
+ * pages received outside of ram_load() (multifd channels, postcopy
+ * discards). Called within an RCU critical section.
+ */
+void *ram_block_host(const char *idstr, ram_addr_t offset, size_t size)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (!strcmp(idstr, block->idstr)) {
+            if (offset >= block->max_length ||
+                size > block->max_length - offset) {
+                return NULL;
+            }
+            return memory_region_get_ram_ptr(block->mr) + offset;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Name of the RAMBlock containing @host and offset of @host in it, or
+ * NULL if @host is not guest RAM. Called within an RCU critical section.
+ */
+const char *ram_block_from_host(void *host, ram_addr_t *offset)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if ((uint8_t *)host >= block->host &&
+            (uint8_t *)host < block->host + block->used_length) {
+            *offset = (uint8_t *)host - block->host;
+            return block->idstr;
+        }
+    }
+
+    return NULL;
+}
+
 /*
  * If a page (or a whole RDMA chunk) has been
  * determined to be zero, then zap it.
@@ -1161,11 +2224,18 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
 
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
-    int flags = 0, ret = 0;
+    int flags = 0, ret = 0, len;
     static uint64_t seq_iter;
+    /* Pages are placed atomically once the VM runs here */
+    bool postcopy = postcopy_ram_incoming_running();
+    uint8_t *page_buf = NULL;
 
     seq_iter++;
 
+    if (postcopy) {
+        page_buf = g_malloc(TARGET_PAGE_SIZE);
+    }
+
     if (version_id != 4) {
         ret = -EINVAL;
     }
@@ -1185,6 +2255,14 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         flags = addr & ~TARGET_PAGE_MASK;
         addr &= TARGET_PAGE_MASK;
 
+        if (postcopy && (flags & (RAM_SAVE_FLAG_XBZRLE |
+                                  RAM_SAVE_FLAG_COMPRESS_PAGE |
+                                  RAM_SAVE_FLAG_MULTIFD_SYNC))) {
+            error_report("Unexpected RAM flags %#x in postcopy", flags);
+            ret = -EINVAL;
+            break;
+        }
+
         switch (flags & ~RAM_SAVE_FLAG_CONTINUE) {
         case RAM_SAVE_FLAG_MEM_SIZE:
             /* Synchronize RAM block list */
@@ -1231,7 +2309,14 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             ch = qemu_get_byte(f);
-            ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
+            if (!postcopy) {
+                ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
+            } else if (ch == 0) {
+                ret = postcopy_place_page_zero(host, TARGET_PAGE_SIZE);
+            } else {
+                memset(page_buf, ch, TARGET_PAGE_SIZE);
+                ret = postcopy_place_page(host, page_buf, TARGET_PAGE_SIZE);
+            }
             break;
         case RAM_SAVE_FLAG_PAGE:
             host = host_from_stream_offset(f, addr, flags);
@@ -1240,7 +2325,13 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 ret = -EINVAL;
                 break;
             }
-            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            if (postcopy) {
+                qemu_get_buffer(f, page_buf, TARGET_PAGE_SIZE);
+                ret = postcopy_place_page(host, page_buf, TARGET_PAGE_SIZE);
+            } else if (ram_control_load_page(f, host, TARGET_PAGE_SIZE)
+                    == RAM_LOAD_CONTROL_NOT_SUPP) {
+                qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            }
             break;
         case RAM_SAVE_FLAG_XBZRLE:
             host = host_from_stream_offset(f, addr, flags);
@@ -1256,6 +2347,31 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_COMPRESS_PAGE:
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                error_report("Invalid RAM offset " RAM_ADDR_FMT, addr);
+                ret = -EINVAL;
+                break;
+            }
+
+            len = qemu_get_be32(f);
+            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+                error_report("Invalid compressed data length: %d", len);
+                ret = -EINVAL;
+                break;
+            }
+            if (!compressed_data_buf) {
+                compressed_data_buf =
+                    g_malloc0(compressBound(TARGET_PAGE_SIZE));
+            }
+            qemu_get_buffer(f, compressed_data_buf, len);
+            ret = decompress_data_with_multi_threads(compressed_data_buf,
+                                                     host, len);
+            break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            ret = multifd_recv_sync_main(qemu_get_be32(f));
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -1273,7 +2389,21 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
 
+    /* Later pages may overwrite those still being decompressed */
+    if (!ret) {
+        ret = wait_for_decompress_done();
+    } else {
+        wait_for_decompress_done();
+    }
+
+    if (!ret) {
+        /* Let the transport complete any page it has deferred */
+        ram_control_after_load(f, RAM_CONTROL_ROUND);
+        ret = qemu_file_get_error(f);
+    }
+
     rcu_read_unlock();
+    g_free(page_buf);
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
     return ret;
@@ -1291,6 +2421,7 @@ static SaveVMHandlers savevm_ram_handlers = {
 void ram_mig_init(void)
 {
     qemu_mutex_init(&XBZRLE.lock);
+    qemu_mutex_init(&page_requests_lock);
     register_savevm_live(NULL, "ram", 0, 4, &savevm_ram_handlers, NULL);
 }
 
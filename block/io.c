@@ -1601,10 +1601,38 @@ int bdrv_is_allocated_above(BlockDriverState *top,
     return 0;
 }
 
+typedef struct WriteCompressedCo {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    const uint8_t *buf;
+    int nb_sectors;
+    int ret;
+} WriteCompressedCo;
+
+static void coroutine_fn bdrv_write_compressed_co_entry(void *opaque)
+{
+    WriteCompressedCo *wco = opaque;
+
+    wco->ret = wco->bs->drv->bdrv_write_compressed(wco->bs, wco->sector_num,
+                                                   wco->buf, wco->nb_sectors);
+}
+
+/*
+ * The driver runs in a coroutine, so that it can yield while compressing;
+ * callers in coroutines can then have several of these in flight.
+ */
 int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors)
 {
     BlockDriver *drv = bs->drv;
+    Coroutine *co;
+    WriteCompressedCo wco = {
+        .bs = bs,
+        .sector_num = sector_num,
+        .buf = buf,
+        .nb_sectors = nb_sectors,
+        .ret = NOT_DONE,
+    };
     int ret;
 
     if (!drv) {
@@ -1620,7 +1648,19 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
-    return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    if (qemu_in_coroutine()) {
+        /* Fast-path if already in coroutine context */
+        bdrv_write_compressed_co_entry(&wco);
+    } else {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        co = qemu_coroutine_create(bdrv_write_compressed_co_entry);
+        qemu_coroutine_enter(co, &wco);
+        while (wco.ret == NOT_DONE) {
+            aio_poll(aio_context, true);
+        }
+    }
+    return wco.ret;
 }
 
 int bdrv_save_vmstate(BlockDriverState *bs, const uint8_t *buf,
@@ -351,6 +351,11 @@ static BlockStats *bdrv_query_stats(const BlockDriverState *bs,
     s->stats->rd_total_time_ns = bs->stats.total_time_ns[BLOCK_ACCT_READ];
     s->stats->flush_total_time_ns = bs->stats.total_time_ns[BLOCK_ACCT_FLUSH];
 
+    if (bs->drv && bs->drv->bdrv_get_cache_stats) {
+        s->has_metadata_cache = true;
+        s->metadata_cache = bs->drv->bdrv_get_cache_stats(bs);
+    }
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_stats(bs->file, query_backing);
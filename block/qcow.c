@@ -901,15 +901,20 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
             goto fail;
         }
     } else {
+        /* The cluster goes at the end of the file, so it must be written
+         * before another request looks up the file length */
+        qemu_co_mutex_lock(&s->lock);
         cluster_offset = get_cluster_offset(bs, sector_num << 9, 2,
                                             out_len, 0, 0);
         if (cluster_offset == 0) {
+            qemu_co_mutex_unlock(&s->lock);
             ret = -EIO;
             goto fail;
         }
 
         cluster_offset &= s->cluster_offset_mask;
         ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
+        qemu_co_mutex_unlock(&s->lock);
         if (ret < 0) {
             goto fail;
         }
@@ -24,15 +24,24 @@
 
 #include "block/block_int.h"
 #include "qemu-common.h"
+#include "qemu/host-utils.h"
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Tables are found through a hash table on their offset, so a lookup costs
+ * the same whatever the size of the cache, and replaced with the CLOCK
+ * algorithm: the hand skips (and clears the bit of) the tables used since
+ * it last went over them, and takes the first one which was not.
+ */
+
 typedef struct Qcow2CachedTable {
-    void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
+    bool    referenced;
     int     ref;
+    /* Next entry in the same hash bucket, -1 at the end */
+    int     hash_next;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -40,39 +49,121 @@ struct Qcow2Cache {
     struct Qcow2Cache*      depends;
     int                     size;
     bool                    depends_on_flush;
+    /* The tables of all entries, one after the other */
+    void*                   table_array;
+    int                     table_size;
+    int                     table_bits;
+    /* First entry of each bucket, -1 if empty */
+    int*                    buckets;
+    int                     hash_bits;
+    /* Entry the CLOCK hand is on */
+    int                     hand;
+    uint64_t                hits;
+    uint64_t                misses;
+    uint64_t                evictions;
 };
 
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
+static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int i)
+{
+    return (uint8_t *)c->table_array + ((size_t)i << c->table_bits);
+}
+
+static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t offset = (uint8_t *)table - (uint8_t *)c->table_array;
+    int i = offset >> c->table_bits;
+
+    assert(i >= 0 && i < c->size && offset == (ptrdiff_t)i << c->table_bits);
+    return i;
+}
+
+static inline int qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    return ((offset >> c->table_bits) * 0x9e3779b97f4a7c15ULL) >>
+           (64 - c->hash_bits);
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
 {
-    BDRVQcowState *s = bs->opaque;
-    Qcow2Cache *c;
     int i;
 
-    c = g_new0(Qcow2Cache, 1);
-    c->size = num_tables;
-    c->entries = g_try_new0(Qcow2CachedTable, num_tables);
-    if (!c->entries) {
-        goto fail;
+    for (i = c->buckets[qcow2_cache_hash(c, offset)]; i >= 0;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    int *bucket = &c->buckets[qcow2_cache_hash(c, c->entries[i].offset)];
+
+    c->entries[i].hash_next = *bucket;
+    *bucket = i;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *p = &c->buckets[qcow2_cache_hash(c, c->entries[i].offset)];
+
+    while (*p != i) {
+        assert(*p >= 0);
+        p = &c->entries[*p].hash_next;
     }
+    *p = c->entries[i].hash_next;
+    c->entries[i].hash_next = -1;
+}
+
+static void qcow2_cache_hash_clear(Qcow2Cache *c)
+{
+    int i;
 
+    for (i = 0; i < 1 << c->hash_bits; i++) {
+        c->buckets[i] = -1;
+    }
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_try_blockalign(bs->file, s->cluster_size);
-        if (c->entries[i].table == NULL) {
-            goto fail;
-        }
+        c->entries[i].hash_next = -1;
     }
+}
 
-    return c;
+/*
+ * Creates a cache of @num_tables tables of @table_size bytes, a power of two
+ * no larger than a cluster. Tables smaller than a cluster are slices of the
+ * metadata clusters, each cached on its own.
+ */
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Cache *c;
 
-fail:
-    if (c->entries) {
-        for (i = 0; i < c->size; i++) {
-            qemu_vfree(c->entries[i].table);
-        }
+    assert(is_power_of_2(table_size) && table_size <= s->cluster_size);
+
+    c = g_new0(Qcow2Cache, 1);
+    c->size = num_tables;
+    c->table_size = table_size;
+    c->table_bits = ctz32(table_size);
+    /* Buckets for at least twice as many tables, so chains stay short */
+    c->hash_bits = 1;
+    while ((1 << c->hash_bits) < 2 * num_tables) {
+        c->hash_bits++;
     }
-    g_free(c->entries);
-    g_free(c);
-    return NULL;
+    c->entries = g_try_new0(Qcow2CachedTable, num_tables);
+    c->buckets = g_try_new(int, 1 << c->hash_bits);
+    c->table_array = qemu_try_blockalign(bs->file,
+                                         (size_t)num_tables << c->table_bits);
+    if (!c->entries || !c->buckets || !c->table_array) {
+        qemu_vfree(c->table_array);
+        g_free(c->buckets);
+        g_free(c->entries);
+        g_free(c);
+        return NULL;
+    }
+
+    qcow2_cache_hash_clear(c);
+    return c;
 }
 
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
@@ -81,9 +172,10 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    qemu_vfree(c->table_array);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
@@ -132,13 +224,13 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
 
     if (c == s->refcount_block_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_REFCOUNT_BLOCK,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else if (c == s->l2_table_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L2,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else {
         ret = qcow2_pre_write_overlap_check(bs, 0,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     }
 
     if (ret < 0) {
@@ -151,8 +243,8 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
-        s->cluster_size);
+    ret = bdrv_pwrite(bs->file, c->entries[i].offset,
+                      qcow2_cache_get_table_addr(c, i), c->table_size);
     if (ret < 0) {
         return ret;
     }
@@ -228,42 +320,36 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
         c->entries[i].offset = 0;
-        c->entries[i].cache_hits = 0;
+        c->entries[i].referenced = false;
     }
+    qcow2_cache_hash_clear(c);
 
     return 0;
 }
 
 static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
 {
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
+    int n;
 
+    /* After one turn every bit is clear, so two turns always find one */
+    for (n = 0; n < 2 * c->size; n++) {
+        int i = c->hand;
+        Qcow2CachedTable *e = &c->entries[i];
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].ref) {
+        c->hand = (c->hand + 1) % c->size;
+        if (e->ref) {
             continue;
         }
-
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
-        }
-
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        if (c->entries[i].cache_hits > 1) {
-            c->entries[i].cache_hits /= 2;
+        if (e->referenced && e->offset) {
+            e->referenced = false;
+            continue;
         }
+        return i;
     }
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
-    }
-    return min_index;
+    /* This can't happen in current synchronous code, but leave the check
+     * here as a reminder for whoever starts using AIO with the cache */
+    abort();
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
@@ -277,11 +363,12 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
                           offset, read_from_disk);
 
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
-        }
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        c->hits++;
+        goto found;
     }
+    c->misses++;
 
     /* If not, write a table back and replace it */
     i = qcow2_cache_find_entry_to_replace(c);
@@ -298,28 +385,31 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    if (c->entries[i].offset) {
+        qcow2_cache_hash_remove(c, i);
+        c->entries[i].offset = 0;
+        c->evictions++;
+    }
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_get_table_addr(c, i),
+                         c->table_size);
         if (ret < 0) {
             return ret;
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
     c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(c, i);
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
+    c->entries[i].referenced = true;
     c->entries[i].ref++;
-    *table = c->entries[i].table;
+    *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
@@ -339,18 +429,27 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     return qcow2_cache_do_get(bs, c, offset, table, false);
 }
 
-int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
+/*
+ * Returns the table at @offset if it is cached, NULL otherwise. Nothing is
+ * read from the image and no reference is taken, so the table may only be
+ * used until the caller yields.
+ */
+void *qcow2_cache_peek(Qcow2Cache *c, uint64_t offset)
 {
-    int i;
+    int i = qcow2_cache_lookup(c, offset);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
+    if (i < 0) {
+        return NULL;
     }
-    return -ENOENT;
+    c->hits++;
+    c->entries[i].referenced = true;
+    return qcow2_cache_get_table_addr(c, i);
+}
+
+int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
+{
+    int i = qcow2_cache_get_table_idx(c, *table);
 
-found:
     c->entries[i].ref--;
     *table = NULL;
 
@@ -360,15 +459,20 @@ found:
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
-    int i;
+    int i = qcow2_cache_get_table_idx(c, table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
-    }
-    abort();
-
-found:
     c->entries[i].dirty = true;
 }
+
+BlockCacheStats *qcow2_cache_get_stats(Qcow2Cache *c, const char *name)
+{
+    BlockCacheStats *stats = g_new0(BlockCacheStats, 1);
+
+    stats->name = g_strdup(name);
+    stats->size = c->size;
+    stats->table_size = c->table_size;
+    stats->hits = c->hits;
+    stats->misses = c->misses;
+    stats->evictions = c->evictions;
+    return stats;
+}
@@ -1010,6 +1010,11 @@ void qcow2_free_any_clusters(BlockDriverState *bs, uint64_t l2_entry,
             qcow2_free_clusters(bs,
                 (l2_entry & s->cluster_offset_mask) & ~511,
                 nb_csectors * 512, type);
+
+            /* The bytes may be reused for another compressed cluster, and
+             * readers may have looked this one up without s->lock */
+            s->cluster_cache_offset = -1;
+            s->cluster_cache_gen++;
         }
         break;
     case QCOW2_CLUSTER_NORMAL:
@@ -1044,7 +1049,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t *l1_table, *l2_table, l2_offset, offset, l1_size2, refcount;
+    uint64_t *l1_table, *l2_slice, l2_offset, offset, l1_size2, refcount;
     bool l1_allocated = false;
     int64_t old_offset, old_l2_offset;
     int i, j, l1_modified = 0, nb_csectors;
@@ -1052,7 +1057,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
 
     assert(addend >= -1 && addend <= 1);
 
-    l2_table = NULL;
+    l2_slice = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
 
@@ -1096,16 +1101,28 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                 goto fail;
             }
 
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
-
             for(j = 0; j < s->l2_size; j++) {
                 uint64_t cluster_index;
+                int k = j & (s->l2_slice_size - 1);
+
+                /* the L2 table goes through the cache one slice at a time */
+                if (k == 0) {
+                    if (l2_slice) {
+                        ret = qcow2_cache_put(bs, s->l2_table_cache,
+                                              (void **) &l2_slice);
+                        if (ret < 0) {
+                            goto fail;
+                        }
+                    }
+                    ret = qcow2_cache_get(bs, s->l2_table_cache,
+                                          l2_offset + j * sizeof(uint64_t),
+                                          (void **) &l2_slice);
+                    if (ret < 0) {
+                        goto fail;
+                    }
+                }
 
-                offset = be64_to_cpu(l2_table[j]);
+                offset = be64_to_cpu(l2_slice[k]);
                 old_offset = offset;
                 offset &= ~QCOW_OFLAG_COPIED;
 
@@ -1176,12 +1193,12 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                         qcow2_cache_set_dependency(bs, s->l2_table_cache,
                             s->refcount_block_cache);
                     }
-                    l2_table[j] = cpu_to_be64(offset);
-                    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
+                    l2_slice[k] = cpu_to_be64(offset);
+                    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
                 }
             }
 
-            ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+            ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_slice);
             if (ret < 0) {
                 goto fail;
             }
@@ -1212,8 +1229,8 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
 
     ret = bdrv_flush(bs);
 fail:
-    if (l2_table) {
-        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    if (l2_slice) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_slice);
     }
 
     s->cache_discards = false;
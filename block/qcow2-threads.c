@@ -0,0 +1,238 @@
+/*
+ * Threaded data processing for the QCOW2 format
+ *
+ * Compressing and decompressing a cluster is CPU bound, so it is done in
+ * the thread pool of the AioContext rather than in the coroutine which
+ * needs it. Requests on different clusters then run in parallel, e.g. the
+ * writes of qemu-img convert -c.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/thread-pool.h"
+#include "qcow2.h"
+
+/*
+ * Compress functions return the compressed size, -ENOMEM if it would not
+ * fit in @dest_size bytes, or another -errno on failure.
+ * Decompress functions must fill all of @dest and return 0, or -EIO; @src
+ * may have trailing garbage, since qcow2 only knows the compressed size
+ * rounded up to a sector.
+ */
+typedef ssize_t Qcow2CompressFunc(void *dest, size_t dest_size,
+                                  const void *src, size_t src_size);
+
+/* zlib: raw deflate stream with a 4 KiB window */
+
+static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    z_stream strm;
+    ssize_t ret;
+
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+
+    strm.avail_in = src_size;
+    strm.next_in = (uint8_t *)src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        ret = dest_size - strm.avail_out;
+    } else {
+        ret = (ret == Z_OK || ret == Z_BUF_ERROR ? -ENOMEM : -EIO);
+    }
+
+    deflateEnd(&strm);
+    return ret;
+}
+
+static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
+{
+    z_stream strm;
+    ssize_t ret;
+
+    memset(&strm, 0, sizeof(strm));
+    strm.next_in = (uint8_t *)src;
+    strm.avail_in = src_size;
+    strm.next_out = dest;
+    strm.avail_out = dest_size;
+
+    ret = inflateInit2(&strm, -12);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+
+    /* Z_BUF_ERROR is fine as long as all of @dest was filled */
+    ret = inflate(&strm, Z_FINISH);
+    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) || strm.avail_out != 0) {
+        ret = -EIO;
+    } else {
+        ret = 0;
+    }
+
+    inflateEnd(&strm);
+    return ret;
+}
+
+#ifdef CONFIG_ZSTD
+
+/* zstd: one frame per cluster, at zstd's default level */
+
+static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    size_t ret = ZSTD_compress(dest, dest_size, src, src_size, 3);
+
+    /* In practice the only error is a too small destination */
+    if (ZSTD_isError(ret)) {
+        return -ENOMEM;
+    }
+    return ret;
+}
+
+static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
+{
+    ZSTD_DStream *zds;
+    ZSTD_inBuffer in = { src, src_size, 0 };
+    ZSTD_outBuffer out = { dest, dest_size, 0 };
+    size_t ret;
+
+    zds = ZSTD_createDStream();
+    if (!zds) {
+        return -EIO;
+    }
+
+    /* Streaming, so that the padding after the frame is not looked at */
+    ret = ZSTD_initDStream(zds);
+    while (!ZSTD_isError(ret) && out.pos < out.size && in.pos < in.size) {
+        ret = ZSTD_decompressStream(zds, &out, &in);
+        if (ret == 0) {
+            break;
+        }
+    }
+
+    ZSTD_freeDStream(zds);
+    if (ZSTD_isError(ret) || out.pos != out.size) {
+        return -EIO;
+    }
+    return 0;
+}
+
+#endif
+
+typedef struct Qcow2CompressData {
+    void *dest;
+    size_t dest_size;
+    const void *src;
+    size_t src_size;
+    Qcow2CompressFunc *func;
+    ssize_t ret;
+} Qcow2CompressData;
+
+static int qcow2_compress_pool_func(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+
+    data->ret = data->func(data->dest, data->dest_size,
+                           data->src, data->src_size);
+    return 0;
+}
+
+static ssize_t coroutine_fn
+qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
+                     const void *src, size_t src_size, Qcow2CompressFunc *func)
+{
+    BDRVQcowState *s = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    Qcow2CompressData data = {
+        .dest       = dest,
+        .dest_size  = dest_size,
+        .src        = src,
+        .src_size   = src_size,
+        .func       = func,
+    };
+
+    while (s->nb_compress_threads >= QCOW2_MAX_COMPRESS_THREADS) {
+        qemu_co_queue_wait(&s->compress_wait_queue);
+    }
+
+    s->nb_compress_threads++;
+    thread_pool_submit_co(pool, qcow2_compress_pool_func, &data);
+    s->nb_compress_threads--;
+
+    qemu_co_queue_next(&s->compress_wait_queue);
+
+    return data.ret;
+}
+
+/*
+ * Compresses @src with the compression type of the image. Returns the
+ * compressed size, -ENOMEM if it does not fit in @dest_size bytes (the
+ * cluster should then be written uncompressed) or another -errno.
+ */
+ssize_t coroutine_fn qcow2_co_compress(BlockDriverState *bs,
+                                       void *dest, size_t dest_size,
+                                       const void *src, size_t src_size)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressFunc *func;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        func = qcow2_zlib_compress;
+        break;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        func = qcow2_zstd_compress;
+        break;
+#endif
+    default:
+        abort();
+    }
+
+    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, func);
+}
+
+/*
+ * Decompresses @src into all of @dest with the compression type of the
+ * image. Returns 0 on success, -EIO if the data is corrupt.
+ */
+int coroutine_fn qcow2_co_decompress(BlockDriverState *bs,
+                                     void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressFunc *func;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        func = qcow2_zlib_decompress;
+        break;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        func = qcow2_zstd_decompress;
+        break;
+#endif
+    default:
+        abort();
+    }
+
+    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, func);
+}
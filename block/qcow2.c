@@ -24,7 +24,6 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "qemu/module.h"
-#include <zlib.h>
 #include "qemu/aes.h"
 #include "block/qcow2.h"
 #include "qemu/error-report.h"
@@ -61,6 +60,12 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_COMPRESSION_TYPE 0x636f6d70
+
+typedef struct {
+    uint8_t type;
+    uint8_t reserved[7];
+} QEMU_PACKED Qcow2CompressionTypeExt;
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -88,6 +93,7 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
 {
     BDRVQcowState *s = bs->opaque;
     QCowExtension ext;
+    Qcow2CompressionTypeExt compression_ext;
     uint64_t offset;
     int ret;
 
@@ -160,6 +166,34 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_COMPRESSION_TYPE:
+            if (ext.len != sizeof(compression_ext)) {
+                error_setg(errp, "ERROR: ext_compression_type: len=%" PRIu32
+                           " invalid (!=%zu)", ext.len,
+                           sizeof(compression_ext));
+                return 2;
+            }
+            ret = bdrv_pread(bs->file, offset, &compression_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: ext_compression_type: "
+                                 "Could not read compression type");
+                return 3;
+            }
+            if (compression_ext.type >= QCOW2_COMPRESSION_TYPE_MAX) {
+                error_setg(errp, "Unknown compression type %d",
+                           compression_ext.type);
+                return 2;
+            }
+#ifndef CONFIG_ZSTD
+            if (compression_ext.type == QCOW2_COMPRESSION_TYPE_ZSTD) {
+                error_setg(errp, "zstd compression is not supported by this "
+                           "build of QEMU");
+                return 2;
+            }
+#endif
+            s->compression_type = compression_ext.type;
+            break;
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -468,6 +502,11 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Maximum refcount block cache size",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the L2 table slices held by the L2 cache",
+        },
         { /* end of list */ }
     },
 };
@@ -551,7 +590,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     uint64_t l1_vm_state_index;
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
-    uint64_t l2_cache_size, refcount_cache_size;
+    uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -810,7 +849,22 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    l2_cache_size /= s->cluster_size;
+    l2_cache_entry_size = qemu_opt_get_size(opts,
+                                            QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+                                            MIN(DEFAULT_L2_CACHE_ENTRY_SIZE,
+                                                s->cluster_size));
+    if (l2_cache_entry_size < (1 << MIN_CLUSTER_BITS) ||
+        l2_cache_entry_size > s->cluster_size ||
+        !is_power_of_2(l2_cache_entry_size)) {
+        error_setg(errp, QCOW2_OPT_L2_CACHE_ENTRY_SIZE " must be a power of "
+                   "two between %d and the cluster size (%d)",
+                   1 << MIN_CLUSTER_BITS, s->cluster_size);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->l2_slice_size = l2_cache_entry_size / sizeof(uint64_t);
+
+    l2_cache_size /= l2_cache_entry_size;
     if (l2_cache_size < MIN_L2_CACHE_SIZE) {
         l2_cache_size = MIN_L2_CACHE_SIZE;
     }
@@ -831,8 +885,10 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size);
-    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size);
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
+                                           l2_cache_entry_size);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
+                                                 s->cluster_size);
     if (s->l2_table_cache == NULL || s->refcount_block_cache == NULL) {
         error_setg(errp, "Could not allocate metadata caches");
         ret = -ENOMEM;
@@ -840,16 +896,8 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     s->cluster_cache = g_malloc(s->cluster_size);
-    /* one more sector for decompressed data alignment */
-    s->cluster_data = qemu_try_blockalign(bs->file, QCOW_MAX_CRYPT_CLUSTERS
-                                                    * s->cluster_size + 512);
-    if (s->cluster_data == NULL) {
-        error_setg(errp, "Could not allocate temporary cluster buffer");
-        ret = -ENOMEM;
-        goto fail;
-    }
-
     s->cluster_cache_offset = -1;
+    qemu_co_queue_init(&s->compress_wait_queue);
     s->flags = flags;
 
     ret = qcow2_refcount_init(bs);
@@ -862,6 +910,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     QTAILQ_INIT(&s->discards);
 
     /* read qcow2 extensions */
+    s->compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
     if (qcow2_read_extensions(bs, header.header_length, ext_end, NULL,
         &local_err)) {
         error_propagate(errp, local_err);
@@ -869,6 +918,15 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    /* an implementation which ignores the extension must not open the image */
+    if (!!(s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION) !=
+        (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB)) {
+        error_setg(errp, "Compression type header extension and feature bit "
+                   "do not match");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* read the backing file name */
     if (header.backing_file_offset != 0) {
         len = header.backing_file_size;
@@ -1011,7 +1069,6 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         qcow2_cache_destroy(bs, s->refcount_block_cache);
     }
     g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
     return ret;
 }
 
@@ -1086,6 +1143,28 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
     return 0;
 }
 
+/*
+ * Looks up a cluster without taking s->lock if its L2 slice is cached, so
+ * that readers don't queue up behind cache misses, allocating writes and
+ * compressed clusters. Only a miss takes the lock to load the slice.
+ */
+static int coroutine_fn qcow2_co_get_cluster_offset(BlockDriverState *bs,
+        int64_t sector_num, int *num, uint64_t *cluster_offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    ret = qcow2_get_cluster_offset_nowait(bs, sector_num << 9, num,
+                                          cluster_offset);
+    if (ret == -EAGAIN) {
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_get_cluster_offset(bs, sector_num << 9, num,
+                                       cluster_offset);
+        qemu_co_mutex_unlock(&s->lock);
+    }
+    return ret;
+}
+
 static int64_t coroutine_fn qcow2_co_get_block_status(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum)
 {
@@ -1095,9 +1174,7 @@ static int64_t coroutine_fn qcow2_co_get_block_status(BlockDriverState *bs,
     int64_t status = 0;
 
     *pnum = nb_sectors;
-    qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_get_cluster_offset(bs, sector_num << 9, pnum, &cluster_offset);
-    qemu_co_mutex_unlock(&s->lock);
+    ret = qcow2_co_get_cluster_offset(bs, sector_num, pnum, &cluster_offset);
     if (ret < 0) {
         return ret;
     }
@@ -1144,11 +1221,13 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
     uint64_t bytes_done = 0;
     QEMUIOVector hd_qiov;
     uint8_t *cluster_data = NULL;
+    unsigned gen;
+    bool locked = false;
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    qemu_co_mutex_lock(&s->lock);
-
+    /* s->lock is only taken for L2 cache misses, and to decompress a
+     * cluster again if it was remapped while we were inflating it */
     while (remaining_sectors != 0) {
 
         /* prepare next request */
@@ -1158,8 +1237,14 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
                 QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors);
         }
 
-        ret = qcow2_get_cluster_offset(bs, sector_num << 9,
-            &cur_nr_sectors, &cluster_offset);
+        gen = s->cluster_cache_gen;
+        if (locked) {
+            ret = qcow2_get_cluster_offset(bs, sector_num << 9,
+                                           &cur_nr_sectors, &cluster_offset);
+        } else {
+            ret = qcow2_co_get_cluster_offset(bs, sector_num, &cur_nr_sectors,
+                                              &cluster_offset);
+        }
         if (ret < 0) {
             goto fail;
         }
@@ -1185,10 +1270,8 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
                                       n1 * BDRV_SECTOR_SIZE);
 
                     BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
-                    qemu_co_mutex_unlock(&s->lock);
                     ret = bdrv_co_readv(bs->backing_hd, sector_num,
                                         n1, &local_qiov);
-                    qemu_co_mutex_lock(&s->lock);
 
                     qemu_iovec_destroy(&local_qiov);
 
@@ -1207,8 +1290,17 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             break;
 
         case QCOW2_CLUSTER_COMPRESSED:
-            /* add AIO support for compressed blocks ? */
+            /* inflated in the thread pool, s->cluster_cache is valid until
+             * we yield again */
             ret = qcow2_decompress_cluster(bs, cluster_offset);
+            if (ret == -EAGAIN || (ret >= 0 && s->cluster_cache_gen != gen)) {
+                /* a write came in meanwhile, and the mapping may be stale:
+                 * look the cluster up again, with writes held off */
+                assert(!locked);
+                qemu_co_mutex_lock(&s->lock);
+                locked = true;
+                continue;
+            }
             if (ret < 0) {
                 goto fail;
             }
@@ -1247,11 +1339,9 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             }
 
             BLKDBG_EVENT(bs->file, BLKDBG_READ_AIO);
-            qemu_co_mutex_unlock(&s->lock);
             ret = bdrv_co_readv(bs->file,
                                 (cluster_offset >> 9) + index_in_cluster,
                                 cur_nr_sectors, &hd_qiov);
-            qemu_co_mutex_lock(&s->lock);
             if (ret < 0) {
                 goto fail;
             }
@@ -1269,6 +1359,11 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             goto fail;
         }
 
+        if (locked) {
+            qemu_co_mutex_unlock(&s->lock);
+            locked = false;
+        }
+
         remaining_sectors -= cur_nr_sectors;
         sector_num += cur_nr_sectors;
         bytes_done += cur_nr_sectors * 512;
@@ -1276,8 +1371,9 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
     ret = 0;
 
 fail:
-    qemu_co_mutex_unlock(&s->lock);
-
+    if (locked) {
+        qemu_co_mutex_unlock(&s->lock);
+    }
     qemu_iovec_destroy(&hd_qiov);
     qemu_vfree(cluster_data);
 
@@ -1304,10 +1400,11 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    s->cluster_cache_offset = -1; /* disable compressed cache */
-
     qemu_co_mutex_lock(&s->lock);
 
+    s->cluster_cache_offset = -1; /* disable compressed cache */
+    s->cluster_cache_gen++;
+
     while (remaining_sectors != 0) {
 
         l2meta = NULL;
@@ -1463,7 +1560,6 @@ static void qcow2_close(BlockDriverState *bs)
     g_free(s->image_backing_format);
 
     g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
 }
@@ -1640,6 +1736,23 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Compression type header extension */
+    if (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        Qcow2CompressionTypeExt compression_ext = {
+            .type = s->compression_type,
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_COMPRESSION_TYPE,
+                             &compression_ext, sizeof(compression_ext),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Feature table */
     Qcow2Feature features[] = {
         {
@@ -1652,6 +1765,11 @@ int qcow2_update_header(BlockDriverState *bs)
             .bit  = QCOW2_INCOMPAT_CORRUPT_BITNR,
             .name = "corrupt bit",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+            .bit  = QCOW2_INCOMPAT_COMPRESSION_BITNR,
+            .name = "compression type",
+        },
         {
             .type = QCOW2_FEAT_TYPE_COMPATIBLE,
             .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
@@ -1798,6 +1916,7 @@ static int qcow2_create2(const char *filename, int64_t total_size,
                          const char *backing_file, const char *backing_format,
                          int flags, size_t cluster_size, PreallocMode prealloc,
                          QemuOpts *opts, int version, int refcount_order,
+                         Qcow2CompressionType compression_type,
                          Error **errp)
 {
     /* Calculate cluster_bits */
@@ -1985,6 +2104,19 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         goto out;
     }
 
+    /* Before anything gets compressed with the default type */
+    if (compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        BDRVQcowState *s = bs->opaque;
+
+        s->compression_type = compression_type;
+        s->incompatible_features |= QCOW2_INCOMPAT_COMPRESSION;
+        ret = qcow2_update_header(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not set the compression type");
+            goto out;
+        }
+    }
+
     /* Want a backing file? There you go.*/
     if (backing_file) {
         ret = bdrv_change_backing_file(bs, backing_file, backing_format);
@@ -2039,6 +2171,7 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
     int version = 3;
     uint64_t refcount_bits = 16;
     int refcount_order;
+    Qcow2CompressionType compression_type;
     Error *local_err = NULL;
     int ret;
 
@@ -2112,9 +2245,38 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
 
     refcount_order = ctz32(refcount_bits);
 
+    g_free(buf);
+    buf = qemu_opt_get_del(opts, BLOCK_OPT_COMPRESSION_TYPE);
+    compression_type = qapi_enum_parse(Qcow2CompressionType_lookup, buf,
+                                       QCOW2_COMPRESSION_TYPE_MAX,
+                                       QCOW2_COMPRESSION_TYPE_ZLIB,
+                                       &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto finish;
+    }
+
+#ifndef CONFIG_ZSTD
+    if (compression_type == QCOW2_COMPRESSION_TYPE_ZSTD) {
+        error_setg(errp, "zstd compression is not supported by this build of "
+                   "QEMU");
+        ret = -ENOTSUP;
+        goto finish;
+    }
+#endif
+
+    if (version < 3 && compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        error_setg(errp, "Compression types other than zlib require "
+                   "compatibility level 1.1 or above (use compat=1.1 or "
+                   "greater)");
+        ret = -EINVAL;
+        goto finish;
+    }
+
     ret = qcow2_create2(filename, size, backing_file, backing_fmt, flags,
                         cluster_size, prealloc, opts, version, refcount_order,
-                        &local_err);
+                        compression_type, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
     }
@@ -2206,10 +2368,10 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
                                   const uint8_t *buf, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
+    ssize_t out_len;
+    int ret;
     uint8_t *out_buf;
-    uint64_t cluster_offset;
+    uint64_t cluster_offset, l2_entry = 0;
 
     if (nb_sectors == 0) {
         /* align end of file to a sector boundary to ease reading with
@@ -2234,62 +2396,62 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
         return ret;
     }
 
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
+    out_buf = g_malloc(s->cluster_size);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
-    }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
-
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    /* bdrv_write_compressed() runs us in a coroutine, so compressing in the
+     * thread pool lets other clusters be compressed meanwhile */
+    out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
+                                buf, s->cluster_size);
+    if (out_len == -ENOMEM) {
         /* could not compress: write normal cluster */
         ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
         if (ret < 0) {
             goto fail;
         }
+    } else if (out_len < 0) {
+        ret = -EINVAL;
+        goto fail;
     } else {
-        cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
+        qemu_co_mutex_lock(&s->lock);
+        l2_entry = qcow2_alloc_compressed_cluster_offset(bs,
             sector_num << 9, out_len);
-        if (!cluster_offset) {
+        if (!l2_entry) {
+            qemu_co_mutex_unlock(&s->lock);
             ret = -EIO;
             goto fail;
         }
-        cluster_offset &= s->cluster_offset_mask;
+        cluster_offset = l2_entry & s->cluster_offset_mask;
 
         ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
+        qemu_co_mutex_unlock(&s->lock);
         if (ret < 0) {
             goto fail;
         }
 
+        /* Only link the cluster once its data is there: readers, including
+         * the lock-free lookups, may use the L2 entry right away */
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
         ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
         if (ret < 0) {
             goto fail;
         }
+
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_link_compressed_cluster(bs, sector_num << 9, l2_entry);
+        qemu_co_mutex_unlock(&s->lock);
+        if (ret < 0) {
+            goto fail;
+        }
     }
 
     ret = 0;
 fail:
+    if (ret < 0 && l2_entry) {
+        /* the compressed cluster was never linked */
+        qemu_co_mutex_lock(&s->lock);
+        qcow2_free_any_clusters(bs, l2_entry, 1, QCOW2_DISCARD_OTHER);
+        qemu_co_mutex_unlock(&s->lock);
+    }
     g_free(out_buf);
     return ret;
 }
@@ -2517,6 +2679,19 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+static BlockCacheStatsList *qcow2_get_cache_stats(const BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BlockCacheStatsList *l2 = g_new0(BlockCacheStatsList, 1);
+    BlockCacheStatsList *refcount = g_new0(BlockCacheStatsList, 1);
+
+    l2->value = qcow2_cache_get_stats(s->l2_table_cache, "l2");
+    l2->next = refcount;
+    refcount->value = qcow2_cache_get_stats(s->refcount_block_cache,
+                                            "refcount");
+    return l2;
+}
+
 static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
@@ -2543,6 +2718,9 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
                                   QCOW2_INCOMPAT_CORRUPT,
             .has_corrupt        = true,
             .refcount_bits      = s->refcount_bits,
+            .compression_type   = s->compression_type,
+            .has_compression_type = s->compression_type !=
+                                    QCOW2_COMPRESSION_TYPE_ZLIB,
         };
     }
 
@@ -2648,6 +2826,12 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
      * the first place; if that happens nonetheless, returning -ENOTSUP is the
      * best thing to do anyway */
 
+    if (s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION) {
+        error_report("qcow2_downgrade: Images with compression types other "
+                     "than zlib cannot be downgraded.");
+        return -ENOTSUP;
+    }
+
     if (s->incompatible_features) {
         return -ENOTSUP;
     }
@@ -2683,6 +2867,7 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
     const char *backing_file = NULL, *backing_format = NULL;
     bool lazy_refcounts = s->use_lazy_refcounts;
     const char *compat = NULL;
+    const char *compression_type = NULL;
     uint64_t cluster_size = s->cluster_size;
     bool encrypt;
     int ret;
@@ -2738,6 +2923,13 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
         } else if (!strcmp(desc->name, BLOCK_OPT_REFCOUNT_BITS)) {
             error_report("Cannot change refcount entry width");
             return -ENOTSUP;
+        } else if (!strcmp(desc->name, BLOCK_OPT_COMPRESSION_TYPE)) {
+            compression_type = qemu_opt_get(opts, BLOCK_OPT_COMPRESSION_TYPE);
+            if (strcmp(compression_type,
+                       Qcow2CompressionType_lookup[s->compression_type])) {
+                error_report("Changing the compression type is not supported");
+                return -ENOTSUP;
+            }
         } else {
             /* if this assertion fails, this probably means a new option was
              * added without having it covered here */
@@ -2918,6 +3110,11 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Width of a reference count entry in bits",
             .def_value_str = "16"
         },
+        {
+            .name = BLOCK_OPT_COMPRESSION_TYPE,
+            .type = QEMU_OPT_STRING,
+            .help = "Compression method of compressed clusters (zlib, zstd)",
+        },
         { /* end of list */ }
     }
 };
@@ -2951,6 +3148,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_load_tmp = qcow2_snapshot_load_tmp,
     .bdrv_get_info          = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_cache_stats   = qcow2_get_cache_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
@@ -1590,8 +1590,13 @@ static int vmdk_write_compressed(BlockDriverState *bs,
                                  int nb_sectors)
 {
     BDRVVmdkState *s = bs->opaque;
+    int ret;
+
     if (s->num_extents == 1 && s->extents[0].compressed) {
-        return vmdk_write(bs, sector_num, buf, nb_sectors, false, false);
+        qemu_co_mutex_lock(&s->lock);
+        ret = vmdk_write(bs, sector_num, buf, nb_sectors, false, false);
+        qemu_co_mutex_unlock(&s->lock);
+        return ret;
     } else {
         return -ENOTSUP;
     }
@@ -0,0 +1,367 @@
+/*
+ * Measuring how fast the guest dirties its memory
+ *
+ * calc-dirty-rate turns dirty logging on for a while, as a migration would,
+ * but only counts the pages that get written instead of sending them. This
+ * tells how much bandwidth or downtime a migration of the guest would need
+ * before starting one.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <zlib.h>
+
+#include "qemu-common.h"
+#include "cpu.h"
+#include "exec/cpu-all.h"
+#include "exec/ram_addr.h"
+#include "exec/address-spaces.h"
+#include "migration/migration.h"
+#include "qemu/hbitmap.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu_queue.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qapi/qmp/qerror.h"
+#include "qmp-commands.h"
+#include "trace.h"
+
+/* The working set is sampled after 125ms, 250ms, 500ms... */
+#define DIRTY_RATE_FIRST_PERIOD_MS 125
+#define DIRTY_RATE_MAX_PERIODS     16
+#define DIRTY_RATE_MAX_CALC_TIME   60
+#define DIRTY_RATE_MAX_SAMPLES     4096
+
+typedef struct DirtyRateBlockState {
+    char *idstr;
+    MemoryRegion *mr;
+    uint8_t *host;
+    ram_addr_t offset;
+    uint64_t pages;
+    uint64_t dirty_pages;
+    /* Sampled pages of the block and the crc32 of their contents */
+    uint64_t nr_samples;
+    uint64_t *sample_page;
+    uint32_t *sample_crc;
+    uint64_t samples_changed;
+} DirtyRateBlockState;
+
+typedef struct DirtyRatePeriod {
+    int64_t period_ms;
+    uint64_t dirty_pages;
+} DirtyRatePeriod;
+
+/*
+ * Protected by the iothread lock. While a measurement runs, only its
+ * thread touches anything but @status.
+ */
+static struct {
+    DirtyRateStatus status;
+    int64_t start_time;
+    int64_t calc_time;
+    int64_t sample_pages;
+    int nr_blocks;
+    DirtyRateBlockState *blocks;
+    int nr_periods;
+    DirtyRatePeriod periods[DIRTY_RATE_MAX_PERIODS];
+} dirty_rate;
+
+static int64_t dirty_rate_mbps(uint64_t pages, int64_t ms)
+{
+    if (ms <= 0) {
+        return 0;
+    }
+    return pages * TARGET_PAGE_SIZE * 1000 / ms / (1024 * 1024);
+}
+
+static void dirty_rate_free_blocks(void)
+{
+    int i;
+
+    for (i = 0; i < dirty_rate.nr_blocks; i++) {
+        g_free(dirty_rate.blocks[i].idstr);
+        g_free(dirty_rate.blocks[i].sample_page);
+        g_free(dirty_rate.blocks[i].sample_crc);
+    }
+    g_free(dirty_rate.blocks);
+    dirty_rate.blocks = NULL;
+    dirty_rate.nr_blocks = 0;
+    dirty_rate.nr_periods = 0;
+}
+
+/*
+ * Called with the iothread lock held. The memory regions are referenced so
+ * that the blocks stay around until the end of the measurement, even if
+ * they are unplugged.
+ */
+static void dirty_rate_snapshot_blocks(void)
+{
+    RAMBlock *block;
+    int n = 0;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        n++;
+    }
+    dirty_rate.blocks = g_new0(DirtyRateBlockState, n);
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        DirtyRateBlockState *b = &dirty_rate.blocks[dirty_rate.nr_blocks];
+
+        if (dirty_rate.nr_blocks == n) {
+            break;
+        }
+        b->idstr = g_strdup(block->idstr);
+        b->mr = block->mr;
+        b->host = block->host;
+        b->offset = block->offset;
+        b->pages = block->used_length >> TARGET_PAGE_BITS;
+        memory_region_ref(b->mr);
+        dirty_rate.nr_blocks++;
+    }
+    rcu_read_unlock();
+}
+
+static void dirty_rate_pick_samples(DirtyRateBlockState *b)
+{
+    uint64_t i;
+
+    b->nr_samples = DIV_ROUND_UP(dirty_rate.sample_pages *
+                                 (b->pages << TARGET_PAGE_BITS), 1ULL << 30);
+    b->nr_samples = MIN(b->nr_samples, b->pages);
+    b->sample_page = g_new(uint64_t, b->nr_samples);
+    b->sample_crc = g_new(uint32_t, b->nr_samples);
+    for (i = 0; i < b->nr_samples; i++) {
+        uint64_t r = (uint64_t)g_random_int() << 32 | g_random_int();
+
+        b->sample_page[i] = r % b->pages;
+        b->sample_crc[i] = crc32(0, b->host + (b->sample_page[i]
+                                               << TARGET_PAGE_BITS),
+                                 TARGET_PAGE_SIZE);
+    }
+}
+
+static void dirty_rate_check_samples(DirtyRateBlockState *b)
+{
+    uint64_t i;
+
+    for (i = 0; i < b->nr_samples; i++) {
+        uint32_t crc = crc32(0, b->host + (b->sample_page[i]
+                                           << TARGET_PAGE_BITS),
+                             TARGET_PAGE_SIZE);
+
+        b->samples_changed += crc != b->sample_crc[i];
+    }
+}
+
+/*
+ * Called with the iothread lock held. Moves the pages dirtied since the
+ * last call into @seen, counting the new ones per block.
+ */
+static void dirty_rate_sync(HBitmap *seen)
+{
+    unsigned long *src;
+    int i;
+
+    address_space_sync_dirty_bitmap(&address_space_memory);
+    src = ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION];
+    for (i = 0; i < dirty_rate.nr_blocks; i++) {
+        DirtyRateBlockState *b = &dirty_rate.blocks[i];
+        uint64_t first = b->offset >> TARGET_PAGE_BITS;
+
+        b->dirty_pages += hbitmap_merge_clear_flat(seen, src, first, b->pages);
+    }
+}
+
+static void *dirty_rate_thread(void *opaque)
+{
+    int64_t calc_ms = dirty_rate.calc_time * 1000;
+    int64_t period = DIRTY_RATE_FIRST_PERIOD_MS;
+    int64_t start, now;
+    HBitmap *seen;
+    int i;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock_iothread();
+    dirty_rate_snapshot_blocks();
+    seen = hbitmap_alloc(last_ram_offset() >> TARGET_PAGE_BITS, 0);
+    qemu_mutex_unlock_iothread();
+
+    if (dirty_rate.sample_pages) {
+        for (i = 0; i < dirty_rate.nr_blocks; i++) {
+            dirty_rate_pick_samples(&dirty_rate.blocks[i]);
+        }
+    }
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_start();
+    /* Forget what was dirtied before the measurement started */
+    address_space_sync_dirty_bitmap(&address_space_memory);
+    for (i = 0; i < dirty_rate.nr_blocks; i++) {
+        cpu_physical_memory_clear_dirty_range_type(
+            dirty_rate.blocks[i].offset,
+            dirty_rate.blocks[i].pages << TARGET_PAGE_BITS,
+            DIRTY_MEMORY_MIGRATION);
+    }
+    start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_mutex_unlock_iothread();
+
+    for (;;) {
+        int64_t target = MIN(period, calc_ms);
+        DirtyRatePeriod *p;
+
+        now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        if (start + target > now) {
+            g_usleep((start + target - now) * 1000);
+        }
+
+        qemu_mutex_lock_iothread();
+        dirty_rate_sync(seen);
+        now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        qemu_mutex_unlock_iothread();
+
+        p = &dirty_rate.periods[dirty_rate.nr_periods++];
+        p->period_ms = now - start;
+        p->dirty_pages = hbitmap_count(seen);
+        trace_dirty_rate_period(p->period_ms, p->dirty_pages);
+
+        if (target == calc_ms ||
+            dirty_rate.nr_periods == DIRTY_RATE_MAX_PERIODS) {
+            break;
+        }
+        period *= 2;
+    }
+
+    for (i = 0; i < dirty_rate.nr_blocks; i++) {
+        dirty_rate_check_samples(&dirty_rate.blocks[i]);
+    }
+    hbitmap_free(seen);
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_stop();
+    for (i = 0; i < dirty_rate.nr_blocks; i++) {
+        memory_region_unref(dirty_rate.blocks[i].mr);
+        dirty_rate.blocks[i].mr = NULL;
+    }
+    dirty_rate.status = DIRTY_RATE_STATUS_MEASURED;
+    qemu_mutex_unlock_iothread();
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* Called with the iothread lock held */
+bool dirty_rate_measuring(void)
+{
+    return dirty_rate.status == DIRTY_RATE_STATUS_MEASURING;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
+                         int64_t sample_pages, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    QemuThread thread;
+
+    if (dirty_rate_measuring()) {
+        error_setg(errp, "A dirty rate measurement is already running");
+        return;
+    }
+    /* Both would turn dirty logging off when they are done */
+    if (migration_is_active(s) || s->state == MIGRATION_STATUS_CANCELLING) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+    if (calc_time < 1 || calc_time > DIRTY_RATE_MAX_CALC_TIME) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "calc-time",
+                  "an integer between 1 and 60");
+        return;
+    }
+    if (!has_sample_pages) {
+        sample_pages = 0;
+    }
+    if (sample_pages < 0 || sample_pages > DIRTY_RATE_MAX_SAMPLES) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "sample-pages",
+                  "an integer between 0 and 4096");
+        return;
+    }
+
+    dirty_rate_free_blocks();
+    dirty_rate.start_time = time(NULL);
+    dirty_rate.calc_time = calc_time;
+    dirty_rate.sample_pages = sample_pages;
+    dirty_rate.status = DIRTY_RATE_STATUS_MEASURING;
+
+    qemu_thread_create(&thread, "dirty rate", dirty_rate_thread, NULL,
+                       QEMU_THREAD_DETACHED);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_malloc0(sizeof(*info));
+    DirtyRateBlockList **next_block = &info->blocks;
+    DirtyRateWorkingSetList **next_ws = &info->working_set;
+    int64_t calc_ms;
+    uint64_t dirty_pages = 0;
+    int64_t sample_rate = 0;
+    int i;
+
+    info->status = dirty_rate.status;
+    if (dirty_rate.status != DIRTY_RATE_STATUS_MEASURED) {
+        return info;
+    }
+
+    /* The last period is the whole measurement */
+    calc_ms = dirty_rate.periods[dirty_rate.nr_periods - 1].period_ms;
+
+    for (i = 0; i < dirty_rate.nr_blocks; i++) {
+        DirtyRateBlockState *b = &dirty_rate.blocks[i];
+        DirtyRateBlockList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->id = g_strdup(b->idstr);
+        entry->value->size = b->pages << TARGET_PAGE_BITS;
+        entry->value->dirty_pages = b->dirty_pages;
+        entry->value->dirty_rate = dirty_rate_mbps(b->dirty_pages, calc_ms);
+        if (b->nr_samples) {
+            /* Scale the changed samples to the size of the block */
+            entry->value->has_sample_dirty_rate = true;
+            entry->value->sample_dirty_rate =
+                dirty_rate_mbps(b->samples_changed * b->pages / b->nr_samples,
+                                calc_ms);
+            sample_rate += entry->value->sample_dirty_rate;
+        }
+        dirty_pages += b->dirty_pages;
+        *next_block = entry;
+        next_block = &entry->next;
+    }
+
+    for (i = 0; i < dirty_rate.nr_periods; i++) {
+        DirtyRatePeriod *p = &dirty_rate.periods[i];
+        DirtyRateWorkingSetList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->period = p->period_ms;
+        entry->value->dirty_pages = p->dirty_pages;
+        entry->value->dirty_rate = dirty_rate_mbps(p->dirty_pages,
+                                                   p->period_ms);
+        *next_ws = entry;
+        next_ws = &entry->next;
+    }
+
+    info->has_start_time = true;
+    info->start_time = dirty_rate.start_time;
+    info->has_calc_time = true;
+    info->calc_time = dirty_rate.calc_time;
+    info->has_sample_pages = true;
+    info->sample_pages = dirty_rate.sample_pages;
+    info->has_dirty_rate = true;
+    info->dirty_rate = dirty_rate_mbps(dirty_pages, calc_ms);
+    if (dirty_rate.sample_pages) {
+        info->has_sample_dirty_rate = true;
+        info->sample_dirty_rate = sample_rate;
+    }
+    info->has_blocks = true;
+    info->has_working_set = true;
+
+    return info;
+}
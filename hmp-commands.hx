@@ -946,6 +946,25 @@ STEXI
 @item migrate_set_cache_size @var{value}
 @findex migrate_set_cache_size
 Set cache size to @var{value} (in bytes) for xbzrle migrations.
+ETEXI
+
+    {
+        .name       = "calc_dirty_rate",
+        .args_type  = "second:i,sample_pages:i?",
+        .params     = "second [sample_pages]",
+        .help       = "measure the rate at which the guest dirties its memory "
+                      "for 'second' seconds, hashing 'sample_pages' pages "
+                      "per GiB",
+        .mhandler.cmd = hmp_calc_dirty_rate,
+    },
+
+STEXI
+@item calc_dirty_rate @var{second} [@var{sample_pages}]
+@findex calc_dirty_rate
+Log the pages written by the guest for @var{second} seconds, without
+migrating it. With @var{sample_pages}, that many pages per GiB of RAM are
+also hashed to check how many actually change. See @code{info dirty_rate}
+for the results.
 ETEXI
 
     {
@@ -1004,6 +1023,21 @@ STEXI
 @item migrate_set_capability @var{capability} @var{state}
 @findex migrate_set_capability
 Enable/Disable the usage of a capability @var{capability} for migration.
+ETEXI
+
+    {
+        .name       = "migrate_set_parameter",
+        .args_type  = "parameter:s,value:s",
+        .params     = "parameter value",
+        .help       = "Set the parameter for migration",
+        .mhandler.cmd = hmp_migrate_set_parameter,
+    },
+
+STEXI
+@item migrate_set_parameter @var{parameter} @var{value}
+@findex migrate_set_parameter
+Set the parameter @var{parameter} for migration. @var{value} is a number,
+a size for mc-slab-size, or comma-separated URIs for mc-secondaries.
 ETEXI
 
     {
@@ -1775,8 +1809,14 @@ show user network stack connection states
 show migration status
 @item info migrate_capabilities
 show current migration capabilities
+@item info migrate_parameters
+show current migration parameters
 @item info migrate_cache_size
 show current migration XBZRLE cache size
+@item info mc_stats
+show percentiles of the last micro-checkpoint statistics
+@item info dirty_rate
+show the results of the last dirty rate measurement
 @item info balloon
 show balloon information
 @item info qtree
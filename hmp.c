@@ -185,6 +185,8 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->transferred >> 10);
         monitor_printf(mon, "throughput: %0.2f mbps\n",
                        info->ram->mbps);
+        monitor_printf(mon, "smoothed throughput: %0.2f mbps\n",
+                       info->ram->smoothed_mbps);
         monitor_printf(mon, "remaining ram: %" PRIu64 " kbytes\n",
                        info->ram->remaining >> 10);
         monitor_printf(mon, "total ram: %" PRIu64 " kbytes\n",
@@ -199,10 +201,16 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->normal_bytes >> 10);
         monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
                        info->ram->dirty_sync_count);
+        monitor_printf(mon, "bitmap sync time: %" PRIu64 " us\n",
+                       info->ram->bitmap_sync_time);
         if (info->ram->dirty_pages_rate) {
             monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages\n",
                            info->ram->dirty_pages_rate);
         }
+        if (info->ram->postcopy_requests) {
+            monitor_printf(mon, "postcopy requests: %" PRIu64 " pages\n",
+                           info->ram->postcopy_requests);
+        }
     }
 
     if (info->has_disk) {
@@ -227,8 +235,21 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->mc->ram_copy_time);
         monitor_printf(mon, "copy_mbps: %0.2f mbps\n",
                        info->mc->copy_mbps);
+        if (info->mc->has_copy_thread_mbps) {
+            numberList *t;
+            int i = 0;
+
+            for (t = info->mc->copy_thread_mbps; t; t = t->next) {
+                monitor_printf(mon, "copy_thread_mbps[%d]: %0.2f mbps\n",
+                               i++, t->value);
+            }
+        }
         monitor_printf(mon, "throughput: %0.2f mbps\n",
                        info->mc->mbps);
+        monitor_printf(mon, "epoch_length: %" PRId64 " ms\n",
+                       info->mc->epoch_length);
+        monitor_printf(mon, "commit_latency: %" PRId64 " ms\n",
+                       info->mc->commit_latency);
     }
 
     if (info->has_xbzrle_cache) {
@@ -244,6 +265,12 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss_rate);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
+        monitor_printf(mon, "xbzrle cache eviction: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_eviction);
+        monitor_printf(mon, "xbzrle cache insert fail: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_insert_fail);
     }
 
     qapi_free_MigrationInfo(info);
@@ -269,12 +296,140 @@ void hmp_info_migrate_capabilities(Monitor *mon, const QDict *qdict)
     qapi_free_MigrationCapabilityStatusList(caps);
 }
 
+void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
+{
+    MigrationParameters *params;
+    strList *uri;
+
+    params = qmp_query_migrate_parameters(NULL);
+
+    if (params) {
+        monitor_printf(mon, "parameters:");
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_LEVEL],
+            params->compress_level);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_THREADS],
+            params->compress_threads);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_DECOMPRESS_THREADS],
+            params->decompress_threads);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_MC_COPY_THREADS],
+            params->mc_copy_threads);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_MC_SLO_LATENCY],
+            params->mc_slo_latency);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_MC_SLO_MIN_DELAY],
+            params->mc_slo_min_delay);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_MC_SLO_MAX_DELAY],
+            params->mc_slo_max_delay);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_MC_SLAB_SIZE],
+            params->mc_slab_size);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_MC_SLAB_LOW_WATERMARK],
+            params->mc_slab_low_watermark);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_MC_SLAB_HIGH_WATERMARK],
+            params->mc_slab_high_watermark);
+        monitor_printf(mon, " %s:",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_MC_SECONDARIES]);
+        for (uri = params->mc_secondaries; uri; uri = uri->next) {
+            monitor_printf(mon, "%s%s", uri == params->mc_secondaries ?
+                           " " : ",", uri->value);
+        }
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_MC_QUORUM],
+            params->mc_quorum);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_MULTIFD_CHANNELS],
+            params->multifd_channels);
+        monitor_printf(mon, "\n");
+    }
+
+    qapi_free_MigrationParameters(params);
+}
+
 void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
 {
     monitor_printf(mon, "xbzrel cache size: %" PRId64 " kbytes\n",
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+static void hmp_print_mc_percentiles(Monitor *mon, const char *name,
+                                     MCPercentiles *p)
+{
+    monitor_printf(mon, "%-16s %10" PRId64 " %10" PRId64 " %10" PRId64
+                   " %10" PRId64 " %10" PRId64 "\n",
+                   name, p->min, p->p50, p->p90, p->p99, p->max);
+}
+
+void hmp_info_mc_stats(Monitor *mon, const QDict *qdict)
+{
+    MCStatsInfo *info = qmp_query_mc_stats(false, 0, NULL);
+
+    monitor_printf(mon, "epochs: %" PRId64 "\n", info->epochs);
+
+    if (info->epochs) {
+        monitor_printf(mon, "%-16s %10s %10s %10s %10s %10s\n",
+                       "(times in us)", "min", "p50", "p90", "p99", "max");
+        hmp_print_mc_percentiles(mon, "dirty_pages", info->dirty_pages);
+        hmp_print_mc_percentiles(mon, "bytes", info->bytes);
+        hmp_print_mc_percentiles(mon, "slabs", info->slabs);
+        hmp_print_mc_percentiles(mon, "capture_time", info->capture_time);
+        hmp_print_mc_percentiles(mon, "copy_time", info->copy_time);
+        hmp_print_mc_percentiles(mon, "xmit_time", info->xmit_time);
+        hmp_print_mc_percentiles(mon, "ack_time", info->ack_time);
+        hmp_print_mc_percentiles(mon, "commit_latency", info->commit_latency);
+        hmp_print_mc_percentiles(mon, "held_packets", info->held_packets);
+    }
+
+    qapi_free_MCStatsInfo(info);
+}
+
+void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    DirtyRateInfo *info = qmp_query_dirty_rate(NULL);
+    DirtyRateBlockList *block;
+    DirtyRateWorkingSetList *ws;
+
+    monitor_printf(mon, "status: %s\n", DirtyRateStatus_lookup[info->status]);
+
+    if (info->status == DIRTY_RATE_STATUS_MEASURED) {
+        monitor_printf(mon, "start time: %" PRId64 "\n", info->start_time);
+        monitor_printf(mon, "calc time: %" PRId64 " s\n", info->calc_time);
+        monitor_printf(mon, "dirty rate: %" PRId64 " MB/s\n",
+                       info->dirty_rate);
+        if (info->has_sample_dirty_rate) {
+            monitor_printf(mon, "sample dirty rate: %" PRId64 " MB/s "
+                           "(%" PRId64 " pages per GiB)\n",
+                           info->sample_dirty_rate, info->sample_pages);
+        }
+
+        monitor_printf(mon, "%-24s %14s %12s %10s\n", "block", "size",
+                       "dirty pages", "MB/s");
+        for (block = info->blocks; block; block = block->next) {
+            monitor_printf(mon, "%-24s %14" PRId64 " %12" PRId64
+                           " %10" PRId64 "\n", block->value->id,
+                           block->value->size, block->value->dirty_pages,
+                           block->value->dirty_rate);
+        }
+
+        monitor_printf(mon, "%-10s %12s %10s\n", "period (ms)",
+                       "dirty pages", "MB/s");
+        for (ws = info->working_set; ws; ws = ws->next) {
+            monitor_printf(mon, "%-10" PRId64 " %12" PRId64 " %10" PRId64 "\n",
+                           ws->value->period, ws->value->dirty_pages,
+                           ws->value->dirty_rate);
+        }
+    }
+
+    qapi_free_DirtyRateInfo(info);
+}
+
 void hmp_info_cpus(Monitor *mon, const QDict *qdict)
 {
     CpuInfoList *cpu_list, *cpu;
@@ -510,6 +665,22 @@ void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
                        stats->value->stats->flush_total_time_ns,
                        stats->value->stats->rd_merged,
                        stats->value->stats->wr_merged);
+
+        if (stats->value->has_metadata_cache) {
+            BlockCacheStatsList *cache;
+
+            for (cache = stats->value->metadata_cache; cache;
+                 cache = cache->next) {
+                monitor_printf(mon, "    %s cache: size=%" PRId64
+                               " table_size=%" PRId64
+                               " hits=%" PRId64 " misses=%" PRId64
+                               " evictions=%" PRId64 "\n",
+                               cache->value->name, cache->value->size,
+                               cache->value->table_size,
+                               cache->value->hits, cache->value->misses,
+                               cache->value->evictions);
+            }
+        }
     }
 
     qapi_free_BlockStatsList(stats_list);
@@ -1170,6 +1341,17 @@ void hmp_migrate_set_cache_size(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    int64_t calc_time = qdict_get_int(qdict, "second");
+    bool has_sample_pages = qdict_haskey(qdict, "sample_pages");
+    int64_t sample_pages = qdict_get_try_int(qdict, "sample_pages", 0);
+    Error *err = NULL;
+
+    qmp_calc_dirty_rate(calc_time, has_sample_pages, sample_pages, &err);
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_migrate_set_speed(Monitor *mon, const QDict *qdict)
 {
     int64_t value = qdict_get_int(qdict, "value");
@@ -1208,6 +1390,86 @@ void hmp_migrate_set_capability(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
+{
+    const char *param = qdict_get_str(qdict, "parameter");
+    const char *valuestr = qdict_get_str(qdict, "value");
+    bool has[MIGRATION_PARAMETER_MAX] = { false };
+    int64_t value = 0;
+    strList *uris = NULL, **tail = &uris;
+    char **split;
+    char *end;
+    Error *err = NULL;
+    int i, x;
+
+    for (i = 0; i < MIGRATION_PARAMETER_MAX; i++) {
+        if (strcmp(param, MigrationParameter_lookup[i]) == 0) {
+            break;
+        }
+    }
+
+    switch (i) {
+    case MIGRATION_PARAMETER_MAX:
+        error_set(&err, QERR_INVALID_PARAMETER, param);
+        goto out;
+    case MIGRATION_PARAMETER_MC_SECONDARIES:
+        /* Comma-separated URIs, or an empty string for none */
+        split = g_strsplit(valuestr, ",", 0);
+        for (x = 0; split[x]; x++) {
+            if (!*split[x]) {
+                continue;
+            }
+            *tail = g_malloc0(sizeof(**tail));
+            (*tail)->value = g_strdup(split[x]);
+            tail = &(*tail)->next;
+        }
+        g_strfreev(split);
+        break;
+    case MIGRATION_PARAMETER_MC_SLAB_SIZE:
+        value = strtosz_suffix(valuestr, &end, STRTOSZ_DEFSUFFIX_B);
+        if (value < 0 || *end) {
+            error_set(&err, QERR_INVALID_PARAMETER_VALUE, param, "a size");
+            goto out;
+        }
+        break;
+    default:
+        value = strtoll(valuestr, &end, 10);
+        if (!*valuestr || *end) {
+            error_set(&err, QERR_INVALID_PARAMETER_VALUE, param, "a number");
+            goto out;
+        }
+        break;
+    }
+
+    has[i] = true;
+    qmp_migrate_set_parameters(has[MIGRATION_PARAMETER_COMPRESS_LEVEL], value,
+                               has[MIGRATION_PARAMETER_COMPRESS_THREADS], value,
+                               has[MIGRATION_PARAMETER_DECOMPRESS_THREADS],
+                               value,
+                               has[MIGRATION_PARAMETER_MC_COPY_THREADS], value,
+                               has[MIGRATION_PARAMETER_MC_SLO_LATENCY], value,
+                               has[MIGRATION_PARAMETER_MC_SLO_MIN_DELAY], value,
+                               has[MIGRATION_PARAMETER_MC_SLO_MAX_DELAY], value,
+                               has[MIGRATION_PARAMETER_MC_SLAB_SIZE], value,
+                               has[MIGRATION_PARAMETER_MC_SLAB_LOW_WATERMARK],
+                               value,
+                               has[MIGRATION_PARAMETER_MC_SLAB_HIGH_WATERMARK],
+                               value,
+                               has[MIGRATION_PARAMETER_MC_SECONDARIES], uris,
+                               has[MIGRATION_PARAMETER_MC_QUORUM], value,
+                               has[MIGRATION_PARAMETER_MULTIFD_CHANNELS], value,
+                               &err);
+
+out:
+    qapi_free_strList(uris);
+
+    if (err) {
+        monitor_printf(mon, "migrate_set_parameter: %s\n",
+                       error_get_pretty(err));
+        error_free(err);
+    }
+}
+
 void hmp_set_password(Monitor *mon, const QDict *qdict)
 {
     const char *protocol  = qdict_get_str(qdict, "protocol");
@@ -0,0 +1,40 @@
+/*
+ * Sets of guest RAM pages for micro-checkpointing
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef MC_PAGES_H
+#define MC_PAGES_H
+
+/* Pages of guest RAM, by ram_addr_t, each with its size */
+typedef struct MCPages MCPages;
+
+MCPages *mc_pages_new(void);
+void mc_pages_free(MCPages *pages);
+
+/**
+ * mc_pages_add: add a page to the set. Adding it again only
+ * updates its size.
+ */
+void mc_pages_add(MCPages *pages, uint64_t addr, uint64_t size);
+
+/**
+ * mc_pages_merge: add all of the pages of @src to @dst.
+ * @src is left as it was.
+ */
+void mc_pages_merge(MCPages *dst, MCPages *src);
+
+void mc_pages_clear(MCPages *pages);
+unsigned int mc_pages_count(MCPages *pages);
+
+typedef void MCPagesFunc(uint64_t addr, uint64_t size, void *opaque);
+
+/**
+ * mc_pages_foreach: call @func on every page of the set, which
+ * must not change meanwhile.
+ */
+void mc_pages_foreach(MCPages *pages, MCPagesFunc *func, void *opaque);
+
+#endif
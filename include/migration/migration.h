@@ -20,6 +20,7 @@
 #include "qemu/notify.h"
 #include "qapi/error.h"
 #include "migration/vmstate.h"
+#include "migration/page_cache.h"
 #include "qapi-types.h"
 #include "exec/cpu-common.h"
 
@@ -34,6 +35,7 @@
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
 #define QEMU_VM_VMDESCRIPTION        0x06
+#define QEMU_VM_POSTCOPY             0x08
 
 struct MigrationParams {
     bool blk;
@@ -42,6 +44,9 @@ struct MigrationParams {
 
 typedef struct MigrationState MigrationState;
 
+#define MC_MAX_COPY_THREADS 64
+#define MC_MAX_REPLICAS 8
+
 struct MigrationState
 {
     int64_t bandwidth_limit;
@@ -54,6 +59,8 @@ struct MigrationState
     int state;
     MigrationParams params;
     double mbps;
+    /* mbps averaged over about a second */
+    double smoothed_mbps;
     double copy_mbps;
     int64_t total_time;
     int64_t downtime;
@@ -66,9 +73,21 @@ struct MigrationState
     int64_t dirty_bytes_rate;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size;
+    int parameters[MIGRATION_PARAMETER_MAX];
     int64_t setup_time;
     int64_t checkpoints;
     int64_t dirty_sync_count;
+    /* microseconds the last dirty bitmap merge took */
+    int64_t bitmap_sync_time;
+    double copy_thread_mbps[MC_MAX_COPY_THREADS];
+    int nb_copy_threads;
+    int64_t mc_epoch_length;
+    int64_t mc_commit_latency;
+
+    /* Postcopy: page requests from the destination */
+    QEMUFile *rp_file;
+    QemuThread rp_thread;
+    int rp_error;
 };
 
 void process_incoming_migration(QEMUFile *f);
@@ -131,6 +150,7 @@ uint64_t xbzrle_mig_bytes_transferred(void);
 uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
+void xbzrle_mig_cache_stats(PageCacheStats *stats);
 //<<<<<<< HEAD
 void acct_clear(void);
 
@@ -138,6 +158,9 @@ void migrate_set_state(MigrationState *s, int old_state, int new_state);
 
 void mc_init_checkpointer(MigrationState *s);
 void mc_process_incoming_checkpoints_if_requested(QEMUFile *f);
+void mc_get_parameters(MigrationParameters *params);
+bool mc_check_parameters(MigrationParameters *params, Error **errp);
+void mc_set_parameters(MigrationParameters *params);
 
 #define MAX_THROTTLE  (32 << 20)
 //=======
@@ -167,15 +190,55 @@ bool migrate_auto_converge(void);
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+const char *xbzrle_encoder_name(void);
+bool xbzrle_encoder_next(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
 
+bool migrate_use_compression(void);
+int migrate_compress_level(void);
+int migrate_compress_threads(void);
+int migrate_decompress_threads(void);
+void migrate_decompress_threads_create(void);
+void migrate_decompress_threads_join(void);
+
+#define MULTIFD_DEFAULT_CHANNELS 2
+#define MULTIFD_MAX_CHANNELS 16
+
+int migrate_use_multifd(void);
+int migrate_multifd_channels(void);
+
+void multifd_save_setup(QEMUFile *f);
+bool multifd_send_active(void);
+int multifd_queue_page(const char *idstr, uint64_t offset, uint8_t *host,
+                       size_t size);
+int multifd_send_sync_main(QEMUFile *f);
+void multifd_save_shutdown(void);
+void multifd_save_cleanup(void);
+bool multifd_recv_accept(int listen_fd, int fd);
+int multifd_recv_sync_main(int count);
+void multifd_load_cleanup(void);
+void *ram_block_host(const char *idstr, ram_addr_t offset, size_t size);
+const char *ram_block_from_host(void *host, ram_addr_t *offset);
+
+bool migrate_socket_pacing(void);
+void migrate_set_rate_limit(MigrationState *s, int64_t rate);
+
+bool migrate_postcopy_ram(void);
+bool ram_postcopy_ready(void);
+void ram_postcopy_send_discard(QEMUFile *f);
+int ram_save_queue_page(const char *idstr, ram_addr_t offset);
+uint64_t ram_postcopy_requests(void);
+
+bool dirty_rate_measuring(void);
+
 int64_t xbzrle_cache_resize(int64_t new_size);
 
 void ram_control_before_iterate(QEMUFile *f, uint64_t flags);
 void ram_control_after_iterate(QEMUFile *f, uint64_t flags);
 void ram_control_load_hook(QEMUFile *f, uint64_t flags);
+void ram_control_after_load(QEMUFile *f, uint64_t flags);
 void ram_control_add(QEMUFile *f, void *host_addr,
                          ram_addr_t block_offset, uint64_t length);
 void ram_control_remove(QEMUFile *f, ram_addr_t block_offset);
@@ -190,6 +253,9 @@ void ram_control_remove(QEMUFile *f, ram_addr_t block_offset);
  */
 #define RAM_SAVE_FLAG_HOOK     0x80
 
+/* Followed by the number of multifd channels to wait for */
+#define RAM_SAVE_FLAG_MULTIFD_SYNC 0x200
+
 #define RAM_SAVE_CONTROL_NOT_SUPP -1000
 #define RAM_SAVE_CONTROL_DELAYED  -2000
 #define RAM_LOAD_CONTROL_NOT_SUPP -3000
@@ -216,9 +282,16 @@ int ram_control_copy_page(QEMUFile *f,
 
 int migrate_use_mc(void);
 int migrate_use_mc_rdma_copy(void);
+int migrate_use_mc_cow(void);
+int migrate_use_mc_pipeline(void);
+int migrate_use_mc_transactional(void);
+int migrate_use_mc_xbzrle(void);
+int migrate_use_mc_zerocopy(void);
 void mc_configure_net(MigrationState *s);
+void mc_connect_secondaries(MigrationState *s);
+void ram_mark_dirty(ram_addr_t addr, ram_addr_t length);
 
-#define MC_VERSION 1
+#define MC_VERSION 3
 
 int mc_info_load(QEMUFile *f, void *opaque, int version_id);
 void mc_info_save(QEMUFile *f, void *opaque);
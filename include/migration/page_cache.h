@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set-associative, indexed by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -18,6 +18,18 @@
 /* Page cache for storing guest pages */
 typedef struct PageCache PageCache;
 
+/* Number of pages an address can be cached in */
+#define PAGE_CACHE_WAYS 8
+
+typedef struct PageCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    /* pages replaced by another one */
+    uint64_t evictions;
+    /* pages not inserted: all candidates were fresh, or out of memory */
+    uint64_t insert_fails;
+} PageCacheStats;
+
 /**
  * cache_init: Initialize the page cache
  *
@@ -36,6 +48,27 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size);
  */
 void cache_fini(PageCache *cache);
 
+/**
+ * cache_lock_page: Lock the part of the cache that holds a page
+ *
+ * cache_is_cached(), get_cached_data() and cache_insert() must be called
+ * with the page locked, and the data returned for a page may only be
+ * used until it is unlocked. Pages are locked by set, so a thread must
+ * not lock two pages at once.
+ *
+ * @cache pointer to the PageCache struct
+ * @addr: page addr
+ */
+void cache_lock_page(const PageCache *cache, uint64_t addr);
+
+/**
+ * cache_unlock_page: Unlock the part of the cache that holds a page
+ *
+ * @cache pointer to the PageCache struct
+ * @addr: page addr
+ */
+void cache_unlock_page(const PageCache *cache, uint64_t addr);
+
 /**
  * cache_is_cached: Checks to see if the page is cached
  *
@@ -62,7 +95,8 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
  * cache_insert: insert the page into the cache. the page cache
  * will dup the data on insert. the previous value will be overwritten
  *
- * Returns -1 when the page isn't inserted into cache
+ * Returns -1 when the page isn't inserted into cache, 1 when another
+ * page was evicted for it, 0 otherwise
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
@@ -73,14 +107,13 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age);
 
 /**
- * cache_resize: resize the page cache. In case of size reduction the extra
- * pages will be freed
+ * cache_get_stats: Sum up the statistics of the cache
  *
- * Returns -1 on error new cache size on success
+ * The pages need not be locked; the result is then only approximate.
  *
  * @cache pointer to the PageCache struct
- * @num_pages: new page cache size (in pages)
+ * @stats: filled with the statistics
  */
-int64_t cache_resize(PageCache *cache, int64_t num_pages);
+void cache_get_stats(const PageCache *cache, PageCacheStats *stats);
 
 #endif
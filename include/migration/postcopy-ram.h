@@ -0,0 +1,40 @@
+/*
+ * Postcopy live migration of RAM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_POSTCOPY_RAM_H
+#define QEMU_POSTCOPY_RAM_H
+
+#include "migration/qemu-file.h"
+
+/* Commands carried by a QEMU_VM_POSTCOPY section */
+enum {
+    /* be64 page size: the destination checks it can do postcopy */
+    POSTCOPY_CMD_ADVISE = 1,
+    /* block name, be32 count, count x (be64 start, be64 length) */
+    POSTCOPY_CMD_DISCARD,
+    /* be32 length, device state: the rest of RAM follows in postcopy */
+    POSTCOPY_CMD_RUN,
+};
+
+/* Messages sent by the destination on the return path */
+enum {
+    /* The destination has every page and lets go of the return path */
+    MIG_RP_MSG_SHUT = 1,
+    /* block name, be64 offset: the guest is waiting for this page */
+    MIG_RP_MSG_REQ_PAGE,
+};
+
+bool postcopy_ram_supported_by_host(void);
+int postcopy_ram_discard_range(const char *idstr, uint64_t start,
+                               uint64_t length);
+int postcopy_ram_incoming_setup(QEMUFile *f);
+bool postcopy_ram_incoming_running(void);
+int postcopy_place_page(void *host, void *from, size_t size);
+int postcopy_place_page_zero(void *host, size_t size);
+void postcopy_ram_incoming_cleanup(void);
+
+#endif
@@ -41,6 +41,8 @@
  * bitmap_set(dst, pos, nbits)			Set specified bit area
  * bitmap_clear(dst, pos, nbits)		Clear specified bit area
  * bitmap_find_next_zero_area(buf, len, pos, n, mask)	Find bit free area
+ * bitmap_merge_clear(dst, src, nbits)		*dst |= *src, *src = 0,
+ *						count new bits in *dst
  */
 
 /*
@@ -59,6 +61,7 @@
  * find_next_bit(addr, nbits, bit)	Position next set bit in *addr >= bit
  */
 
+#define BITMAP_FIRST_WORD_MASK(start) (~0UL << ((start) % BITS_PER_LONG))
 #define BITMAP_LAST_WORD_MASK(nbits)                                    \
     (                                                                   \
         ((nbits) % BITS_PER_LONG) ?                                     \
@@ -232,6 +235,9 @@ unsigned long bitmap_find_next_zero_area(unsigned long *map,
                                          unsigned long start,
                                          unsigned long nr,
                                          unsigned long align_mask);
+long bitmap_merge_clear(unsigned long *dst, unsigned long *src, long nbits);
+const char *bitmap_merge_accel_name(void);
+bool bitmap_merge_next_accel(void);
 
 static inline unsigned long *bitmap_zero_extend(unsigned long *old,
                                                 long old_nbits, long new_nbits)
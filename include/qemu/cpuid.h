@@ -0,0 +1,57 @@
+/*
+ * Runtime detection of host vector extensions
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_CPUID_H
+#define QEMU_CPUID_H
+
+#ifdef CONFIG_CPUID_H
+#include <cpuid.h>
+#endif
+
+/* Extensions which the CPU has and the OS saves on context switches */
+#define CPUID_VEC_AVX2          (1 << 0)
+#define CPUID_VEC_AVX512F       (1 << 1)
+#define CPUID_VEC_AVX512BW      (1 << 2)
+
+static inline unsigned cpuid_vector_features(void)
+{
+    unsigned features = 0;
+#ifdef CONFIG_CPUID_H
+    /* Older <cpuid.h> do not know all of them */
+    const unsigned osxsave = 1 << 27;       /* leaf 1, ecx */
+    const unsigned avx2 = 1 << 5;           /* leaf 7, ebx */
+    const unsigned avx512f = 1 << 16;       /* leaf 7, ebx */
+    const unsigned avx512bw = 1 << 30;      /* leaf 7, ebx */
+    unsigned a, b, c, d, xcr0, xcr0_hi;
+
+    if (__get_cpuid_max(0, 0) < 7) {
+        return 0;
+    }
+
+    __cpuid(1, a, b, c, d);
+    if (!(c & osxsave)) {
+        return 0;
+    }
+    asm("xgetbv" : "=a"(xcr0), "=d"(xcr0_hi) : "c"(0));
+
+    __cpuid_count(7, 0, a, b, c, d);
+    /* SSE and AVX state */
+    if ((xcr0 & 0x6) == 0x6 && (b & avx2)) {
+        features |= CPUID_VEC_AVX2;
+    }
+    /* and the AVX-512 opmask and upper ZMM state */
+    if ((xcr0 & 0xe6) == 0xe6 && (b & avx512f)) {
+        features |= CPUID_VEC_AVX512F;
+        if (b & avx512bw) {
+            features |= CPUID_VEC_AVX512BW;
+        }
+    }
+#endif
+    return features;
+}
+
+#endif
@@ -148,6 +148,23 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item);
  */
 void hbitmap_free(HBitmap *hb);
 
+/**
+ * hbitmap_merge_clear_flat:
+ * @hb: HBitmap to operate on, with a granularity of zero.
+ * @src: Flat bitmap, indexed like @hb.
+ * @start: First bit to move.
+ * @count: Number of bits to move.
+ *
+ * Set the bits of @src between @start and @start + @count - 1 in @hb,
+ * and clear them in @src.  Return the number of bits that were not already
+ * set in @hb.
+ *
+ * Several threads may call this at the same time on disjoint ranges, as
+ * long as nothing else accesses @hb meanwhile.
+ */
+uint64_t hbitmap_merge_clear_flat(HBitmap *hb, unsigned long *src,
+                                  uint64_t start, uint64_t count);
+
 /**
  * hbitmap_iter_init:
  * @hbi: HBitmapIter to initialize.
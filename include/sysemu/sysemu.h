@@ -88,6 +88,14 @@ int qemu_savevm_state_iterate(QEMUFile *f);
 void qemu_savevm_state_complete(QEMUFile *f);
 void qemu_savevm_state_cancel(void);
 uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size);
+void qemu_savevm_send_postcopy_advise(QEMUFile *f);
+void qemu_savevm_send_postcopy_discard(QEMUFile *f, const char *idstr,
+                                       uint32_t nr, const uint64_t *start,
+                                       const uint64_t *length);
+void qemu_savevm_state_postcopy(QEMUFile *f);
+void qemu_savevm_state_postcopy_complete(QEMUFile *f);
+/* The rest of the stream has been handed over to the postcopy thread */
+#define LOADVM_POSTCOPY_RUNNING 1
 int qemu_loadvm_state(QEMUFile *f);
 
 typedef enum DisplayType
@@ -36,6 +36,9 @@
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
 
+/* Reads in flight are limited to this much of the migration bandwidth */
+#define MAX_INFLIGHT_MS 100
+
 //#define DEBUG_BLK_MIGRATION
 
 #ifdef DEBUG_BLK_MIGRATION
@@ -670,7 +673,7 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
     blk_mig_lock();
     while ((block_mig_state.submitted +
             block_mig_state.read_done) * BLOCK_SIZE <
-           qemu_file_get_rate_limit(f)) {
+           qemu_file_get_rate_limit(f) / (1000 / MAX_INFLIGHT_MS)) {
         blk_mig_unlock();
         if (block_mig_state.bulk_completed == 0) {
             /* first finish the bulk phase */
@@ -0,0 +1,74 @@
+/*
+ * Sets of guest RAM pages for micro-checkpointing
+ *
+ * The sender records the pages of each checkpoint in one of these, so
+ * that a destination which has to skip the checkpoint can be sent its
+ * pages again later: by then the copy descriptors have been reused.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "migration/mc-pages.h"
+
+struct MCPages {
+    GHashTable *table;
+};
+
+MCPages *mc_pages_new(void)
+{
+    MCPages *pages = g_new(MCPages, 1);
+
+    /* addresses and sizes are stored in the pointers themselves */
+    pages->table = g_hash_table_new(NULL, NULL);
+
+    return pages;
+}
+
+void mc_pages_free(MCPages *pages)
+{
+    if (!pages) {
+        return;
+    }
+
+    g_hash_table_destroy(pages->table);
+    g_free(pages);
+}
+
+void mc_pages_add(MCPages *pages, uint64_t addr, uint64_t size)
+{
+    g_hash_table_insert(pages->table, (gpointer) (uintptr_t) addr,
+                        (gpointer) (uintptr_t) size);
+}
+
+void mc_pages_merge(MCPages *dst, MCPages *src)
+{
+    GHashTableIter iter;
+    gpointer addr, size;
+
+    g_hash_table_iter_init(&iter, src->table);
+    while (g_hash_table_iter_next(&iter, &addr, &size)) {
+        g_hash_table_insert(dst->table, addr, size);
+    }
+}
+
+void mc_pages_clear(MCPages *pages)
+{
+    g_hash_table_remove_all(pages->table);
+}
+
+unsigned int mc_pages_count(MCPages *pages)
+{
+    return g_hash_table_size(pages->table);
+}
+
+void mc_pages_foreach(MCPages *pages, MCPagesFunc *func, void *opaque)
+{
+    GHashTableIter iter;
+    gpointer addr, size;
+
+    g_hash_table_iter_init(&iter, pages->table);
+    while (g_hash_table_iter_next(&iter, &addr, &size)) {
+        func((uintptr_t) addr, (uintptr_t) size, opaque);
+    }
+}
@@ -21,11 +21,26 @@
 #include "hw/virtio/virtio.h"
 #include "hw/virtio/virtio-net.h"
 #include "qemu/sockets.h"
+#include "qemu/iov.h"
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
 #include "qmp-commands.h"
+#include "qapi/qmp/qerror.h"
 #include "net/tap-linux.h"
+#include "qemu/event_notifier.h"
+#include "qemu/crc32c.h"
+#include "qemu/bswap.h"
+#include "migration/page_cache.h"
+#include "migration/mc-pages.h"
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <linux/errqueue.h>
+#ifdef CONFIG_USERFAULTFD
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#endif
 
 #define DEBUG_MC
 //#define DEBUG_MC_VERBOSE
@@ -76,29 +91,36 @@
  *
  * Regardless, the current strategy taken is:
  * 
- * 1. If the checkpoint size increases,
- *    then grow the number of slabs to support it,
+ * 1. Slabs come from a pool of pre-faulted, hugepage-backed buffers,
+ *    so that growing a checkpoint while the VM is stopped neither
+ *    allocates nor faults in memory.
  *    (if and only if RDMA is activated, these slabs will be pinned.)
- * 2. If the next checkpoint size is smaller than the last one,
-      then that's a "strike".
- * 3. After N strikes, cut the size of the slab cache in half
- *    (to a minimum of 1 slab as described before).
+ * 2. When a checkpoint starts, the slabs that the previous one did not
+ *    need go back to the pool.
+ * 3. Between checkpoints, the pool is topped up to its low watermark
+ *    and trimmed down to its high watermark
+ *    (see the mc-slab-* migration parameters).
  *
  * As of this writing, a typical average size of 
  * an Idle-VM checkpoint is under 5MB.
  */
 
-#define MC_SLAB_BUFFER_SIZE     (5UL * 1024UL * 1024UL) /* empirical */
+#define MC_DEFAULT_SLAB_SIZE    (5UL * 1024UL * 1024UL) /* empirical */
+#define MC_MIN_SLAB_SIZE        (64UL * 1024UL)
+#define MC_MAX_SLAB_SIZE        (1024UL * 1024UL * 1024UL)
+#define MC_DEFAULT_SLABS_LOW    2
+#define MC_DEFAULT_SLABS_HIGH   16
 #define MC_DEV_NAME_MAX_SIZE    256
 
 #define MC_DEFAULT_CHECKPOINT_FREQ_MS 100 /* too slow, but best for now */
+#define MC_DEFAULT_COPY_THREADS 1
 #define CALC_MAX_STRIKES()                                           \
     do {  max_strikes = (max_strikes_delay_secs * 1000) / freq_ms; } \
     while (0)
 
 /*
  * How many "seconds-worth" of checkpoints to wait before re-evaluating the size
- * of the slab list?
+ * of the copyset list? (slabs are managed by the slab pool instead)
  *
  * #strikes_until_shrink_cache = Function(#checkpoints/sec)
  *
@@ -106,7 +128,7 @@
  * to be reached until it is time to cut the cache in half.
  *
  * Below value is open for debate - we just want it to be small enough to ensure
- * that a large, idle slab list doesn't stay too large for too long.
+ * that a large, idle copyset list doesn't stay too large for too long.
  */
 #define MC_DEFAULT_SLAB_MAX_CHECK_DELAY_SECS 10
 
@@ -130,10 +152,21 @@
  *
  * We're not actually using this assumption for any memory management 
  * management, only as a hint to know how big of an array to allocate.
+ * Copysets are sized for the default slab size, whatever the slab
+ * size actually in use.
  *
- * The following adds a fixed-cost of about 40 KB to each slab.
+ * The following adds a fixed-cost of about 60 KB to each slab
+ * (1280 descriptors of sizeof(MCCopy), 48 bytes).
+ */
+#define MC_MAX_SLAB_COPY_DESCRIPTORS (MC_DEFAULT_SLAB_SIZE / 4096)
+
+/*
+ * Copy-on-write capture (mc-cow) needs userfaultfd write-protection,
+ * which older kernel headers do not provide.
  */
-#define MC_MAX_SLAB_COPY_DESCRIPTORS (MC_SLAB_BUFFER_SIZE / 4096)
+#if defined(CONFIG_USERFAULTFD) && defined(UFFDIO_WRITEPROTECT)
+#define MC_COW_SUPPORTED
+#endif
 
 #define SLAB_RESET(s) do {                      \
                             s->size = 0;      \
@@ -141,14 +174,27 @@
                       } while(0)
 
 uint64_t freq_ms = MC_DEFAULT_CHECKPOINT_FREQ_MS;
+static int copy_threads = MC_DEFAULT_COPY_THREADS;
+static uint64_t slab_size = MC_DEFAULT_SLAB_SIZE;
+static int slabs_low = MC_DEFAULT_SLABS_LOW;
+static int slabs_high = MC_DEFAULT_SLABS_HIGH;
 uint32_t max_strikes_delay_secs = MC_DEFAULT_SLAB_MAX_CHECK_DELAY_SECS;
 uint32_t max_strikes = -1;
 
+enum {
+    MC_COPY_PENDING = 0,
+    MC_COPY_BUSY,
+    MC_COPY_DONE,
+};
+
 typedef struct QEMU_PACKED MCCopy {
     uint64_t ramblock_offset;
     uint64_t host_addr;
     uint64_t offset;
     uint64_t size;
+    uint64_t dest;      /* slab address reserved for this copy (mc-cow) */
+    uint32_t state;     /* MC_COPY_* (mc-cow) */
+    uint32_t reserved;
 } MCCopy;
 
 typedef struct QEMU_PACKED MCCopyset {
@@ -158,14 +204,76 @@ typedef struct QEMU_PACKED MCCopyset {
     int idx;
 } MCCopyset;
 
-typedef struct QEMU_PACKED MCSlab {
+typedef struct MCSlab {
     QTAILQ_ENTRY(MCSlab) node;
-    uint8_t buf[MC_SLAB_BUFFER_SIZE];
+    QSLIST_ENTRY(MCSlab) free_node;
+    uint8_t *buf;
     uint64_t read;
     uint64_t size;
+    uint64_t wire_size; /* big endian size, sent with the slab (mc-zerocopy) */
     int idx;
 } MCSlab;
 
+/*
+ * Copy-on-write capture state. Shared by all of the
+ * checkpoint buffers of the sender.
+ */
+typedef struct MCCow {
+    int uffd;
+    QemuThread thread;
+    EventNotifier quit;
+    QemuMutex lock;
+    GHashTable *pages;
+    uint64_t faults;
+} MCCow;
+
+typedef struct MCCopyPool MCCopyPool;
+
+/*
+ * Pool of free slabs, shared by all of the checkpoint buffers.
+ *
+ * Any thread may give slabs back to the pool, but only the thread
+ * filling the checkpoint buffers takes slabs out of it, so the free
+ * list can be popped with a plain compare-and-swap without ABA.
+ */
+typedef struct MCSlabPool {
+    QSLIST_HEAD(, MCSlab) free;
+    uint64_t slab_size;
+    uint64_t map_size;
+    bool hugetlb;
+    int nb_free;
+    int nb_slabs;
+    uint64_t misses;    /* slabs allocated while filling a checkpoint */
+} MCSlabPool;
+
+enum {
+    MC_PAGE_RAW = 0,
+    MC_PAGE_XBZRLE,
+    MC_PAGE_ZERO,
+};
+
+/* Precedes every page of a delta-compressed checkpoint (mc-xbzrle) */
+typedef struct QEMU_PACKED MCPageHeader {
+    uint8_t type;       /* MC_PAGE_* */
+    uint8_t reserved;
+    uint16_t len;       /* big endian, bytes of payload that follow */
+} MCPageHeader;
+
+/*
+ * Delta compression state. On the source, shared by all of the
+ * checkpoint buffers. On the destination, only encoded_buf is used.
+ */
+typedef struct MCXbzrle {
+    PageCache *cache;
+    unsigned int page_size;
+    uint8_t *encoded_buf;
+    uint64_t age;
+    uint64_t raw_pages;
+    uint64_t xbzrle_pages;
+    uint64_t zero_pages;
+    uint64_t bytes;
+} MCXbzrle;
+
 typedef struct MCParams {
     QTAILQ_HEAD(shead, MCSlab) slab_head;
     QTAILQ_HEAD(chead, MCCopyset) copy_head;
@@ -180,10 +288,27 @@ typedef struct MCParams {
     uint64_t total_copies;
     uint64_t nb_slabs;
     uint64_t used_slabs;
-    uint32_t slab_strikes;
     uint32_t copy_strikes;
     int nb_copysets;
     uint64_t checkpoints;
+    MCCow *cow;
+    MCCopyPool *pool;
+    MCXbzrle *xbzrle;
+    MCSlabPool *slabs;
+    bool own_slabs;
+    bool scatter;       /* defer RAM page loads (mc-transactional) */
+    /* pipelining */
+    QemuSemaphore free;
+    uint64_t epoch;
+    int64_t start_time;
+    /* telemetry */
+    int64_t barrier_us; /* when the epoch's output started being held */
+    MCEpochStats stats;
+    /* fan-out, protected by MCSender.ack_lock */
+    int senders;        /* destinations still sending this checkpoint */
+    int acks;
+    int acked_by;       /* destination which completed the quorum */
+    MCPages *pages;     /* RAM pages of the checkpoint, kept for skippers */
 } MCParams;
 
 enum {
@@ -228,6 +353,12 @@ static bool buffering_enabled = false;
 static const char * BUFFER_NIC_PREFIX = "ifb";
 static QEMUBH *checkpoint_bh = NULL;
 static bool mc_requested = false;
+static bool mc_transactional = false;
+static bool mc_xbzrle = false;
+
+/* Flags of the MC info section, version 2 */
+#define MC_INFO_TRANSACTIONAL   0x01
+#define MC_INFO_XBZRLE          0x02
 
 int migrate_use_mc(void)
 {
@@ -241,6 +372,36 @@ int migrate_use_mc_rdma_copy(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_MC_RDMA_COPY];
 }
 
+int migrate_use_mc_cow(void)
+{
+    MigrationState *s = migrate_get_current();
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MC_COW];
+}
+
+int migrate_use_mc_pipeline(void)
+{
+    MigrationState *s = migrate_get_current();
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MC_PIPELINE];
+}
+
+int migrate_use_mc_transactional(void)
+{
+    MigrationState *s = migrate_get_current();
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MC_TRANSACTIONAL];
+}
+
+int migrate_use_mc_xbzrle(void)
+{
+    MigrationState *s = migrate_get_current();
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MC_XBZRLE];
+}
+
+int migrate_use_mc_zerocopy(void)
+{
+    MigrationState *s = migrate_get_current();
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MC_ZEROCOPY];
+}
+
 static int mc_deliver(int update)
 {
     int err, flags = NLM_F_CREATE | NLM_F_REPLACE;
@@ -559,7 +720,276 @@ static int mc_flush_oldest_buffer(void)
 }
 
 /*
- * Get the next slab in the list. If there is none, then make one.
+ * Output commit bookkeeping.
+ *
+ * The plug qdisc only tracks two epochs: the one currently being
+ * buffered and a single closed one waiting to be released. Without
+ * pipelining that is all we ever need. With pipelining, a checkpoint
+ * can be captured before the previous one has been acknowledged, so
+ * its barrier cannot always be inserted right away. In that case the
+ * barrier is deferred until the closed epoch has been released, and the
+ * packets buffered in the meantime are only released once a checkpoint
+ * captured *after* the deferred barrier has been acknowledged.
+ *
+ * Packets are therefore never released before the state that produced
+ * them is safe on the destination, at the cost of holding some of them
+ * for one extra checkpoint.
+ */
+static QemuMutex plug_lock;
+static bool plug_closed;
+static bool plug_deferred;
+static uint64_t plug_release_epoch;
+static uint64_t plug_last_epoch;
+
+static void mc_plug_init(void)
+{
+    qemu_mutex_init(&plug_lock);
+    plug_closed = false;
+    plug_deferred = false;
+    plug_release_epoch = 0;
+    plug_last_epoch = 0;
+}
+
+/*
+ * Called while the VM is stopped for checkpoint 'epoch'.
+ */
+static int mc_plug_barrier(uint64_t epoch)
+{
+    int ret = 0;
+
+    qemu_mutex_lock(&plug_lock);
+    plug_last_epoch = epoch;
+    if (!plug_closed) {
+        ret = mc_start_buffer();
+        plug_closed = true;
+        plug_release_epoch = epoch;
+    } else {
+        DDPRINTF("Deferring barrier for checkpoint %" PRIu64 "\n", epoch);
+        plug_deferred = true;
+    }
+    qemu_mutex_unlock(&plug_lock);
+
+    return ret;
+}
+
+/*
+ * Called once checkpoint 'epoch' has been acknowledged.
+ */
+static int mc_plug_release(uint64_t epoch)
+{
+    int ret = 0;
+
+    qemu_mutex_lock(&plug_lock);
+    if (plug_closed && plug_release_epoch <= epoch) {
+        ret = mc_flush_oldest_buffer();
+        plug_closed = false;
+
+        if (plug_deferred) {
+            plug_deferred = false;
+            plug_closed = true;
+            plug_release_epoch = plug_last_epoch + 1;
+            if (mc_start_buffer() < 0) {
+                ret = -EINVAL;
+            }
+        }
+    }
+    qemu_mutex_unlock(&plug_lock);
+
+    return ret;
+}
+
+/*
+ * Number of packets currently held back by the plug qdisc, or -1 if it
+ * cannot be read. This dumps the qdiscs of the host, so it must not be
+ * called while the VM is stopped or output is waiting to be released.
+ */
+static int64_t mc_held_packets(void)
+{
+    struct nl_cache *qdisc_cache;
+    struct rtnl_qdisc *plug;
+    int64_t packets = -1;
+
+    qemu_mutex_lock(&plug_lock);
+
+    if (!buffering_enabled) {
+        packets = 0;
+    } else if (rtnl_qdisc_alloc_cache(sock, &qdisc_cache) >= 0) {
+        plug = rtnl_qdisc_get_by_parent(qdisc_cache, rtnl_tc_get_ifindex(tc),
+                                        rtnl_tc_get_parent(tc));
+        if (plug) {
+            packets = rtnl_tc_get_stat(TC_CAST(plug), RTNL_TC_QLEN);
+            rtnl_qdisc_put(plug);
+        }
+        nl_cache_free(qdisc_cache);
+    }
+
+    qemu_mutex_unlock(&plug_lock);
+
+    return packets;
+}
+
+/*
+ * Slab pool.
+ *
+ * Slabs are backed by hugetlbfs pages when the host has some to spare,
+ * and by memory advised for transparent hugepages otherwise, to keep
+ * TLB misses down while checkpoints are copied. Either way, a slab is
+ * faulted in as soon as it is allocated.
+ */
+#define MC_SLAB_HUGEPAGE_SIZE (2UL * 1024UL * 1024UL)
+
+static MCSlab *mc_slab_alloc(MCSlabPool *pool)
+{
+    MCSlab *slab = g_malloc0(sizeof(MCSlab));
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void *buf = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (pool->hugetlb) {
+        buf = mmap(NULL, pool->map_size, PROT_READ | PROT_WRITE,
+                   flags | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        if (buf == MAP_FAILED) {
+            DPRINTF("No hugetlbfs pages left for slabs, "
+                    "using transparent hugepages\n");
+            pool->hugetlb = false;
+        }
+    }
+#endif
+
+    if (buf == MAP_FAILED) {
+        buf = mmap(NULL, pool->map_size, PROT_READ | PROT_WRITE,
+                   flags, -1, 0);
+        if (buf == MAP_FAILED) {
+            fprintf(stderr, "Failed to allocate MC slab: %s\n",
+                    strerror(errno));
+            abort();
+        }
+        qemu_madvise(buf, pool->map_size, QEMU_MADV_HUGEPAGE);
+        memset(buf, 0, pool->map_size);
+    }
+
+    slab->buf = buf;
+    atomic_inc(&pool->nb_slabs);
+
+    return slab;
+}
+
+static void mc_slab_dealloc(MCSlabPool *pool, MCSlab *slab)
+{
+    munmap(slab->buf, pool->map_size);
+    g_free(slab);
+    atomic_dec(&pool->nb_slabs);
+}
+
+static void mc_slab_put(MCSlabPool *pool, MCSlab *slab)
+{
+    QSLIST_INSERT_HEAD_ATOMIC(&pool->free, slab, free_node);
+    atomic_inc(&pool->nb_free);
+}
+
+static MCSlab *mc_slab_pop(MCSlabPool *pool)
+{
+    MCSlab *slab;
+
+    do {
+        slab = atomic_rcu_read(&pool->free.slh_first);
+        if (!slab) {
+            return NULL;
+        }
+    } while (atomic_cmpxchg(&pool->free.slh_first, slab,
+                            slab->free_node.sle_next) != slab);
+
+    atomic_dec(&pool->nb_free);
+
+    return slab;
+}
+
+/*
+ * Take a slab out of the pool. Only allocates if the pool ran dry,
+ * which means that the low watermark is too low for the workload.
+ */
+static MCSlab *mc_slab_get(MCSlabPool *pool)
+{
+    MCSlab *slab = mc_slab_pop(pool);
+
+    if (!slab) {
+        pool->misses++;
+        slab = mc_slab_alloc(pool);
+    }
+
+    return slab;
+}
+
+/*
+ * Called between checkpoints, by the thread filling the checkpoint
+ * buffers, to bring the number of free slabs between the watermarks.
+ */
+static void mc_slab_pool_balance(MCSlabPool *pool)
+{
+    int low = atomic_read(&slabs_low), high = atomic_read(&slabs_high);
+    MCSlab *slab;
+
+    while (atomic_read(&pool->nb_free) < low) {
+        mc_slab_put(pool, mc_slab_alloc(pool));
+    }
+
+    while (atomic_read(&pool->nb_free) > high &&
+           (slab = mc_slab_pop(pool))) {
+        mc_slab_dealloc(pool, slab);
+    }
+}
+
+static MCSlabPool *mc_slab_pool_new(uint64_t size)
+{
+    MCSlabPool *pool = g_malloc0(sizeof(*pool));
+
+    QSLIST_INIT(&pool->free);
+    pool->slab_size = size;
+    pool->map_size = ROUND_UP(size, MC_SLAB_HUGEPAGE_SIZE);
+    pool->hugetlb = true;
+
+    mc_slab_pool_balance(pool);
+
+    DPRINTF("Slab pool: %" PRIu64 " KB slabs, %d free, %s\n",
+            size / 1024UL, pool->nb_free,
+            pool->hugetlb ? "hugetlbfs" : "transparent hugepages");
+
+    return pool;
+}
+
+/* All of the slabs must have been given back first */
+static void mc_slab_pool_free(MCSlabPool *pool)
+{
+    MCSlab *slab;
+
+    if (!pool) {
+        return;
+    }
+
+    while ((slab = mc_slab_pop(pool))) {
+        mc_slab_dealloc(pool, slab);
+    }
+
+    assert(!pool->nb_slabs);
+    g_free(pool);
+}
+
+/*
+ * Hand the last slab of a checkpoint buffer back to the pool.
+ */
+static void mc_slab_release(MCParams *mc)
+{
+    MCSlab *slab = QTAILQ_LAST(&mc->slab_head, shead);
+
+    ram_control_remove(mc->file, (uint64_t) slab->buf);
+    QTAILQ_REMOVE(&mc->slab_head, slab, node);
+    mc_slab_put(mc->slabs, slab);
+    mc->nb_slabs--;
+}
+
+/*
+ * Get the next slab in the list. If there is none, then take one
+ * from the pool.
  */
 static MCSlab *mc_slab_next(MCParams *mc, MCSlab *slab)
 {
@@ -568,18 +998,16 @@ static MCSlab *mc_slab_next(MCParams *mc, MCSlab *slab)
         mc->used_slabs++;
         DDPRINTF("Extending slabs by one: %" PRIu64 " slabs total, "
                  "%" PRIu64 " MB\n", mc->nb_slabs,
-                 mc->nb_slabs * sizeof(MCSlab) / 1024UL / 1024UL);
-        mc->curr_slab = qemu_memalign(4096, sizeof(MCSlab));
-        memset(mc->curr_slab, 0, sizeof(*(mc->curr_slab)));
-        mc->curr_slab->idx = idx;
-        QTAILQ_INSERT_TAIL(&mc->slab_head, mc->curr_slab, node);
-        slab = mc->curr_slab;
+                 mc->nb_slabs * mc->slabs->slab_size / 1024UL / 1024UL);
+        slab = mc_slab_get(mc->slabs);
+        slab->idx = idx;
+        QTAILQ_INSERT_TAIL(&mc->slab_head, slab, node);
         ram_control_add(mc->file, slab->buf, 
-                (uint64_t) slab->buf, MC_SLAB_BUFFER_SIZE);
+                (uint64_t) slab->buf, mc->slabs->slab_size);
     } else {
         DDPRINTF("Adding to existing slab: %" PRIu64 " slabs total, "
                  "%" PRIu64 " MB\n", mc->nb_slabs,
-                 mc->nb_slabs * sizeof(MCSlab) / 1024UL / 1024UL);
+                 mc->nb_slabs * mc->slabs->slab_size / 1024UL / 1024UL);
         slab = QTAILQ_NEXT(slab, node);
         mc->used_slabs++;
     }
@@ -605,14 +1033,15 @@ static int mc_put_buffer(void *opaque, const uint8_t *buf,
     assert(slab);
 
     while (len) {
-        long put = MIN(MC_SLAB_BUFFER_SIZE - slab->size, len);
+        long put = MIN(mc->slabs->slab_size - slab->size, len);
 
         if (put == 0) {
             DDPRINTF("Reached the end of slab %d Need a new one\n", slab->idx);
             goto zero;
         }
 
-        if (mc->copy && migrate_use_mc_rdma_copy()) {
+        /* Delta-compressed pages are encoded by the CPU (mc-xbzrle) */
+        if (mc->copy && !mc->xbzrle && migrate_use_mc_rdma_copy()) {
             int ret = ram_control_copy_page(mc->file, 
                                         (uint64_t) slab->buf,
                                         slab->size,
@@ -658,264 +1087,1876 @@ zero:
 }
 
 /*
- * Stop the VM, generate the micro checkpoint,
- * but save the dirty memory into staging memory until
- * we can re-activate the VM as soon as possible.
+ * Delta-compressed checkpoints (mc-xbzrle).
+ *
+ * Every page of the checkpoint is preceded by an MCPageHeader. The source
+ * keeps the last contents it sent for each page in a page cache and, when
+ * the page is cached, only sends the XBZRLE delta against it. Pages which
+ * are entirely zero are sent without any payload.
+ *
+ * The destination does not need a cache of its own: its copy of guest
+ * memory always holds the last contents sent for every page, so deltas
+ * are decoded in place.
  */
-static int capture_checkpoint(MCParams *mc, MigrationState *s)
+static long mc_put_page(MCParams *mc, MCCopy *c)
 {
-    MCCopyset *copyset;
-    int idx, ret = 0;
-    uint64_t start, stop, copies = 0;
-    int64_t start_time;
+    MCXbzrle *xb = mc->xbzrle;
+    uint8_t *addr = (uint8_t *) (c->host_addr + c->offset);
+    uint64_t key = c->ramblock_offset + c->offset;
+    MCPageHeader hdr = { .type = MC_PAGE_RAW };
+    uint8_t *payload = addr;
+    uint8_t *cached;
+    int len = c->size;
+
+    if (!xb->cache) {
+        xb->page_size = c->size;
+        xb->cache = cache_init(migrate_xbzrle_cache_size() / xb->page_size,
+                               xb->page_size);
+        xb->encoded_buf = g_malloc(xb->page_size);
+    }
 
-    mc->total_copies = 0;
-    qemu_mutex_lock_iothread();
-    vm_stop_force_state(RUN_STATE_CHECKPOINT_VM);
-    start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    if (!xb->cache || c->size != xb->page_size) {
+        goto put;
+    }
 
-    /*
-     * If buffering is enabled, insert a Qdisc plug here
-     * to hold packets for the *next* MC, (not this one,
-     * the packets for this one have already been plugged
-     * and will be released after the MC has been transmitted.
-     */
-    mc_start_buffer();
+    cache_lock_page(xb->cache, key);
+    cached = get_cached_data(xb->cache, key);
+    if (buffer_is_zero(addr, c->size)) {
+        hdr.type = MC_PAGE_ZERO;
+        len = 0;
+    } else if (cache_is_cached(xb->cache, key, xb->age)) {
+        int encoded = xbzrle_encode_buffer(cached, addr, c->size,
+                                           xb->encoded_buf,
+                                           c->size - sizeof(hdr));
+        if (encoded >= 0) {
+            hdr.type = MC_PAGE_XBZRLE;
+            payload = xb->encoded_buf;
+            len = encoded;
+        }
+    }
 
-    qemu_savevm_state_begin(mc->staging, &s->params);
-    ret = qemu_file_get_error(s->file);
+    /* Remember what the destination will hold for this page */
+    if (cached) {
+        memcpy(cached, addr, c->size);
+    } else {
+        cache_insert(xb->cache, key, addr, xb->age);
+    }
+    cache_unlock_page(xb->cache, key);
+
+put:
+    switch (hdr.type) {
+    case MC_PAGE_RAW:
+        xb->raw_pages++;
+        break;
+    case MC_PAGE_XBZRLE:
+        xb->xbzrle_pages++;
+        break;
+    case MC_PAGE_ZERO:
+        xb->zero_pages++;
+        break;
+    }
 
-    if (ret < 0) {
-        migrate_set_state(s, MIG_STATE_CHECKPOINTING, MIG_STATE_ERROR);
+    hdr.len = cpu_to_be16(len);
+    xb->bytes += sizeof(hdr) + len;
+
+    if (mc_put_buffer(mc, (uint8_t *) &hdr, 0, sizeof(hdr)) != sizeof(hdr) ||
+        (len && mc_put_buffer(mc, payload, 0, len) != len)) {
+        return -EINVAL;
     }
 
-    qemu_savevm_state_complete(mc->staging);
+    return c->size;
+}
 
-    ret = qemu_file_get_error(s->file);
-    if (ret < 0) {
-        migrate_set_state(s, MIG_STATE_CHECKPOINTING, MIG_STATE_ERROR);
-        goto out;
+static MCXbzrle *mc_xbzrle_new(void)
+{
+    return g_malloc0(sizeof(MCXbzrle));
+}
+
+static void mc_xbzrle_free(MCXbzrle *xb)
+{
+    if (!xb) {
+        return;
     }
 
-    /*
-     * The copied memory gets appended to the end of the snapshot, so let's
-     * remember where its going to go first and start a new slab.
-     */
+    if (xb->cache) {
+        cache_fini(xb->cache);
+    }
 
-    start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    g_free(xb->encoded_buf);
+    g_free(xb);
+}
 
-    if (!mc->total_copies) {
-        DDPRINTF("No copysets. Don't copy.\n");
-        mc->start_copyset = 0;
-        goto skip_copies;
+/*
+ * Copy-on-write capture (mc-cow).
+ *
+ * Instead of copying every dirty page into the slabs while the VM is
+ * stopped, a staging location is reserved for each page, the pages are
+ * write-protected through userfaultfd and the VM is resumed right away.
+ * The MC thread then drains the pages into their reserved locations.
+ * If anybody writes to a page which has not been copied yet, the fault
+ * thread copies that page first and only then lifts the protection,
+ * so the checkpoint still reflects the instant the VM was stopped.
+ *
+ * Because every copy has a fixed destination, the order in which the
+ * pages are copied does not matter: the destination still reads them
+ * back in the order they were recorded.
+ */
+
+/*
+ * Copy a single page into its reserved slab location, unless someone
+ * else already did (or is doing) it.
+ *
+ * Returns true if the caller performed the copy.
+ */
+static bool mc_copy_one(MCCopy *c)
+{
+    if (atomic_cmpxchg(&c->state, MC_COPY_PENDING, MC_COPY_BUSY)
+            == MC_COPY_PENDING) {
+        memcpy((void *) c->dest, (void *) (c->host_addr + c->offset),
+               c->size);
+        atomic_mb_set(&c->state, MC_COPY_DONE);
+        return true;
     }
 
-    DDPRINTF("Copyset identifiers complete. Copying memory from %d" 
-                " copysets...\n", mc->nb_copysets); 
+    /* The other side is copying a single page, this won't take long */
+    while (atomic_mb_read(&c->state) != MC_COPY_DONE) {
+        /* spin */
+    }
 
-    mc_slab_next(mc, mc->curr_slab);
-    mc->start_copyset = mc->curr_slab->idx;
+    return false;
+}
+
+static bool mc_copy_can_protect(MCCopy *c)
+{
+    uint64_t page_size = getpagesize();
+
+    return !((c->host_addr + c->offset) & (page_size - 1)) &&
+           !(c->size & (page_size - 1));
+}
+
+/*
+ * Reserve a location in the slab list for every recorded copy.
+ * A copy never straddles two slabs: if it does not fit in the
+ * remainder of the current slab, the slab is closed early.
+ */
+static void mc_reserve_copies(MCParams *mc)
+{
+    MCCopyset *copyset;
+    MCSlab *slab = mc->curr_slab;
+    int idx;
 
-    /*
-     * Now perform the actual copy of memory into the tail end of the slab list. 
-     */
     QTAILQ_FOREACH(copyset, &mc->copy_head, node) {
         if (!copyset->nb_copies) {
             break;
         }
 
-        copies += copyset->nb_copies;
+        for (idx = 0; idx < copyset->nb_copies; idx++) {
+            MCCopy *c = &copyset->copies[idx];
 
-        DDDPRINTF("copyset %d copies: %" PRIu64 " total: %" PRIu64 "\n",
-                copyset->idx, copyset->nb_copies, copies);
+            if ((mc->slabs->slab_size - slab->size) < c->size) {
+                slab = mc_slab_next(mc, slab);
+            }
 
-        for (idx = 0; idx < copyset->nb_copies; idx++) {
-            uint8_t *addr;
-            long size;
-            mc->copy = &copyset->copies[idx];
-            addr = (uint8_t *) (mc->copy->host_addr + mc->copy->offset);
-            size = mc_put_buffer(mc, addr, mc->copy->offset, mc->copy->size);
-            if (size != mc->copy->size) {
-                fprintf(stderr, "Failure to initiate copyset %d index %d\n",
+            c->dest = (uint64_t) (slab->buf + slab->size);
+            slab->size     += c->size;
+            mc->slab_total += c->size;
+        }
+    }
+}
+
+/*
+ * Parallel copy (mc-copy-threads).
+ *
+ * Once a slab location has been reserved for every copy, the copies
+ * are independent of each other and can be performed by several
+ * threads at once. Workers grab MC_COPY_CHUNK copies at a time from
+ * a shared cursor until all of them have been copied.
+ */
+#define MC_COPY_CHUNK 64
+
+typedef struct MCCopyWorker {
+    MCCopyPool *pool;
+    QemuThread thread;
+    QemuSemaphore go;
+    int idx;
+    uint64_t bytes;
+    int64_t time_ns;
+} MCCopyWorker;
+
+struct MCCopyPool {
+    MCCopyWorker *workers;
+    int nb_workers;
+    QemuSemaphore done;
+    bool quit;
+    /* current job */
+    MCCopyset **copysets;
+    int nb_copysets;
+    uint64_t total_copies;
+    uint64_t next;
+};
+
+static void mc_copy_chunk(MCCopyWorker *w, uint64_t first)
+{
+    MCCopyPool *pool = w->pool;
+    uint64_t last = MIN(first + MC_COPY_CHUNK, pool->total_copies);
+    uint64_t x;
+
+    for (x = first; x < last; x++) {
+        MCCopyset *copyset = pool->copysets[x / MC_MAX_SLAB_COPY_DESCRIPTORS];
+        MCCopy *c = &copyset->copies[x % MC_MAX_SLAB_COPY_DESCRIPTORS];
+
+        if (mc_copy_one(c)) {
+            w->bytes += c->size;
+        }
+    }
+}
+
+static void *mc_copy_worker(void *opaque)
+{
+    MCCopyWorker *w = opaque;
+    MCCopyPool *pool = w->pool;
+
+    while (true) {
+        int64_t start;
+        uint64_t first;
+
+        qemu_sem_wait(&w->go);
+
+        if (atomic_mb_read(&pool->quit)) {
+            break;
+        }
+
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        w->bytes = 0;
+
+        while ((first = atomic_fetch_add(&pool->next, MC_COPY_CHUNK))
+                < pool->total_copies) {
+            mc_copy_chunk(w, first);
+        }
+
+        w->time_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+        qemu_sem_post(&pool->done);
+    }
+
+    return NULL;
+}
+
+static MCCopyPool *mc_copy_pool_new(int nb_workers)
+{
+    MCCopyPool *pool = g_malloc0(sizeof(*pool));
+    int x;
+
+    pool->nb_workers = nb_workers;
+    pool->workers = g_malloc0(sizeof(MCCopyWorker) * nb_workers);
+    qemu_sem_init(&pool->done, 0);
+
+    for (x = 0; x < nb_workers; x++) {
+        MCCopyWorker *w = &pool->workers[x];
+
+        w->pool = pool;
+        w->idx = x;
+        qemu_sem_init(&w->go, 0);
+        qemu_thread_create(&w->thread, "mc_copy", mc_copy_worker, w,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    DPRINTF("Started %d copy threads\n", nb_workers);
+
+    return pool;
+}
+
+static void mc_copy_pool_free(MCCopyPool *pool)
+{
+    int x;
+
+    if (!pool) {
+        return;
+    }
+
+    atomic_mb_set(&pool->quit, true);
+
+    for (x = 0; x < pool->nb_workers; x++) {
+        qemu_sem_post(&pool->workers[x].go);
+    }
+
+    for (x = 0; x < pool->nb_workers; x++) {
+        qemu_thread_join(&pool->workers[x].thread);
+        qemu_sem_destroy(&pool->workers[x].go);
+    }
+
+    qemu_sem_destroy(&pool->done);
+    g_free(pool->copysets);
+    g_free(pool->workers);
+    g_free(pool);
+}
+
+/*
+ * Copy every pending copy of the checkpoint into the location
+ * reserved for it by mc_reserve_copies() and record the throughput
+ * achieved by each of the workers (if 's' is given).
+ */
+static void mc_copy_parallel(MCParams *mc, MigrationState *s)
+{
+    MCCopyPool *pool = mc->pool;
+    MCCopyset *copyset;
+    int x = 0;
+
+    pool->copysets = g_renew(MCCopyset *, pool->copysets, mc->nb_copysets);
+    QTAILQ_FOREACH(copyset, &mc->copy_head, node) {
+        if (!copyset->nb_copies) {
+            break;
+        }
+        pool->copysets[x++] = copyset;
+    }
+
+    pool->nb_copysets = x;
+    pool->total_copies = mc->total_copies;
+    atomic_mb_set(&pool->next, 0);
+
+    for (x = 0; x < pool->nb_workers; x++) {
+        qemu_sem_post(&pool->workers[x].go);
+    }
+
+    for (x = 0; x < pool->nb_workers; x++) {
+        qemu_sem_wait(&pool->done);
+    }
+
+    if (!s) {
+        return;
+    }
+
+    for (x = 0; x < pool->nb_workers; x++) {
+        MCCopyWorker *w = &pool->workers[x];
+
+        s->copy_thread_mbps[x] = w->time_ns ?
+            ((double) w->bytes * 8 * 1000) / w->time_ns : 0;
+    }
+    s->nb_copy_threads = pool->nb_workers;
+}
+
+#ifdef MC_COW_SUPPORTED
+static int mc_cow_protect(MCCow *cow, uint64_t start, uint64_t len, bool wp)
+{
+    struct uffdio_writeprotect prot = {
+        .range = { .start = start, .len = len },
+        .mode = wp ? UFFDIO_WRITEPROTECT_MODE_WP : 0,
+    };
+
+    if (!len) {
+        return 0;
+    }
+
+    if (ioctl(cow->uffd, UFFDIO_WRITEPROTECT, &prot)) {
+        fprintf(stderr, "MC: failed to %s %" PRIx64 " + %" PRIu64 ": %s\n",
+                wp ? "write-protect" : "unprotect", start, len,
+                strerror(errno));
+        return -errno;
+    }
+
+    return 0;
+}
+
+static void mc_cow_fault(MCCow *cow, uint64_t addr)
+{
+    MCCopy *c;
+
+    qemu_mutex_lock(&cow->lock);
+    c = g_hash_table_lookup(cow->pages, (gpointer) (uintptr_t) addr);
+
+    if (c) {
+        DDDPRINTF("COW fault on %" PRIx64 ", copying first\n", addr);
+        mc_copy_one(c);
+        mc_cow_protect(cow, c->host_addr + c->offset, c->size, false);
+        cow->faults++;
+    } else {
+        mc_cow_protect(cow, addr, getpagesize(), false);
+    }
+    qemu_mutex_unlock(&cow->lock);
+}
+
+static void *mc_cow_thread(void *opaque)
+{
+    MCCow *cow = opaque;
+    uint64_t page_mask = ~((uint64_t) getpagesize() - 1);
+    struct pollfd pfd[2] = {
+        { .fd = cow->uffd, .events = POLLIN },
+        { .fd = event_notifier_get_fd(&cow->quit), .events = POLLIN },
+    };
+
+    while (true) {
+        struct uffd_msg msg;
+        ssize_t len;
+
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "MC: COW fault thread poll failed: %s\n",
+                    strerror(errno));
+            break;
+        }
+
+        if (pfd[1].revents) {
+            break;
+        }
+
+        len = read(cow->uffd, &msg, sizeof(msg));
+        if (len != sizeof(msg)) {
+            if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            fprintf(stderr, "MC: COW fault thread read failed: %s\n",
+                    strerror(errno));
+            break;
+        }
+
+        if (msg.event != UFFD_EVENT_PAGEFAULT ||
+            !(msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP)) {
+            continue;
+        }
+
+        mc_cow_fault(cow, msg.arg.pagefault.address & page_mask);
+    }
+
+    return NULL;
+}
+
+static void mc_cow_register_block(void *host_addr, ram_addr_t offset,
+                                  ram_addr_t length, void *opaque)
+{
+    MCCow *cow = opaque;
+    struct uffdio_register reg = {
+        .range = { .start = (uint64_t) host_addr, .len = length },
+        .mode = UFFDIO_REGISTER_MODE_WP,
+    };
+
+    if (cow->uffd < 0) {
+        return;
+    }
+
+    if (ioctl(cow->uffd, UFFDIO_REGISTER, &reg)) {
+        fprintf(stderr, "MC: cannot register RAM block %p (%" PRIu64
+                " bytes) for write-protection: %s\n",
+                host_addr, (uint64_t) length, strerror(errno));
+        close(cow->uffd);
+        cow->uffd = -1;
+    }
+}
+#else
+static int mc_cow_protect(MCCow *cow, uint64_t start, uint64_t len, bool wp)
+{
+    return -ENOSYS;
+}
+#endif
+
+/*
+ * Returns NULL if copy-on-write capture cannot be used, in which case
+ * checkpoints are captured by copying while the VM is stopped.
+ */
+static MCCow *mc_cow_new(void)
+{
+#ifdef MC_COW_SUPPORTED
+    struct uffdio_api api = {
+        .api = UFFD_API,
+        .features = UFFD_FEATURE_PAGEFAULT_FLAG_WP,
+    };
+    MCCow *cow = g_malloc0(sizeof(*cow));
+
+    cow->uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (cow->uffd < 0) {
+        fprintf(stderr, "MC: userfaultfd not available: %s\n",
+                strerror(errno));
+        goto err;
+    }
+
+    if (ioctl(cow->uffd, UFFDIO_API, &api) ||
+        !(api.features & UFFD_FEATURE_PAGEFAULT_FLAG_WP)) {
+        fprintf(stderr, "MC: userfaultfd write-protection not supported\n");
+        close(cow->uffd);
+        goto err;
+    }
+
+    qemu_ram_foreach_block(mc_cow_register_block, cow);
+    if (cow->uffd < 0) {
+        goto err;
+    }
+
+    event_notifier_init(&cow->quit, false);
+    qemu_mutex_init(&cow->lock);
+    cow->pages = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    qemu_thread_create(&cow->thread, "mc_cow", mc_cow_thread, cow,
+                       QEMU_THREAD_JOINABLE);
+
+    DPRINTF("Copy-on-write capture enabled\n");
+    return cow;
+
+err:
+    g_free(cow);
+    return NULL;
+#else
+    fprintf(stderr, "MC: copy-on-write capture needs userfaultfd "
+                    "write-protection support\n");
+    return NULL;
+#endif
+}
+
+static void mc_cow_free(MCCow *cow)
+{
+    if (!cow) {
+        return;
+    }
+
+    event_notifier_set(&cow->quit);
+    qemu_thread_join(&cow->thread);
+    event_notifier_cleanup(&cow->quit);
+
+    /* Closing the descriptor drops any leftover protection */
+    close(cow->uffd);
+
+    g_hash_table_destroy(cow->pages);
+    qemu_mutex_destroy(&cow->lock);
+    g_free(cow);
+}
+
+/*
+ * Called with the VM stopped: write-protect every page of the checkpoint,
+ * merging neighbouring pages into a single range. Pages which cannot be
+ * protected individually are copied right away.
+ */
+static int mc_cow_protect_copies(MCParams *mc)
+{
+    MCCopyset *copyset;
+    uint64_t start = 0, len = 0;
+    int idx, ret;
+
+    QTAILQ_FOREACH(copyset, &mc->copy_head, node) {
+        if (!copyset->nb_copies) {
+            break;
+        }
+
+        for (idx = 0; idx < copyset->nb_copies; idx++) {
+            MCCopy *c = &copyset->copies[idx];
+            uint64_t addr = c->host_addr + c->offset;
+
+            if (!mc_copy_can_protect(c)) {
+                mc_copy_one(c);
+                continue;
+            }
+
+            if (len && addr == start + len) {
+                len += c->size;
+                continue;
+            }
+
+            ret = mc_cow_protect(mc->cow, start, len, true);
+            if (ret < 0) {
+                return ret;
+            }
+
+            start = addr;
+            len = c->size;
+        }
+    }
+
+    return mc_cow_protect(mc->cow, start, len, true);
+}
+
+/*
+ * Called with the VM running: copy whatever the fault thread has not
+ * already copied, lifting the protection as we go.
+ */
+static void mc_cow_drain(MCParams *mc, MigrationState *s)
+{
+    MCCopyset *copyset;
+    uint64_t start = 0, len = 0;
+    int idx;
+
+    if (mc->pool) {
+        mc_copy_parallel(mc, s);
+    }
+
+    QTAILQ_FOREACH(copyset, &mc->copy_head, node) {
+        if (!copyset->nb_copies) {
+            break;
+        }
+
+        for (idx = 0; idx < copyset->nb_copies; idx++) {
+            MCCopy *c = &copyset->copies[idx];
+            uint64_t addr = c->host_addr + c->offset;
+
+            /* Copies done by the workers still need to be unprotected */
+            if (!mc_copy_one(c) && !mc->pool) {
+                continue;
+            }
+
+            if (len && addr == start + len) {
+                len += c->size;
+                continue;
+            }
+
+            mc_cow_protect(mc->cow, start, len, false);
+            start = addr;
+            len = c->size;
+        }
+
+        copyset->nb_copies = 0;
+    }
+
+    mc_cow_protect(mc->cow, start, len, false);
+}
+
+/*
+ * Stop the VM, generate the micro checkpoint,
+ * but save the dirty memory into staging memory until
+ * we can re-activate the VM as soon as possible.
+ *
+ * With copy-on-write capture, the dirty memory is only
+ * write-protected while the VM is stopped and gets copied
+ * after the VM has been re-activated.
+ */
+static int capture_checkpoint(MCParams *mc, MigrationState *s)
+{
+    MCCopyset *copyset;
+    int idx, ret = 0;
+    uint64_t start, stop, copies = 0;
+    int64_t start_time;
+
+    mc->total_copies = 0;
+    qemu_mutex_lock_iothread();
+    vm_stop_force_state(RUN_STATE_CHECKPOINT_VM);
+    start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    if (mc->cow) {
+        /*
+         * The previous checkpoint has been fully drained, so nobody can
+         * fault on its pages anymore. Held until the new pages are
+         * protected so that the fault thread sees a complete table.
+         */
+        qemu_mutex_lock(&mc->cow->lock);
+        g_hash_table_remove_all(mc->cow->pages);
+    }
+
+    /*
+     * If buffering is enabled, insert a Qdisc plug here
+     * to hold packets for the *next* MC, (not this one,
+     * the packets for this one have already been plugged
+     * and will be released after the MC has been transmitted.
+     */
+    mc_plug_barrier(mc->epoch);
+
+    qemu_savevm_state_begin(mc->staging, &s->params);
+    ret = qemu_file_get_error(s->file);
+
+    if (ret < 0) {
+        migrate_set_state(s, MIG_STATE_CHECKPOINTING, MIG_STATE_ERROR);
+    }
+
+    qemu_savevm_state_complete(mc->staging);
+
+    ret = qemu_file_get_error(s->file);
+    if (ret < 0) {
+        migrate_set_state(s, MIG_STATE_CHECKPOINTING, MIG_STATE_ERROR);
+        goto out;
+    }
+
+    /*
+     * The copied memory gets appended to the end of the snapshot, so let's
+     * remember where its going to go first and start a new slab.
+     * Anything still buffered in the staging file must land before it.
+     */
+    qemu_fflush(mc->staging);
+
+    start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    if (!mc->total_copies) {
+        DDPRINTF("No copysets. Don't copy.\n");
+        mc->start_copyset = 0;
+        goto skip_copies;
+    }
+
+    DDPRINTF("Copyset identifiers complete. Copying memory from %d" 
+                " copysets...\n", mc->nb_copysets); 
+
+    mc_slab_next(mc, mc->curr_slab);
+    mc->start_copyset = mc->curr_slab->idx;
+
+    if (mc->cow) {
+        mc_reserve_copies(mc);
+        copies = mc->total_copies;
+
+        if (mc_cow_protect_copies(mc) < 0) {
+            /* Stay consistent: copy everything before letting the VM go */
+            DPRINTF("Write-protection failed, copying with the VM stopped\n");
+            mc_cow_drain(mc, s);
+        }
+
+        goto skip_copies;
+    }
+
+    /* Delta compression produces pages of variable size: copy serially */
+    if (mc->pool && !mc->xbzrle) {
+        mc_reserve_copies(mc);
+        mc_copy_parallel(mc, s);
+
+        QTAILQ_FOREACH(copyset, &mc->copy_head, node) {
+            if (!copyset->nb_copies) {
+                break;
+            }
+            copies += copyset->nb_copies;
+            copyset->nb_copies = 0;
+        }
+
+        goto skip_copies;
+    }
+
+    /*
+     * Now perform the actual copy of memory into the tail end of the slab list. 
+     */
+    QTAILQ_FOREACH(copyset, &mc->copy_head, node) {
+        if (!copyset->nb_copies) {
+            break;
+        }
+
+        copies += copyset->nb_copies;
+
+        DDDPRINTF("copyset %d copies: %" PRIu64 " total: %" PRIu64 "\n",
+                copyset->idx, copyset->nb_copies, copies);
+
+        for (idx = 0; idx < copyset->nb_copies; idx++) {
+            uint8_t *addr;
+            long size;
+            mc->copy = &copyset->copies[idx];
+            if (mc->xbzrle) {
+                size = mc_put_page(mc, mc->copy);
+            } else {
+                addr = (uint8_t *) (mc->copy->host_addr + mc->copy->offset);
+                size = mc_put_buffer(mc, addr, mc->copy->offset,
+                                     mc->copy->size);
+            }
+            if (size != mc->copy->size) {
+                fprintf(stderr, "Failure to initiate copyset %d index %d\n",
                         copyset->idx, idx);
                 migrate_set_state(s, MIG_STATE_CHECKPOINTING, MIG_STATE_ERROR);
                 vm_start();
                 goto out;
             }
 
-            DDDPRINTF("Success copyset %d index %d\n", copyset->idx, idx);
+            DDDPRINTF("Success copyset %d index %d\n", copyset->idx, idx);
+        }
+
+        copyset->nb_copies = 0;
+    }
+
+    DDPRINTF("Copy complete.\n");
+
+skip_copies:
+    s->ram_copy_time = (qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start_time);
+
+    mc->copy = NULL;
+    ram_control_before_iterate(mc->file, RAM_CONTROL_FLUSH); 
+    assert(mc->total_copies == copies);
+
+    stop = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    /*
+     * MC is safe in staging area (or write-protected). Let the VM go.
+     */
+    vm_start();
+    qemu_fflush(mc->staging);
+
+    s->downtime = stop - start;
+
+    if (mc->cow) {
+        qemu_mutex_unlock(&mc->cow->lock);
+        qemu_mutex_unlock_iothread();
+
+        mc_cow_drain(mc, s);
+        s->ram_copy_time = (qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                            start_time);
+        return ret;
+    }
+out:
+    if (mc->cow) {
+        qemu_mutex_unlock(&mc->cow->lock);
+    }
+    qemu_mutex_unlock_iothread();
+    return ret;
+}
+
+/*
+ * Synchronously send a micro-checkpointing command
+ */
+static int mc_send(QEMUFile *f, uint64_t request)
+{
+    int ret = 0;
+
+    qemu_put_be64(f, request);
+
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        fprintf(stderr, "transaction: send error while sending %" PRIu64 ", "
+                "bailing: %s\n", request, strerror(-ret));
+    } else {
+        DDPRINTF("transaction: sent: %s (%" PRIu64 ")\n", 
+            mc_desc[request], request);
+    }
+
+    qemu_fflush(f);
+
+    return ret;
+}
+
+/*
+ * Synchronously receive a micro-checkpointing command
+ */
+static int mc_recv(QEMUFile *f, uint64_t request, uint64_t *action)
+{
+    int ret = 0;
+    uint64_t got;
+    
+    got = qemu_get_be64(f);
+    
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        fprintf(stderr, "transaction: recv error while expecting %s (%"
+                PRIu64 "), bailing: %s\n", mc_desc[request], 
+                request, strerror(-ret));
+    } else {
+        if ((request != MC_TRANSACTION_ANY) && request != got) {
+            fprintf(stderr, "transaction: was expecting %s (%" PRIu64 
+                    ") but got %" PRIu64 " instead\n",
+                    mc_desc[request], request, got);
+            ret = -EINVAL;
+        } else {
+            DDPRINTF("transaction: recv: %s (%" PRIu64 ")\n", 
+                     mc_desc[got], got);
+            ret = 0;
+            if (action) {
+                *action = got;
+            }
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * Checksum of the first 'nb_slabs' slabs of a checkpoint (mc-transactional)
+ */
+static uint32_t mc_checksum(MCParams *mc, uint64_t nb_slabs)
+{
+    MCSlab *slab = QTAILQ_FIRST(&mc->slab_head);
+    uint32_t crc = 0xffffffff;
+    uint64_t x;
+
+    for (x = 0; x < nb_slabs && slab; x++) {
+        crc = crc32c(crc, slab->buf, slab->size);
+        slab = QTAILQ_NEXT(slab, node);
+    }
+
+    return crc ^ 0xffffffff;
+}
+
+static MCSlab *mc_slab_start(MCParams *mc)
+{
+    /*
+     * Give back the slabs the last checkpoint did not need:
+     * the pool hands them out to whichever buffer needs them next.
+     */
+    while (mc->nb_slabs > MAX(mc->used_slabs, 1)) {
+        mc_slab_release(mc);
+    }
+
+    mc->used_slabs = 1;
+    mc->slab_total = 0;
+    mc->curr_slab = QTAILQ_FIRST(&mc->slab_head);
+    SLAB_RESET(mc->curr_slab);
+
+    return mc->curr_slab;
+}
+
+static MCCopyset *mc_copy_start(MCParams *mc)
+{
+    if (mc->nb_copysets >= 2) {
+        if (mc->copy_strikes >= max_strikes) {
+            int nb_copies_to_free = MAX(1, (((mc->nb_copysets - 1) / 2)));
+
+            DPRINTF("MC has reached max strikes. Will free %d / %d copies max %d\n",
+                    nb_copies_to_free, mc->nb_copysets, max_strikes);
+
+            mc->copy_strikes = 0;
+
+            while (nb_copies_to_free) {
+                MCCopyset * copyset = QTAILQ_LAST(&mc->copy_head, chead);
+                QTAILQ_REMOVE(&mc->copy_head, copyset, node);
+                g_free(copyset);
+                nb_copies_to_free--;
+                mc->nb_copysets--;
+            }
+
+            goto skip;
+        } else if (((mc->total_copies <= 
+                    ((mc->nb_copysets - 1) * MC_MAX_SLAB_COPY_DESCRIPTORS)))) {
+            mc->copy_strikes++;
+            DDPRINTF("MC has strike %d copies %d max %d\n", 
+                     mc->copy_strikes, mc->nb_copysets, max_strikes);
+            goto skip;
+        }
+    }
+
+    if (mc->copy_strikes) {
+        DDPRINTF("MC used all copies. Resetting strikes to zero.\n");
+        mc->copy_strikes = 0;
+    }
+skip:
+
+    mc->total_copies = 0;
+    mc->curr_copyset = QTAILQ_FIRST(&mc->copy_head);
+    mc->curr_copyset->nb_copies = 0;
+
+    if (mc->pages) {
+        mc_pages_clear(mc->pages);
+    }
+
+    return mc->curr_copyset;
+}
+
+/*
+ * Adaptive checkpoint interval (the mc-slo-* migration parameters).
+ *
+ * Network output produced during an epoch is held until the checkpoint
+ * which ends that epoch has been acknowledged, so the worst case output
+ * commit latency is roughly:
+ *
+ *     epoch + downtime + transmission time
+ *
+ * Downtime and transmission time both grow with the size of the
+ * checkpoint, which is the dirty rate times the epoch length. After each
+ * checkpoint, the controller re-estimates the dirty rate and the cost of
+ * copying and sending a byte, and picks the longest epoch which keeps
+ * the latency under the target. A correction factor, driven by the
+ * latency actually measured, makes up for what the model does not
+ * capture (fixed costs, re-dirtied pages, ...).
+ */
+#define MC_DEFAULT_MIN_DELAY_MS 10
+#define MC_DEFAULT_MAX_DELAY_MS 1000
+#define MC_SLO_WEIGHT 0.3 /* weight of the newest sample in the averages */
+
+typedef struct MCController {
+    double dirty_rate;  /* bytes per ms */
+    double copy_cost;   /* ms of downtime per byte */
+    double xmit_cost;   /* ms of transmission per byte */
+    double correction;
+    int64_t epoch_ms;
+} MCController;
+
+static int64_t slo_latency_ms;  /* 0: fixed delay from migrate-set-mc-delay */
+static int64_t slo_min_delay_ms = MC_DEFAULT_MIN_DELAY_MS;
+static int64_t slo_max_delay_ms = MC_DEFAULT_MAX_DELAY_MS;
+
+static double mc_average(double avg, double sample)
+{
+    return avg ? (MC_SLO_WEIGHT * sample + (1 - MC_SLO_WEIGHT) * avg) : sample;
+}
+
+/*
+ * Returns the length of the next epoch, in milliseconds.
+ * 'epoch_ms' is how long the VM ran before checkpoint 'mc' was captured.
+ */
+static int64_t mc_controller_update(MCController *ctl, MigrationState *s,
+                                    MCParams *mc, int64_t epoch_ms)
+{
+    int64_t target = atomic_mb_read(&slo_latency_ms);
+    int64_t min_ms = atomic_mb_read(&slo_min_delay_ms);
+    int64_t max_ms = atomic_mb_read(&slo_max_delay_ms);
+    double bytes = mc->slab_total, rate, cost, latency;
+
+    latency = epoch_ms + s->downtime + s->xmit_time;
+    s->mc_commit_latency = latency;
+
+    if (!target) {
+        ctl->epoch_ms = freq_ms;
+        return ctl->epoch_ms;
+    }
+
+    /* Dirty rate from migration_bitmap_sync(), else from this checkpoint */
+    if (s->dirty_bytes_rate) {
+        rate = s->dirty_bytes_rate / 1000.0;
+    } else {
+        rate = bytes / MAX(epoch_ms + s->downtime, 1);
+    }
+    ctl->dirty_rate = mc_average(ctl->dirty_rate, rate);
+
+    if (bytes) {
+        ctl->copy_cost = mc_average(ctl->copy_cost, s->downtime / bytes);
+    }
+
+    if (s->mbps > 0) {
+        ctl->xmit_cost = mc_average(ctl->xmit_cost, 8 / (s->mbps * 1000.0));
+    }
+
+    if (!ctl->correction) {
+        ctl->correction = 1;
+    } else if (latency > 0) {
+        ctl->correction = mc_average(ctl->correction,
+                                     ctl->correction * target / latency);
+        ctl->correction = MIN(MAX(ctl->correction, 0.25), 4);
+    }
+
+    cost = 1 + (ctl->copy_cost + ctl->xmit_cost) * ctl->dirty_rate;
+    ctl->epoch_ms = (target / cost) * ctl->correction;
+    ctl->epoch_ms = MIN(MAX(ctl->epoch_ms, min_ms), max_ms);
+
+    DDPRINTF("SLO %" PRId64 " ms: latency %0.1f ms rate %0.1f B/ms "
+             "copy %0.6f xmit %0.6f ms/B correction %0.2f next %" PRId64
+             " ms\n", target, latency, ctl->dirty_rate, ctl->copy_cost,
+             ctl->xmit_cost, ctl->correction, ctl->epoch_ms);
+
+    return ctl->epoch_ms;
+}
+
+/*
+ * Zero-copy slab transmission (mc-zerocopy).
+ *
+ * Over TCP, slabs normally go through qemu_put_buffer_async(), whose
+ * iovec only holds a few dozen entries, so each slab ends up being sent
+ * by many small writev() calls. Instead, each slab (with its size) is
+ * handed to the kernel by a single sendmsg() with MSG_ZEROCOPY, so that
+ * the kernel sends straight out of the slab.
+ *
+ * The kernel keeps referencing the slabs until it signals, through the
+ * socket error queue, that it is done with them. A checkpoint buffer is
+ * therefore not reused until every send from it has completed.
+ *
+ * If the socket does not accept SO_ZEROCOPY, the slabs are still sent
+ * with one sendmsg() each, which the kernel copies.
+ */
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && \
+    defined(SO_EE_ORIGIN_ZEROCOPY)
+#define MC_ZEROCOPY_SUPPORTED
+#endif
+
+typedef struct MCZeroCopy {
+    int fd;
+    bool enabled;       /* SO_ZEROCOPY was accepted */
+    uint32_t sent;      /* zero-copy sends issued */
+    uint32_t completed; /* zero-copy sends the kernel is done with */
+    uint64_t copied;    /* sends the kernel copied anyway */
+} MCZeroCopy;
+
+static MCZeroCopy *mc_zerocopy_new(int fd)
+{
+    MCZeroCopy *zc = g_malloc0(sizeof(*zc));
+#ifdef MC_ZEROCOPY_SUPPORTED
+    int one = 1;
+
+    zc->enabled = !setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+#endif
+
+    zc->fd = fd;
+
+    if (!zc->enabled) {
+        DDPRINTF("zero-copy send not supported, "
+                 "the kernel will copy the slabs\n");
+    }
+
+    return zc;
+}
+
+/*
+ * Read the completion notifications queued on the socket.
+ * If 'block' is set, wait for at least one of them.
+ */
+static int mc_zerocopy_reap(MCZeroCopy *zc, bool block)
+{
+#ifdef MC_ZEROCOPY_SUPPORTED
+    while (true) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+        struct msghdr msg = {
+            .msg_control = control,
+            .msg_controllen = sizeof(control),
+        };
+        struct sock_extended_err *serr;
+        struct cmsghdr *cm;
+
+        if (recvmsg(zc->fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN && block) {
+                /* The error queue is signalled as POLLERR */
+                struct pollfd pfd = { .fd = zc->fd, .events = 0 };
+
+                if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                    return -errno;
+                }
+                continue;
+            }
+
+            return (errno == EAGAIN) ? 0 : -errno;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            serr = (struct sock_extended_err *) CMSG_DATA(cm);
+
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+
+            /* Sends ee_info to ee_data (inclusive) are done */
+            zc->completed += serr->ee_data - serr->ee_info + 1;
+
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                zc->copied += serr->ee_data - serr->ee_info + 1;
+            }
+        }
+
+        block = false;
+    }
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Wait until the kernel no longer references any of the slabs sent so far.
+ */
+static int mc_zerocopy_wait(MCZeroCopy *zc)
+{
+    int ret = 0;
+
+    while (!ret && zc->completed != zc->sent) {
+        ret = mc_zerocopy_reap(zc, true);
+    }
+
+    return ret;
+}
+
+static int mc_zerocopy_send(MCZeroCopy *zc, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt) {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+        int flags = 0;
+        ssize_t len;
+
+#ifdef MC_ZEROCOPY_SUPPORTED
+        if (zc->enabled) {
+            flags = MSG_ZEROCOPY;
+        }
+#endif
+
+        len = sendmsg(zc->fd, &msg, flags);
+
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN) {
+                struct pollfd pfd = { .fd = zc->fd, .events = POLLOUT };
+                poll(&pfd, 1, -1);
+                continue;
+            }
+
+            /* Too many pinned buffers: wait for some of them to complete */
+            if (errno == ENOBUFS && zc->completed != zc->sent) {
+                int ret = mc_zerocopy_reap(zc, true);
+                if (ret < 0) {
+                    return ret;
+                }
+                continue;
+            }
+
+            return -errno;
+        }
+
+        if (flags) {
+            zc->sent++;
+        }
+
+        /* Partial send: skip what went out and send the rest */
+        while (iovcnt && len >= iov->iov_len) {
+            len -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt) {
+            iov->iov_base = (uint8_t *) iov->iov_base + len;
+            iov->iov_len -= len;
+        }
+    }
+
+    return 0;
+}
+
+static void mc_zerocopy_free(MCZeroCopy *zc)
+{
+    if (!zc) {
+        return;
+    }
+
+    mc_zerocopy_wait(zc);
+    g_free(zc);
+}
+
+/*
+ * Per-epoch telemetry (query-mc-stats).
+ *
+ * Every checkpoint leaves a record in a fixed-size ring once it has
+ * been acknowledged and its output released. Times are in microseconds.
+ * The commit latency of an epoch runs from the checkpoint barrier
+ * which opened it to the release of its output, so it is the longest
+ * time any packet produced during the epoch was held back.
+ */
+#define MC_STATS_RING_SIZE 1024
+
+static MCEpochStats stats_ring[MC_STATS_RING_SIZE];
+static uint64_t stats_count;
+static QemuMutex stats_lock;
+
+static void __attribute__((constructor)) mc_stats_init(void)
+{
+    qemu_mutex_init(&stats_lock);
+}
+
+static void mc_stats_reset(void)
+{
+    qemu_mutex_lock(&stats_lock);
+    stats_count = 0;
+    qemu_mutex_unlock(&stats_lock);
+}
+
+static void mc_stats_record(MCEpochStats *stats)
+{
+    qemu_mutex_lock(&stats_lock);
+    stats_ring[stats_count++ % MC_STATS_RING_SIZE] = *stats;
+    qemu_mutex_unlock(&stats_lock);
+}
+
+static int mc_compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Secondaries (the mc-secondaries migration parameter).
+ *
+ * The secondaries are connected when the migration starts, and the
+ * initial migration is written to all of the destinations through a
+ * fan-out file. Once checkpointing starts, mc_thread takes over their
+ * sockets and sends each of them the checkpoints on its own.
+ */
+typedef struct MCFanout {
+    QEMUFile *primary;
+    int fds[MC_MAX_REPLICAS];
+    int nb_fds;
+} MCFanout;
+
+static char *secondary_uris[MC_MAX_REPLICAS - 1];
+static int nb_secondaries;
+static int mc_quorum;
+static MCFanout *fanout;
+
+static ssize_t mc_fanout_writev_buffer(void *opaque, struct iovec *iov,
+                                       int iovcnt, int64_t pos)
+{
+    MCFanout *fo = opaque;
+    ssize_t size = iov_size(iov, iovcnt), len;
+    int x;
+
+    for (x = 0; x < fo->nb_fds; x++) {
+        len = iov_send(fo->fds[x], iov, iovcnt, 0, size);
+        if (len != size) {
+            return (len < 0) ? -socket_error() : -EIO;
+        }
+    }
+
+    return size;
+}
+
+static int mc_fanout_get_fd(void *opaque)
+{
+    MCFanout *fo = opaque;
+
+    return fo->fds[0];
+}
+
+static int mc_fanout_close(void *opaque)
+{
+    MCFanout *fo = opaque;
+    int x, ret;
+
+    for (x = 1; x < fo->nb_fds; x++) {
+        closesocket(fo->fds[x]);
+    }
+
+    ret = qemu_fclose(fo->primary);
+
+    if (fanout == fo) {
+        fanout = NULL;
+    }
+    g_free(fo);
+
+    return ret;
+}
+
+static const QEMUFileOps mc_fanout_ops = {
+    .writev_buffer = mc_fanout_writev_buffer,
+    .get_fd = mc_fanout_get_fd,
+    .close = mc_fanout_close,
+};
+
+/*
+ * Called when an MC migration starts: connect to the secondaries and
+ * send the migration stream to all of the destinations from now on.
+ */
+void mc_connect_secondaries(MigrationState *s)
+{
+    MCFanout *fo;
+    int x;
+
+    if (!nb_secondaries) {
+        return;
+    }
+
+    if (qemu_file_has_ram_hooks(s->file)) {
+        fprintf(stderr, "MC: secondaries are not supported over RDMA\n");
+        return;
+    }
+
+    fo = g_malloc0(sizeof(*fo));
+    fo->primary = s->file;
+    fo->fds[fo->nb_fds++] = qemu_get_fd(s->file);
+
+    for (x = 0; x < nb_secondaries; x++) {
+        const char *host;
+        Error *local_err = NULL;
+        int fd;
+
+        if (!strstart(secondary_uris[x], "tcp:", &host)) {
+            fprintf(stderr, "MC: unsupported secondary %s\n",
+                    secondary_uris[x]);
+            continue;
         }
 
-        copyset->nb_copies = 0;
+        fd = inet_connect(host, &local_err);
+        if (fd < 0) {
+            fprintf(stderr, "MC: cannot connect to secondary %s: %s\n",
+                    secondary_uris[x], error_get_pretty(local_err));
+            error_free(local_err);
+            continue;
+        }
+
+        fo->fds[fo->nb_fds++] = fd;
     }
 
-    DDPRINTF("Copy complete.\n");
+    if (fo->nb_fds == 1) {
+        g_free(fo);
+        return;
+    }
 
-skip_copies:
-    s->ram_copy_time = (qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start_time);
+    for (x = 0; x < fo->nb_fds; x++) {
+        qemu_set_block(fo->fds[x]);
+    }
 
-    mc->copy = NULL;
-    ram_control_before_iterate(mc->file, RAM_CONTROL_FLUSH); 
-    assert(mc->total_copies == copies);
+    DPRINTF("Migrating to %d destinations\n", fo->nb_fds);
 
-    stop = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    fanout = fo;
+    s->file = qemu_fopen_ops(fo, &mc_fanout_ops);
+}
 
-    /*
-     * MC is safe in staging area. Let the VM go.
-     */
-    vm_start();
-    qemu_fflush(mc->staging);
+/*
+ * Sender-side checkpointing state.
+ *
+ * Without pipelining, only buf[0] is used and each checkpoint is
+ * transmitted (and acknowledged) by mc_thread before the next one
+ * is captured.
+ *
+ * With pipelining (mc-pipeline), checkpoints alternate between the two
+ * buffers: mc_thread captures epoch N+1 into one buffer while the
+ * transmit thread is still sending epoch N out of the other one.
+ * A buffer is only reused once the checkpoint it holds has been
+ * acknowledged by the destination.
+ *
+ * With secondaries (the mc-secondaries parameter), every checkpoint is
+ * sent to all of the destinations in parallel, one thread each, and
+ * the epoch is committed as soon as a quorum of them has acknowledged
+ * it. A destination still busy with an older checkpoint skips the new
+ * ones. Once it has caught up, the pages of the checkpoints it skipped
+ * are marked dirty again, so that the next checkpoint brings it back
+ * in sync. Checkpoints rotate over MC_FANOUT_BUFFERS buffers: capture
+ * only waits for a slow destination once it is that far behind.
+ */
+#define MC_NB_BUFFERS 2
+#define MC_FANOUT_BUFFERS 4
 
-    s->downtime = stop - start;
-out:
-    qemu_mutex_unlock_iothread();
-    return ret;
+typedef struct MCSender MCSender;
+
+/* A destination of the checkpoints */
+typedef struct MCReplica {
+    MCSender *ms;
+    int idx;
+    QEMUFile *file;
+    QEMUFile *control;
+    MCZeroCopy *zc;
+    /* fan-out */
+    QemuThread thread;
+    QemuSemaphore ready;
+    MCParams *mc;           /* checkpoint being sent, NULL if idle */
+    MCPages *missed;        /* pages of the checkpoints it skipped */
+    bool failed;
+    /* last checkpoint sent */
+    int64_t xmit_time;
+    int64_t ack_time;
+} MCReplica;
+
+struct MCSender {
+    MigrationState *s;
+    MCReplica replicas[MC_MAX_REPLICAS];
+    int nb_replicas;
+    int quorum;
+    QemuMutex ack_lock;
+    QemuCond ack_cond;
+    MCParams buf[MC_FANOUT_BUFFERS];
+    MCCow *cow;
+    MCCopyPool *pool;
+    MCXbzrle *xbzrle;
+    MCSlabPool *slabs;
+    bool pipeline;
+    QemuThread xmit_thread;
+    QemuSemaphore xmit_ready;
+    bool xmit_quit;
+    bool xmit_error;
+    uint64_t epochs;
+};
+
+/*
+ * Called between checkpoints: (re)start the copy workers if
+ * mc-copy-threads has changed since the last checkpoint.
+ */
+static void mc_copy_pool_update(MCSender *ms)
+{
+    int nb_workers = atomic_mb_read(&copy_threads);
+    int x;
+
+    /* Offloaded copies are issued one at a time through the RDMA context */
+    if (migrate_use_mc_rdma_copy()) {
+        nb_workers = 1;
+    }
+
+    if ((ms->pool ? ms->pool->nb_workers : 1) == nb_workers) {
+        return;
+    }
+
+    mc_copy_pool_free(ms->pool);
+    ms->pool = (nb_workers > 1) ? mc_copy_pool_new(nb_workers) : NULL;
+    ms->s->nb_copy_threads = ms->pool ? nb_workers : 0;
+
+    for (x = 0; x < ARRAY_SIZE(ms->buf); x++) {
+        ms->buf[x].pool = ms->pool;
+    }
 }
 
 /*
- * Synchronously send a micro-checkpointing command
+ * Send one captured checkpoint to a destination and wait
+ * for it to be acknowledged.
  */
-static int mc_send(QEMUFile *f, uint64_t request)
+static int mc_send_checkpoint(MCSender *ms, MCReplica *r, MCParams *mc)
 {
-    int ret = 0;
+    MCSlab *slab;
+    int64_t xmit_start, sent;
+    bool commit_sent = false;
+    int ret, x;
 
-    qemu_put_be64(f, request);
+    xmit_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
 
-    ret = qemu_file_get_error(f);
+    ret = mc_send(r->file, MC_TRANSACTION_START);
+    if (ret < 0) {
+        fprintf(stderr, "transaction start failed\n");
+        return ret;
+    }
+
+    DDPRINTF("Sending checkpoint size %" PRId64
+             " copyset start: %" PRIu64 " nb slab %" PRIu64
+             " used slabs %" PRIu64 "\n",
+             mc->slab_total,
+             mc->start_copyset, mc->nb_slabs, mc->used_slabs);
+
+    mc->curr_slab = QTAILQ_FIRST(&mc->slab_head);
+
+    qemu_put_be64(r->file, mc->slab_total);
+    qemu_put_be64(r->file, mc->start_copyset);
+    qemu_put_be64(r->file, mc->used_slabs);
+
+    qemu_fflush(r->file);
+
+    DDPRINTF("Transaction commit\n");
+
+    /*
+     * The MC is safe, and VM is running again.
+     * Start a transaction and send it.
+     */
+    ram_control_before_iterate(r->file, RAM_CONTROL_ROUND);
+
+    slab = QTAILQ_FIRST(&mc->slab_head);
+
+    for (x = 0; x < mc->used_slabs; x++) {
+        DDPRINTF("Attempting write to slab #%d: %p"
+                " total size: %" PRId64 " / %" PRIu64 "\n",
+                x, slab->buf, slab->size, mc->slabs->slab_size);
+
+        ret = ram_control_save_page(r->file, (uint64_t) slab->buf,
+                                    NULL, 0, slab->size, NULL);
+
+        if (ret == RAM_SAVE_CONTROL_NOT_SUPP) {
+            if (!commit_sent) {
+                ret = mc_send(r->file, MC_TRANSACTION_COMMIT);
+                if (ret < 0) {
+                    fprintf(stderr, "transaction commit failed\n");
+                    return ret;
+                }
+                commit_sent = true;
+            }
+
+            if (r->zc) {
+                struct iovec iov[2] = {
+                    { .iov_base = &slab->wire_size,
+                      .iov_len = sizeof(slab->wire_size) },
+                    { .iov_base = slab->buf, .iov_len = slab->size },
+                };
+
+                slab->wire_size = cpu_to_be64(slab->size);
+                ret = mc_zerocopy_send(r->zc, iov, 2);
+                if (ret < 0) {
+                    fprintf(stderr, "zero-copy send failed: %s\n",
+                            strerror(-ret));
+                    qemu_file_set_error(r->file, ret);
+                    return ret;
+                }
+            } else {
+                qemu_put_be64(r->file, slab->size);
+                qemu_put_buffer_async(r->file, slab->buf, slab->size);
+            }
+        } else if ((ret < 0) && (ret != RAM_SAVE_CONTROL_DELAYED)) {
+            fprintf(stderr, "failed 1, skipping send\n");
+            return ret;
+        }
+
+        ret = qemu_file_get_error(r->file);
+        if (ret) {
+            fprintf(stderr, "failed 2, skipping send\n");
+            return ret;
+        }
+
+        DDPRINTF("Sent idx %d slab size %" PRId64 " all %ld\n",
+            x, slab->size, mc->slab_total);
+
+        slab = QTAILQ_NEXT(slab, node);
+    }
+
+    if (!commit_sent) {
+        ram_control_after_iterate(r->file, RAM_CONTROL_ROUND);
+        slab = QTAILQ_FIRST(&mc->slab_head);
+
+        for (x = 0; x < mc->used_slabs; x++) {
+            qemu_put_be64(r->file, slab->size);
+            slab = QTAILQ_NEXT(slab, node);
+        }
+    }
+
+    if (migrate_use_mc_transactional()) {
+        qemu_put_be32(r->file, mc_checksum(mc, mc->used_slabs));
+    }
+
+    qemu_fflush(r->file);
+    sent = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+
+    /* Nothing can be released before the ACK anyway */
+    if (ms->nb_replicas == 1) {
+        mc->stats.held_packets = mc_held_packets();
+    }
+
+    if (commit_sent) {
+        DDPRINTF("Waiting for commit ACK\n");
+
+        ret = mc_recv(r->control, MC_TRANSACTION_ACK, NULL);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    r->xmit_time = sent - xmit_start;
+    r->ack_time = commit_sent ? qemu_clock_get_us(QEMU_CLOCK_REALTIME) - sent
+                              : 0;
+
+    /* The slabs of this buffer may only be reused once the kernel is done */
+    if (r->zc && mc_zerocopy_wait(r->zc) < 0) {
+        fprintf(stderr, "zero-copy completion failed\n");
+        return -EIO;
+    }
+
+    ret = qemu_file_get_error(r->file);
     if (ret) {
-        fprintf(stderr, "transaction: send error while sending %" PRIu64 ", "
-                "bailing: %s\n", request, strerror(-ret));
-    } else {
-        DDPRINTF("transaction: sent: %s (%" PRIu64 ")\n", 
-            mc_desc[request], request);
+        fprintf(stderr, "Error sending checkpoint: %d\n", ret);
+        return ret;
     }
 
-    qemu_fflush(f);
+    DDPRINTF("Memory transfer complete.\n");
 
-    return ret;
+    return 0;
 }
 
 /*
- * Synchronously receive a micro-checkpointing command
+ * The MC is safe on the other side now ('r' completed the quorum),
+ * go along our merry way and release the network
+ * packets from the buffer if enabled.
  */
-static int mc_recv(QEMUFile *f, uint64_t request, uint64_t *action)
+static void mc_commit_checkpoint(MCSender *ms, MCParams *mc, MCReplica *r,
+                                 int64_t xmit_start)
 {
-    int ret = 0;
-    uint64_t got;
-    
-    got = qemu_get_be64(f);
-    
-    ret = qemu_file_get_error(f);
-    if (ret) {
-        fprintf(stderr, "transaction: recv error while expecting %s (%"
-                PRIu64 "), bailing: %s\n", mc_desc[request], 
-                request, strerror(-ret));
-    } else {
-        if ((request != MC_TRANSACTION_ANY) && request != got) {
-            fprintf(stderr, "transaction: was expecting %s (%" PRIu64 
-                    ") but got %" PRIu64 " instead\n",
-                    mc_desc[request], request, got);
-            ret = -EINVAL;
-        } else {
-            DDPRINTF("transaction: recv: %s (%" PRIu64 ")\n", 
-                     mc_desc[got], got);
-            ret = 0;
-            if (action) {
-                *action = got;
+    MigrationState *s = ms->s;
+    int64_t end_time;
+
+    mc_plug_release(mc->epoch);
+
+    mc->stats.xmit_time = r->xmit_time;
+    mc->stats.ack_time = r->ack_time;
+    mc->stats.commit_latency = qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                               mc->barrier_us;
+    mc_stats_record(&mc->stats);
+
+    end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    s->total_time = end_time - mc->start_time;
+    s->xmit_time = end_time - xmit_start;
+    s->mbps = MBPS(mc->slab_total, s->xmit_time);
+    s->bytes_xfer = mc->slab_total;
+    s->checkpoints = mc->epoch;
+}
+
+/*
+ * Transmit one captured checkpoint and wait for the destination
+ * to acknowledge it.
+ */
+static int mc_transmit_checkpoint(MCSender *ms, MCParams *mc)
+{
+    int64_t xmit_start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    MCReplica *r = &ms->replicas[0];
+    int ret;
+
+    ret = mc_send_checkpoint(ms, r, mc);
+    if (ret < 0) {
+        return ret;
+    }
+
+    mc_commit_checkpoint(ms, mc, r, xmit_start);
+
+    return 0;
+}
+
+static void *mc_xmit_thread(void *opaque)
+{
+    MCSender *ms = opaque;
+    int idx = 0;
+
+    while (true) {
+        MCParams *mc = &ms->buf[idx];
+
+        qemu_sem_wait(&ms->xmit_ready);
+
+        if (atomic_mb_read(&ms->xmit_quit)) {
+            break;
+        }
+
+        if (mc_transmit_checkpoint(ms, mc) < 0) {
+            atomic_mb_set(&ms->xmit_error, true);
+            migrate_set_state(ms->s, MIG_STATE_CHECKPOINTING, MIG_STATE_ERROR);
+            /* Unblock the capture loop, whichever buffer it waits on */
+            for (idx = 0; idx < MC_NB_BUFFERS; idx++) {
+                qemu_sem_post(&ms->buf[idx].free);
             }
+            break;
         }
+
+        qemu_sem_post(&mc->free);
+        idx = (idx + 1) % MC_NB_BUFFERS;
     }
 
-    return ret;
+    return NULL;
 }
 
-static MCSlab *mc_slab_start(MCParams *mc)
+/*
+ * Record the pages of a checkpoint that destination 'r' skips,
+ * so that they can be sent again once it has caught up. The copy
+ * descriptors are reset by the capture, hence mc->pages.
+ */
+static void mc_replica_skip(MCReplica *r, MCParams *mc)
 {
-    if (mc->nb_slabs > 2) {
-        if (mc->slab_strikes >= max_strikes) {
-            uint64_t nb_slabs_to_free = MAX(1, (((mc->nb_slabs - 1) / 2)));
-
-            DPRINTF("MC has reached max strikes. Will free %" 
-                    PRIu64 " / %" PRIu64 " slabs max %d, "
-                    "checkpoints %" PRIu64 "\n",
-                    nb_slabs_to_free, mc->nb_slabs,
-                    max_strikes, mc->checkpoints);
-
-            mc->slab_strikes = 0;
-
-            while (nb_slabs_to_free) {
-                MCSlab *slab = QTAILQ_LAST(&mc->slab_head, shead);
-                ram_control_remove(mc->file, (uint64_t) slab->buf);
-                QTAILQ_REMOVE(&mc->slab_head, slab, node);
-                g_free(slab);
-                nb_slabs_to_free--;
-                mc->nb_slabs--;
-            }
+    mc_pages_merge(r->missed, mc->pages);
+}
 
-            goto skip;
-        } else if (((mc->slab_total <= 
-                    ((mc->nb_slabs - 1) * MC_SLAB_BUFFER_SIZE)))) {
-            mc->slab_strikes++;
-            DDPRINTF("MC has strike %d slabs %" PRIu64 " max %d\n", 
-                     mc->slab_strikes, mc->nb_slabs, max_strikes);
-            goto skip;
+static void mc_replica_redirty(uint64_t addr, uint64_t size, void *opaque)
+{
+    ram_mark_dirty(addr, size);
+}
+
+/*
+ * Called before capturing a checkpoint: the destinations which skipped
+ * checkpoints and are idle again get the pages they missed in this one.
+ */
+static void mc_replicas_resync(MCSender *ms)
+{
+    int x;
+
+    qemu_mutex_lock(&ms->ack_lock);
+    for (x = 0; x < ms->nb_replicas; x++) {
+        MCReplica *r = &ms->replicas[x];
+
+        if (r->failed || r->mc || !mc_pages_count(r->missed)) {
+            continue;
         }
-    }
 
-    if (mc->slab_strikes) {
-        DDPRINTF("MC used all slabs. Resetting strikes to zero.\n");
-        mc->slab_strikes = 0;
+        DPRINTF("Resynchronizing destination %d: %u pages\n",
+                x, mc_pages_count(r->missed));
+
+        qemu_mutex_lock_iothread();
+        mc_pages_foreach(r->missed, mc_replica_redirty, NULL);
+        qemu_mutex_unlock_iothread();
+
+        mc_pages_clear(r->missed);
     }
-skip:
+    qemu_mutex_unlock(&ms->ack_lock);
+}
 
-    mc->used_slabs = 1;
-    mc->slab_total = 0;
-    mc->curr_slab = QTAILQ_FIRST(&mc->slab_head);
-    SLAB_RESET(mc->curr_slab);
+static void *mc_replica_thread(void *opaque)
+{
+    MCReplica *r = opaque;
+    MCSender *ms = r->ms;
 
-    return mc->curr_slab;
+    while (true) {
+        MCParams *mc;
+        int ret;
+
+        qemu_sem_wait(&r->ready);
+
+        if (atomic_mb_read(&ms->xmit_quit)) {
+            break;
+        }
+
+        mc = r->mc;
+        ret = mc_send_checkpoint(ms, r, mc);
+
+        qemu_mutex_lock(&ms->ack_lock);
+        if (ret < 0) {
+            fprintf(stderr, "MC: lost destination %d, dropping it\n", r->idx);
+            r->failed = true;
+        } else if (++mc->acks == ms->quorum) {
+            mc->acked_by = r->idx;
+        }
+
+        r->mc = NULL;
+        if (!--mc->senders) {
+            qemu_sem_post(&mc->free);
+        }
+        qemu_cond_broadcast(&ms->ack_cond);
+        qemu_mutex_unlock(&ms->ack_lock);
+
+        if (ret < 0) {
+            break;
+        }
+    }
+
+    return NULL;
 }
 
-static MCCopyset *mc_copy_start(MCParams *mc)
+/*
+ * Hand a captured checkpoint to every destination which is in sync
+ * and idle, then wait until a quorum has acknowledged it. If too many
+ * destinations are lagging for the quorum to be reached, the output of
+ * the epoch stays held until a later checkpoint reaches it.
+ */
+static int mc_fanout_checkpoint(MCSender *ms, MCParams *mc)
 {
-    if (mc->nb_copysets >= 2) {
-        if (mc->copy_strikes >= max_strikes) {
-            int nb_copies_to_free = MAX(1, (((mc->nb_copysets - 1) / 2)));
+    int64_t xmit_start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    int x, live = 0;
 
-            DPRINTF("MC has reached max strikes. Will free %d / %d copies max %d\n",
-                    nb_copies_to_free, mc->nb_copysets, max_strikes);
+    qemu_mutex_lock(&ms->ack_lock);
+    mc->acks = 0;
+    mc->senders = 0;
+    mc->acked_by = -1;
 
-            mc->copy_strikes = 0;
+    for (x = 0; x < ms->nb_replicas; x++) {
+        MCReplica *r = &ms->replicas[x];
 
-            while (nb_copies_to_free) {
-                MCCopyset * copyset = QTAILQ_LAST(&mc->copy_head, chead);
-                QTAILQ_REMOVE(&mc->copy_head, copyset, node);
-                g_free(copyset);
-                nb_copies_to_free--;
-                mc->nb_copysets--;
-            }
+        if (r->failed) {
+            continue;
+        }
 
-            goto skip;
-        } else if (((mc->total_copies <= 
-                    ((mc->nb_copysets - 1) * MC_MAX_SLAB_COPY_DESCRIPTORS)))) {
-            mc->copy_strikes++;
-            DDPRINTF("MC has strike %d copies %d max %d\n", 
-                     mc->copy_strikes, mc->nb_copysets, max_strikes);
-            goto skip;
+        live++;
+
+        /* Busy with an older checkpoint, or not resynchronized yet */
+        if (r->mc || mc_pages_count(r->missed)) {
+            mc_replica_skip(r, mc);
+            continue;
         }
+
+        r->mc = mc;
+        mc->senders++;
+        qemu_sem_post(&r->ready);
+    }
+
+    if (!mc->senders) {
+        qemu_sem_post(&mc->free);
+    }
+    qemu_mutex_unlock(&ms->ack_lock);
+
+    if (live < ms->quorum) {
+        fprintf(stderr, "MC: %d destinations left, quorum is %d\n",
+                live, ms->quorum);
+        return -EIO;
+    }
+
+    /* Nothing can be released before the quorum is reached anyway */
+    mc->stats.held_packets = mc_held_packets();
+
+    qemu_mutex_lock(&ms->ack_lock);
+    while (mc->acks < ms->quorum && mc->acks + mc->senders >= ms->quorum) {
+        qemu_cond_wait(&ms->ack_cond, &ms->ack_lock);
     }
+    x = mc->acked_by;
+    qemu_mutex_unlock(&ms->ack_lock);
 
-    if (mc->copy_strikes) {
-        DDPRINTF("MC used all copies. Resetting strikes to zero.\n");
-        mc->copy_strikes = 0;
+    if (x < 0) {
+        DPRINTF("Checkpoint %" PRIu64 " missed the quorum, "
+                "holding its output\n", mc->epoch);
+        return 0;
     }
-skip:
 
-    mc->total_copies = 0;
-    mc->curr_copyset = QTAILQ_FIRST(&mc->copy_head);
-    mc->curr_copyset->nb_copies = 0;
+    mc_commit_checkpoint(ms, mc, &ms->replicas[x], xmit_start);
 
-    return mc->curr_copyset;
+    return 0;
+}
+
+static void mc_replicas_stop(MCSender *ms)
+{
+    int x;
+
+    if (ms->nb_replicas == 1) {
+        return;
+    }
+
+    atomic_mb_set(&ms->xmit_quit, true);
+
+    for (x = 0; x < ms->nb_replicas; x++) {
+        /* Unblock threads waiting on a destination which went away */
+        qemu_file_shutdown(ms->replicas[x].control);
+        qemu_sem_post(&ms->replicas[x].ready);
+        qemu_thread_join(&ms->replicas[x].thread);
+    }
 }
 
 /*
@@ -923,170 +2964,226 @@ skip:
  * into staging, restart the VM, transmit the MC,
  * and then sleep for some milliseconds before
  * starting the next MC.
+ *
+ * When pipelining, transmission is handed over to
+ * mc_xmit_thread and the next MC can be captured
+ * before the previous one has been acknowledged.
  */
 static void *mc_thread(void *opaque)
 {
     MigrationState *s = opaque;
-    MCParams mc = { .file = s->file };
-    MCSlab * slab;
+    MCSender ms = { .s = s, .nb_replicas = 1 };
     int64_t initial_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    int ret = 0, fd = qemu_get_fd(s->file), x;
-    QEMUFile *mc_control, *mc_staging = NULL;
+    int nb_buffers = 1, idx = 0, x;
     uint64_t wait_time = 0;
-   
-    if (!(mc_control = qemu_fopen_socket(fd, "rb"))) {
-        fprintf(stderr, "Failed to setup read MC control\n");
-        goto err;
-    }
+    MCController ctl = { .epoch_ms = freq_ms };
+    int64_t resume_time = initial_time, epoch_ms;
+    int64_t barrier_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME), capture_us;
 
-    if (!(mc_staging = qemu_fopen_mc(&mc, "wb"))) {
-        fprintf(stderr, "Failed to setup MC staging area\n");
-        goto err;
-    }
+    mc_plug_init();
+    mc_stats_reset();
+    qemu_mutex_init(&ms.ack_lock);
+    qemu_cond_init(&ms.ack_cond);
 
-    mc.staging = mc_staging;
+    ms.replicas[0].file = s->file;
 
-    qemu_set_block(fd);
-    socket_set_nodelay(fd);
+    if (fanout) {
+        /* Checkpoints go to each destination separately from now on */
+        qemu_fflush(s->file);
+        ms.replicas[0].file = fanout->primary;
+        ms.nb_replicas = fanout->nb_fds;
+        ms.quorum = mc_quorum ? MIN(mc_quorum, ms.nb_replicas)
+                              : ms.nb_replicas / 2 + 1;
+        nb_buffers = MC_FANOUT_BUFFERS;
+
+        for (x = 1; x < ms.nb_replicas; x++) {
+            ms.replicas[x].file = qemu_fopen_socket(dup(fanout->fds[x]), "wb");
+        }
 
-    s->checkpoints = 0;
+        DPRINTF("Checkpointing to %d destinations, quorum %d\n",
+                ms.nb_replicas, ms.quorum);
+    }
 
-    while (s->state == MIG_STATE_CHECKPOINTING) {
-        int64_t current_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-        int64_t start_time, xmit_start, end_time;
-        bool commit_sent = false;
-        int nb_slab = 0;
-        (void)nb_slab;
-        
-        slab = mc_slab_start(&mc);
-        mc_copy_start(&mc);
-        acct_clear();
-        start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    for (x = 0; x < ms.nb_replicas; x++) {
+        MCReplica *r = &ms.replicas[x];
+        int rfd = qemu_get_fd(r->file);
 
-        if (capture_checkpoint(&mc, s) < 0) {
-            break;
+        r->ms = &ms;
+        r->idx = x;
+        r->missed = mc_pages_new();
+        qemu_sem_init(&r->ready, 0);
+
+        if (!(r->control = qemu_fopen_socket(x ? dup(rfd) : rfd, "rb"))) {
+            fprintf(stderr, "Failed to setup read MC control\n");
+            goto err;
         }
 
-        assert(mc.slab_total);
+        if (migrate_use_mc_zerocopy() && !qemu_file_has_ram_hooks(r->file)) {
+            r->zc = mc_zerocopy_new(rfd);
+        }
 
-        xmit_start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        qemu_set_block(rfd);
+        socket_set_nodelay(rfd);
+    }
 
-        if ((ret = mc_send(s->file, MC_TRANSACTION_START) < 0)) {
-            fprintf(stderr, "transaction start failed\n");
-            break;
+    if (migrate_use_mc_pipeline() && ms.nb_replicas > 1) {
+        DPRINTF("Checkpoints are sent asynchronously to the destinations, "
+                "mc-pipeline is implied\n");
+    } else if (migrate_use_mc_pipeline()) {
+        if (qemu_file_has_ram_hooks(s->file)) {
+            fprintf(stderr, "MC: pipelining is not supported over RDMA, "
+                            "sending checkpoints synchronously\n");
+        } else {
+            ms.pipeline = true;
+            nb_buffers = MC_NB_BUFFERS;
         }
-        
-        DDPRINTF("Sending checkpoint size %" PRId64 
-                 " copyset start: %" PRIu64 " nb slab %" PRIu64 
-                 " used slabs %" PRIu64 "\n",
-                 mc.slab_total, 
-                 mc.start_copyset, mc.nb_slabs, mc.used_slabs);
+    }
+
+    if (migrate_use_mc_xbzrle()) {
+        /* Deltas would not apply on a destination which skipped some */
+        if (ms.nb_replicas > 1) {
+            fprintf(stderr, "MC: mc-xbzrle cannot be used with secondaries, "
+                            "sending pages as they are\n");
+        } else {
+            ms.xbzrle = mc_xbzrle_new();
+        }
+    }
 
-        mc.curr_slab = QTAILQ_FIRST(&mc.slab_head);
+    if (migrate_use_mc_cow()) {
+        if (migrate_use_mc_rdma_copy()) {
+            fprintf(stderr, "MC: mc-cow and mc-rdma-copy are mutually "
+                            "exclusive, using mc-rdma-copy\n");
+        } else if (ms.xbzrle) {
+            fprintf(stderr, "MC: mc-cow cannot be combined with mc-xbzrle, "
+                            "stopping the VM for the copy instead\n");
+        } else if (!(ms.cow = mc_cow_new())) {
+            fprintf(stderr, "MC: copy-on-write capture unavailable, "
+                            "stopping the VM for the copy instead\n");
+        }
+    }
 
-        qemu_put_be64(s->file, mc.slab_total);
-        qemu_put_be64(s->file, mc.start_copyset);
-        qemu_put_be64(s->file, mc.used_slabs);
+    ms.slabs = mc_slab_pool_new(atomic_read(&slab_size));
 
-        qemu_fflush(s->file);
-       
-        DDPRINTF("Transaction commit\n");
+    for (x = 0; x < nb_buffers; x++) {
+        MCParams *mc = &ms.buf[x];
 
-        /*
-         * The MC is safe, and VM is running again.
-         * Start a transaction and send it.
-         */
-        ram_control_before_iterate(s->file, RAM_CONTROL_ROUND); 
+        mc->file = s->file;
+        mc->slabs = ms.slabs;
+        mc->cow = ms.cow;
+        mc->xbzrle = ms.xbzrle;
+        qemu_sem_init(&mc->free, 1);
 
-        slab = QTAILQ_FIRST(&mc.slab_head);
+        if (ms.nb_replicas > 1) {
+            mc->pages = mc_pages_new();
+        }
 
-        for (x = 0; x < mc.used_slabs; x++) {
-            DDPRINTF("Attempting write to slab #%d: %p"
-                    " total size: %" PRId64 " / %" PRIu64 "\n",
-                    nb_slab++, slab->buf, slab->size, MC_SLAB_BUFFER_SIZE);
+        if (!(mc->staging = qemu_fopen_mc(mc, "wb"))) {
+            fprintf(stderr, "Failed to setup MC staging area\n");
+            goto err;
+        }
+    }
 
-            ret = ram_control_save_page(s->file, (uint64_t) slab->buf,
-                                        NULL, 0, slab->size, NULL);
+    s->checkpoints = 0;
+    s->nb_copy_threads = 0;
 
-            if (ret == RAM_SAVE_CONTROL_NOT_SUPP) {
-                if (!commit_sent) {
-                    if ((ret = mc_send(s->file, MC_TRANSACTION_COMMIT) < 0)) {
-                        fprintf(stderr, "transaction commit failed\n");
-                        break;
-                    }
-                    commit_sent = true;
-                }
+    if (ms.pipeline) {
+        qemu_sem_init(&ms.xmit_ready, 0);
+        qemu_thread_create(&ms.xmit_thread, "mc_xmit", mc_xmit_thread, &ms,
+                           QEMU_THREAD_JOINABLE);
+    }
 
-                qemu_put_be64(s->file, slab->size);
-                qemu_put_buffer_async(s->file, slab->buf, slab->size);
-            } else if ((ret < 0) && (ret != RAM_SAVE_CONTROL_DELAYED)) {
-                fprintf(stderr, "failed 1, skipping send\n");
-                goto err;
-            }
+    for (x = 0; ms.nb_replicas > 1 && x < ms.nb_replicas; x++) {
+        qemu_thread_create(&ms.replicas[x].thread, "mc_replica",
+                           mc_replica_thread, &ms.replicas[x],
+                           QEMU_THREAD_JOINABLE);
+    }
 
-            if (qemu_file_get_error(s->file)) {
-                fprintf(stderr, "failed 2, skipping send\n");
-                goto err;
+    while (s->state == MIG_STATE_CHECKPOINTING) {
+        int64_t current_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        MCParams *mc = &ms.buf[idx];
+
+        if (ms.pipeline || ms.nb_replicas > 1) {
+            /* Wait until the checkpoint held by this buffer is acknowledged */
+            qemu_sem_wait(&mc->free);
+            if (atomic_mb_read(&ms.xmit_error)) {
+                break;
             }
-                
-            DDPRINTF("Sent idx %d slab size %" PRId64 " all %ld\n",
-                x, slab->size, mc.slab_total);
+        }
 
-            slab = QTAILQ_NEXT(slab, node);
+        if (ms.nb_replicas > 1) {
+            mc_replicas_resync(&ms);
         }
 
-        if (!commit_sent) {
-            ram_control_after_iterate(s->file, RAM_CONTROL_ROUND); 
-            slab = QTAILQ_FIRST(&mc.slab_head);
+        mc_copy_pool_update(&ms);
+        mc_slab_start(mc);
+        mc_copy_start(mc);
+        acct_clear();
+        mc->start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        mc->epoch = ms.epochs++;
+        if (ms.xbzrle) {
+            ms.xbzrle->age = mc->epoch;
+        }
 
-            for (x = 0; x < mc.used_slabs; x++) {
-                qemu_put_be64(s->file, slab->size);
-                slab = QTAILQ_NEXT(slab, node);
-            }
+        memset(&mc->stats, 0, sizeof(mc->stats));
+        mc->stats.epoch = mc->epoch;
+        mc->barrier_us = barrier_us;
+        capture_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+
+        if (capture_checkpoint(mc, s) < 0) {
+            break;
         }
 
-        qemu_fflush(s->file);
+        assert(mc->slab_total);
+
+        /* The next epoch's output is held from this checkpoint's barrier */
+        barrier_us = capture_us;
+        mc->stats.capture_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                 capture_us;
+        mc->stats.copy_time = s->ram_copy_time * 1000;
+        mc->stats.dirty_pages = mc->total_copies;
+        mc->stats.bytes = mc->slab_total;
+        mc->stats.slabs = mc->used_slabs;
 
-        if (commit_sent) {
-            DDPRINTF("Waiting for commit ACK\n");
+        s->bitmap_time = norm_mig_bitmap_time();
+        s->log_dirty_time = norm_mig_log_dirty_time();
+        s->copy_mbps = MBPS(mc->slab_total, s->ram_copy_time);
 
-            if ((ret = mc_recv(mc_control, MC_TRANSACTION_ACK, NULL)) < 0) {
+        if (ms.nb_replicas > 1) {
+            if (mc_fanout_checkpoint(&ms, mc) < 0) {
                 goto err;
             }
-        }
-
-        ret = qemu_file_get_error(s->file);
-        if (ret) {
-            fprintf(stderr, "Error sending checkpoint: %d\n", ret);
+            idx = (idx + 1) % nb_buffers;
+        } else if (ms.pipeline) {
+            qemu_sem_post(&ms.xmit_ready);
+            idx = (idx + 1) % nb_buffers;
+        } else if (mc_transmit_checkpoint(&ms, mc) < 0) {
             goto err;
         }
 
-        DDPRINTF("Memory transfer complete.\n");
+        mc->checkpoints++;
 
-        /*
-         * The MC is safe on the other side now,
-         * go along our merry way and release the network
-         * packets from the buffer if enabled.
-         */
-        mc_flush_oldest_buffer();
+        /* The VM is running again: refill the slab pool now */
+        mc_slab_pool_balance(ms.slabs);
 
-        end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-        s->total_time = end_time - start_time;
-        s->xmit_time = end_time - xmit_start;
-        s->bitmap_time = norm_mig_bitmap_time();
-        s->log_dirty_time = norm_mig_log_dirty_time();
-        s->mbps = MBPS(mc.slab_total, s->xmit_time);
-        s->copy_mbps = MBPS(mc.slab_total, s->ram_copy_time);
-        s->bytes_xfer = mc.slab_total;
-        s->checkpoints = mc.checkpoints++;
+        epoch_ms = mc_controller_update(&ctl, s, mc,
+                                        mc->start_time - resume_time);
+        resume_time = mc->start_time + s->downtime;
+        s->mc_epoch_length = epoch_ms;
 
-        wait_time = (s->downtime <= freq_ms) ? (freq_ms - s->downtime) : 0;
+        if (atomic_mb_read(&slo_latency_ms)) {
+            int64_t elapsed = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                              resume_time;
+            wait_time = (epoch_ms > elapsed) ? (epoch_ms - elapsed) : 0;
+        } else {
+            wait_time = (s->downtime <= freq_ms) ? (freq_ms - s->downtime) : 0;
+        }
 
         if (current_time >= initial_time + 1000) {
             DPRINTF("bytes %" PRIu64 " xmit_mbps %0.1f xmit_time %" PRId64
                     " downtime %" PRIu64 " sync_time %" PRId64
                     " logdirty_time %" PRId64 " ram_copy_time %" PRId64
                     " copy_mbps %0.1f wait time %" PRIu64
+                    " cow faults %" PRIu64
                     " checkpoints %" PRId64 "\n",
                     s->bytes_xfer,
                     s->mbps,
@@ -1097,7 +3194,24 @@ static void *mc_thread(void *opaque)
                     s->ram_copy_time,
                     s->copy_mbps,
                     wait_time,
+                    ms.cow ? ms.cow->faults : 0,
                     s->checkpoints);
+            if (ms.xbzrle) {
+                DPRINTF("pages raw %" PRIu64 " xbzrle %" PRIu64
+                        " zero %" PRIu64 " page bytes %" PRIu64 "\n",
+                        ms.xbzrle->raw_pages, ms.xbzrle->xbzrle_pages,
+                        ms.xbzrle->zero_pages, ms.xbzrle->bytes);
+            }
+            DPRINTF("slabs %d free %d misses %" PRIu64 "\n",
+                    ms.slabs->nb_slabs, ms.slabs->nb_free, ms.slabs->misses);
+            for (x = 0; x < ms.nb_replicas; x++) {
+                MCZeroCopy *zc = ms.replicas[x].zc;
+
+                if (zc) {
+                    DPRINTF("destination %d zero-copy sends %" PRIu32
+                            " copied %" PRIu64 "\n", x, zc->sent, zc->copied);
+                }
+            }
             initial_time = current_time;
         }
 
@@ -1124,15 +3238,52 @@ err:
      */
     migrate_set_state(s, MIG_STATE_CHECKPOINTING, MIG_STATE_ERROR);
 out:
-    if (mc_staging) {
-        qemu_fclose(mc_staging);
+    if (ms.pipeline) {
+        atomic_mb_set(&ms.xmit_quit, true);
+        qemu_sem_post(&ms.xmit_ready);
+        qemu_thread_join(&ms.xmit_thread);
+        qemu_sem_destroy(&ms.xmit_ready);
     }
 
-    if (mc_control) {
-        qemu_fclose(mc_control);
+    if (ms.nb_replicas > 1) {
+        mc_replicas_stop(&ms);
+    }
+
+    for (x = 0; x < nb_buffers; x++) {
+        if (ms.buf[x].staging) {
+            qemu_fclose(ms.buf[x].staging);
+        }
+        qemu_sem_destroy(&ms.buf[x].free);
+        mc_pages_free(ms.buf[x].pages);
+    }
+
+    mc_cow_free(ms.cow);
+    mc_copy_pool_free(ms.pool);
+    mc_xbzrle_free(ms.xbzrle);
+    mc_slab_pool_free(ms.slabs);
+    s->nb_copy_threads = 0;
+
+    for (x = 0; x < ms.nb_replicas; x++) {
+        MCReplica *r = &ms.replicas[x];
+
+        mc_zerocopy_free(r->zc);
+        if (r->control) {
+            qemu_fclose(r->control);
+        }
+        if (x && r->file) {
+            qemu_fclose(r->file);
+        }
+        if (r->missed) {
+            mc_pages_free(r->missed);
+            qemu_sem_destroy(&r->ready);
+        }
     }
 
+    qemu_mutex_destroy(&ms.ack_lock);
+    qemu_cond_destroy(&ms.ack_cond);
+
     mc_disable_buffering();
+    qemu_mutex_destroy(&plug_lock);
 
     qemu_mutex_lock_iothread();
 
@@ -1167,48 +3318,349 @@ static MCCopyset *mc_copy_next(MCParams *mc, MCCopyset *copyset)
         copyset = QTAILQ_NEXT(copyset, node);
     }
 
-    mc->curr_copyset = copyset;
-    copyset->nb_copies = 0;
+    mc->curr_copyset = copyset;
+    copyset->nb_copies = 0;
+
+    return copyset;
+}
+
+static MCCopy *mc_copy_add(MCParams *mc)
+{
+    MCCopyset *copyset = mc->curr_copyset;
+
+    if (copyset->nb_copies >= MC_MAX_SLAB_COPY_DESCRIPTORS) {
+        copyset = mc_copy_next(mc, copyset);
+    }
+
+    mc->total_copies++;
+
+    return &copyset->copies[copyset->nb_copies++];
+}
+
+
+
+static int mc_get_buffer_timeout_fail(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    QEMUFileSocket *s = opaque;
+    ssize_t len;
+    len = qemu_recv(s->fd, buf, size, 0);
+    if (len == -1) {
+        len = -socket_error();
+    }
+    return len;
+}
+
+static const QEMUFileOps *cp_ops_getbuffer_timeout(const QEMUFileOps *src){
+    QEMUFileOps *ret = malloc(sizeof(QEMUFileOps));
+    memcpy(ret,src,sizeof(QEMUFileOps));
+    ret->get_buffer = mc_get_buffer_timeout_fail;
+    return ret;
+}
+
+//not used
+//static const QEMUFileOps mc_read_notimeout_ops = {
+//    .get_buffer = mc_get_buffer_timeout_fail,
+//    .get_fd = socket_get_fd,
+//    .close = socket_close
+//};
+
+/*
+ * Receive the slabs of a checkpoint sent over TCP.
+ */
+static int mc_recv_slabs(MCParams *mc, QEMUFile *f, uint64_t checkpoint_size)
+{
+    MCSlab *slab = mc_slab_start(mc);
+    uint64_t received = 0;
+    int got;
+
+    while (received < checkpoint_size) {
+        uint64_t total = 0;
+        slab->size = qemu_get_be64(f);
+
+        DDPRINTF("Expecting size: %" PRIu64 "\n", slab->size);
+
+        if (slab->size > mc->slabs->slab_size) {
+            fprintf(stderr, "Invalid slab size: %" PRIu64 "\n", slab->size);
+            return -EINVAL;
+        }
+
+        while (total != slab->size) {
+            got = qemu_get_buffer(f, slab->buf + total, slab->size - total);
+            if (got <= 0) {
+                fprintf(stderr, "Error pre-filling checkpoint: %d\n", got);
+                return -EIO;
+            }
+            DDPRINTF("Received %d slab %" PRIu64 " / %" PRIu64
+                     " received %" PRIu64 " total %" PRIu64 "\n",
+                     got, total, slab->size, received, checkpoint_size);
+            received += got;
+            total += got;
+        }
+
+        if (received != checkpoint_size) {
+            slab = mc_slab_next(mc, slab);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Must be RDMA registration handling. Preallocate
+ * the slabs (if not already done in a previous checkpoint)
+ * before allowing RDMA to register them.
+ */
+static void mc_recv_hook(MCParams *mc, QEMUFile *f, uint64_t slabs,
+                         uint64_t action)
+{
+    MCSlab *slab = mc_slab_start(mc);
+    int x;
+
+    DDPRINTF("Pre-populating slabs %" PRIu64 "...\n", slabs);
+
+    for(x = 1; x < slabs; x++) {
+        slab = mc_slab_next(mc, slab);
+    }
+
+    ram_control_load_hook(f, action);
+
+    DDPRINTF("Hook complete.\n");
+
+    slab = QTAILQ_FIRST(&mc->slab_head);
+
+    for(x = 0; x < slabs; x++) {
+        slab->size = qemu_get_be64(f);
+        slab = QTAILQ_NEXT(slab, node);
+    }
+}
+
+/*
+ * Transactional apply (mc-transactional), destination side.
+ *
+ * A receive thread reads each checkpoint into one of two buffers and
+ * verifies it (every slab received, checksum matching) before
+ * acknowledging it. The checkpoint is then handed over to the incoming
+ * migration thread, which applies it while the next one is received
+ * into the other buffer. A checkpoint which fails verification is
+ * never applied: the VM is recovered from the last one that was.
+ *
+ * RAM pages are not copied into guest memory one at a time while the
+ * RAM section is parsed. Their locations are recorded instead and the
+ * pages are scattered out of the slabs by the copy threads at the end
+ * of the section, before any device state is loaded.
+ */
+typedef struct MCReceiver {
+    QEMUFile *file;
+    QEMUFile *control;
+    MCParams buf[MC_NB_BUFFERS];
+    int nb_buffers;
+    MCCopyPool *pool;
+    MCXbzrle *xbzrle;
+    MCSlabPool *slabs;
+    QemuThread thread;
+    QemuSemaphore ready;
+    uint64_t received;
+} MCReceiver;
+
+static int mc_verify_checkpoint(MCReceiver *mr, MCParams *mc,
+                                uint64_t checkpoint_size, uint64_t slabs)
+{
+    MCSlab *slab = QTAILQ_FIRST(&mc->slab_head);
+    uint64_t total = 0, x;
+    uint32_t crc = qemu_get_be32(mr->file);
+
+    if (qemu_file_get_error(mr->file)) {
+        return -EIO;
+    }
+
+    for (x = 0; x < slabs && slab; x++) {
+        total += slab->size;
+        slab = QTAILQ_NEXT(slab, node);
+    }
+
+    if (x != slabs || total != checkpoint_size) {
+        fprintf(stderr, "MC: incomplete checkpoint: %" PRIu64 "/%" PRIu64
+                " slabs, %" PRIu64 "/%" PRIu64 " bytes\n",
+                x, slabs, total, checkpoint_size);
+        return -EINVAL;
+    }
+
+    if (crc != mc_checksum(mc, slabs)) {
+        fprintf(stderr, "MC: checkpoint checksum mismatch\n");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static void *mc_recv_thread(void *opaque)
+{
+    MCReceiver *mr = opaque;
+    QEMUFile *f = mr->file;
+    uint64_t checkpoint_size = 0, slabs = 0, action;
+    int idx = 0;
+
+    while (true) {
+        MCParams *mc = &mr->buf[idx];
+
+        if (mc_recv(f, MC_TRANSACTION_ANY, &action) < 0) {
+            break;
+        }
+
+        switch(action) {
+        case MC_TRANSACTION_START:
+            /* Wait until the checkpoint held by this buffer is applied */
+            qemu_sem_wait(&mc->free);
+
+            checkpoint_size = qemu_get_be64(f);
+            mc->start_copyset = qemu_get_be64(f);
+            slabs = qemu_get_be64(f);
+
+            DDPRINTF("Transaction start: size %" PRIu64
+                     " copyset start: %" PRIu64 " slabs %" PRIu64 "\n",
+                     checkpoint_size, mc->start_copyset, slabs);
+            continue;
+        case MC_TRANSACTION_COMMIT: /* tcp */
+            if (mc_recv_slabs(mc, f, checkpoint_size) < 0) {
+                goto out;
+            }
+            break;
+        case RAM_SAVE_FLAG_HOOK: /* rdma */
+            mc_recv_hook(mc, f, slabs, action);
+            break;
+        default:
+            fprintf(stderr, "Unknown MC action: %" PRIu64 "\n", action);
+            goto out;
+        }
+
+        if (mc_verify_checkpoint(mr, mc, checkpoint_size, slabs) < 0) {
+            mc_send(mr->control, MC_TRANSACTION_NACK);
+            goto out;
+        }
+
+        if (action == MC_TRANSACTION_COMMIT) {
+            DDPRINTF("Acknowledging successful commit\n");
+
+            if (mc_send(mr->control, MC_TRANSACTION_ACK) < 0) {
+                goto out;
+            }
+        }
+
+        /*
+         * Committed: this checkpoint must now be applied,
+         * whatever happens to the source.
+         */
+        mc->curr_slab = QTAILQ_FIRST(&mc->slab_head);
+        mc->slab_total = checkpoint_size;
+        atomic_mb_set(&mr->received, mr->received + 1);
+        qemu_sem_post(&mr->ready);
+
+        mc_slab_pool_balance(mr->slabs);
+
+        idx = (idx + 1) % mr->nb_buffers;
+    }
+
+out:
+    /* received is not incremented: tells the apply loop to stop */
+    qemu_sem_post(&mr->ready);
+    return NULL;
+}
+
+static void mc_process_transactional(QEMUFile *f, QEMUFile *mc_control)
+{
+    MCReceiver mr = { .file = f, .control = mc_control, .nb_buffers = 1 };
+    uint64_t applied = 0;
+    int idx = 0, x;
+
+    /* RDMA writes the slabs remotely, only one set can be registered */
+    if (!qemu_file_has_ram_hooks(f)) {
+        mr.nb_buffers = MC_NB_BUFFERS;
+    }
+
+    if (copy_threads > 1) {
+        mr.pool = mc_copy_pool_new(copy_threads);
+    }
+
+    if (mc_xbzrle) {
+        mr.xbzrle = mc_xbzrle_new();
+    }
+
+    mr.slabs = mc_slab_pool_new(atomic_read(&slab_size));
+
+    for (x = 0; x < mr.nb_buffers; x++) {
+        MCParams *mc = &mr.buf[x];
+
+        mc->file = f;
+        mc->slabs = mr.slabs;
+        mc->pool = mr.pool;
+        mc->xbzrle = mr.xbzrle;
+        mc->scatter = true;
+        qemu_sem_init(&mc->free, 1);
+
+        if (!(mc->staging = qemu_fopen_mc(mc, "rb"))) {
+            fprintf(stderr, "Could not make outgoing MC staging area\n");
+            goto out;
+        }
+    }
+
+    qemu_sem_init(&mr.ready, 0);
+    qemu_thread_create(&mr.thread, "mc_recv", mc_recv_thread, &mr,
+                       QEMU_THREAD_JOINABLE);
 
-    return copyset;
-}
+    while (true) {
+        MCParams *mc = &mr.buf[idx];
 
+        qemu_sem_wait(&mr.ready);
 
+        if (atomic_mb_read(&mr.received) == applied) {
+            break;
+        }
 
-static int mc_get_buffer_timeout_fail(void *opaque, uint8_t *buf, int64_t pos, int size)
-{
-    QEMUFileSocket *s = opaque;
-    ssize_t len;
-    len = qemu_recv(s->fd, buf, size, 0);
-    if (len == -1) {
-        len = -socket_error();
+        DDPRINTF("Applying verified MC state\n");
+
+        mc_copy_start(mc);
+
+        if (qemu_loadvm_state(mc->staging) < 0) {
+            /*
+             * The checkpoint was verified, so this is not a transmission
+             * problem and there is nothing consistent to go back to.
+             */
+            fprintf(stderr, "loadvm of verified checkpoint failed\n");
+            fprintf(stderr, "Micro Checkpointing Protocol Failed\n");
+            exit(1);
+        }
+
+        DDPRINTF("Transaction complete.\n");
+        mc->checkpoints++;
+        applied++;
+
+        qemu_sem_post(&mc->free);
+        idx = (idx + 1) % mr.nb_buffers;
     }
-    return len;
-}
 
-static const QEMUFileOps *cp_ops_getbuffer_timeout(const QEMUFileOps *src){
-    QEMUFileOps *ret = malloc(sizeof(QEMUFileOps));
-    memcpy(ret,src,sizeof(QEMUFileOps));
-    ret->get_buffer = mc_get_buffer_timeout_fail;
-    return ret;
-}
+    qemu_thread_join(&mr.thread);
+    qemu_sem_destroy(&mr.ready);
+out:
+    for (x = 0; x < mr.nb_buffers; x++) {
+        if (mr.buf[x].staging) {
+            qemu_fclose(mr.buf[x].staging);
+        }
+        qemu_sem_destroy(&mr.buf[x].free);
+    }
 
-//not used
-//static const QEMUFileOps mc_read_notimeout_ops = {
-//    .get_buffer = mc_get_buffer_timeout_fail,
-//    .get_fd = socket_get_fd,
-//    .close = socket_close
-//};
+    mc_copy_pool_free(mr.pool);
+    mc_xbzrle_free(mr.xbzrle);
+    mc_slab_pool_free(mr.slabs);
+}
 
 void mc_process_incoming_checkpoints_if_requested(QEMUFile *f)
 {
     MCParams mc = { .file = f };
-    MCSlab *slab;
     int fd = qemu_get_fd(f);
     QEMUFile *mc_control = NULL, *mc_staging = NULL;
     uint64_t checkpoint_size = 0, action;
     uint64_t slabs = 0;
-    int got, x, ret, received = 0;
+    int ret;
     bool checkpoint_received = 0;
 
     CALC_MAX_STRIKES();
@@ -1223,11 +3675,6 @@ void mc_process_incoming_checkpoints_if_requested(QEMUFile *f)
         goto rollback;
     }
 
-    if (!(mc_staging = qemu_fopen_mc(&mc, "rb"))) {
-        fprintf(stderr, "Could not make outgoing MC staging area\n");
-        goto rollback;
-    }
-
     //qemu_set_block(fd);
     //socket_set_nodelay(fd);
     struct timeval timeout;
@@ -1238,6 +3685,20 @@ void mc_process_incoming_checkpoints_if_requested(QEMUFile *f)
         printf("error : setsockopt failed\n");
     
     f->ops=cp_ops_getbuffer_timeout(f->ops);
+
+    if (mc_transactional) {
+        mc_process_transactional(f, mc_control);
+        goto rollback;
+    }
+
+    if (!(mc_staging = qemu_fopen_mc(&mc, "rb"))) {
+        fprintf(stderr, "Could not make outgoing MC staging area\n");
+        goto rollback;
+    }
+
+    if (mc_xbzrle) {
+        mc.xbzrle = mc_xbzrle_new();
+    }
     
     while (true) {
         checkpoint_received = false;
@@ -1259,31 +3720,8 @@ void mc_process_incoming_checkpoints_if_requested(QEMUFile *f)
             assert(checkpoint_size);
             break;
         case MC_TRANSACTION_COMMIT: /* tcp */
-            slab = mc_slab_start(&mc);
-            received = 0;
-
-            while (received < checkpoint_size) {
-                int total = 0;
-                slab->size = qemu_get_be64(f);
-
-                DDPRINTF("Expecting size: %" PRIu64 "\n", slab->size);
-
-                while (total != slab->size) {
-                    got = qemu_get_buffer(f, slab->buf + total, slab->size - total);
-                    if (got <= 0) {
-                        fprintf(stderr, "Error pre-filling checkpoint: %d\n", got);
-                        goto rollback;
-                    }
-                    DDPRINTF("Received %d slab %d / %ld received %d total %"
-                             PRIu64 "\n", got, total, slab->size, 
-                             received, checkpoint_size);
-                    received += got;
-                    total += got;
-                }
-
-                if (received != checkpoint_size) {
-                    slab = mc_slab_next(&mc, slab);
-                }
+            if (mc_recv_slabs(&mc, f, checkpoint_size) < 0) {
+                goto rollback;
             }
 
             DDPRINTF("Acknowledging successful commit\n");
@@ -1295,30 +3733,7 @@ void mc_process_incoming_checkpoints_if_requested(QEMUFile *f)
             checkpoint_received = true;
             break;
         case RAM_SAVE_FLAG_HOOK: /* rdma */
-            /*
-             * Must be RDMA registration handling. Preallocate
-             * the slabs (if not already done in a previous checkpoint)
-             * before allowing RDMA to register them.
-             */
-            slab = mc_slab_start(&mc);
-
-            DDPRINTF("Pre-populating slabs %" PRIu64 "...\n", slabs);
-
-            for(x = 1; x < slabs; x++) {
-                slab = mc_slab_next(&mc, slab);
-            }
-
-            ram_control_load_hook(f, action);
-
-            DDPRINTF("Hook complete.\n");
-
-            slab = QTAILQ_FIRST(&mc.slab_head);
-
-            for(x = 0; x < slabs; x++) {
-                slab->size = qemu_get_be64(f);
-                slab = QTAILQ_NEXT(slab, node);
-            }
-
+            mc_recv_hook(&mc, f, slabs, action);
             checkpoint_received = true;
             break;
         default:
@@ -1340,6 +3755,7 @@ void mc_process_incoming_checkpoints_if_requested(QEMUFile *f)
                  * This is fatal. No rollback possible because we have potentially
                  * applied only a subset of the checkpoint to main memory, potentially
                  * leaving the VM in an inconsistent state.
+                 * Use mc-transactional to verify checkpoints before applying them.
                  */
                 goto err;
             }
@@ -1348,6 +3764,8 @@ void mc_process_incoming_checkpoints_if_requested(QEMUFile *f)
 
             DDPRINTF("Transaction complete.\n");
             mc.checkpoints++;
+
+            mc_slab_pool_balance(mc.slabs);
         }
     }
 
@@ -1365,6 +3783,8 @@ out:
     if (mc_control) {
         qemu_fclose(mc_control);
     }
+
+    mc_xbzrle_free(mc.xbzrle);
 }
 
 static int mc_get_buffer_internal(void *opaque, uint8_t *buf, int64_t pos,
@@ -1421,16 +3841,174 @@ static int mc_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
 
 
 
+/*
+ * Record where a page has to be copied instead of copying it.
+ * The copy is performed later by mc_scatter_pages().
+ */
+static int mc_scatter_page(MCParams *mc, uint8_t *host_addr, long size)
+{
+    MCSlab *slab = mc->mem_slab;
+    uint64_t len = size;
+
+    while (len && slab) {
+        uint64_t get = MIN(slab->size - slab->read, len);
+
+        if (get) {
+            MCCopy *c = mc_copy_add(mc);
+
+            c->host_addr = (uint64_t) (slab->buf + slab->read);
+            c->offset = 0;
+            c->size = get;
+            c->dest = (uint64_t) host_addr;
+            c->state = MC_COPY_PENDING;
+        }
+
+        host_addr      += get;
+        slab->read     += get;
+        len            -= get;
+        mc->slab_total -= get;
+
+        if (len) {
+            if (slab->idx == mc->nb_slabs - 1) {
+                break;
+            }
+
+            slab = QTAILQ_NEXT(slab, node);
+        }
+    }
+
+    mc->mem_slab = slab;
+
+    return size - len;
+}
+
+/*
+ * Load a page of a delta-compressed checkpoint (mc-xbzrle)
+ */
+static int mc_load_encoded_page(MCParams *mc, uint8_t *host_addr, long size)
+{
+    MCPageHeader hdr;
+    int len;
+
+    if (mc_get_buffer_internal(mc, (uint8_t *) &hdr, 0, sizeof(hdr),
+                               &mc->mem_slab, mc->nb_slabs - 1)
+            != sizeof(hdr)) {
+        return -EINVAL;
+    }
+
+    len = be16_to_cpu(hdr.len);
+
+    switch (hdr.type) {
+    case MC_PAGE_RAW:
+        if (len != size) {
+            break;
+        }
+        if (mc->scatter) {
+            return mc_scatter_page(mc, host_addr, size);
+        }
+        return mc_get_buffer_internal(mc, host_addr, 0, size, &mc->mem_slab,
+                                      mc->nb_slabs - 1);
+    case MC_PAGE_ZERO:
+        ram_handle_compressed(host_addr, 0, size);
+        return size;
+    case MC_PAGE_XBZRLE:
+        if (len > size) {
+            break;
+        }
+
+        if (!mc->xbzrle->encoded_buf) {
+            mc->xbzrle->encoded_buf = g_malloc(size);
+        }
+
+        if (mc_get_buffer_internal(mc, mc->xbzrle->encoded_buf, 0, len,
+                                   &mc->mem_slab, mc->nb_slabs - 1) != len) {
+            return -EINVAL;
+        }
+
+        /* An empty delta means the page has not changed */
+        if (len && xbzrle_decode_buffer(mc->xbzrle->encoded_buf, len,
+                                        host_addr, size) < 0) {
+            fprintf(stderr, "MC: failed to decode page at %p\n", host_addr);
+            return -EINVAL;
+        }
+        return size;
+    }
+
+    fprintf(stderr, "MC: invalid page header type %d len %d\n",
+            hdr.type, len);
+    return -EINVAL;
+}
+
 static int mc_load_page(QEMUFile *f, void *opaque, void *host_addr, long size)
 {
     MCParams *mc = opaque;
 
     DDDPRINTF("Loading page into %p of size %" PRIu64 "\n", host_addr, size);
 
+    if (mc->xbzrle) {
+        return mc_load_encoded_page(mc, host_addr, size);
+    }
+
+    if (mc->scatter) {
+        return mc_scatter_page(mc, host_addr, size);
+    }
+
     return mc_get_buffer_internal(mc, host_addr, 0, size, &mc->mem_slab,
                                   mc->nb_slabs - 1);
 }
 
+/*
+ * Copy the pages recorded by mc_scatter_page() from the slabs into
+ * guest memory, using the copy threads if there are any.
+ */
+static void mc_scatter_pages(MCParams *mc)
+{
+    MCCopyset *copyset;
+    int idx;
+
+    if (!mc->total_copies) {
+        return;
+    }
+
+    DDPRINTF("Scattering %" PRIu64 " pages\n", mc->total_copies);
+
+    if (mc->pool) {
+        mc_copy_parallel(mc, NULL);
+    }
+
+    QTAILQ_FOREACH(copyset, &mc->copy_head, node) {
+        if (!copyset->nb_copies) {
+            break;
+        }
+
+        if (!mc->pool) {
+            for (idx = 0; idx < copyset->nb_copies; idx++) {
+                mc_copy_one(&copyset->copies[idx]);
+            }
+        }
+
+        copyset->nb_copies = 0;
+    }
+
+    mc->total_copies = 0;
+    mc->curr_copyset = QTAILQ_FIRST(&mc->copy_head);
+}
+
+/*
+ * Called once a whole RAM section has been parsed, before any
+ * device state is loaded.
+ */
+static int mc_after_ram_load(QEMUFile *f, void *opaque, uint64_t flags)
+{
+    MCParams *mc = opaque;
+
+    if (mc->scatter) {
+        mc_scatter_pages(mc);
+    }
+
+    return 0;
+}
+
 /*
  * Provide QEMUFile with an *local* RDMA-based way to do memcpy().
  * This lowers cache pollution and allows the CPU pipeline to
@@ -1448,19 +4026,27 @@ static int mc_save_page(QEMUFile *f, void *opaque,
                            long size, int *bytes_sent)
 {
     MCParams *mc = opaque;
-    MCCopyset *copyset = mc->curr_copyset;
-    MCCopy *c;
-
-    if (copyset->nb_copies >= MC_MAX_SLAB_COPY_DESCRIPTORS) {
-        copyset = mc_copy_next(mc, copyset);
-    }
+    MCCopy *c = mc_copy_add(mc);
 
-    c = &copyset->copies[copyset->nb_copies++];
     c->ramblock_offset = (uint64_t) block_offset;
     c->host_addr = (uint64_t) host_addr;
     c->offset = (uint64_t) offset;
     c->size = (uint64_t) size;
-    mc->total_copies++;
+    c->state = MC_COPY_PENDING;
+
+    if (mc->pages) {
+        mc_pages_add(mc->pages, c->ramblock_offset + c->offset, c->size);
+    }
+
+    if (mc->cow) {
+        uint64_t page_size = getpagesize();
+        uint64_t addr = c->host_addr + c->offset;
+        uint64_t end = addr + c->size;
+
+        for (addr &= ~(page_size - 1); addr < end; addr += page_size) {
+            g_hash_table_insert(mc->cow->pages, (gpointer) (uintptr_t) addr, c);
+        }
+    }
 
     return RAM_SAVE_CONTROL_DELAYED;
 }
@@ -1489,16 +4075,18 @@ static int mc_get_fd(void *opaque)
 static int mc_close(void *opaque)
 {
     MCParams *mc = opaque;
-    MCSlab *slab, *next;
 
-    QTAILQ_FOREACH_SAFE(slab, &mc->slab_head, node, next) {
-        ram_control_remove(mc->file, (uint64_t) slab->buf);
-        QTAILQ_REMOVE(&mc->slab_head, slab, node);
-        g_free(slab);
+    while (mc->nb_slabs) {
+        mc_slab_release(mc);
     }
 
     mc->curr_slab = NULL;
 
+    if (mc->own_slabs) {
+        mc_slab_pool_free(mc->slabs);
+        mc->slabs = NULL;
+    }
+
     return 0;
 }
 	
@@ -1515,6 +4103,7 @@ static const QEMUFileOps mc_read_ops = {
     .get_fd = mc_get_fd,
     .close = mc_close,
     .load_page = mc_load_page,
+    .after_ram_load = mc_after_ram_load,
 };
 
 QEMUFile *qemu_fopen_mc(void *opaque, const char *mode)
@@ -1530,16 +4119,21 @@ QEMUFile *qemu_fopen_mc(void *opaque, const char *mode)
     QTAILQ_INIT(&mc->slab_head);
     QTAILQ_INIT(&mc->copy_head);
 
-    slab = qemu_memalign(8, sizeof(MCSlab));
-    memset(slab, 0, sizeof(*slab));
+    /* Buffers which do not share a pool get one of their own */
+    if (!mc->slabs) {
+        mc->slabs = mc_slab_pool_new(atomic_read(&slab_size));
+        mc->own_slabs = true;
+    }
+
+    slab = mc_slab_get(mc->slabs);
     slab->idx = 0;
     QTAILQ_INSERT_HEAD(&mc->slab_head, slab, node);
     mc->slab_total = 0;
     mc->curr_slab = slab;
     mc->nb_slabs = 1;
-    mc->slab_strikes = 0;
 
-    ram_control_add(mc->file, slab->buf, (uint64_t) slab->buf, MC_SLAB_BUFFER_SIZE);
+    ram_control_add(mc->file, slab->buf, (uint64_t) slab->buf,
+                    mc->slabs->slab_size);
 
     copyset = g_malloc(sizeof(MCCopyset));
     copyset->idx = 0;
@@ -1590,6 +4184,223 @@ void qmp_migrate_set_mc_delay(int64_t value, Error **errp)
             freq_ms, max_strikes, max_strikes_delay_secs);
 }
 
+/* The micro-checkpointing fields of query-migrate-parameters */
+void mc_get_parameters(MigrationParameters *params)
+{
+    strList **tail = &params->mc_secondaries;
+    int x;
+
+    params->mc_copy_threads = atomic_mb_read(&copy_threads);
+    params->mc_slo_latency = atomic_mb_read(&slo_latency_ms);
+    params->mc_slo_min_delay = atomic_mb_read(&slo_min_delay_ms);
+    params->mc_slo_max_delay = atomic_mb_read(&slo_max_delay_ms);
+    params->mc_slab_size = atomic_mb_read(&slab_size);
+    params->mc_slab_low_watermark = atomic_mb_read(&slabs_low);
+    params->mc_slab_high_watermark = atomic_mb_read(&slabs_high);
+    params->mc_quorum = mc_quorum;
+
+    for (x = 0; x < nb_secondaries; x++) {
+        *tail = g_malloc0(sizeof(**tail));
+        (*tail)->value = g_strdup(secondary_uris[x]);
+        tail = &(*tail)->next;
+    }
+}
+
+/*
+ * migrate-set-parameters: @params holds the values requested, and the
+ * current ones for the parameters which are not being changed. They
+ * are all checked before mc_set_parameters() applies any of them.
+ */
+bool mc_check_parameters(MigrationParameters *params, Error **errp)
+{
+    strList *e;
+    int nb = 0;
+
+    if (params->mc_copy_threads < 1 ||
+        params->mc_copy_threads > MC_MAX_COPY_THREADS) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "mc-copy-threads",
+                  "a number of copy threads between 1 and "
+                  stringify(MC_MAX_COPY_THREADS));
+        return false;
+    }
+
+    if (params->mc_slo_latency < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "mc-slo-latency",
+                  "a positive latency in milliseconds, or 0");
+        return false;
+    }
+
+    if (params->mc_slo_min_delay < 1 ||
+        params->mc_slo_max_delay < params->mc_slo_min_delay) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "mc-slo-max-delay",
+                  "a delay no smaller than mc-slo-min-delay, itself at "
+                  "least 1 ms");
+        return false;
+    }
+
+    if (params->mc_slab_size < MC_MIN_SLAB_SIZE ||
+        params->mc_slab_size > MC_MAX_SLAB_SIZE ||
+        (params->mc_slab_size & (getpagesize() - 1))) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "mc-slab-size",
+                  "a multiple of the page size between 64 KB and 1 GB");
+        return false;
+    }
+
+    if (params->mc_slab_low_watermark < 0 ||
+        params->mc_slab_high_watermark < params->mc_slab_low_watermark) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE,
+                  "mc-slab-high-watermark",
+                  "a number of slabs no smaller than mc-slab-low-watermark");
+        return false;
+    }
+
+    for (e = params->mc_secondaries; e; e = e->next) {
+        if (++nb > MC_MAX_REPLICAS - 1) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, "mc-secondaries",
+                      "at most " stringify(MC_MAX_REPLICAS) " destinations, "
+                      "the migration URI included");
+            return false;
+        }
+    }
+
+    if (params->mc_quorum < 0 || params->mc_quorum > nb + 1) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "mc-quorum",
+                  "between 1 and the number of destinations, or 0 for "
+                  "a majority");
+        return false;
+    }
+
+    return true;
+}
+
+void mc_set_parameters(MigrationParameters *params)
+{
+    strList *e;
+    int x;
+
+    atomic_mb_set(&copy_threads, params->mc_copy_threads);
+    DPRINTF("Using %d threads to copy checkpoints\n", copy_threads);
+
+    atomic_mb_set(&slo_min_delay_ms, params->mc_slo_min_delay);
+    atomic_mb_set(&slo_max_delay_ms, params->mc_slo_max_delay);
+    atomic_mb_set(&slo_latency_ms, params->mc_slo_latency);
+    DPRINTF("Output commit latency target %" PRId64 " ms, checkpoint delay "
+            "between %" PRId64 " and %" PRId64 " ms\n",
+            slo_latency_ms, slo_min_delay_ms, slo_max_delay_ms);
+
+    atomic_mb_set(&slab_size, params->mc_slab_size);
+    atomic_mb_set(&slabs_low, params->mc_slab_low_watermark);
+    atomic_mb_set(&slabs_high, params->mc_slab_high_watermark);
+    DPRINTF("Slabs of %" PRIu64 " KB, keeping %d to %d of them free\n",
+            slab_size / 1024, slabs_low, slabs_high);
+
+    for (x = 0; x < nb_secondaries; x++) {
+        g_free(secondary_uris[x]);
+    }
+
+    for (x = 0, e = params->mc_secondaries; e; e = e->next) {
+        secondary_uris[x++] = g_strdup(e->value);
+    }
+
+    nb_secondaries = x;
+    mc_quorum = params->mc_quorum;
+    DPRINTF("%d secondaries, quorum %d\n", nb_secondaries, mc_quorum);
+}
+
+static MCPercentiles *mc_percentiles(MCEpochStats *epochs, int n,
+                                     size_t offset, int64_t *values)
+{
+    MCPercentiles *p = g_malloc0(sizeof(*p));
+    int x;
+
+    for (x = 0; x < n; x++) {
+        values[x] = *(int64_t *) ((uint8_t *) &epochs[x] + offset);
+    }
+
+    qsort(values, n, sizeof(*values), mc_compare_int64);
+
+    /* Nearest rank */
+    p->min = values[0];
+    p->p50 = values[(n * 50 + 99) / 100 - 1];
+    p->p90 = values[(n * 90 + 99) / 100 - 1];
+    p->p99 = values[(n * 99 + 99) / 100 - 1];
+    p->max = values[n - 1];
+
+    return p;
+}
+
+MCStatsInfo *qmp_query_mc_stats(bool has_history, int64_t history,
+                                Error **errp)
+{
+    MCStatsInfo *info;
+    MCEpochStats *epochs;
+    MCEpochStatsList *entry;
+    int64_t *values;
+    uint64_t first;
+    int n, x;
+
+    if (!has_history) {
+        history = 0;
+    }
+
+    if (history < 0 || history > MC_STATS_RING_SIZE) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "history",
+                  "a number of epochs between 0 and "
+                  stringify(MC_STATS_RING_SIZE));
+        return NULL;
+    }
+
+    qemu_mutex_lock(&stats_lock);
+    n = MIN(stats_count, MC_STATS_RING_SIZE);
+    first = stats_count - n;
+    epochs = g_new(MCEpochStats, n + 1);
+    for (x = 0; x < n; x++) {
+        epochs[x] = stats_ring[(first + x) % MC_STATS_RING_SIZE];
+    }
+    qemu_mutex_unlock(&stats_lock);
+
+    info = g_malloc0(sizeof(*info));
+    info->epochs = n;
+
+    if (n) {
+        values = g_new(int64_t, n);
+
+#define MC_SUMMARY(field)                                                 \
+        do {                                                              \
+            info->has_##field = true;                                     \
+            info->field = mc_percentiles(epochs, n,                       \
+                                         offsetof(MCEpochStats, field),   \
+                                         values);                         \
+        } while (0)
+
+        MC_SUMMARY(dirty_pages);
+        MC_SUMMARY(bytes);
+        MC_SUMMARY(slabs);
+        MC_SUMMARY(capture_time);
+        MC_SUMMARY(copy_time);
+        MC_SUMMARY(xmit_time);
+        MC_SUMMARY(ack_time);
+        MC_SUMMARY(commit_latency);
+        MC_SUMMARY(held_packets);
+#undef MC_SUMMARY
+
+        g_free(values);
+    }
+
+    /* Most recent epochs, oldest first */
+    for (x = n - 1; x >= 0 && x >= n - history; x--) {
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = g_memdup(&epochs[x], sizeof(MCEpochStats));
+        entry->next = info->history;
+        info->history = entry;
+        info->has_history = true;
+    }
+
+    g_free(epochs);
+
+    return info;
+}
+
 int mc_info_load(QEMUFile *f, void *opaque, int version_id)
 {
     bool mc_enabled = qemu_get_byte(f);
@@ -1601,13 +4412,45 @@ int mc_info_load(QEMUFile *f, void *opaque, int version_id)
 
     max_strikes = qemu_get_be32(f);
 
+    if (version_id >= 2) {
+        uint8_t flags = qemu_get_byte(f);
+
+        mc_transactional = flags & MC_INFO_TRANSACTIONAL;
+        mc_xbzrle = flags & MC_INFO_XBZRLE;
+    }
+
+    /* The destination slabs must be able to hold the source ones */
+    if (version_id >= 3) {
+        uint64_t size = qemu_get_be64(f);
+
+        if (size < MC_MIN_SLAB_SIZE || size > MC_MAX_SLAB_SIZE) {
+            fprintf(stderr, "MC: invalid slab size %" PRIu64 "\n", size);
+            return -EINVAL;
+        }
+
+        atomic_mb_set(&slab_size, size);
+    }
+
     return 0;
 }
 
 void mc_info_save(QEMUFile *f, void *opaque)
 {
+    uint8_t flags = 0;
+
     qemu_put_byte(f, migrate_use_mc());
     qemu_put_be32(f, max_strikes);
+
+    if (migrate_use_mc_transactional()) {
+        flags |= MC_INFO_TRANSACTIONAL;
+    }
+
+    if (migrate_use_mc_xbzrle()) {
+        flags |= MC_INFO_XBZRLE;
+    }
+
+    qemu_put_byte(f, flags);
+    qemu_put_be64(f, atomic_read(&slab_size));
 }
 
 void mc_configure_net(MigrationState *s)
@@ -22,18 +22,27 @@
 #include "block/block.h"
 #include "qemu/sockets.h"
 #include "migration/block.h"
+#include "migration/postcopy-ram.h"
 #include "qemu/thread.h"
 #include "qmp-commands.h"
 #include "trace.h"
 
-/* Amount of time to allocate to each "chunk" of bandwidth-throttled
- * data. */
+/* How often the bandwidth is measured, in ms */
 #define BUFFER_DELAY     100
-#define XFER_LIMIT_RATIO (1000 / BUFFER_DELAY)
+/* Weight of the past in the smoothed bandwidth, about a second */
+#define BANDWIDTH_EWMA_WEIGHT 8
 
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
 
+/* Default compression thread count */
+#define DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT 8
+/* Default decompression thread count, usually decompression is at
+ * least 4 times as fast as compression.*/
+#define DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT 2
+/*0: means nocompress, 1: best speed, ... 9: best compress ratio */
+#define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -49,6 +58,14 @@ MigrationState *migrate_get_current(void)
         .state = MIGRATION_STATUS_NONE,
         .bandwidth_limit = MAX_THROTTLE,
         .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
+        .parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] =
+                DEFAULT_MIGRATE_COMPRESS_LEVEL,
+        .parameters[MIGRATION_PARAMETER_COMPRESS_THREADS] =
+                DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT,
+        .parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
+                DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT,
+        .parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS] =
+                MULTIFD_DEFAULT_CHANNELS,
     };
 
     return &current_migration;
@@ -99,10 +116,16 @@ static void process_incoming_migration_co(void *opaque)
     int ret;
 
     ret = qemu_loadvm_state(f);
-    if (ret >= 0) {
-        mc_process_incoming_checkpoints_if_requested(f);
+    multifd_load_cleanup();
+    migrate_decompress_threads_join();
+    /* In postcopy, the listen thread reads the rest of RAM, then f is
+     * closed by its bottom half */
+    if (ret != LOADVM_POSTCOPY_RUNNING) {
+        if (ret >= 0) {
+            mc_process_incoming_checkpoints_if_requested(f);
+        }
+        qemu_fclose(f);
     }
-    qemu_fclose(f);
     free_xbzrle_decoded_buf();
     if (ret < 0) {
         error_report("load of migration failed: %s", strerror(-ret));
@@ -130,6 +153,10 @@ void process_incoming_migration(QEMUFile *f)
     int fd = qemu_get_fd(f);
 
     assert(fd != -1);
+    /* Without the capability, compressed pages are decompressed inline */
+    if (migrate_use_compression()) {
+        migrate_decompress_threads_create();
+    }
     qemu_set_nonblock(fd);
     qemu_coroutine_enter(co, f);
 }
@@ -170,9 +197,30 @@ MigrationCapabilityStatusList *qmp_query_migrate_capabilities(Error **errp)
     return head;
 }
 
+MigrationParameters *qmp_query_migrate_parameters(Error **errp)
+{
+    MigrationParameters *params;
+    MigrationState *s = migrate_get_current();
+
+    params = g_malloc0(sizeof(*params));
+    params->compress_level = s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL];
+    params->compress_threads =
+            s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
+    params->decompress_threads =
+            s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
+    params->multifd_channels =
+            s->parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS];
+    mc_get_parameters(params);
+
+    return params;
+}
+
 static void get_xbzrle_cache_stats(MigrationInfo *info)
 {
+    PageCacheStats stats;
+
     if (migrate_use_xbzrle()) {
+        xbzrle_mig_cache_stats(&stats);
         info->has_xbzrle_cache = true;
         info->xbzrle_cache = g_malloc0(sizeof(*info->xbzrle_cache));
         info->xbzrle_cache->cache_size = migrate_xbzrle_cache_size();
@@ -181,6 +229,9 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
         info->xbzrle_cache->cache_miss_rate = xbzrle_mig_cache_miss_rate();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
+        info->xbzrle_cache->cache_hit = stats.hits;
+        info->xbzrle_cache->cache_eviction = stats.evictions;
+        info->xbzrle_cache->cache_insert_fail = stats.insert_fails;
     }
 }
 
@@ -199,6 +250,9 @@ static void get_ram_stats(MigrationState *s, MigrationInfo *info)
     info->ram->normal = norm_mig_pages_transferred();
     info->ram->normal_bytes = norm_mig_bytes_transferred();
     info->ram->mbps = s->mbps;
+    info->ram->smoothed_mbps = s->smoothed_mbps;
+    info->ram->postcopy_requests = ram_postcopy_requests();
+    info->ram->bitmap_sync_time = s->bitmap_sync_time;
 
     if (blk_mig_active()) {
         info->has_disk = true;
@@ -247,6 +301,16 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
         get_xbzrle_cache_stats(info);
         break;
+    case MIGRATION_STATUS_POSTCOPY_ACTIVE:
+        info->has_status = true;
+        info->has_setup_time = true;
+        info->setup_time = s->setup_time;
+        info->has_downtime = true;
+        info->downtime = s->downtime;
+
+        get_ram_stats(s, info);
+        info->ram->dirty_sync_count = s->dirty_sync_count;
+        break;
     case MIGRATION_STATUS_COMPLETED:
         get_xbzrle_cache_stats(info);
 
@@ -281,6 +345,20 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->mc->copy_mbps = s->copy_mbps;
         info->mc->mbps = s->mbps;
         info->mc->checkpoints = s->checkpoints;
+        info->mc->epoch_length = s->mc_epoch_length;
+        info->mc->commit_latency = s->mc_commit_latency;
+
+        if (s->nb_copy_threads) {
+            numberList **tail = &info->mc->copy_thread_mbps;
+            int i;
+
+            info->mc->has_copy_thread_mbps = true;
+            for (i = 0; i < s->nb_copy_threads; i++) {
+                *tail = g_malloc0(sizeof(**tail));
+                (*tail)->value = s->copy_thread_mbps[i];
+                tail = &(*tail)->next;
+            }
+        }
         break;
     case MIGRATION_STATUS_FAILED:
         info->has_status = true;
@@ -301,7 +379,8 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     MigrationCapabilityStatusList *cap;
 
     if (s->state == MIGRATION_STATUS_ACTIVE ||
-        s->state == MIGRATION_STATUS_SETUP) {
+        s->state == MIGRATION_STATUS_SETUP ||
+        s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
@@ -311,12 +390,132 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     }
 }
 
+void qmp_migrate_set_parameters(bool has_compress_level,
+                                int64_t compress_level,
+                                bool has_compress_threads,
+                                int64_t compress_threads,
+                                bool has_decompress_threads,
+                                int64_t decompress_threads,
+                                bool has_mc_copy_threads,
+                                int64_t mc_copy_threads,
+                                bool has_mc_slo_latency,
+                                int64_t mc_slo_latency,
+                                bool has_mc_slo_min_delay,
+                                int64_t mc_slo_min_delay,
+                                bool has_mc_slo_max_delay,
+                                int64_t mc_slo_max_delay,
+                                bool has_mc_slab_size,
+                                int64_t mc_slab_size,
+                                bool has_mc_slab_low_watermark,
+                                int64_t mc_slab_low_watermark,
+                                bool has_mc_slab_high_watermark,
+                                int64_t mc_slab_high_watermark,
+                                bool has_mc_secondaries,
+                                strList *mc_secondaries,
+                                bool has_mc_quorum,
+                                int64_t mc_quorum,
+                                bool has_multifd_channels,
+                                int64_t multifd_channels, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+    MigrationParameters *mc;
+
+    if (has_compress_level && (compress_level < 0 || compress_level > 9)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress_level",
+                  "is invalid, it should be in the range of 0 to 9");
+        return;
+    }
+    if (has_compress_threads &&
+            (compress_threads < 1 || compress_threads > 255)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE,
+                  "compress_threads",
+                  "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_decompress_threads &&
+            (decompress_threads < 1 || decompress_threads > 255)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE,
+                  "decompress_threads",
+                  "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_multifd_channels &&
+            (multifd_channels < 1 || multifd_channels > MULTIFD_MAX_CHANNELS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "multifd_channels",
+                  "is invalid, it should be in the range of 1 to "
+                  stringify(MULTIFD_MAX_CHANNELS));
+        return;
+    }
+
+    /*
+     * The micro-checkpointing parameters depend on each other, so they
+     * are checked together with the current values of the others.
+     */
+    mc = g_malloc0(sizeof(*mc));
+    mc_get_parameters(mc);
+    if (has_mc_copy_threads) {
+        mc->mc_copy_threads = mc_copy_threads;
+    }
+    if (has_mc_slo_latency) {
+        mc->mc_slo_latency = mc_slo_latency;
+    }
+    if (has_mc_slo_min_delay) {
+        mc->mc_slo_min_delay = mc_slo_min_delay;
+    }
+    if (has_mc_slo_max_delay) {
+        mc->mc_slo_max_delay = mc_slo_max_delay;
+    }
+    if (has_mc_slab_size) {
+        mc->mc_slab_size = mc_slab_size;
+    }
+    if (has_mc_slab_low_watermark) {
+        mc->mc_slab_low_watermark = mc_slab_low_watermark;
+    }
+    if (has_mc_slab_high_watermark) {
+        mc->mc_slab_high_watermark = mc_slab_high_watermark;
+    }
+    if (has_mc_secondaries) {
+        qapi_free_strList(mc->mc_secondaries);
+        mc->mc_secondaries = mc_secondaries;
+    }
+    if (has_mc_quorum) {
+        mc->mc_quorum = mc_quorum;
+    }
+
+    if (!mc_check_parameters(mc, errp)) {
+        goto out;
+    }
+
+    mc_set_parameters(mc);
+    if (has_compress_level) {
+        s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] = compress_level;
+    }
+    if (has_compress_threads) {
+        s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS] = compress_threads;
+    }
+    if (has_decompress_threads) {
+        s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
+                                                    decompress_threads;
+    }
+    if (has_multifd_channels) {
+        s->parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS] = multifd_channels;
+    }
+
+out:
+    if (has_mc_secondaries) {
+        /* Owned by the caller */
+        mc->mc_secondaries = NULL;
+    }
+    qapi_free_MigrationParameters(mc);
+}
+
 /* shared migration helpers */
 
 bool migration_is_active(MigrationState *s)
 {
     return s->state == MIGRATION_STATUS_ACTIVE || s->state ==  MIGRATION_STATUS_SETUP
-            || s->state ==  MIGRATION_STATUS_CHECKPOINTING;
+            || s->state ==  MIGRATION_STATUS_CHECKPOINTING
+            || s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE;
 }
 
 void migrate_set_state(MigrationState *s, int old_state, int new_state)
@@ -326,6 +525,8 @@ void migrate_set_state(MigrationState *s, int old_state, int new_state)
     }
 }
 
+static void migrate_close_return_path(MigrationState *s, bool abort);
+
 static void migrate_fd_cleanup(void *opaque)
 {
     MigrationState *s = opaque;
@@ -342,6 +543,7 @@ static void migrate_fd_cleanup(void *opaque)
         qemu_mutex_lock_iothread();
         g_free(s->thread);
 
+        migrate_close_return_path(s, true);
         qemu_fclose(s->file);
         s->file = NULL;
     }
@@ -392,6 +594,7 @@ static void migrate_fd_cancel(MigrationState *s)
      */
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
+        multifd_save_shutdown();
     }
 }
 
@@ -432,6 +635,12 @@ static MigrationState *migrate_init(const MigrationParams *params)
     int64_t bandwidth_limit = s->bandwidth_limit;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size = s->xbzrle_cache_size;
+    int multifd_channels = s->parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS];
+    int compress_level = s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL];
+    int compress_thread_count =
+            s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
+    int decompress_thread_count =
+            s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
@@ -441,6 +650,12 @@ static MigrationState *migrate_init(const MigrationParams *params)
     memcpy(s->enabled_capabilities, enabled_capabilities,
            sizeof(enabled_capabilities));
     s->xbzrle_cache_size = xbzrle_cache_size;
+    s->parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS] = multifd_channels;
+    s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] = compress_level;
+    s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS] =
+               compress_thread_count;
+    s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
+               decompress_thread_count;
 
     s->bandwidth_limit = bandwidth_limit;
     s->state = MIGRATION_STATUS_SETUP;
@@ -499,11 +714,31 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
 
     if (s->state == MIGRATION_STATUS_ACTIVE ||
         s->state == MIGRATION_STATUS_SETUP ||
-        s->state == MIGRATION_STATUS_CANCELLING) {
+        s->state == MIGRATION_STATUS_CANCELLING ||
+        s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
 
+    if (dirty_rate_measuring()) {
+        error_setg(errp, "A dirty rate measurement is running");
+        return;
+    }
+
+    if (migrate_postcopy_ram()) {
+        if (migrate_use_mc() || params.blk || params.shared) {
+            error_setg(errp, "Postcopy cannot be used with micro-checkpointing"
+                       " or block migration");
+            return;
+        }
+        if (!strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL) &&
+            !strstart(uri, "fd:", NULL)) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
+                      "tcp:, unix: or fd: for postcopy");
+            return;
+        }
+    }
+
     if (runstate_check(RUN_STATE_INMIGRATE)) {
         error_setg(errp, "Guest is waiting for an incoming migration");
         return;
@@ -600,7 +835,7 @@ void qmp_migrate_set_speed(int64_t value, Error **errp)
     s = migrate_get_current();
     s->bandwidth_limit = value;
     if (s->file) {
-        qemu_file_set_rate_limit(s->file, s->bandwidth_limit / XFER_LIMIT_RATIO);
+        migrate_set_rate_limit(s, s->bandwidth_limit);
     }
 }
 
@@ -647,6 +882,238 @@ int64_t migrate_xbzrle_cache_size(void)
     return s->xbzrle_cache_size;
 }
 
+bool migrate_use_compression(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+}
+
+int migrate_compress_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL];
+}
+
+int migrate_compress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
+}
+
+int migrate_decompress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
+}
+
+int migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_MULTIFD_CHANNELS];
+}
+
+bool migrate_socket_pacing(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_SOCKET_PACING];
+}
+
+/*
+ * Limits the migration stream to @rate bytes/s, INT64_MAX for no limit.
+ * With socket-pacing, the kernel also spaces out the packets of the
+ * socket (this needs the fq qdisc), which smooths the traffic further
+ * than the millisecond waits of the migration thread.
+ */
+void migrate_set_rate_limit(MigrationState *s, int64_t rate)
+{
+#ifdef SO_MAX_PACING_RATE
+    unsigned int pacing;
+    int fd;
+#endif
+
+    qemu_file_set_rate_limit(s->file, rate);
+
+#ifdef SO_MAX_PACING_RATE
+    fd = qemu_get_fd(s->file);
+    if (!migrate_socket_pacing() || fd < 0) {
+        return;
+    }
+    /* ~0U lifts the limit */
+    pacing = rate <= 0 || rate >= UINT_MAX ? ~0U : rate;
+    if (qemu_setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE,
+                        &pacing, sizeof(pacing)) < 0) {
+        trace_migrate_pacing_rate_error(fd, errno);
+    }
+#endif
+}
+
+bool migrate_postcopy_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM];
+}
+
+/* postcopy return path */
+
+/*
+ * Reads the page requests sent by the destination once it runs, until
+ * it says it has every page (or the connection goes away).
+ */
+static void *source_return_path_thread(void *opaque)
+{
+    MigrationState *s = opaque;
+    QEMUFile *rp = s->rp_file;
+    char idstr[256];
+    uint64_t offset;
+    uint16_t msg;
+    int len;
+
+    while (true) {
+        msg = qemu_get_be16(rp);
+        if (qemu_file_get_error(rp)) {
+            break;
+        }
+
+        switch (msg) {
+        case MIG_RP_MSG_SHUT:
+            return NULL;
+        case MIG_RP_MSG_REQ_PAGE:
+            len = qemu_get_byte(rp);
+            qemu_get_buffer(rp, (uint8_t *)idstr, len);
+            idstr[len] = 0;
+            offset = qemu_get_be64(rp);
+            if (qemu_file_get_error(rp)) {
+                break;
+            }
+            if (ram_save_queue_page(idstr, offset) < 0) {
+                error_report("postcopy: bad page request %s %" PRIx64,
+                             idstr, offset);
+                s->rp_error = -EINVAL;
+                return NULL;
+            }
+            continue;
+        default:
+            error_report("postcopy: unknown return path message %d", msg);
+            s->rp_error = -EINVAL;
+            return NULL;
+        }
+        break;
+    }
+
+    s->rp_error = qemu_file_get_error(rp);
+    if (!s->rp_error) {
+        s->rp_error = -EIO;
+    }
+
+    return NULL;
+}
+
+static int migrate_open_return_path(MigrationState *s)
+{
+    int fd = dup(qemu_get_fd(s->file));
+
+    if (fd < 0) {
+        return -errno;
+    }
+
+    s->rp_error = 0;
+    s->rp_file = qemu_fopen_socket(fd, "rb");
+    qemu_thread_create(&s->rp_thread, "return path",
+                       source_return_path_thread, s, QEMU_THREAD_JOINABLE);
+
+    return 0;
+}
+
+/*
+ * Waits for the destination to let go of the return path; on @abort,
+ * it is not waited for.
+ */
+static void migrate_close_return_path(MigrationState *s, bool abort)
+{
+    if (!s->rp_file) {
+        return;
+    }
+
+    if (abort) {
+        qemu_file_shutdown(s->rp_file);
+    }
+    qemu_thread_join(&s->rp_thread);
+    qemu_fclose(s->rp_file);
+    s->rp_file = NULL;
+}
+
+/*
+ * Switch to postcopy: with the VM stopped, drop on the destination the
+ * pages which were dirtied since they were sent, send it the device
+ * state and let it run. Returns with the VM stopped for good.
+ */
+static int postcopy_start(MigrationState *s, bool *old_vm_running)
+{
+    int ret;
+
+    qemu_mutex_lock_iothread();
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    *old_vm_running = runstate_is_running();
+
+    ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = migrate_open_return_path(s);
+    if (ret < 0) {
+        error_report("postcopy: cannot open the return path: %s",
+                     strerror(-ret));
+        goto out;
+    }
+
+    /* Pages the guest waits for must not queue behind the limit */
+    migrate_set_rate_limit(s, INT64_MAX);
+
+    ram_postcopy_send_discard(s->file);
+    qemu_savevm_state_postcopy(s->file);
+
+    ret = qemu_file_get_error(s->file);
+    if (!ret) {
+        migrate_set_state(s, MIGRATION_STATUS_ACTIVE,
+                          MIGRATION_STATUS_POSTCOPY_ACTIVE);
+    }
+
+out:
+    qemu_mutex_unlock_iothread();
+    return ret;
+}
+
 /* migration thread support */
 
 static void *migration_thread(void *opaque)
@@ -657,21 +1124,57 @@ static void *migration_thread(void *opaque)
     int64_t initial_bytes = 0;
     int64_t max_size = 0;
     int64_t start_time = initial_time;
+    double smoothed_bandwidth = 0;
     bool old_vm_running = false;
+    bool entered_postcopy = false;
+    int current_active_state = MIGRATION_STATUS_ACTIVE;
 
     qemu_savevm_state_begin(s->file, &s->params);
 
     s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
     migrate_set_state(s, MIGRATION_STATUS_SETUP, MIGRATION_STATUS_ACTIVE);
 
-    while (s->state == MIGRATION_STATUS_ACTIVE) {
+    while (s->state == MIGRATION_STATUS_ACTIVE ||
+           s->state == MIGRATION_STATUS_POSTCOPY_ACTIVE) {
         int64_t current_time;
         uint64_t pending_size;
 
-        if (!qemu_file_rate_limit(s->file)) {
+        if (entered_postcopy) {
+            /* Every page left is sent, requested ones first */
+            pending_size = qemu_savevm_state_pending(s->file, 0);
+            if (pending_size) {
+                qemu_savevm_state_iterate(s->file);
+            } else {
+                qemu_mutex_lock_iothread();
+                qemu_savevm_state_postcopy_complete(s->file);
+                qemu_mutex_unlock_iothread();
+
+                migrate_close_return_path(s, false);
+                if (!qemu_file_get_error(s->file) && !s->rp_error) {
+                    migrate_set_state(s, MIGRATION_STATUS_POSTCOPY_ACTIVE,
+                                      MIGRATION_STATUS_COMPLETED);
+                    break;
+                }
+            }
+            if (s->rp_error && !qemu_file_get_error(s->file)) {
+                qemu_file_set_error(s->file, s->rp_error);
+            }
+        } else if (!qemu_file_rate_limit(s->file)) {
             pending_size = qemu_savevm_state_pending(s->file, max_size);
             trace_migrate_pending(pending_size, max_size);
-            if (pending_size && pending_size >= max_size) {
+            if (pending_size && pending_size >= max_size &&
+                migrate_postcopy_ram() && ram_postcopy_ready()) {
+                start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+                if (postcopy_start(s, &old_vm_running) < 0) {
+                    migrate_set_state(s, MIGRATION_STATUS_ACTIVE,
+                                      MIGRATION_STATUS_FAILED);
+                    break;
+                }
+                s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                              start_time;
+                entered_postcopy = true;
+                current_active_state = MIGRATION_STATUS_POSTCOPY_ACTIVE;
+            } else if (pending_size && pending_size >= max_size) {
                 qemu_savevm_state_iterate(s->file);
             } else {
                 int ret;
@@ -683,7 +1186,7 @@ static void *migration_thread(void *opaque)
 
                 ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
                 if (ret >= 0) {
-                    qemu_file_set_rate_limit(s->file, INT64_MAX);
+                    migrate_set_rate_limit(s, INT64_MAX);
                     qemu_savevm_state_complete(s->file);
                 }
                 qemu_mutex_unlock_iothread();
@@ -705,7 +1208,7 @@ static void *migration_thread(void *opaque)
         }
 
         if (qemu_file_get_error(s->file)) {
-            migrate_set_state(s, MIGRATION_STATUS_ACTIVE,
+            migrate_set_state(s, current_active_state,
                               MIGRATION_STATUS_FAILED);
             break;
         }
@@ -713,26 +1216,43 @@ static void *migration_thread(void *opaque)
         if (current_time >= initial_time + BUFFER_DELAY) {
             uint64_t transferred_bytes = qemu_ftell(s->file) - initial_bytes;
             uint64_t time_spent = current_time - initial_time;
-            double bandwidth = transferred_bytes / time_spent;
-            max_size = bandwidth * migrate_max_downtime() / 1000000;
+            /* bytes per ms */
+            double bandwidth = (double)transferred_bytes / time_spent;
+
+            /*
+             * A single period is too noisy to size the last iteration
+             * with, it may have been spent waiting for the rate limit
+             * or for a sync of the dirty bitmap.
+             */
+            if (smoothed_bandwidth) {
+                smoothed_bandwidth += (bandwidth - smoothed_bandwidth) /
+                                      BANDWIDTH_EWMA_WEIGHT;
+            } else {
+                smoothed_bandwidth = bandwidth;
+            }
+            max_size = smoothed_bandwidth * migrate_max_downtime() / 1000000;
 
             s->mbps = MBPS(transferred_bytes, time_spent);
+            s->smoothed_mbps = smoothed_bandwidth * 8 / 1000;
 
             trace_migrate_transferred(transferred_bytes, time_spent,
-                                      bandwidth, max_size);
+                                      bandwidth, smoothed_bandwidth, max_size);
             /* if we haven't sent anything, we don't want to recalculate
                10000 is a small enough number for our purposes */
             if (s->dirty_bytes_rate && transferred_bytes > 10000) {
-                s->expected_downtime = s->dirty_bytes_rate / bandwidth;
+                s->expected_downtime = s->dirty_bytes_rate / smoothed_bandwidth;
             }
 
-            qemu_file_reset_rate_limit(s->file);
             initial_time = current_time;
             initial_bytes = qemu_ftell(s->file);
         }
-        if (qemu_file_rate_limit(s->file)) {
-            /* usleep expects microseconds */
-            g_usleep((initial_time + BUFFER_DELAY - current_time)*1000);
+        if (!qemu_file_get_error(s->file)) {
+            int64_t wait = qemu_file_rate_limit_wait(s->file);
+
+            /* Still wake up in time for the next bandwidth sample */
+            if (wait) {
+                g_usleep(MIN(wait / SCALE_US, BUFFER_DELAY * 1000));
+            }
         }
     }
 
@@ -741,7 +1261,9 @@ static void *migration_thread(void *opaque)
         int64_t end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
         uint64_t transferred_bytes = qemu_ftell(s->file);
         s->total_time = end_time - s->total_time;
-        s->downtime = end_time - start_time;
+        if (!entered_postcopy) {
+            s->downtime = end_time - start_time;
+        }
         if (s->total_time) {
             s->mbps = (((double) transferred_bytes * 8.0) /
                        ((double) s->total_time)) / 1000;
@@ -752,7 +1274,8 @@ static void *migration_thread(void *opaque)
             mc_configure_net(s);
         }
 
-        if (old_vm_running) {
+        /* After the switch, the destination may have run already */
+        if (old_vm_running && !entered_postcopy) {
             vm_start();
         }
     }
@@ -777,8 +1300,11 @@ void migrate_fd_connect(MigrationState *s)
     s->expected_downtime = max_downtime/1000000;
     s->cleanup_bh = qemu_bh_new(migrate_fd_cleanup, s);
 
-    qemu_file_set_rate_limit(s->file,
-                             s->bandwidth_limit / XFER_LIMIT_RATIO);
+    if (migrate_use_mc()) {
+        mc_connect_secondaries(s);
+    }
+
+    migrate_set_rate_limit(s, s->bandwidth_limit);
 
     /* Notify before starting migration thread */
     notifier_list_notify(&migration_state_notifiers, s);
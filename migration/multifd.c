@@ -0,0 +1,757 @@
+/*
+ * Multiple channel (multifd) RAM migration
+ *
+ * With the multifd capability, RAM pages are not written to the main
+ * migration stream: they are batched per RAMBlock and written by sender
+ * threads, each on its own connection to the destination, where receive
+ * threads write them straight into guest memory. The main stream still
+ * carries device state, zero pages, XBZRLE pages and the sync points.
+ *
+ * A page is sent at most once between two dirty bitmap syncs, so pages
+ * sent on different channels within a round never overlap. At the end
+ * of each round the source sends a SYNC packet on every channel, and a
+ * RAM_SAVE_FLAG_MULTIFD_SYNC on the main stream: the destination does
+ * not go past it until every channel has applied the pages before its
+ * SYNC packet, and no channel goes past its SYNC packet until then.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "block/coroutine.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+
+//#define DEBUG_MULTIFD
+
+#ifdef DEBUG_MULTIFD
+#define DPRINTF(fmt, ...) \
+    do { printf("multifd: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+#define MULTIFD_MAGIC   0x11223344U
+#define MULTIFD_VERSION 1
+
+/* Pages per packet */
+#define MULTIFD_PAGES   128
+
+#define MULTIFD_FLAG_SYNC (1 << 0)
+
+/* Sent once when a channel connects */
+typedef struct QEMU_PACKED MultiFDInit {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t id;
+    /* Number of channels the source opened */
+    uint32_t count;
+} MultiFDInit;
+
+/*
+ * Followed by the RAMBlock idstr (idlen bytes), num be64 offsets and
+ * num pages of page_size bytes each.
+ */
+typedef struct QEMU_PACKED MultiFDPacket {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t num;
+    uint32_t page_size;
+    uint8_t idlen;
+} MultiFDPacket;
+
+/* Header, idstr and offsets, then the pages */
+#define MULTIFD_IOV_PAGES 3
+
+typedef struct MultiFDPages {
+    const char *idstr;
+    uint32_t num;
+    uint32_t page_size;
+    uint64_t offset[MULTIFD_PAGES];
+    struct iovec iov[MULTIFD_IOV_PAGES + MULTIFD_PAGES];
+} MultiFDPages;
+
+/* Source side */
+
+typedef struct MultiFDSendChannel {
+    int id;
+    int fd;
+    QemuThread thread;
+    /* Posted when there is a batch of pages or a SYNC to send */
+    QemuSemaphore sem;
+    /* Posted when the SYNC packet has been written */
+    QemuSemaphore sem_sync;
+    QemuMutex mutex;
+    /* Protected by mutex */
+    MultiFDPages *pages;
+    bool sync;
+    bool quit;
+    uint64_t packets;
+    uint64_t bytes;
+} MultiFDSendChannel;
+
+static struct {
+    MultiFDSendChannel *channels;
+    int count;
+    /* Number of channels which can take a batch of pages */
+    QemuSemaphore channels_ready;
+    /* Batch being filled by the migration thread */
+    MultiFDPages *pages;
+    int next;
+    int error;
+} *multifd_send_state;
+
+static MultiFDPages *multifd_pages_new(void)
+{
+    return g_malloc0(sizeof(MultiFDPages));
+}
+
+/* Point the first iovs of @pages at its packet header */
+static void multifd_pages_header(MultiFDPages *pages, uint32_t flags,
+                                 MultiFDPacket *hdr, uint64_t *offsets)
+{
+    uint8_t idlen = pages->num ? strlen(pages->idstr) : 0;
+    int i;
+
+    hdr->magic = cpu_to_be32(MULTIFD_MAGIC);
+    hdr->flags = cpu_to_be32(flags);
+    hdr->num = cpu_to_be32(pages->num);
+    hdr->page_size = cpu_to_be32(pages->page_size);
+    hdr->idlen = idlen;
+
+    for (i = 0; i < pages->num; i++) {
+        offsets[i] = cpu_to_be64(pages->offset[i]);
+    }
+
+    pages->iov[0].iov_base = hdr;
+    pages->iov[0].iov_len = sizeof(*hdr);
+    pages->iov[1].iov_base = (void *) pages->idstr;
+    pages->iov[1].iov_len = idlen;
+    pages->iov[2].iov_base = offsets;
+    pages->iov[2].iov_len = pages->num * sizeof(offsets[0]);
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendChannel *c = opaque;
+    MultiFDPages *pages = multifd_pages_new();
+    uint64_t offsets[MULTIFD_PAGES];
+    MultiFDPacket hdr;
+    MultiFDInit init = {
+        .magic = cpu_to_be32(MULTIFD_MAGIC),
+        .version = cpu_to_be32(MULTIFD_VERSION),
+        .id = cpu_to_be32(c->id),
+        .count = cpu_to_be32(multifd_send_state->count),
+    };
+    struct iovec iov = { .iov_base = &init, .iov_len = sizeof(init) };
+    int ret = 0;
+
+    if (iov_send(c->fd, &iov, 1, 0, sizeof(init)) != sizeof(init)) {
+        ret = -socket_error();
+    }
+
+    qemu_sem_post(&multifd_send_state->channels_ready);
+
+    while (true) {
+        MultiFDPages *tmp;
+        bool sync, had_pages;
+        ssize_t size, len;
+        int iovcnt;
+
+        qemu_sem_wait(&c->sem);
+
+        qemu_mutex_lock(&c->mutex);
+        if (c->quit) {
+            qemu_mutex_unlock(&c->mutex);
+            break;
+        }
+        /* Take the batch, leaving an empty one for the next */
+        tmp = c->pages;
+        c->pages = pages;
+        pages = tmp;
+        sync = c->sync;
+        c->sync = false;
+        qemu_mutex_unlock(&c->mutex);
+
+        had_pages = pages->num != 0;
+
+        if (!ret && (had_pages || sync)) {
+            multifd_pages_header(pages, sync ? MULTIFD_FLAG_SYNC : 0,
+                                 &hdr, offsets);
+            iovcnt = MULTIFD_IOV_PAGES + pages->num;
+
+            size = iov_size(pages->iov, iovcnt);
+            len = iov_send(c->fd, pages->iov, iovcnt, 0, size);
+            if (len != size) {
+                ret = (len < 0) ? -socket_error() : -EIO;
+                DPRINTF("channel %d: send failed: %s\n", c->id,
+                        strerror(-ret));
+            } else {
+                c->packets++;
+                c->bytes += size;
+            }
+        }
+
+        if (ret) {
+            atomic_cmpxchg(&multifd_send_state->error, 0, ret);
+        }
+
+        pages->num = 0;
+        pages->idstr = NULL;
+
+        if (had_pages) {
+            qemu_sem_post(&multifd_send_state->channels_ready);
+        }
+        if (sync) {
+            qemu_sem_post(&c->sem_sync);
+        }
+    }
+
+    g_free(pages);
+    DPRINTF("channel %d: %" PRIu64 " packets, %" PRIu64 " bytes\n",
+            c->id, c->packets, c->bytes);
+
+    return NULL;
+}
+
+/* Connect to the same address as the main migration socket */
+static int multifd_connect(int main_fd)
+{
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    int fd, ret;
+
+    if (getpeername(main_fd, (struct sockaddr *) &ss, &len) < 0) {
+        return -socket_error();
+    }
+
+    fd = qemu_socket(ss.ss_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -socket_error();
+    }
+
+    do {
+        ret = connect(fd, (struct sockaddr *) &ss, len);
+    } while (ret < 0 && socket_error() == EINTR);
+
+    if (ret < 0) {
+        ret = -socket_error();
+        closesocket(fd);
+        return ret;
+    }
+
+    if (ss.ss_family == AF_INET || ss.ss_family == AF_INET6) {
+        socket_set_nodelay(fd);
+    }
+
+    return fd;
+}
+
+/*
+ * Called from ram_save_setup(): open the extra channels. If that is not
+ * possible, RAM is sent on the main stream as usual.
+ */
+void multifd_save_setup(QEMUFile *f)
+{
+    int i, count = migrate_multifd_channels();
+    int main_fd = qemu_get_fd(f);
+    int fds[MULTIFD_MAX_CHANNELS];
+
+    assert(!multifd_send_state);
+
+    /* Not a migration (savevm) */
+    if (main_fd < 0) {
+        return;
+    }
+
+    if (qemu_file_has_ram_hooks(f)) {
+        error_report("multifd: not supported over RDMA, "
+                     "using a single channel");
+        return;
+    }
+
+    /*
+     * The destination expects as many channels as it is configured for,
+     * so either all of them are opened or none is used. The count goes
+     * in the handshake of every channel.
+     */
+    for (i = 0; i < count; i++) {
+        fds[i] = multifd_connect(main_fd);
+        if (fds[i] < 0) {
+            error_report("multifd: cannot open channel %d: %s, "
+                         "using a single channel", i, strerror(-fds[i]));
+            while (i--) {
+                closesocket(fds[i]);
+            }
+            return;
+        }
+    }
+
+    multifd_send_state = g_malloc0(sizeof(*multifd_send_state));
+    multifd_send_state->channels = g_new0(MultiFDSendChannel, count);
+    multifd_send_state->count = count;
+    multifd_send_state->pages = multifd_pages_new();
+    qemu_sem_init(&multifd_send_state->channels_ready, 0);
+
+    for (i = 0; i < count; i++) {
+        MultiFDSendChannel *c = &multifd_send_state->channels[i];
+
+        c->id = i;
+        c->fd = fds[i];
+        c->pages = multifd_pages_new();
+        qemu_mutex_init(&c->mutex);
+        qemu_sem_init(&c->sem, 0);
+        qemu_sem_init(&c->sem_sync, 0);
+        qemu_thread_create(&c->thread, "multifd_send", multifd_send_thread,
+                           c, QEMU_THREAD_JOINABLE);
+    }
+
+    DPRINTF("%d channels\n", count);
+}
+
+bool multifd_send_active(void)
+{
+    return multifd_send_state != NULL;
+}
+
+/* Hand the batch being filled over to the next idle channel */
+static int multifd_send_pages(void)
+{
+    MultiFDPages *pages = multifd_send_state->pages;
+    int i, count = multifd_send_state->count;
+
+    qemu_sem_wait(&multifd_send_state->channels_ready);
+
+    for (i = 0; i < count; i++) {
+        int id = (multifd_send_state->next + i) % count;
+        MultiFDSendChannel *c = &multifd_send_state->channels[id];
+
+        qemu_mutex_lock(&c->mutex);
+        if (!c->pages->num) {
+            multifd_send_state->pages = c->pages;
+            c->pages = pages;
+            qemu_mutex_unlock(&c->mutex);
+            multifd_send_state->next = id + 1;
+            qemu_sem_post(&c->sem);
+            return atomic_mb_read(&multifd_send_state->error);
+        }
+        qemu_mutex_unlock(&c->mutex);
+    }
+
+    /* channels_ready counts idle channels, so one is idle */
+    abort();
+}
+
+/*
+ * Queue a page for one of the channels. The page is read when the batch
+ * is sent, as with qemu_put_buffer_async(). Returns a negative errno if
+ * a channel failed.
+ */
+int multifd_queue_page(const char *idstr, uint64_t offset, uint8_t *host,
+                       size_t size)
+{
+    MultiFDPages *pages = multifd_send_state->pages;
+    int ret;
+
+    if (pages->num && (pages->idstr != idstr || pages->page_size != size)) {
+        ret = multifd_send_pages();
+        if (ret < 0) {
+            return ret;
+        }
+        pages = multifd_send_state->pages;
+    }
+
+    pages->idstr = idstr;
+    pages->page_size = size;
+    pages->offset[pages->num] = offset;
+    pages->iov[MULTIFD_IOV_PAGES + pages->num].iov_base = host;
+    pages->iov[MULTIFD_IOV_PAGES + pages->num].iov_len = size;
+    pages->num++;
+
+    if (pages->num == MULTIFD_PAGES) {
+        return multifd_send_pages();
+    }
+
+    return atomic_mb_read(&multifd_send_state->error);
+}
+
+/*
+ * End of a round: flush the pending batch, send a SYNC packet on every
+ * channel and a sync point on the main stream. Must be called from the
+ * RCU critical section that queued the pages.
+ */
+int multifd_send_sync_main(QEMUFile *f)
+{
+    int i, ret;
+
+    if (!multifd_send_state) {
+        return 0;
+    }
+
+    if (multifd_send_state->pages->num) {
+        ret = multifd_send_pages();
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendChannel *c = &multifd_send_state->channels[i];
+
+        qemu_mutex_lock(&c->mutex);
+        c->sync = true;
+        qemu_mutex_unlock(&c->mutex);
+        qemu_sem_post(&c->sem);
+    }
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        qemu_sem_wait(&multifd_send_state->channels[i].sem_sync);
+    }
+
+    ret = atomic_mb_read(&multifd_send_state->error);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    qemu_put_be32(f, multifd_send_state->count);
+
+    return 0;
+}
+
+/* Unblock channels stuck on a dead connection (migrate_cancel) */
+void multifd_save_shutdown(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        shutdown(multifd_send_state->channels[i].fd, SHUT_RDWR);
+    }
+}
+
+void multifd_save_cleanup(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendChannel *c = &multifd_send_state->channels[i];
+
+        qemu_mutex_lock(&c->mutex);
+        c->quit = true;
+        qemu_mutex_unlock(&c->mutex);
+        qemu_sem_post(&c->sem);
+        qemu_thread_join(&c->thread);
+
+        closesocket(c->fd);
+        g_free(c->pages);
+        qemu_mutex_destroy(&c->mutex);
+        qemu_sem_destroy(&c->sem);
+        qemu_sem_destroy(&c->sem_sync);
+    }
+
+    qemu_sem_destroy(&multifd_send_state->channels_ready);
+    g_free(multifd_send_state->channels);
+    g_free(multifd_send_state->pages);
+    g_free(multifd_send_state);
+    multifd_send_state = NULL;
+}
+
+/* Destination side */
+
+typedef struct MultiFDRecvChannel {
+    int id;
+    int fd;
+    QemuThread thread;
+    /* Posted by the main thread once every channel reached the sync */
+    QemuSemaphore sem_sync;
+    bool quit;
+    uint64_t packets;
+    uint64_t bytes;
+} MultiFDRecvChannel;
+
+static struct {
+    MultiFDRecvChannel channels[MULTIFD_MAX_CHANNELS];
+    int count;
+    int listen_fd;
+    /* Number of channels waiting at a SYNC packet */
+    int synced;
+    /* Incoming migration coroutine waiting for the channels */
+    Coroutine *co;
+    /* Scheduled by the channels to wake co up */
+    QEMUBH *bh;
+    int error;
+} *multifd_recv_state;
+
+static void multifd_recv_bh(void *opaque)
+{
+    Coroutine *co = multifd_recv_state->co;
+
+    if (co) {
+        multifd_recv_state->co = NULL;
+        qemu_coroutine_enter(co, NULL);
+    }
+}
+
+/* Can be called from any thread */
+static void multifd_recv_set_error(int ret)
+{
+    atomic_cmpxchg(&multifd_recv_state->error, 0, ret);
+    qemu_bh_schedule(multifd_recv_state->bh);
+}
+
+static int multifd_recv_full(int fd, void *buf, size_t size)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    ssize_t len = iov_recv(fd, &iov, 1, 0, size);
+
+    if (len != size) {
+        return (len < 0) ? -socket_error() : -EIO;
+    }
+
+    return 0;
+}
+
+static int multifd_recv_packet(MultiFDRecvChannel *c, MultiFDPacket *hdr,
+                               struct iovec *iov, uint64_t *offsets)
+{
+    char idstr[256];
+    uint32_t num, page_size, i;
+    size_t size;
+    int ret;
+
+    num = be32_to_cpu(hdr->num);
+    page_size = be32_to_cpu(hdr->page_size);
+
+    if (be32_to_cpu(hdr->magic) != MULTIFD_MAGIC || num > MULTIFD_PAGES) {
+        error_report("multifd: channel %d: bad packet", c->id);
+        return -EINVAL;
+    }
+
+    if (!num) {
+        return 0;
+    }
+
+    ret = multifd_recv_full(c->fd, idstr, hdr->idlen);
+    if (!ret) {
+        ret = multifd_recv_full(c->fd, offsets, num * sizeof(offsets[0]));
+    }
+    if (ret) {
+        return ret;
+    }
+    idstr[hdr->idlen] = 0;
+
+    rcu_read_lock();
+    for (i = 0; i < num; i++) {
+        uint64_t offset = be64_to_cpu(offsets[i]);
+
+        iov[i].iov_base = ram_block_host(idstr, offset, page_size);
+        iov[i].iov_len = page_size;
+        if (!iov[i].iov_base) {
+            error_report("multifd: channel %d: illegal page %s:%" PRIx64,
+                         c->id, idstr, offset);
+            rcu_read_unlock();
+            return -EINVAL;
+        }
+    }
+
+    size = (size_t) num * page_size;
+    if (iov_recv(c->fd, iov, num, 0, size) != size) {
+        ret = -EIO;
+    }
+    rcu_read_unlock();
+
+    c->packets++;
+    c->bytes += size;
+
+    return ret;
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvChannel *c = opaque;
+    struct iovec iov[MULTIFD_PAGES];
+    uint64_t offsets[MULTIFD_PAGES];
+    int ret = 0;
+
+    rcu_register_thread();
+
+    while (!ret && !atomic_mb_read(&c->quit)) {
+        MultiFDPacket hdr;
+
+        ret = multifd_recv_full(c->fd, &hdr, sizeof(hdr));
+        if (!ret) {
+            ret = multifd_recv_packet(c, &hdr, iov, offsets);
+        }
+
+        if (!ret && (be32_to_cpu(hdr.flags) & MULTIFD_FLAG_SYNC)) {
+            atomic_inc(&multifd_recv_state->synced);
+            qemu_bh_schedule(multifd_recv_state->bh);
+            qemu_sem_wait(&c->sem_sync);
+        }
+    }
+
+    if (ret && !atomic_mb_read(&c->quit)) {
+        DPRINTF("channel %d: %s\n", c->id, strerror(-ret));
+        /* Do not leave the main thread waiting for our sync */
+        multifd_recv_set_error(ret);
+    }
+
+    DPRINTF("channel %d: %" PRIu64 " packets, %" PRIu64 " bytes\n",
+            c->id, c->packets, c->bytes);
+
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+static void multifd_recv_stop_listening(void)
+{
+    if (multifd_recv_state->listen_fd >= 0) {
+        qemu_set_fd_handler2(multifd_recv_state->listen_fd, NULL, NULL, NULL,
+                             NULL);
+        closesocket(multifd_recv_state->listen_fd);
+        multifd_recv_state->listen_fd = -1;
+    }
+}
+
+/*
+ * Called by the tcp: and unix: transports for each connection accepted
+ * on @listen_fd while the multifd capability is on. The first one is the
+ * main migration stream: false is returned and the transport goes on
+ * with it, but keeps listening. The following ones are taken as
+ * channels.
+ */
+bool multifd_recv_accept(int listen_fd, int fd)
+{
+    MultiFDRecvChannel *c;
+    MultiFDInit init;
+    int count = migrate_multifd_channels();
+
+    if (!multifd_recv_state) {
+        multifd_recv_state = g_malloc0(sizeof(*multifd_recv_state));
+        multifd_recv_state->listen_fd = listen_fd;
+        multifd_recv_state->bh = qemu_bh_new(multifd_recv_bh, NULL);
+        return false;
+    }
+
+    qemu_set_block(fd);
+
+    if (multifd_recv_full(fd, &init, sizeof(init)) < 0 ||
+        be32_to_cpu(init.magic) != MULTIFD_MAGIC ||
+        be32_to_cpu(init.version) != MULTIFD_VERSION ||
+        be32_to_cpu(init.id) != multifd_recv_state->count) {
+        error_report("multifd: unexpected connection, closing it");
+        closesocket(fd);
+        return true;
+    }
+
+    if (be32_to_cpu(init.count) != count) {
+        error_report("multifd: the source opened %" PRIu32 " channels, but "
+                     "multifd-channels is %d on the destination",
+                     be32_to_cpu(init.count), count);
+        closesocket(fd);
+        multifd_recv_stop_listening();
+        multifd_recv_set_error(-EINVAL);
+        return true;
+    }
+
+    c = &multifd_recv_state->channels[multifd_recv_state->count++];
+    c->id = be32_to_cpu(init.id);
+    c->fd = fd;
+    qemu_sem_init(&c->sem_sync, 0);
+    qemu_thread_create(&c->thread, "multifd_recv", multifd_recv_thread, c,
+                       QEMU_THREAD_JOINABLE);
+
+    DPRINTF("channel %d connected\n", c->id);
+
+    if (multifd_recv_state->count == count) {
+        multifd_recv_stop_listening();
+    }
+
+    qemu_bh_schedule(multifd_recv_state->bh);
+
+    return true;
+}
+
+/*
+ * RAM_SAVE_FLAG_MULTIFD_SYNC on the main stream: wait until the @count
+ * channels have applied all pages before their SYNC packet, then let
+ * them go on. Runs in the incoming migration coroutine, which yields
+ * meanwhile so that the main loop keeps running: channels which are not
+ * connected yet are accepted from it.
+ */
+int multifd_recv_sync_main(int count)
+{
+    int i, ret;
+
+    if (!multifd_recv_state || count < 1 || count > MULTIFD_MAX_CHANNELS) {
+        error_report("multifd: unexpected sync for %d channels", count);
+        return -EINVAL;
+    }
+
+    if (count != migrate_multifd_channels()) {
+        error_report("multifd: the source uses %d channels, but "
+                     "multifd-channels is %d on the destination",
+                     count, migrate_multifd_channels());
+        return -EINVAL;
+    }
+
+    while (!(ret = atomic_mb_read(&multifd_recv_state->error)) &&
+           (multifd_recv_state->count < count ||
+            atomic_mb_read(&multifd_recv_state->synced) < count)) {
+        multifd_recv_state->co = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+
+    if (ret) {
+        return ret;
+    }
+
+    atomic_mb_set(&multifd_recv_state->synced, 0);
+    for (i = 0; i < count; i++) {
+        qemu_sem_post(&multifd_recv_state->channels[i].sem_sync);
+    }
+
+    return 0;
+}
+
+void multifd_load_cleanup(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        return;
+    }
+
+    multifd_recv_stop_listening();
+
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        MultiFDRecvChannel *c = &multifd_recv_state->channels[i];
+
+        atomic_mb_set(&c->quit, true);
+        shutdown(c->fd, SHUT_RDWR);
+        qemu_sem_post(&c->sem_sync);
+        qemu_thread_join(&c->thread);
+        closesocket(c->fd);
+        qemu_sem_destroy(&c->sem_sync);
+    }
+
+    qemu_bh_delete(multifd_recv_state->bh);
+    g_free(multifd_recv_state);
+    multifd_recv_state = NULL;
+}
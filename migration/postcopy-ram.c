@@ -0,0 +1,400 @@
+/*
+ * Postcopy live migration of RAM
+ *
+ * After a first precopy pass, the source stops the VM, tells the
+ * destination which pages were dirtied since they were sent, and sends
+ * the device state. The destination drops those pages, registers guest
+ * RAM with userfaultfd and starts the VM right away. When the guest
+ * touches a page which is not there, the fault thread asks the source
+ * for it on the return path; the source sends it ahead of the pages it
+ * keeps streaming in the background, and the page is placed atomically
+ * with UFFDIO_COPY, which wakes up whoever was waiting for it.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "qemu/event_notifier.h"
+#include "qemu/rcu.h"
+#include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "migration/migration.h"
+#include "migration/postcopy-ram.h"
+#include "migration/qemu-file.h"
+
+#ifdef CONFIG_USERFAULTFD
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <linux/userfaultfd.h>
+#endif
+
+//#define DEBUG_POSTCOPY
+
+#ifdef DEBUG_POSTCOPY
+#define DPRINTF(fmt, ...) \
+    do { printf("postcopy: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+#ifdef CONFIG_USERFAULTFD
+
+typedef struct PostcopyIncomingState {
+    int uffd;
+    QemuThread fault_thread;
+    EventNotifier quit;
+    /* Return path to the source, only written by the fault thread */
+    QEMUFile *rp;
+    uint64_t faults;
+} PostcopyIncomingState;
+
+static PostcopyIncomingState *postcopy_incoming;
+
+typedef struct PostcopyRegister {
+    int uffd;
+    int ret;
+} PostcopyRegister;
+
+static int postcopy_open_uffd(void)
+{
+    struct uffdio_api api = { .api = UFFD_API };
+    int uffd;
+
+    uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (uffd < 0) {
+        error_report("postcopy: userfaultfd not available: %s",
+                     strerror(errno));
+        return -1;
+    }
+
+    if (ioctl(uffd, UFFDIO_API, &api)) {
+        error_report("postcopy: userfaultfd API mismatch: %s",
+                     strerror(errno));
+        close(uffd);
+        return -1;
+    }
+
+    return uffd;
+}
+
+static void postcopy_register_block(void *host_addr, ram_addr_t offset,
+                                    ram_addr_t length, void *opaque)
+{
+    PostcopyRegister *r = opaque;
+    struct uffdio_register reg = {
+        .range = { .start = (uintptr_t) host_addr, .len = length },
+        .mode = UFFDIO_REGISTER_MODE_MISSING,
+    };
+
+    if (r->ret) {
+        return;
+    }
+
+    if (ioctl(r->uffd, UFFDIO_REGISTER, &reg)) {
+        r->ret = -errno;
+        error_report("postcopy: cannot register RAM block %p (%" PRIu64
+                     " bytes): %s", host_addr, (uint64_t) length,
+                     strerror(errno));
+        return;
+    }
+
+    if (!(reg.ioctls & ((uint64_t) 1 << _UFFDIO_COPY)) ||
+        !(reg.ioctls & ((uint64_t) 1 << _UFFDIO_ZEROPAGE))) {
+        r->ret = -ENOTSUP;
+        error_report("postcopy: RAM block %p cannot be filled through "
+                     "userfaultfd", host_addr);
+    }
+}
+
+/*
+ * Registering every RAM block is the only reliable test: the kernel
+ * turns down memory it cannot fill on demand (hugetlbfs, shared memory
+ * on older kernels). Closing the userfaultfd drops the registrations.
+ */
+bool postcopy_ram_supported_by_host(void)
+{
+    PostcopyRegister r = { .ret = 0 };
+
+    r.uffd = postcopy_open_uffd();
+    if (r.uffd < 0) {
+        return false;
+    }
+
+    qemu_ram_foreach_block(postcopy_register_block, &r);
+    close(r.uffd);
+
+    return !r.ret;
+}
+
+/*
+ * Drop a range of pages which were dirtied after they had been sent,
+ * so that the guest faults on them until the source sends them again.
+ */
+int postcopy_ram_discard_range(const char *idstr, uint64_t start,
+                               uint64_t length)
+{
+    void *host;
+    int ret = 0;
+
+    rcu_read_lock();
+    host = ram_block_host(idstr, start, length);
+    if (!host) {
+        error_report("postcopy: cannot discard %s %" PRIx64 " + %" PRIu64,
+                     idstr, start, length);
+        ret = -EINVAL;
+    } else if (madvise(host, length, MADV_DONTNEED)) {
+        ret = -errno;
+        error_report("postcopy: cannot discard %s %" PRIx64 " + %" PRIu64
+                     ": %s", idstr, start, length, strerror(errno));
+    }
+    rcu_read_unlock();
+
+    return ret;
+}
+
+static void postcopy_request_page(PostcopyIncomingState *pis, uint64_t addr)
+{
+    const char *idstr;
+    ram_addr_t offset;
+    size_t len;
+
+    rcu_read_lock();
+    idstr = ram_block_from_host((void *)(uintptr_t) addr, &offset);
+    if (!idstr) {
+        rcu_read_unlock();
+        error_report("postcopy: fault at %" PRIx64 " outside guest RAM", addr);
+        return;
+    }
+
+    len = strlen(idstr);
+    qemu_put_be16(pis->rp, MIG_RP_MSG_REQ_PAGE);
+    qemu_put_byte(pis->rp, len);
+    qemu_put_buffer(pis->rp, (const uint8_t *) idstr, len);
+    qemu_put_be64(pis->rp, offset);
+    rcu_read_unlock();
+
+    qemu_fflush(pis->rp);
+    pis->faults++;
+}
+
+static void *postcopy_ram_fault_thread(void *opaque)
+{
+    PostcopyIncomingState *pis = opaque;
+    uint64_t page_mask = ~((uint64_t) getpagesize() - 1);
+    struct pollfd pfd[2] = {
+        { .fd = pis->uffd, .events = POLLIN },
+        { .fd = event_notifier_get_fd(&pis->quit), .events = POLLIN },
+    };
+
+    rcu_register_thread();
+
+    while (true) {
+        struct uffd_msg msg;
+        ssize_t len;
+
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("postcopy: fault thread poll failed: %s",
+                         strerror(errno));
+            break;
+        }
+
+        if (pfd[1].revents) {
+            break;
+        }
+
+        len = read(pis->uffd, &msg, sizeof(msg));
+        if (len != sizeof(msg)) {
+            if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            error_report("postcopy: fault thread read failed: %s",
+                         strerror(errno));
+            break;
+        }
+
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+
+        postcopy_request_page(pis, msg.arg.pagefault.address & page_mask);
+        if (qemu_file_get_error(pis->rp)) {
+            error_report("postcopy: lost the return path to the source");
+            break;
+        }
+    }
+
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+/*
+ * Called when the source switches to postcopy, before the device state
+ * is loaded (it may touch guest RAM already). From now on, pages on @f
+ * are placed with postcopy_place_page().
+ */
+int postcopy_ram_incoming_setup(QEMUFile *f)
+{
+    PostcopyIncomingState *pis;
+    PostcopyRegister r = { .ret = 0 };
+    int fd;
+
+    r.uffd = postcopy_open_uffd();
+    if (r.uffd < 0) {
+        return -ENOSYS;
+    }
+
+    qemu_ram_foreach_block(postcopy_register_block, &r);
+    if (r.ret) {
+        close(r.uffd);
+        return r.ret;
+    }
+
+    fd = dup(qemu_get_fd(f));
+    if (fd < 0) {
+        error_report("postcopy: cannot open the return path: %s",
+                     strerror(errno));
+        close(r.uffd);
+        return -errno;
+    }
+
+    pis = g_malloc0(sizeof(*pis));
+    pis->uffd = r.uffd;
+    /* This also makes @f blocking, as it is read by a thread from now on */
+    pis->rp = qemu_fopen_socket(fd, "wb");
+    event_notifier_init(&pis->quit, false);
+
+    qemu_thread_create(&pis->fault_thread, "postcopy_fault",
+                       postcopy_ram_fault_thread, pis, QEMU_THREAD_JOINABLE);
+
+    atomic_mb_set(&postcopy_incoming, pis);
+
+    return 0;
+}
+
+bool postcopy_ram_incoming_running(void)
+{
+    return atomic_mb_read(&postcopy_incoming) != NULL;
+}
+
+/*
+ * Fill a missing page and wake up whoever is waiting for it. The page
+ * may already be there if it was requested while it was on its way:
+ * both copies are the same.
+ */
+int postcopy_place_page(void *host, void *from, size_t size)
+{
+    struct uffdio_copy copy = {
+        .dst = (uintptr_t) host,
+        .src = (uintptr_t) from,
+        .len = size,
+    };
+
+    while (ioctl(postcopy_incoming->uffd, UFFDIO_COPY, &copy)) {
+        if (errno == EEXIST) {
+            break;
+        }
+        if (errno != EAGAIN) {
+            error_report("postcopy: cannot place page at %p: %s", host,
+                         strerror(errno));
+            return -errno;
+        }
+    }
+
+    return 0;
+}
+
+int postcopy_place_page_zero(void *host, size_t size)
+{
+    struct uffdio_zeropage zero = {
+        .range = { .start = (uintptr_t) host, .len = size },
+    };
+
+    while (ioctl(postcopy_incoming->uffd, UFFDIO_ZEROPAGE, &zero)) {
+        if (errno == EEXIST) {
+            break;
+        }
+        if (errno != EAGAIN) {
+            error_report("postcopy: cannot place zero page at %p: %s", host,
+                         strerror(errno));
+            return -errno;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Called once the source has sent every page. Pages which are still
+ * missing were never sent because they were zero: closing the
+ * userfaultfd lets the kernel fill them in, including for anybody
+ * already waiting on one.
+ */
+void postcopy_ram_incoming_cleanup(void)
+{
+    PostcopyIncomingState *pis = postcopy_incoming;
+
+    if (!pis) {
+        return;
+    }
+
+    event_notifier_set(&pis->quit);
+    qemu_thread_join(&pis->fault_thread);
+    event_notifier_cleanup(&pis->quit);
+
+    atomic_mb_set(&postcopy_incoming, NULL);
+    close(pis->uffd);
+
+    qemu_put_be16(pis->rp, MIG_RP_MSG_SHUT);
+    qemu_fclose(pis->rp);
+
+    DPRINTF("%" PRIu64 " pages requested by the guest\n", pis->faults);
+    g_free(pis);
+}
+
+#else
+
+bool postcopy_ram_supported_by_host(void)
+{
+    error_report("postcopy: needs userfaultfd support");
+    return false;
+}
+
+int postcopy_ram_discard_range(const char *idstr, uint64_t start,
+                               uint64_t length)
+{
+    return -ENOSYS;
+}
+
+int postcopy_ram_incoming_setup(QEMUFile *f)
+{
+    return -ENOSYS;
+}
+
+bool postcopy_ram_incoming_running(void)
+{
+    return false;
+}
+
+int postcopy_place_page(void *host, void *from, size_t size)
+{
+    return -ENOSYS;
+}
+
+int postcopy_place_page_zero(void *host, size_t size)
+{
+    return -ENOSYS;
+}
+
+void postcopy_ram_incoming_cleanup(void)
+{
+}
+
+#endif
@@ -27,6 +27,7 @@
 
 #include "qemu-common.h"
 #include "qemu/iov.h"
+#include "qemu/throttle.h"
 
 #define IO_BUF_SIZE 32768
 #define MAX_IOV_SIZE MIN(IOV_MAX, 64)
@@ -35,8 +36,11 @@ struct QEMUFile {
     const QEMUFileOps *ops;
     void *opaque;
 
+    /* Bytes sent since they were last added to the rate limit bucket */
     int64_t bytes_xfer;
-    int64_t xfer_limit;
+    /* In bytes/s, 0 if unlimited */
+    LeakyBucket rate_limit;
+    int64_t rate_limit_leak;
 
     int64_t pos; /* start of buffer when writing, end of buffer
                     when reading */
@@ -21,7 +21,9 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  */
+#include <zlib.h>
 #include "qemu-common.h"
+#include "qemu/error-report.h"
 #include "qemu/iov.h"
 #include "qemu/sockets.h"
 #include "block/coroutine.h"
@@ -89,6 +91,15 @@ bool qemu_file_is_writable(QEMUFile *f)
     return f->ops->writev_buffer || f->ops->put_buffer;
 }
 
+/*
+ * Returns true if RAM pages written to this file are handled
+ * by the transport (e.g. RDMA) rather than by the byte stream.
+ */
+bool qemu_file_has_ram_hooks(QEMUFile *f)
+{
+    return f->ops->save_page != NULL;
+}
+
 /**
  * Flushes QEMUFile buffer
  *
@@ -160,6 +171,33 @@ void ram_control_load_hook(QEMUFile *f, uint64_t flags)
     }
 }
 
+void ram_control_after_load(QEMUFile *f, uint64_t flags)
+{
+    int ret = 0;
+
+    if (f->ops->after_ram_load) {
+        ret = f->ops->after_ram_load(f, f->opaque, flags);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+        }
+    }
+}
+
+int ram_control_load_page(QEMUFile *f, void *host_addr, long size)
+{
+    if (f->ops->load_page) {
+        int ret = f->ops->load_page(f, f->opaque, host_addr, size);
+
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+        }
+
+        return ret;
+    }
+
+    return RAM_LOAD_CONTROL_NOT_SUPP;
+}
+
 size_t ram_control_save_page(QEMUFile *f, ram_addr_t block_offset,
                              ram_addr_t offset, size_t size,
                              uint64_t *bytes_sent)
@@ -231,6 +269,16 @@ void qemu_update_position(QEMUFile *f, size_t size)
     f->pos += size;
 }
 
+/*
+ * Account for data sent on another connection on behalf of @f, so that
+ * rate limiting and qemu_ftell() include it.
+ */
+void qemu_file_credit_transfer(QEMUFile *f, size_t size)
+{
+    f->pos += size;
+    f->bytes_xfer += size;
+}
+
 /** Closes the file
  *
  * Returns negative error value if any error happened on previous operations or
@@ -475,30 +523,76 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+/*
+ * The rate limit is a token bucket: a file which was idle can send this
+ * many milliseconds worth of data at once, and must then wait for more
+ * tokens. Waits are rounded up to the millisecond, so the traffic stays
+ * close to the limit instead of coming in bursts.
+ */
+#define RATE_LIMIT_BURST_MS 10
+
+static void qemu_file_leak_rate_limit(QEMUFile *f)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    throttle_leak_bucket(&f->rate_limit, now - f->rate_limit_leak);
+    f->rate_limit_leak = now;
+    f->rate_limit.level += f->bytes_xfer;
+    f->bytes_xfer = 0;
+}
+
+/*
+ * Returns the time in ns before the file may send again, 0 if it is not
+ * rate limited right now.
+ */
+int64_t qemu_file_rate_limit_wait(QEMUFile *f)
+{
+    int64_t wait;
+
+    if (!f->rate_limit.avg) {
+        return 0;
+    }
+    qemu_file_leak_rate_limit(f);
+    wait = throttle_compute_wait(&f->rate_limit);
+    return DIV_ROUND_UP(wait, SCALE_MS) * SCALE_MS;
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (qemu_file_get_error(f)) {
         return 1;
     }
-    if (f->xfer_limit > 0 && f->bytes_xfer > f->xfer_limit) {
-        return 1;
-    }
-    return 0;
+    return qemu_file_rate_limit_wait(f) > 0;
 }
 
+/* Returns the limit in bytes/s, INT64_MAX if the file is not limited */
 int64_t qemu_file_get_rate_limit(QEMUFile *f)
 {
-    return f->xfer_limit;
+    if (!f->rate_limit.avg) {
+        return INT64_MAX;
+    }
+    return (int64_t)f->rate_limit.avg;
 }
 
+/*
+ * Limits the file to @limit bytes/s, or lifts the limit if @limit is 0 or
+ * INT64_MAX. The bytes already sent still count against the new limit.
+ */
 void qemu_file_set_rate_limit(QEMUFile *f, int64_t limit)
 {
-    f->xfer_limit = limit;
-}
-
-void qemu_file_reset_rate_limit(QEMUFile *f)
-{
-    f->bytes_xfer = 0;
+    if (limit <= 0 || limit == INT64_MAX) {
+        f->rate_limit.avg = 0;
+        f->rate_limit.max = 0;
+        f->rate_limit.level = 0;
+        return;
+    }
+    if (!f->rate_limit.avg) {
+        f->rate_limit_leak = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        f->bytes_xfer = 0;
+    }
+    f->rate_limit.avg = limit;
+    f->rate_limit.max = MAX((double)limit * RATE_LIMIT_BURST_MS / 1000,
+                            IO_BUF_SIZE);
 }
 
 void qemu_put_be16(QEMUFile *f, unsigned int v)
@@ -546,3 +640,44 @@ uint64_t qemu_get_be64(QEMUFile *f)
     v |= qemu_get_be32(f);
     return v;
 }
+
+/*
+ * Compress @size bytes at @p with zlib at @level into the buffer of @f,
+ * preceded by their be32 length. Returns the number of bytes added to
+ * the buffer, or 0 if there is not enough room or compression failed.
+ * Meant for files opened without ops, which only collect data.
+ */
+ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
+                                  int level)
+{
+    ssize_t blen = IO_BUF_SIZE - f->buf_index - sizeof(int32_t);
+
+    if (blen < compressBound(size)) {
+        return 0;
+    }
+    if (compress2(f->buf + f->buf_index + sizeof(int32_t), (uLongf *)&blen,
+                  (Bytef *)p, size, level) != Z_OK) {
+        error_report("Compress Failed!");
+        return 0;
+    }
+    qemu_put_be32(f, blen);
+    f->buf_index += blen;
+    f->bytes_xfer += blen;
+    return blen + sizeof(int32_t);
+}
+
+/*
+ * Append the data buffered in @f_src to @f_des, and empty @f_src.
+ * Returns the number of bytes moved.
+ */
+int qemu_put_qemu_file(QEMUFile *f_des, QEMUFile *f_src)
+{
+    int len = 0;
+
+    if (f_src->buf_index > 0) {
+        len = f_src->buf_index;
+        qemu_put_buffer(f_des, f_src->buf, f_src->buf_index);
+        f_src->buf_index = 0;
+    }
+    return len;
+}
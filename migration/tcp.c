@@ -65,8 +65,12 @@ static void tcp_accept_incoming_migration(void *opaque)
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
         err = socket_error();
     } while (c < 0 && err == EINTR);
-    qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
-    closesocket(s);
+
+    /* multifd channels are accepted on the same socket */
+    if (!migrate_use_multifd()) {
+        qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
+        closesocket(s);
+    }
 
     DPRINTF("accepted migration\n");
 
@@ -76,6 +80,10 @@ static void tcp_accept_incoming_migration(void *opaque)
         return;
     }
 
+    if (migrate_use_multifd() && multifd_recv_accept(s, c)) {
+        return;
+    }
+
     f = qemu_fopen_socket(c, "rb");
     if (f == NULL) {
         error_report("could not qemu_fopen socket");
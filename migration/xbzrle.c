@@ -12,6 +12,11 @@
  */
 #include "qemu-common.h"
 #include "include/migration/migration.h"
+#include "qemu/cpuid.h"
+#include "qemu/host-utils.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*
   page = zrun nzrun
@@ -23,8 +28,10 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+
+/* Compares a long at a time, for hosts without a vector encoder */
+static int xbzrle_encode_buffer_long(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
@@ -125,6 +132,248 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+/*
+ * The vector encoders compare 64 bytes at a time into a mask (bit n set
+ * if byte n is unchanged) and walk the runs in the mask, so that each
+ * byte is only looked at once. They produce exactly the same output as
+ * xbzrle_encode_buffer_long(), including when it gives up on overflow.
+ */
+#define XBZRLE_BLOCK 64
+
+typedef uint64_t XbzrleEqualMask(const uint8_t *old_buf,
+                                 const uint8_t *new_buf);
+
+static inline uint64_t xbzrle_equal_mask_bytes(const uint8_t *old_buf,
+                                               const uint8_t *new_buf, int n)
+{
+    uint64_t mask = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        mask |= (uint64_t)(old_buf[i] == new_buf[i]) << i;
+    }
+    return mask;
+}
+
+static inline int xbzrle_encode_buffer_mask(uint8_t *old_buf, uint8_t *new_buf,
+                                            int slen, uint8_t *dst, int dlen,
+                                            XbzrleEqualMask *equal_mask)
+{
+    uint32_t zrun_len = 0, nzrun_len = 0;
+    uint8_t *nzrun_start = NULL;
+    bool zrun = true;
+    int d = 0, i;
+
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    if (slen && d + 2 > dlen) {
+        return -1;
+    }
+
+    for (i = 0; i < slen; i += XBZRLE_BLOCK) {
+        int n = MIN(XBZRLE_BLOCK, slen - i);
+        uint64_t mask, run;
+        int b = 0;
+
+        if (n == XBZRLE_BLOCK) {
+            mask = equal_mask(old_buf + i, new_buf + i);
+            if (zrun && mask == ~0ULL) {
+                zrun_len += XBZRLE_BLOCK;
+                continue;
+            }
+        } else {
+            mask = xbzrle_equal_mask_bytes(old_buf + i, new_buf + i, n);
+        }
+
+        while (b < n) {
+            /* Bits past the end of the block end the current run */
+            run = zrun ? ~mask >> b : mask >> b;
+            run = MIN(run ? ctz64(run) : 64, n - b);
+            b += run;
+
+            if (zrun) {
+                zrun_len += run;
+                if (b == n) {
+                    break;
+                }
+                d += uleb128_encode_small(dst + d, zrun_len);
+                zrun_len = 0;
+                nzrun_start = new_buf + i + b;
+                /* overflow */
+                if (d + 2 > dlen) {
+                    return -1;
+                }
+                zrun = false;
+            } else {
+                nzrun_len += run;
+                if (b == n && i + n < slen) {
+                    break;
+                }
+                d += uleb128_encode_small(dst + d, nzrun_len);
+                /* overflow */
+                if (d + nzrun_len > dlen) {
+                    return -1;
+                }
+                memcpy(dst + d, nzrun_start, nzrun_len);
+                d += nzrun_len;
+                nzrun_len = 0;
+                /* overflow */
+                if (i + b < slen && d + 2 > dlen) {
+                    return -1;
+                }
+                zrun = true;
+            }
+        }
+    }
+
+    /* buffer unchanged */
+    if (zrun_len == slen) {
+        return 0;
+    }
+
+    /* the last zero run is skipped */
+    return d;
+}
+
+#ifdef __SSE2__
+static inline uint64_t xbzrle_equal_mask_sse2(const uint8_t *old_buf,
+                                              const uint8_t *new_buf)
+{
+    const __m128i *o = (const __m128i *)old_buf;
+    const __m128i *n = (const __m128i *)new_buf;
+    uint64_t mask = 0;
+    int i;
+
+    for (i = 0; i < XBZRLE_BLOCK / sizeof(__m128i); i++) {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128(o + i),
+                                    _mm_loadu_si128(n + i));
+        mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(eq) << (i * 16);
+    }
+    return mask;
+}
+
+static int xbzrle_encode_buffer_sse2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_mask(old_buf, new_buf, slen, dst, dlen,
+                                     xbzrle_equal_mask_sse2);
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static inline uint64_t xbzrle_equal_mask_avx2(const uint8_t *old_buf,
+                                              const uint8_t *new_buf)
+{
+    const __m256i *o = (const __m256i *)old_buf;
+    const __m256i *n = (const __m256i *)new_buf;
+    uint32_t lo, hi;
+
+    lo = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(o),
+                                                _mm256_loadu_si256(n)));
+    hi = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(o + 1),
+                                                _mm256_loadu_si256(n + 1)));
+    return (uint64_t)hi << 32 | lo;
+}
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_mask(old_buf, new_buf, slen, dst, dlen,
+                                     xbzrle_equal_mask_avx2);
+}
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+#include <immintrin.h>
+
+static inline uint64_t xbzrle_equal_mask_avx512bw(const uint8_t *old_buf,
+                                                  const uint8_t *new_buf)
+{
+    return _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(old_buf),
+                                  _mm512_loadu_si512(new_buf));
+}
+
+static int xbzrle_encode_buffer_avx512bw(uint8_t *old_buf, uint8_t *new_buf,
+                                         int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_mask(old_buf, new_buf, slen, dst, dlen,
+                                     xbzrle_equal_mask_avx512bw);
+}
+#pragma GCC pop_options
+#endif
+
+typedef struct XbzrleEncoder {
+    const char *name;
+    /* CPUID_VEC_* bits the host must have, 0 if none */
+    unsigned needs;
+    int (*encode)(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                  uint8_t *dst, int dlen);
+} XbzrleEncoder;
+
+/* Fastest first; the last one is always available */
+static const XbzrleEncoder xbzrle_encoders[] = {
+#ifdef CONFIG_AVX512BW_OPT
+    { "avx512bw", CPUID_VEC_AVX512BW, xbzrle_encode_buffer_avx512bw },
+#endif
+#ifdef CONFIG_AVX2_OPT
+    { "avx2", CPUID_VEC_AVX2, xbzrle_encode_buffer_avx2 },
+#endif
+#ifdef __SSE2__
+    { "sse2", 0, xbzrle_encode_buffer_sse2 },
+#endif
+    { "long", 0, xbzrle_encode_buffer_long },
+};
+
+static unsigned xbzrle_host_accel;
+static const XbzrleEncoder *xbzrle_encoder =
+    &xbzrle_encoders[ARRAY_SIZE(xbzrle_encoders) - 1];
+
+static void xbzrle_select_encoder(const XbzrleEncoder *from)
+{
+    while ((from->needs & xbzrle_host_accel) != from->needs) {
+        from++;
+    }
+    xbzrle_encoder = from;
+}
+
+static void __attribute__((constructor)) xbzrle_init_encoder(void)
+{
+    xbzrle_host_accel = cpuid_vector_features();
+    xbzrle_select_encoder(xbzrle_encoders);
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return xbzrle_encoder->encode(old_buf, new_buf, slen, dst, dlen);
+}
+
+const char *xbzrle_encoder_name(void)
+{
+    return xbzrle_encoder->name;
+}
+
+/*
+ * Falls back to the next slower encoder the host supports, so that tests
+ * can go through all of them. Returns false once on the last one.
+ */
+bool xbzrle_encoder_next(void)
+{
+    if (xbzrle_encoder == &xbzrle_encoders[ARRAY_SIZE(xbzrle_encoders) - 1]) {
+        return false;
+    }
+    xbzrle_select_encoder(xbzrle_encoder + 1);
+    return true;
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
@@ -2858,6 +2858,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show current migration capabilities",
         .mhandler.cmd = hmp_info_migrate_capabilities,
     },
+    {
+        .name       = "migrate_parameters",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration parameters",
+        .mhandler.cmd = hmp_info_migrate_parameters,
+    },
     {
         .name       = "migrate_cache_size",
         .args_type  = "",
@@ -2865,6 +2872,20 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show current migration xbzrle cache size",
         .mhandler.cmd = hmp_info_migrate_cache_size,
     },
+    {
+        .name       = "mc_stats",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show percentiles of the last micro-checkpoint statistics",
+        .mhandler.cmd = hmp_info_mc_stats,
+    },
+    {
+        .name       = "dirty_rate",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the results of the last dirty rate measurement",
+        .mhandler.cmd = hmp_info_dirty_rate,
+    },
     {
         .name       = "balloon",
         .args_type  = "",
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set-associative, indexed by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -12,17 +12,8 @@
  *
  */
 
-#include <stdint.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <strings.h>
-#include <string.h>
-#include <sys/time.h>
-#include <sys/types.h>
-#include <stdbool.h>
-#include <glib.h>
-
 #include "qemu-common.h"
+#include "qemu/thread.h"
 #include "migration/page_cache.h"
 
 #ifdef DEBUG_CACHE
@@ -36,20 +27,29 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
-typedef struct CacheItem CacheItem;
-
-struct CacheItem {
-    uint64_t it_addr;
-    uint64_t it_age;
-    uint8_t *it_data;
-};
+/*
+ * Each address can go in any of the ways of one set. Within a set, the
+ * page to replace is picked with CLOCK: the hand skips (and clears) the
+ * ways which were used since it last went past, and the pages which are
+ * still fresh.
+ */
+typedef struct CacheSet {
+    QemuMutex lock;
+    uint64_t addr[PAGE_CACHE_WAYS];
+    uint64_t age[PAGE_CACHE_WAYS];
+    uint8_t *data[PAGE_CACHE_WAYS];
+    /* CLOCK reference bits, one per way */
+    uint32_t referenced;
+    unsigned int hand;
+    PageCacheStats stats;
+} CacheSet;
 
 struct PageCache {
-    CacheItem *page_cache;
+    CacheSet *sets;
     unsigned int page_size;
+    unsigned int ways;
+    int64_t num_sets;
     int64_t max_num_items;
-    uint64_t max_item_age;
-    int64_t num_items;
 };
 
 PageCache *cache_init(int64_t num_pages, unsigned int page_size)
@@ -75,25 +75,23 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         DPRINTF("rounding down to %" PRId64 "\n", num_pages);
     }
     cache->page_size = page_size;
-    cache->num_items = 0;
-    cache->max_item_age = 0;
+    cache->ways = MIN(num_pages, PAGE_CACHE_WAYS);
+    cache->num_sets = num_pages / cache->ways;
     cache->max_num_items = num_pages;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache sets to %" PRId64 " x %u\n", cache->num_sets,
+            cache->ways);
 
     /* We prefer not to abort if there is no memory */
-    cache->page_cache = g_try_malloc((cache->max_num_items) *
-                                     sizeof(*cache->page_cache));
-    if (!cache->page_cache) {
-        DPRINTF("Failed to allocate cache->page_cache\n");
+    cache->sets = g_try_malloc0(cache->num_sets * sizeof(*cache->sets));
+    if (!cache->sets) {
+        DPRINTF("Failed to allocate cache->sets\n");
         g_free(cache);
         return NULL;
     }
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        cache->page_cache[i].it_data = NULL;
-        cache->page_cache[i].it_age = 0;
-        cache->page_cache[i].it_addr = -1;
+    for (i = 0; i < cache->num_sets; i++) {
+        qemu_mutex_init(&cache->sets[i].lock);
     }
 
     return cache;
@@ -102,145 +100,157 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
 void cache_fini(PageCache *cache)
 {
     int64_t i;
+    unsigned int w;
 
     g_assert(cache);
-    g_assert(cache->page_cache);
+    g_assert(cache->sets);
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        g_free(cache->page_cache[i].it_data);
+    for (i = 0; i < cache->num_sets; i++) {
+        for (w = 0; w < cache->ways; w++) {
+            g_free(cache->sets[i].data[w]);
+        }
+        qemu_mutex_destroy(&cache->sets[i].lock);
     }
 
-    g_free(cache->page_cache);
-    cache->page_cache = NULL;
+    g_free(cache->sets);
+    cache->sets = NULL;
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+static CacheSet *cache_get_set(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    g_assert(cache);
+    g_assert(cache->sets);
 
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    return &cache->sets[(addr / cache->page_size) & (cache->num_sets - 1)];
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+/* Returns the way holding @addr, or -1 */
+static int cache_set_find(const PageCache *cache, const CacheSet *set,
+                          uint64_t addr)
 {
-    size_t pos;
+    unsigned int w;
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    for (w = 0; w < cache->ways; w++) {
+        if (set->data[w] && set->addr[w] == addr) {
+            return w;
+        }
+    }
+    return -1;
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+void cache_lock_page(const PageCache *cache, uint64_t addr)
+{
+    qemu_mutex_lock(&cache_get_set(cache, addr)->lock);
+}
 
-    return &cache->page_cache[pos];
+void cache_unlock_page(const PageCache *cache, uint64_t addr)
+{
+    qemu_mutex_unlock(&cache_get_set(cache, addr)->lock);
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheSet *set = cache_get_set(cache, addr);
+    int w = cache_set_find(cache, set, addr);
+
+    return w < 0 ? NULL : set->data[w];
 }
 
 bool cache_is_cached(const PageCache *cache, uint64_t addr,
                      uint64_t current_age)
 {
-    CacheItem *it;
-
-    it = cache_get_by_addr(cache, addr);
+    CacheSet *set = cache_get_set(cache, addr);
+    int w = cache_set_find(cache, set, addr);
 
-    if (it->it_addr == addr) {
-        /* update the it_age when the cache hit */
-        it->it_age = current_age;
-        return true;
+    if (w < 0) {
+        set->stats.misses++;
+        return false;
     }
-    return false;
+
+    /* update the age when the cache hit */
+    set->age[w] = current_age;
+    set->referenced |= 1u << w;
+    set->stats.hits++;
+    return true;
 }
 
-int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
-                 uint64_t current_age)
+/* Returns the way to replace, or -1 if every page is too fresh for that */
+static int cache_set_victim(const PageCache *cache, CacheSet *set,
+                            uint64_t current_age)
 {
+    unsigned int i, w;
 
-    CacheItem *it;
+    /* Twice round: the first may only clear reference bits */
+    for (i = 0; i < 2 * cache->ways; i++) {
+        w = set->hand;
+        set->hand = (set->hand + 1) % cache->ways;
 
-    /* actual update of entry */
-    it = cache_get_by_addr(cache, addr);
+        if (set->referenced & (1u << w)) {
+            set->referenced &= ~(1u << w);
+            continue;
+        }
+        if (set->age[w] + CACHED_PAGE_LIFETIME <= current_age) {
+            return w;
+        }
+    }
+    return -1;
+}
 
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
+                 uint64_t current_age)
+{
+    CacheSet *set = cache_get_set(cache, addr);
+    int w, ret = 0;
+
+    w = cache_set_find(cache, set, addr);
+    if (w < 0) {
+        /* a free way first */
+        for (w = 0; w < cache->ways && set->data[w]; w++) {
+            /* nothing */
+        }
+        if (w == cache->ways) {
+            w = cache_set_victim(cache, set, current_age);
+            if (w < 0) {
+                /* the cached pages are fresh, don't replace them */
+                set->stats.insert_fails++;
+                return -1;
+            }
+            set->stats.evictions++;
+            ret = 1;
+        }
     }
+
     /* allocate page */
-    if (!it->it_data) {
-        it->it_data = g_try_malloc(cache->page_size);
-        if (!it->it_data) {
+    if (!set->data[w]) {
+        set->data[w] = g_try_malloc(cache->page_size);
+        if (!set->data[w]) {
             DPRINTF("Error allocating page\n");
+            set->stats.insert_fails++;
             return -1;
         }
-        cache->num_items++;
     }
 
-    memcpy(it->it_data, pdata, cache->page_size);
+    memcpy(set->data[w], pdata, cache->page_size);
 
-    it->it_age = current_age;
-    it->it_addr = addr;
+    set->addr[w] = addr;
+    set->age[w] = current_age;
+    set->referenced |= 1u << w;
 
-    return 0;
+    return ret;
 }
 
-int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
+void cache_get_stats(const PageCache *cache, PageCacheStats *stats)
 {
-    PageCache *new_cache;
     int64_t i;
 
-    CacheItem *old_it, *new_it;
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < cache->num_sets; i++) {
+        const PageCacheStats *s = &cache->sets[i].stats;
 
-    g_assert(cache);
-
-    /* cache was not inited */
-    if (cache->page_cache == NULL) {
-        return -1;
+        stats->hits += s->hits;
+        stats->misses += s->misses;
+        stats->evictions += s->evictions;
+        stats->insert_fails += s->insert_fails;
     }
-
-    /* same size */
-    if (pow2floor(new_num_pages) == cache->max_num_items) {
-        return cache->max_num_items;
-    }
-
-    new_cache = cache_init(new_num_pages, cache->page_size);
-    if (!(new_cache)) {
-        DPRINTF("Error creating new cache\n");
-        return -1;
-    }
-
-    /* move all data from old cache */
-    for (i = 0; i < cache->max_num_items; i++) {
-        old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
-                /* keep the MRU page */
-                g_free(old_it->it_data);
-            } else {
-                if (!new_it->it_data) {
-                    new_cache->num_items++;
-                }
-                g_free(new_it->it_data);
-                new_it->it_data = old_it->it_data;
-                new_it->it_age = old_it->it_age;
-                new_it->it_addr = old_it->it_addr;
-            }
-        }
-    }
-
-    g_free(cache->page_cache);
-    cache->page_cache = new_cache->page_cache;
-    cache->max_num_items = new_cache->max_num_items;
-    cache->num_items = new_cache->num_items;
-
-    g_free(new_cache);
-
-    return cache->max_num_items;
 }
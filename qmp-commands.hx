@@ -732,6 +732,78 @@ Example:
 -> { "execute": "query-migrate-cache-size" }
 <- { "return": 67108864 }
 
+EQMP
+
+    {
+        .name       = "calc-dirty-rate",
+        .args_type  = "calc-time:i,sample-pages:i?",
+        .mhandler.cmd_new = qmp_marshal_input_calc_dirty_rate,
+    },
+
+SQMP
+calc-dirty-rate
+---------------
+
+Measure the rate at which the guest dirties its memory, without migrating
+it. The results are returned by query-dirty-rate.
+
+Arguments:
+
+- "calc-time": length of the measurement in seconds, 1 to 60 (json-int)
+- "sample-pages": pages hashed per GiB of RAM, 0 to 4096, default 0
+  (json-int, optional)
+
+Example:
+
+-> { "execute": "calc-dirty-rate", "arguments": { "calc-time": 2 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-dirty-rate",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_dirty_rate,
+    },
+
+SQMP
+query-dirty-rate
+----------------
+
+Return the results of the last dirty rate measurement.
+
+- "status": "unstarted", "measuring" or "measured" (json-string)
+- "start-time": start of the measurement, in seconds since the Epoch
+  (json-int, optional)
+- "calc-time": length of the measurement in seconds (json-int, optional)
+- "sample-pages": pages hashed per GiB of RAM (json-int, optional)
+- "dirty-rate": distinct pages written over the measurement, in MB/s
+  (json-int, optional)
+- "sample-dirty-rate": rate at which sampled pages changed, in MB/s
+  (json-int, optional)
+- "blocks": the same per RAM block, with its "id" and "size" and the
+  number of "dirty-pages" (json-array, optional)
+- "working-set": for increasing periods from the start of the
+  measurement, in milliseconds, the number of distinct "dirty-pages"
+  and the "dirty-rate" (json-array, optional)
+
+Example:
+
+-> { "execute": "query-dirty-rate" }
+<- { "return": {
+        "status": "measured", "start-time": 1444923017, "calc-time": 1,
+        "sample-pages": 0, "dirty-rate": 108,
+        "blocks": [ { "id": "pc.ram", "size": 1073741824,
+                      "dirty-pages": 27648, "dirty-rate": 108 } ],
+        "working-set": [ { "period": 125, "dirty-pages": 9216,
+                           "dirty-rate": 288 },
+                         { "period": 250, "dirty-pages": 14336,
+                           "dirty-rate": 224 },
+                         { "period": 500, "dirty-pages": 20480,
+                           "dirty-rate": 160 },
+                         { "period": 1000, "dirty-pages": 27648,
+                           "dirty-rate": 108 } ] } }
+
 EQMP
 
     {
@@ -801,6 +873,47 @@ Example:
 -> { "execute": "migrate-set-mc-delay", "arguments": { "value": 100 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "query-mc-stats",
+        .args_type  = "history:i?",
+        .mhandler.cmd_new = qmp_marshal_input_query_mc_stats,
+    },
+
+SQMP
+query-mc-stats
+--------------
+
+Show percentiles of the statistics of the last micro-checkpoints (up to
+1024). Times are in microseconds.
+
+Arguments:
+
+- "history": number of recent checkpoints to return individually,
+             default 0 (json-int, optional)
+
+Returns a json-object with the following information:
+
+- "epochs": number of checkpoints summarized (json-int)
+- "dirty-pages", "bytes", "slabs", "capture-time", "copy-time",
+  "xmit-time", "ack-time", "commit-latency", "held-packets": json-objects
+  with the "min", "p50", "p90", "p99" and "max" of each statistic,
+  absent if no checkpoint was taken yet
+- "history": json-array of json-objects with the statistics of each of
+  the requested checkpoints, oldest first (optional)
+
+Example:
+
+-> { "execute": "query-mc-stats" }
+<- { "return": {
+        "epochs": 1024,
+        "commit-latency": { "min": 102841, "p50": 104120, "p90": 108964,
+                            "p99": 131007, "max": 140562 },
+        ...
+     }
+   }
+
 EQMP
 
     {
@@ -2481,6 +2594,15 @@ Each json-object contain the following:
                    another request (json-int)
     - "wr_merged": number of write requests that have been merged into
                    another request (json-int)
+- "metadata-cache": Statistics of the metadata caches of the image format,
+                    e.g. the L2 and refcount caches of qcow2 (json-array,
+                    optional). Each json-object contains:
+    - "name": the cache (json-string)
+    - "size": number of tables the cache holds (json-int)
+    - "table-size": size of each table in bytes (json-int)
+    - "hits": lookups which found their table in the cache (json-int)
+    - "misses": lookups which had to load their table (json-int)
+    - "evictions": tables dropped to make room for another one (json-int)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -3277,7 +3399,13 @@ The main json-object contains the following:
             pages. This is just normal pages times size of one page,
             but this way upper levels don't need to care about page
             size (json-int)
+         - "mbps": throughput of the last 100ms, in megabits/sec
+            (json-number)
+         - "smoothed-mbps": throughput averaged over about a second, in
+            megabits/sec, used to estimate the downtime (json-number)
          - "dirty-sync-count": times that dirty ram was synchronized (json-int)
+         - "bitmap-sync-time": microseconds the last synchronization spent
+            merging the dirty log into the migration bitmap (json-int)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information:
          - "transferred": amount transferred in bytes (json-int)
@@ -3294,6 +3422,10 @@ The main json-object contains the following:
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+         - "cache-hit": number of XBZRLE page cache hits
+         - "cache-eviction": number of cached pages replaced by another
+         - "cache-insert-fail": number of pages not cached because every
+           page they could replace was too recent
 
 Examples:
 
@@ -3399,7 +3531,10 @@ Examples:
             "pages":2444343,
             "cache-miss":2244,
             "cache-miss-rate":0.123,
-            "overflow":34434
+            "overflow":34434,
+            "cache-hit":18230,
+            "cache-eviction":1530,
+            "cache-insert-fail":12
          }
       }
    }
@@ -3465,6 +3600,112 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_migrate_capabilities,
     },
 
+SQMP
+migrate-set-parameters
+----------------------
+
+Set migration parameters
+
+- "compress-level": set compression level during migration (json-int)
+- "compress-threads": set compression thread count for migration (json-int)
+- "decompress-threads": set decompression thread count for migration (json-int)
+- "mc-copy-threads": set micro-checkpoint copy thread count, 1 to 64 (json-int)
+- "mc-slo-latency": set micro-checkpoint output commit latency target in
+                    milliseconds, 0 for a fixed delay (json-int)
+- "mc-slo-min-delay": set shortest delay between micro-checkpoints in
+                      milliseconds (json-int)
+- "mc-slo-max-delay": set longest delay between micro-checkpoints in
+                      milliseconds (json-int)
+- "mc-slab-size": set micro-checkpoint slab size in bytes (json-int)
+- "mc-slab-low-watermark": set free slabs kept ready (json-int)
+- "mc-slab-high-watermark": set free slabs kept at most (json-int)
+- "mc-secondaries": set URIs of the additional secondaries
+                    (json-array of strings)
+- "mc-quorum": set destinations which must acknowledge a checkpoint,
+               0 for a majority (json-int)
+- "multifd-channels": set multifd connection count, 1 to 16 (json-int)
+
+Arguments:
+
+Example:
+
+-> { "execute": "migrate-set-parameters" , "arguments":
+      { "compress-level": 1 } }
+<- { "return": {} }
+
+-> { "execute": "migrate-set-parameters" , "arguments":
+      { "mc-secondaries": [ "tcp:10.0.0.3:6666", "tcp:10.0.0.4:6666" ],
+        "mc-quorum": 2 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "migrate-set-parameters",
+        .args_type  =
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,"
+            "mc-copy-threads:i?,"
+            "mc-slo-latency:i?,mc-slo-min-delay:i?,mc-slo-max-delay:i?,"
+            "mc-slab-size:o?,mc-slab-low-watermark:i?,"
+            "mc-slab-high-watermark:i?,"
+            "mc-secondaries:q?,mc-quorum:i?,"
+            "multifd-channels:i?",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_parameters,
+    },
+
+SQMP
+query-migrate-parameters
+------------------------
+
+Query current migration parameters
+
+- "parameters": migration parameters value
+         - "compress-level" : compression level value (json-int)
+         - "compress-threads" : compression thread count value (json-int)
+         - "decompress-threads" : decompression thread count value (json-int)
+         - "mc-copy-threads" : micro-checkpoint copy thread count (json-int)
+         - "mc-slo-latency" : output commit latency target (json-int)
+         - "mc-slo-min-delay" : shortest checkpoint delay (json-int)
+         - "mc-slo-max-delay" : longest checkpoint delay (json-int)
+         - "mc-slab-size" : slab size in bytes (json-int)
+         - "mc-slab-low-watermark" : free slabs kept ready (json-int)
+         - "mc-slab-high-watermark" : free slabs kept at most (json-int)
+         - "mc-secondaries" : additional secondaries (json-array of strings)
+         - "mc-quorum" : acknowledging destinations, 0 for a majority
+                         (json-int)
+         - "multifd-channels" : multifd connection count (json-int)
+
+Arguments:
+
+Example:
+
+-> { "execute": "query-migrate-parameters" }
+<- {
+      "return": {
+         "multifd-channels": 2,
+         "mc-quorum": 0,
+         "mc-secondaries": [],
+         "mc-slab-high-watermark": 16,
+         "mc-slab-low-watermark": 2,
+         "mc-slab-size": 5242880,
+         "mc-slo-max-delay": 1000,
+         "mc-slo-min-delay": 10,
+         "mc-slo-latency": 0,
+         "mc-copy-threads": 1,
+         "decompress-threads": 2,
+         "compress-threads": 8,
+         "compress-level": 1
+      }
+   }
+
+EQMP
+
+    {
+        .name       = "query-migrate-parameters",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_parameters,
+    },
+
 SQMP
 query-balloon
 -------------
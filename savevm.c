@@ -33,6 +33,7 @@
 #include "qemu/timer.h"
 #include "audio/audio.h"
 #include "migration/migration.h"
+#include "migration/postcopy-ram.h"
 #include "qemu/sockets.h"
 #include "qemu/queue.h"
 #include "sysemu/cpus.h"
@@ -40,6 +41,7 @@
 #include "qmp-commands.h"
 #include "trace.h"
 #include "qemu/iov.h"
+#include "qemu/rcu.h"
 #include "block/snapshot.h"
 #include "block/qapi.h"
 
@@ -633,6 +635,10 @@ void qemu_savevm_state_begin(QEMUFile *f,
     qemu_put_be32(f, QEMU_VM_FILE_MAGIC);
     qemu_put_be32(f, QEMU_VM_FILE_VERSION);
 
+    if (migrate_postcopy_ram()) {
+        qemu_savevm_send_postcopy_advise(f);
+    }
+
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         int len;
 
@@ -716,17 +722,12 @@ static bool should_send_vmdesc(void)
     return !machine->suppress_vmdesc;
 }
 
-void qemu_savevm_state_complete(QEMUFile *f)
+/* END sections of the live handlers */
+static int qemu_savevm_state_complete_live(QEMUFile *f)
 {
-    QJSON *vmdesc;
-    int vmdesc_len;
     SaveStateEntry *se;
     int ret;
 
-    trace_savevm_state_complete();
-
-    cpu_synchronize_all_states();
-
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if (!se->ops || !se->ops->save_live_complete) {
             continue;
@@ -745,13 +746,18 @@ void qemu_savevm_state_complete(QEMUFile *f)
         trace_savevm_section_end(se->idstr, se->section_id, ret);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
-            return;
+            return ret;
         }
     }
 
-    vmdesc = qjson_new();
-    json_prop_int(vmdesc, "page_size", TARGET_PAGE_SIZE);
-    json_start_array(vmdesc, "devices");
+    return 0;
+}
+
+/* FULL sections of the devices, described in @vmdesc if it is given */
+static void qemu_savevm_state_devices(QEMUFile *f, QJSON *vmdesc)
+{
+    SaveStateEntry *se;
+
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         int len;
 
@@ -760,9 +766,11 @@ void qemu_savevm_state_complete(QEMUFile *f)
         }
         trace_savevm_section_start(se->idstr, se->section_id);
 
-        json_start_object(vmdesc, NULL);
-        json_prop_str(vmdesc, "name", se->idstr);
-        json_prop_int(vmdesc, "instance_id", se->instance_id);
+        if (vmdesc) {
+            json_start_object(vmdesc, NULL);
+            json_prop_str(vmdesc, "name", se->idstr);
+            json_prop_int(vmdesc, "instance_id", se->instance_id);
+        }
 
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_FULL);
@@ -778,9 +786,30 @@ void qemu_savevm_state_complete(QEMUFile *f)
 
         vmstate_save(f, se, vmdesc);
 
-        json_end_object(vmdesc);
+        if (vmdesc) {
+            json_end_object(vmdesc);
+        }
         trace_savevm_section_end(se->idstr, se->section_id, 0);
     }
+}
+
+void qemu_savevm_state_complete(QEMUFile *f)
+{
+    QJSON *vmdesc;
+    int vmdesc_len;
+
+    trace_savevm_state_complete();
+
+    cpu_synchronize_all_states();
+
+    if (qemu_savevm_state_complete_live(f) < 0) {
+        return;
+    }
+
+    vmdesc = qjson_new();
+    json_prop_int(vmdesc, "page_size", TARGET_PAGE_SIZE);
+    json_start_array(vmdesc, "devices");
+    qemu_savevm_state_devices(f, vmdesc);
 
     qemu_put_byte(f, QEMU_VM_EOF);
 
@@ -798,6 +827,82 @@ void qemu_savevm_state_complete(QEMUFile *f)
     qemu_fflush(f);
 }
 
+/*
+ * Postcopy: the source tells the destination to get ready, which pages
+ * to drop, and then sends it the device state so that it can run. The
+ * rest of RAM follows in the usual sections.
+ */
+void qemu_savevm_send_postcopy_advise(QEMUFile *f)
+{
+    qemu_put_byte(f, QEMU_VM_POSTCOPY);
+    qemu_put_byte(f, POSTCOPY_CMD_ADVISE);
+    qemu_put_be64(f, TARGET_PAGE_SIZE);
+}
+
+void qemu_savevm_send_postcopy_discard(QEMUFile *f, const char *idstr,
+                                       uint32_t nr, const uint64_t *start,
+                                       const uint64_t *length)
+{
+    size_t len = strlen(idstr);
+    uint32_t i;
+
+    qemu_put_byte(f, QEMU_VM_POSTCOPY);
+    qemu_put_byte(f, POSTCOPY_CMD_DISCARD);
+    qemu_put_byte(f, len);
+    qemu_put_buffer(f, (const uint8_t *)idstr, len);
+    qemu_put_be32(f, nr);
+    for (i = 0; i < nr; i++) {
+        qemu_put_be64(f, start[i]);
+        qemu_put_be64(f, length[i]);
+    }
+}
+
+/*
+ * The device state goes as a single blob, so that the destination can
+ * load it while another thread keeps reading the pages it needs for
+ * that off the stream. Called with the VM stopped.
+ */
+void qemu_savevm_state_postcopy(QEMUFile *f)
+{
+    const QEMUSizedBuffer *qsb;
+    QEMUFile *bf;
+    uint8_t *buf;
+    size_t len;
+
+    trace_savevm_state_complete();
+
+    cpu_synchronize_all_states();
+
+    bf = qemu_bufopen("w", NULL);
+    qemu_savevm_state_devices(bf, NULL);
+    qemu_put_byte(bf, QEMU_VM_EOF);
+
+    qsb = qemu_buf_get(bf);
+    len = qsb_get_length(qsb);
+    buf = g_malloc(len);
+    qsb_get_buffer(qsb, 0, len, buf);
+    qemu_fclose(bf);
+
+    qemu_put_byte(f, QEMU_VM_POSTCOPY);
+    qemu_put_byte(f, POSTCOPY_CMD_RUN);
+    qemu_put_be32(f, len);
+    qemu_put_buffer(f, buf, len);
+    qemu_fflush(f);
+
+    g_free(buf);
+}
+
+/* Once every page has been sent in postcopy */
+void qemu_savevm_state_postcopy_complete(QEMUFile *f)
+{
+    if (qemu_savevm_state_complete_live(f) < 0) {
+        return;
+    }
+
+    qemu_put_byte(f, QEMU_VM_EOF);
+    qemu_fflush(f);
+}
+
 uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size)
 {
     SaveStateEntry *se;
@@ -929,37 +1034,194 @@ typedef struct LoadStateEntry {
     int version_id;
 } LoadStateEntry;
 
-int qemu_loadvm_state(QEMUFile *f)
+typedef QLIST_HEAD(, LoadStateEntry) LoadStateList;
+
+static int qemu_loadvm_state_main(QEMUFile *f, LoadStateList *handlers);
+
+static void loadvm_free_handlers(LoadStateList *handlers)
 {
-    QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
-        QLIST_HEAD_INITIALIZER(loadvm_handlers);
     LoadStateEntry *le, *new_le;
-    Error *local_err = NULL;
-    uint8_t section_type;
-    unsigned int v;
+
+    QLIST_FOREACH_SAFE(le, handlers, entry, new_le) {
+        QLIST_REMOVE(le, entry);
+        g_free(le);
+    }
+}
+
+typedef struct PostcopyListen {
+    QEMUFile *f;
+    LoadStateList handlers;
+    QemuThread thread;
+    QEMUBH *bh;
     int ret;
-    int file_error_after_eof = -1;
+} PostcopyListen;
 
-    if (qemu_savevm_state_blocked(&local_err)) {
-        error_report_err(local_err);
-        return -EINVAL;
+/* Runs in the main loop once the listen thread is done, and closes f */
+static void loadvm_postcopy_listen_bh(void *opaque)
+{
+    PostcopyListen *listen = opaque;
+    int ret = listen->ret;
+
+    qemu_thread_join(&listen->thread);
+    qemu_fclose(listen->f);
+    qemu_bh_delete(listen->bh);
+    g_free(listen);
+
+    if (ret < 0) {
+        /* The only complete copy of guest RAM is gone with the source */
+        error_report("postcopy: load of migration failed: %s",
+                     strerror(-ret));
+        exit(EXIT_FAILURE);
     }
+}
 
-    v = qemu_get_be32(f);
-    if (v != QEMU_VM_FILE_MAGIC) {
-        error_report("Not a migration stream");
-        return -EINVAL;
+/*
+ * Reads the rest of the stream once the VM runs on the destination:
+ * pages arrive in the usual RAM sections until the source is done.
+ * The stream is closed in the main loop, so that loadvm_postcopy_run()
+ * can still stop the thread and keep the stream if it fails.
+ */
+static void *loadvm_postcopy_listen_thread(void *opaque)
+{
+    PostcopyListen *listen = opaque;
+    int ret;
+
+    rcu_register_thread();
+
+    ret = qemu_loadvm_state_main(listen->f, &listen->handlers);
+    if (!ret) {
+        ret = qemu_file_get_error(listen->f);
     }
 
-    v = qemu_get_be32(f);
-    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
-        error_report("SaveVM v2 format is obsolete and don't work anymore");
-        return -ENOTSUP;
+    postcopy_ram_incoming_cleanup();
+    loadvm_free_handlers(&listen->handlers);
+
+    rcu_unregister_thread();
+
+    listen->ret = ret;
+    qemu_bh_schedule(listen->bh);
+    return NULL;
+}
+
+static int loadvm_postcopy_run(QEMUFile *f, LoadStateList *handlers)
+{
+    LoadStateList devices = QLIST_HEAD_INITIALIZER(devices);
+    PostcopyListen *listen;
+    QEMUSizedBuffer *qsb;
+    QEMUFile *bf;
+    uint8_t *buf;
+    uint32_t len;
+    int ret;
+
+    len = qemu_get_be32(f);
+    buf = g_malloc(len);
+    if (qemu_get_buffer(f, buf, len) != len) {
+        g_free(buf);
+        return -EIO;
     }
-    if (v != QEMU_VM_FILE_VERSION) {
-        error_report("Unsupported migration stream version");
-        return -ENOTSUP;
+    qsb = qsb_create(buf, len);
+    g_free(buf);
+
+    ret = postcopy_ram_incoming_setup(f);
+    if (ret < 0) {
+        qsb_free(qsb);
+        return ret;
+    }
+
+    listen = g_malloc0(sizeof(*listen));
+    listen->f = f;
+    listen->bh = qemu_bh_new(loadvm_postcopy_listen_bh, listen);
+    QLIST_INIT(&listen->handlers);
+    QLIST_SWAP(&listen->handlers, handlers, entry);
+    qemu_thread_create(&listen->thread, "postcopy_listen",
+                       loadvm_postcopy_listen_thread, listen,
+                       QEMU_THREAD_JOINABLE);
+
+    /* Devices may touch pages which are missing: they are requested */
+    bf = qemu_bufopen("r", qsb);
+    ret = qemu_loadvm_state_main(bf, &devices);
+    if (!ret) {
+        ret = qemu_file_get_error(bf);
     }
+    loadvm_free_handlers(&devices);
+    qemu_fclose(bf);
+    qsb_free(qsb);
+
+    if (ret < 0) {
+        error_report("postcopy: cannot load the device state");
+
+        /* The caller closes f: stop the listen thread first. Its bottom
+         * half cannot have run yet, we are in the main loop. */
+        if (qemu_file_shutdown(f) < 0) {
+            error_report("postcopy: cannot stop reading the stream");
+            exit(EXIT_FAILURE);
+        }
+        qemu_thread_join(&listen->thread);
+        qemu_bh_delete(listen->bh);
+        g_free(listen);
+        return ret;
+    }
+
+    cpu_synchronize_all_post_init();
+
+    return LOADVM_POSTCOPY_RUNNING;
+}
+
+static int loadvm_process_postcopy(QEMUFile *f, LoadStateList *handlers)
+{
+    uint64_t page_size, start, length;
+    uint8_t cmd = qemu_get_byte(f);
+    char idstr[256];
+    uint32_t nr;
+    int len, ret;
+
+    switch (cmd) {
+    case POSTCOPY_CMD_ADVISE:
+        page_size = qemu_get_be64(f);
+        if (page_size != TARGET_PAGE_SIZE || page_size != getpagesize()) {
+            error_report("postcopy: page size %" PRIu64 " does not match "
+                         "the host", page_size);
+            return -EINVAL;
+        }
+        if (!postcopy_ram_supported_by_host()) {
+            return -ENOTSUP;
+        }
+        return 0;
+    case POSTCOPY_CMD_DISCARD:
+        len = qemu_get_byte(f);
+        qemu_get_buffer(f, (uint8_t *)idstr, len);
+        idstr[len] = 0;
+        nr = qemu_get_be32(f);
+        while (nr--) {
+            start = qemu_get_be64(f);
+            length = qemu_get_be64(f);
+            ret = qemu_file_get_error(f);
+            if (!ret) {
+                ret = postcopy_ram_discard_range(idstr, start, length);
+            }
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        return 0;
+    case POSTCOPY_CMD_RUN:
+        return loadvm_postcopy_run(f, handlers);
+    default:
+        error_report("Unknown postcopy command %d", cmd);
+        return -EINVAL;
+    }
+}
+
+/*
+ * Returns 0 once QEMU_VM_EOF has been read (or the stream failed, see
+ * qemu_file_get_error()), LOADVM_POSTCOPY_RUNNING if another thread
+ * reads the stream from now on, or a negative error.
+ */
+static int qemu_loadvm_state_main(QEMUFile *f, LoadStateList *handlers)
+{
+    LoadStateEntry *le;
+    uint8_t section_type;
+    int ret;
 
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
@@ -986,16 +1248,14 @@ int qemu_loadvm_state(QEMUFile *f)
             if (se == NULL) {
                 error_report("Unknown savevm section or instance '%s' %d",
                              idstr, instance_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Validate version */
             if (version_id > se->version_id) {
                 error_report("savevm: unsupported version %d for '%s' v%d",
                              version_id, idstr, se->version_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Add entry */
@@ -1004,13 +1264,13 @@ int qemu_loadvm_state(QEMUFile *f)
             le->se = se;
             le->section_id = section_id;
             le->version_id = version_id;
-            QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
+            QLIST_INSERT_HEAD(handlers, le, entry);
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 error_report("error while loading state for instance 0x%x of"
                              " device '%s'", instance_id, idstr);
-                goto out;
+                return ret;
             }
             break;
         case QEMU_VM_SECTION_PART:
@@ -1018,31 +1278,81 @@ int qemu_loadvm_state(QEMUFile *f)
             section_id = qemu_get_be32(f);
 
             trace_qemu_loadvm_state_section_partend(section_id);
-            QLIST_FOREACH(le, &loadvm_handlers, entry) {
+            QLIST_FOREACH(le, handlers, entry) {
                 if (le->section_id == section_id) {
                     break;
                 }
             }
             if (le == NULL) {
                 error_report("Unknown savevm section %d", section_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 error_report("error while loading state section id %d(%s)",
                              section_id, le->se->idstr);
-                goto out;
+                return ret;
+            }
+            break;
+        case QEMU_VM_POSTCOPY:
+            ret = loadvm_process_postcopy(f, handlers);
+            if (ret) {
+                return ret;
             }
             break;
         default:
             error_report("Unknown savevm section type %d", section_type);
-            ret = -EINVAL;
-            goto out;
+            return -EINVAL;
         }
     }
 
+    return 0;
+}
+
+/*
+ * Returns 0 on success, LOADVM_POSTCOPY_RUNNING if the stream has been
+ * handed over to the postcopy listen thread (the caller must then leave
+ * @f alone, the thread closes it) or a negative error.
+ */
+int qemu_loadvm_state(QEMUFile *f)
+{
+    LoadStateList loadvm_handlers = QLIST_HEAD_INITIALIZER(loadvm_handlers);
+    Error *local_err = NULL;
+    unsigned int v;
+    int ret;
+    int file_error_after_eof = -1;
+
+    if (qemu_savevm_state_blocked(&local_err)) {
+        error_report_err(local_err);
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v != QEMU_VM_FILE_MAGIC) {
+        error_report("Not a migration stream");
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
+        error_report("SaveVM v2 format is obsolete and don't work anymore");
+        return -ENOTSUP;
+    }
+    if (v != QEMU_VM_FILE_VERSION) {
+        error_report("Unsupported migration stream version");
+        return -ENOTSUP;
+    }
+
+    ret = qemu_loadvm_state_main(f, &loadvm_handlers);
+    if (ret == LOADVM_POSTCOPY_RUNNING) {
+        /* The listen thread owns the stream now */
+        return ret;
+    }
+    if (ret < 0) {
+        goto out;
+    }
+
     file_error_after_eof = qemu_file_get_error(f);
 
     /*
@@ -1066,10 +1376,7 @@ int qemu_loadvm_state(QEMUFile *f)
     ret = 0;
 
 out:
-    QLIST_FOREACH_SAFE(le, &loadvm_handlers, entry, new_le) {
-        QLIST_REMOVE(le, entry);
-        g_free(le);
-    }
+    loadvm_free_handlers(&loadvm_handlers);
 
     if (ret == 0) {
         /* We may not have a VMDESC section, so ignore relative errors */
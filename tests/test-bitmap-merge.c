@@ -0,0 +1,107 @@
+/*
+ * bitmap_merge_clear() unit tests and benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+
+#include "qemu-common.h"
+#include "qemu/bitmap.h"
+
+#define NBITS 4096
+
+static void random_bits(unsigned long *map, long nbits, int density)
+{
+    long i;
+
+    bitmap_zero(map, nbits);
+    for (i = 0; i < nbits; i++) {
+        if (g_test_rand_int_range(0, 100) < density) {
+            set_bit(i, map);
+        }
+    }
+}
+
+static void test_accels(void)
+{
+    unsigned long *dst = bitmap_new(NBITS);
+    unsigned long *src = bitmap_new(NBITS);
+    unsigned long *expect = bitmap_new(NBITS);
+    unsigned long *rest = bitmap_new(NBITS);
+    static const int densities[] = { 0, 1, 50, 100 };
+    long nbits, count, i;
+    int d, s;
+
+    do {
+        for (nbits = 1; nbits <= NBITS; nbits += nbits < 300 ? 1 : 377) {
+            for (d = 0; d < ARRAY_SIZE(densities); d++) {
+                for (s = 0; s < ARRAY_SIZE(densities); s++) {
+                    random_bits(dst, NBITS, densities[d]);
+                    random_bits(src, NBITS, densities[s]);
+
+                    bitmap_or(expect, dst, src, nbits);
+                    bitmap_copy(rest, src, NBITS);
+                    bitmap_clear(rest, 0, nbits);
+                    count = 0;
+                    for (i = 0; i < nbits; i++) {
+                        count += test_bit(i, src) && !test_bit(i, dst);
+                    }
+
+                    g_assert_cmpint(bitmap_merge_clear(dst, src, nbits), ==,
+                                    count);
+                    g_assert(bitmap_equal(dst, expect, nbits));
+                    g_assert(bitmap_equal(src, rest, NBITS));
+                }
+            }
+        }
+    } while (bitmap_merge_next_accel());
+
+    g_free(dst);
+    g_free(src);
+    g_free(expect);
+    g_free(rest);
+}
+
+/* Throughput on a sparse dirty log, run with gtester -m perf */
+static void test_perf(void)
+{
+    /* 1 TiB of 4 KiB pages */
+    const long nbits = 1L << 28;
+    unsigned long *dst = bitmap_new(nbits);
+    unsigned long *src = bitmap_new(nbits);
+    long i;
+
+    do {
+        double t;
+
+        for (i = 0; i < nbits; i += 4099) {
+            set_bit(i, src);
+        }
+
+        g_test_timer_start();
+        bitmap_merge_clear(dst, src, nbits);
+        t = g_test_timer_elapsed();
+
+        g_test_message("%-6s %8.1f Gpages/s", bitmap_merge_accel_name(),
+                       nbits / t / 1e9);
+    } while (bitmap_merge_next_accel());
+
+    g_free(dst);
+    g_free(src);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    /* Both go through every version, the slowest is left selected */
+    if (g_test_perf()) {
+        g_test_add_func("/bitmap-merge/perf", test_perf);
+    } else {
+        g_test_add_func("/bitmap-merge/accels", test_accels);
+    }
+
+    return g_test_run();
+}
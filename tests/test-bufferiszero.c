@@ -0,0 +1,81 @@
+/*
+ * buffer_is_zero() unit tests and benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+
+#include "qemu-common.h"
+
+#define BUF_SIZE 1024
+
+static void test_accels(void)
+{
+    /* room for every alignment and a guard byte on each side */
+    uint8_t *buf = g_malloc0(BUF_SIZE + 128);
+    size_t off, len, i;
+
+    do {
+        for (off = 1; off < 65; off++) {
+            for (len = 0; len <= BUF_SIZE; len += len < 256 ? 1 : 61) {
+                uint8_t *b = buf + off;
+
+                memset(buf, 0, BUF_SIZE + 128);
+                b[-1] = 1;
+                b[len] = 1;
+                g_assert(buffer_is_zero(b, len));
+
+                for (i = 0; i < len; i++) {
+                    b[i] = 0x80;
+                    g_assert(!buffer_is_zero(b, len));
+                    b[i] = 0;
+                }
+            }
+        }
+    } while (buffer_zero_next_accel());
+
+    g_free(buf);
+}
+
+/* Throughput on zero pages, run with gtester -m perf */
+static void test_perf(void)
+{
+    const size_t len = 64 * 1024 * 1024;
+    uint8_t *buf = g_malloc0(len);
+    int i;
+
+    do {
+        double t;
+
+        g_test_timer_start();
+        for (i = 0; i < 16; i++) {
+            size_t off;
+
+            for (off = 0; off < len; off += 4096) {
+                g_assert(buffer_is_zero(buf + off, 4096));
+            }
+        }
+        t = g_test_timer_elapsed();
+
+        g_test_message("%-6s %8.1f MB/s", buffer_zero_accel_name(),
+                       16.0 * len / t / 1e6);
+    } while (buffer_zero_next_accel());
+
+    g_free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    /* Both go through every version, the slowest is left selected */
+    if (g_test_perf()) {
+        g_test_add_func("/buffer-is-zero/perf", test_perf);
+    } else {
+        g_test_add_func("/buffer-is-zero/accels", test_accels);
+    }
+
+    return g_test_run();
+}
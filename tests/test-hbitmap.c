@@ -184,6 +184,36 @@ static void hbitmap_test_reset(TestHBitmapData *data,
     }
 }
 
+/* Move a range of a flat bitmap into the HBitmap and the shadow bitmap.
+ */
+static void hbitmap_test_merge_clear(TestHBitmapData *data,
+                                     unsigned long *src,
+                                     uint64_t first, uint64_t count)
+{
+    uint64_t added = 0;
+    uint64_t i;
+
+    for (i = first; i < first + count; i++) {
+        size_t pos = i >> LOG_BITS_PER_LONG;
+        unsigned long bit = 1UL << (i & (BITS_PER_LONG - 1));
+
+        if (src[pos] & bit) {
+            added += !(data->bits[pos] & bit);
+            data->bits[pos] |= bit;
+        }
+    }
+
+    g_assert_cmpint(hbitmap_merge_clear_flat(data->hb, src, first, count),
+                    ==, added);
+    for (i = first; i < first + count; i++) {
+        size_t pos = i >> LOG_BITS_PER_LONG;
+        unsigned long bit = 1UL << (i & (BITS_PER_LONG - 1));
+
+        g_assert_cmpint(src[pos] & bit, ==, 0);
+    }
+    hbitmap_test_check(data, 0);
+}
+
 static void hbitmap_test_check_get(TestHBitmapData *data)
 {
     uint64_t count = 0;
@@ -602,6 +632,32 @@ static void test_hbitmap_truncate_shrink_large(TestHBitmapData *data,
     hbitmap_test_truncate(data, size, -diff, 0);
 }
 
+static void test_hbitmap_merge_clear(TestHBitmapData *data,
+                                     const void *unused)
+{
+    unsigned long *src = g_new0(unsigned long, L3 / BITS_PER_LONG);
+    uint64_t i;
+
+    hbitmap_test_init(data, L3, 0);
+    hbitmap_test_set(data, L1 * 3, L1);
+    hbitmap_test_set(data, L2 * 2 + 7, 3);
+
+    for (i = 0; i < L3; i += 7) {
+        src[i >> LOG_BITS_PER_LONG] |= 1UL << (i & (BITS_PER_LONG - 1));
+    }
+    memset(&src[L2 / BITS_PER_LONG * 4], 0xff, L2 / 8);
+
+    hbitmap_test_merge_clear(data, src, 0, L1);
+    hbitmap_test_merge_clear(data, src, L1 + 3, L2);
+    hbitmap_test_merge_clear(data, src, L2 * 2 - 5, 17);
+    hbitmap_test_merge_clear(data, src, L2 * 4 - 1, L2 * 3 + 2);
+    hbitmap_test_merge_clear(data, src, L3 - L1 - 1, L1 + 1);
+    /* Nothing left to move */
+    hbitmap_test_merge_clear(data, src, 0, L1);
+
+    g_free(src);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -628,6 +684,7 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/reset/empty", test_hbitmap_reset_empty);
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
+    hbitmap_test_add("/hbitmap/merge-clear", test_hbitmap_merge_clear);
 
     hbitmap_test_add("/hbitmap/truncate/nop", test_hbitmap_truncate_nop);
     hbitmap_test_add("/hbitmap/truncate/grow/negligible",
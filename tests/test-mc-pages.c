@@ -0,0 +1,82 @@
+/*
+ * Micro-checkpoint page set unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+
+#include "qemu-common.h"
+#include "migration/mc-pages.h"
+
+#define PAGE_SIZE 4096
+
+static void sum_pages(uint64_t addr, uint64_t size, void *opaque)
+{
+    uint64_t *sum = opaque;
+
+    g_assert_cmpint(addr % PAGE_SIZE, ==, 0);
+    *sum += size;
+}
+
+static void test_add(void)
+{
+    MCPages *pages = mc_pages_new();
+    uint64_t sum = 0;
+
+    mc_pages_add(pages, 0, PAGE_SIZE);
+    mc_pages_add(pages, PAGE_SIZE, PAGE_SIZE);
+    mc_pages_add(pages, 0, PAGE_SIZE);
+    g_assert_cmpint(mc_pages_count(pages), ==, 2);
+
+    mc_pages_foreach(pages, sum_pages, &sum);
+    g_assert_cmpint(sum, ==, 2 * PAGE_SIZE);
+
+    mc_pages_clear(pages);
+    g_assert_cmpint(mc_pages_count(pages), ==, 0);
+
+    mc_pages_free(pages);
+}
+
+/*
+ * A destination below the quorum skips an epoch: its pages must
+ * still be known once the sender has reset the epoch for the next
+ * checkpoint.
+ */
+static void test_skipped_epoch(void)
+{
+    MCPages *epoch = mc_pages_new();
+    MCPages *missed = mc_pages_new();
+    uint64_t addr;
+
+    for (addr = 0; addr < 8 * PAGE_SIZE; addr += PAGE_SIZE) {
+        mc_pages_add(epoch, addr, PAGE_SIZE);
+    }
+
+    mc_pages_merge(missed, epoch);
+    g_assert_cmpint(mc_pages_count(epoch), ==, 8);
+
+    /* next epoch: overlaps the previous one */
+    mc_pages_clear(epoch);
+    g_assert_cmpint(mc_pages_count(missed), ==, 8);
+
+    for (addr = 4 * PAGE_SIZE; addr < 12 * PAGE_SIZE; addr += PAGE_SIZE) {
+        mc_pages_add(epoch, addr, PAGE_SIZE);
+    }
+    mc_pages_merge(missed, epoch);
+    mc_pages_clear(epoch);
+    g_assert_cmpint(mc_pages_count(missed), ==, 12);
+
+    mc_pages_free(epoch);
+    mc_pages_free(missed);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/mc-pages/add", test_add);
+    g_test_add_func("/mc-pages/skipped-epoch", test_skipped_epoch);
+
+    return g_test_run();
+}
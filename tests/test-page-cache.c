@@ -0,0 +1,114 @@
+/*
+ * Page cache unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+
+#include "qemu-common.h"
+#include "migration/page_cache.h"
+
+#define PAGE_SIZE 64
+#define NUM_PAGES 64
+#define NUM_SETS (NUM_PAGES / PAGE_CACHE_WAYS)
+
+/* The i-th page which maps to the same set as page 0 */
+static uint64_t set0_addr(int i)
+{
+    return (uint64_t)i * PAGE_SIZE * NUM_SETS;
+}
+
+static void insert(PageCache *cache, uint64_t addr, uint8_t val,
+                   uint64_t age, int expect)
+{
+    uint8_t page[PAGE_SIZE];
+
+    memset(page, val, sizeof(page));
+    cache_lock_page(cache, addr);
+    g_assert_cmpint(cache_insert(cache, addr, page, age), ==, expect);
+    cache_unlock_page(cache, addr);
+}
+
+static bool cached(PageCache *cache, uint64_t addr, uint8_t val)
+{
+    uint8_t *data;
+    bool ret;
+
+    cache_lock_page(cache, addr);
+    data = get_cached_data(cache, addr);
+    ret = data && data[0] == val && data[PAGE_SIZE - 1] == val;
+    cache_unlock_page(cache, addr);
+    return ret;
+}
+
+static void test_insert_lookup(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    PageCacheStats stats;
+    uint64_t addr;
+
+    for (addr = 0; addr < NUM_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(!cache_is_cached(cache, addr, 0));
+        insert(cache, addr, addr / PAGE_SIZE, 0, 0);
+    }
+    for (addr = 0; addr < NUM_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(cache_is_cached(cache, addr, 1));
+        g_assert(cached(cache, addr, addr / PAGE_SIZE));
+    }
+
+    /* updating a cached page does not evict anything */
+    insert(cache, 0, 0xaa, 1, 0);
+    g_assert(cached(cache, 0, 0xaa));
+
+    cache_get_stats(cache, &stats);
+    g_assert_cmpint(stats.hits, ==, NUM_PAGES);
+    g_assert_cmpint(stats.misses, ==, NUM_PAGES);
+    g_assert_cmpint(stats.evictions, ==, 0);
+    g_assert_cmpint(stats.insert_fails, ==, 0);
+
+    cache_fini(cache);
+}
+
+static void test_eviction(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    PageCacheStats stats;
+    int i;
+
+    for (i = 0; i < PAGE_CACHE_WAYS; i++) {
+        insert(cache, set0_addr(i), i, 0, 0);
+    }
+
+    /* the set is full of fresh pages */
+    insert(cache, set0_addr(PAGE_CACHE_WAYS), 0xff, 1, -1);
+    g_assert(!cached(cache, set0_addr(PAGE_CACHE_WAYS), 0xff));
+
+    /* a hit makes page 0 fresh again, page 1 goes instead */
+    g_assert(cache_is_cached(cache, set0_addr(0), 2));
+    insert(cache, set0_addr(PAGE_CACHE_WAYS), 0xff, 2, 1);
+    g_assert(cached(cache, set0_addr(PAGE_CACHE_WAYS), 0xff));
+    g_assert(cached(cache, set0_addr(0), 0));
+    g_assert(!cached(cache, set0_addr(1), 1));
+
+    /* other sets were not touched */
+    insert(cache, PAGE_SIZE, 0x11, 2, 0);
+
+    cache_get_stats(cache, &stats);
+    g_assert_cmpint(stats.hits, ==, 1);
+    g_assert_cmpint(stats.evictions, ==, 1);
+    g_assert_cmpint(stats.insert_fails, ==, 1);
+
+    cache_fini(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page-cache/insert-lookup", test_insert_lookup);
+    g_test_add_func("/page-cache/eviction", test_eviction);
+
+    return g_test_run();
+}
@@ -179,6 +179,158 @@ static void test_encode_decode(void)
     }
 }
 
+/*
+ * Byte at a time version of the encoder, as a reference for the wire
+ * format: every encoder must produce exactly this, overflow included.
+ */
+static int encode_reference(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                            uint8_t *dst, int dlen)
+{
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0, start;
+
+    while (i < slen) {
+        if (d + 2 > dlen) {
+            return -1;
+        }
+        for (zrun_len = 0; i < slen && old_buf[i] == new_buf[i]; i++) {
+            zrun_len++;
+        }
+        if (zrun_len == slen) {
+            return 0;
+        }
+        if (i == slen) {
+            return d;
+        }
+        d += uleb128_encode_small(dst + d, zrun_len);
+        if (d + 2 > dlen) {
+            return -1;
+        }
+        start = i;
+        for (nzrun_len = 0; i < slen && old_buf[i] != new_buf[i]; i++) {
+            nzrun_len++;
+        }
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + start, nzrun_len);
+        d += nzrun_len;
+    }
+
+    return d;
+}
+
+/* Random changes, in runs of 1 to @max_run bytes */
+static void dirty_page(uint8_t *old_buf, uint8_t *new_buf, int max_run)
+{
+    int runs = g_test_rand_int_range(0, 64);
+    int i, start, len;
+
+    memcpy(new_buf, old_buf, PAGE_SIZE);
+    while (runs--) {
+        start = g_test_rand_int_range(0, PAGE_SIZE);
+        len = g_test_rand_int_range(1, max_run + 1);
+        for (i = start; i < MIN(start + len, PAGE_SIZE); i++) {
+            new_buf[i] = old_buf[i] + g_test_rand_int_range(1, 256);
+        }
+    }
+}
+
+static void test_encode_encoders(void)
+{
+    uint8_t *old_buf = g_malloc(PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(PAGE_SIZE);
+    uint8_t *expected = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *decoded = g_malloc(PAGE_SIZE);
+    static const int max_runs[] = { 1, 7, 65, 1000 };
+    int i, dlen, rc, slen, ret;
+
+    do {
+        for (i = 0; i < 4000; i++) {
+            memset(old_buf, i, PAGE_SIZE);
+            old_buf[g_test_rand_int_range(0, PAGE_SIZE)] = 0;
+            dirty_page(old_buf, new_buf, max_runs[i % ARRAY_SIZE(max_runs)]);
+
+            /* partial pages and short output buffers too */
+            slen = i % 3 ? PAGE_SIZE : g_test_rand_int_range(0, 512) * 8;
+            dlen = i % 5 ? PAGE_SIZE : g_test_rand_int_range(0, PAGE_SIZE);
+
+            ret = encode_reference(old_buf, new_buf, slen, expected, dlen);
+            rc = xbzrle_encode_buffer(old_buf, new_buf, slen, compressed,
+                                      dlen);
+            g_assert_cmpint(rc, ==, ret);
+            if (rc <= 0) {
+                continue;
+            }
+            g_assert(memcmp(compressed, expected, rc) == 0);
+
+            memcpy(decoded, old_buf, PAGE_SIZE);
+            dlen = xbzrle_decode_buffer(compressed, rc, decoded, PAGE_SIZE);
+            g_assert_cmpint(dlen, <=, slen);
+            g_assert(memcmp(decoded, new_buf, slen) == 0);
+        }
+    } while (xbzrle_encoder_next());
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(expected);
+    g_free(compressed);
+    g_free(decoded);
+}
+
+/* Throughput of each encoder, run with gtester -m perf */
+static void test_encode_perf(void)
+{
+    const int pages = 16384;
+    uint8_t *old_buf = g_malloc(PAGE_SIZE * pages);
+    uint8_t *new_buf = g_malloc(PAGE_SIZE * pages);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    static const int max_runs[] = { 0, 1, 16, 256 };
+    int i, j;
+
+    for (i = 0; i < PAGE_SIZE * pages; i++) {
+        old_buf[i] = g_test_rand_int();
+    }
+
+    do {
+        for (j = 0; j < ARRAY_SIZE(max_runs); j++) {
+            int64_t bytes = 0;
+            double t;
+
+            for (i = 0; i < pages; i++) {
+                if (max_runs[j]) {
+                    dirty_page(old_buf + i * PAGE_SIZE,
+                               new_buf + i * PAGE_SIZE, max_runs[j]);
+                } else {
+                    memcpy(new_buf + i * PAGE_SIZE, old_buf + i * PAGE_SIZE,
+                           PAGE_SIZE);
+                }
+            }
+
+            g_test_timer_start();
+            for (i = 0; i < pages; i++) {
+                int rc = xbzrle_encode_buffer(old_buf + i * PAGE_SIZE,
+                                              new_buf + i * PAGE_SIZE,
+                                              PAGE_SIZE, compressed,
+                                              PAGE_SIZE);
+                bytes += MAX(rc, 0);
+            }
+            t = g_test_timer_elapsed();
+
+            g_test_message("%-8s runs up to %3d bytes: %8.1f MB/s, "
+                           "%" PRId64 " bytes encoded",
+                           xbzrle_encoder_name(), max_runs[j],
+                           (double)PAGE_SIZE * pages / t / 1e6, bytes);
+        }
+    } while (xbzrle_encoder_next());
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -191,6 +343,12 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    /* These go through every encoder, the slowest is left selected */
+    if (g_test_perf()) {
+        g_test_add_func("/xbzrle/encode_perf", test_encode_perf);
+    } else {
+        g_test_add_func("/xbzrle/encode_encoders", test_encode_encoders);
+    }
 
     return g_test_run();
 }
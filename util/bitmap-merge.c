@@ -0,0 +1,156 @@
+/*
+ * Moving the bits of a dirty log into another bitmap
+ *
+ * Migration does this for every page of guest RAM on each dirty bitmap
+ * sync, so it has an AVX2 version selected with cpuid when QEMU starts.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "qemu/bitmap.h"
+#include "qemu/cpuid.h"
+#include "qemu/host-utils.h"
+
+static long bitmap_merge_int(unsigned long *dst, unsigned long *src,
+                             long nr_words)
+{
+    long i, count = 0;
+
+    for (i = 0; i < nr_words; i++) {
+        unsigned long s = src[i];
+
+        if (s) {
+            count += ctpopl(s & ~dst[i]);
+            dst[i] |= s;
+            src[i] = 0;
+        }
+    }
+    return count;
+}
+
+/* 64-bit hosts only, for _mm256_extract_epi64 */
+#if defined(CONFIG_AVX2_OPT) && HOST_LONG_BITS == 64
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+/*
+ * Four 64-bit words at a time. Most of a dirty log is zero, so those
+ * vectors are skipped before dst is even loaded. The new bits are
+ * counted a nibble at a time with a lookup table, and the byte counts
+ * summed into 64-bit lanes with psadbw.
+ */
+static long bitmap_merge_avx2(unsigned long *dst, unsigned long *src,
+                              long nr_words)
+{
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+                                         1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3,
+                                         1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    long i;
+
+    for (i = 0; i + 4 <= nr_words; i += 4) {
+        __m256i s = _mm256_loadu_si256((__m256i *)(src + i));
+        __m256i d, n, c;
+
+        if (_mm256_testz_si256(s, s)) {
+            continue;
+        }
+        d = _mm256_loadu_si256((__m256i *)(dst + i));
+        n = _mm256_andnot_si256(d, s);
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(d, s));
+        _mm256_storeu_si256((__m256i *)(src + i), zero);
+
+        c = _mm256_add_epi8(
+            _mm256_shuffle_epi8(lut, _mm256_and_si256(n, nibble)),
+            _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(n, 4),
+                                                      nibble)));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(c, zero));
+    }
+
+    return _mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) +
+           _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3) +
+           bitmap_merge_int(dst + i, src + i, nr_words - i);
+}
+#pragma GCC pop_options
+#endif
+
+typedef struct BitmapMergeAccel {
+    const char *name;
+    /* CPUID_VEC_* bits the host must have, 0 if none */
+    unsigned needs;
+    long (*merge)(unsigned long *dst, unsigned long *src, long nr_words);
+} BitmapMergeAccel;
+
+/* Fastest first; the last one is always available */
+static const BitmapMergeAccel bitmap_merge_accels[] = {
+#if defined(CONFIG_AVX2_OPT) && HOST_LONG_BITS == 64
+    { "avx2", CPUID_VEC_AVX2, bitmap_merge_avx2 },
+#endif
+    { "int", 0, bitmap_merge_int },
+};
+
+static unsigned bitmap_merge_host_accel;
+static const BitmapMergeAccel *bitmap_merge_accel =
+    &bitmap_merge_accels[ARRAY_SIZE(bitmap_merge_accels) - 1];
+
+static void bitmap_merge_select_accel(const BitmapMergeAccel *from)
+{
+    while ((from->needs & bitmap_merge_host_accel) != from->needs) {
+        from++;
+    }
+    bitmap_merge_accel = from;
+}
+
+static void __attribute__((constructor)) bitmap_merge_init_accel(void)
+{
+    bitmap_merge_host_accel = cpuid_vector_features();
+    bitmap_merge_select_accel(bitmap_merge_accels);
+}
+
+/*
+ * ORs the first @nbits of @src into @dst and clears them in @src.
+ * Returns the number of bits which were not already set in @dst.
+ *
+ * Neither bitmap is accessed atomically: the caller must make sure
+ * nobody else writes to these words meanwhile.
+ */
+long bitmap_merge_clear(unsigned long *dst, unsigned long *src, long nbits)
+{
+    long nr_words = nbits / BITS_PER_LONG;
+    long count = bitmap_merge_accel->merge(dst, src, nr_words);
+
+    if (nbits % BITS_PER_LONG) {
+        unsigned long s = src[nr_words] & BITMAP_LAST_WORD_MASK(nbits);
+
+        count += ctpopl(s & ~dst[nr_words]);
+        dst[nr_words] |= s;
+        src[nr_words] &= ~s;
+    }
+    return count;
+}
+
+const char *bitmap_merge_accel_name(void)
+{
+    return bitmap_merge_accel->name;
+}
+
+/*
+ * Falls back to the next slower version the host supports, so that tests
+ * can go through all of them. Returns false once on the last one.
+ */
+bool bitmap_merge_next_accel(void)
+{
+    const BitmapMergeAccel *last =
+        &bitmap_merge_accels[ARRAY_SIZE(bitmap_merge_accels) - 1];
+
+    if (bitmap_merge_accel == last) {
+        return false;
+    }
+    bitmap_merge_select_accel(bitmap_merge_accel + 1);
+    return true;
+}
@@ -0,0 +1,221 @@
+/*
+ * Checking whether a buffer is all zeroes
+ *
+ * Used on every page of a migration or a dump, and on every cluster that
+ * qemu-img converts, so it has vector versions selected with cpuid when
+ * QEMU starts.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "qemu/cpuid.h"
+#include "qemu/bswap.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* The accelerated versions need at least this many bytes */
+#define BUFFER_ZERO_MIN_LEN 64
+
+static bool buffer_zero_int(const void *buf, size_t len)
+{
+    const unsigned char *b = buf;
+    const uint64_t *p, *e;
+    uint64_t t;
+
+    if (len < 8) {
+        unsigned char c = 0;
+
+        while (len--) {
+            c |= *b++;
+        }
+        return !c;
+    }
+
+    /* Unaligned head and tail, aligned words in between */
+    t = ldq_he_p(b) | ldq_he_p(b + len - 8);
+    p = (const uint64_t *)(((uintptr_t)b + 8) & -8);
+    e = (const uint64_t *)(((uintptr_t)b + len) & -8);
+
+    for (; p + 8 <= e; p += 8) {
+        if (t) {
+            return false;
+        }
+        t = p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7];
+    }
+    while (p < e) {
+        t |= *p++;
+    }
+
+    return !t;
+}
+
+/*
+ * The vector versions load the first and last vector unaligned, and the
+ * aligned ones in between four at a time, only testing the accumulated
+ * value once per iteration.
+ */
+
+#ifdef __SSE2__
+static bool buffer_zero_sse2(const void *buf, size_t len)
+{
+    const __m128i *p = (const __m128i *)(((uintptr_t)buf + 16) & -16);
+    const __m128i *e = (const __m128i *)(((uintptr_t)buf + len) & -16);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i t = _mm_loadu_si128(buf);
+
+    for (; p + 4 <= e; p += 4) {
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(t, zero)) != 0xffff) {
+            return false;
+        }
+        t = _mm_or_si128(_mm_or_si128(p[0], p[1]), _mm_or_si128(p[2], p[3]));
+    }
+    while (p < e) {
+        t = _mm_or_si128(t, *p++);
+    }
+    t = _mm_or_si128(t, _mm_loadu_si128(buf + len - 16));
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(t, zero)) == 0xffff;
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static bool buffer_zero_avx2(const void *buf, size_t len)
+{
+    const __m256i *p = (const __m256i *)(((uintptr_t)buf + 32) & -32);
+    const __m256i *e = (const __m256i *)(((uintptr_t)buf + len) & -32);
+    __m256i t = _mm256_loadu_si256(buf);
+
+    for (; p + 4 <= e; p += 4) {
+        if (!_mm256_testz_si256(t, t)) {
+            return false;
+        }
+        t = _mm256_or_si256(_mm256_or_si256(p[0], p[1]),
+                            _mm256_or_si256(p[2], p[3]));
+    }
+    while (p < e) {
+        t = _mm256_or_si256(t, *p++);
+    }
+    t = _mm256_or_si256(t, _mm256_loadu_si256(buf + len - 32));
+
+    return _mm256_testz_si256(t, t);
+}
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#include <immintrin.h>
+
+static bool buffer_zero_avx512(const void *buf, size_t len)
+{
+    const __m512i *p = (const __m512i *)(((uintptr_t)buf + 64) & -64);
+    const __m512i *e = (const __m512i *)(((uintptr_t)buf + len) & -64);
+    __m512i t = _mm512_loadu_si512(buf);
+
+    for (; p + 4 <= e; p += 4) {
+        if (_mm512_test_epi64_mask(t, t)) {
+            return false;
+        }
+        t = _mm512_or_si512(_mm512_or_si512(p[0], p[1]),
+                            _mm512_or_si512(p[2], p[3]));
+    }
+    while (p < e) {
+        t = _mm512_or_si512(t, *p++);
+    }
+    t = _mm512_or_si512(t, _mm512_loadu_si512(buf + len - 64));
+
+    return !_mm512_test_epi64_mask(t, t);
+}
+#pragma GCC pop_options
+#endif
+
+typedef struct BufferZeroAccel {
+    const char *name;
+    /* CPUID_VEC_* bits the host must have, 0 if none */
+    unsigned needs;
+    bool (*is_zero)(const void *buf, size_t len);
+} BufferZeroAccel;
+
+/* Fastest first; the last one is always available */
+static const BufferZeroAccel buffer_zero_accels[] = {
+#ifdef CONFIG_AVX512BW_OPT
+    { "avx512", CPUID_VEC_AVX512F, buffer_zero_avx512 },
+#endif
+#ifdef CONFIG_AVX2_OPT
+    { "avx2", CPUID_VEC_AVX2, buffer_zero_avx2 },
+#endif
+#ifdef __SSE2__
+    { "sse2", 0, buffer_zero_sse2 },
+#endif
+    { "int", 0, buffer_zero_int },
+};
+
+static unsigned buffer_zero_host_accel;
+static const BufferZeroAccel *buffer_zero_accel =
+    &buffer_zero_accels[ARRAY_SIZE(buffer_zero_accels) - 1];
+
+static void buffer_zero_select_accel(const BufferZeroAccel *from)
+{
+    while ((from->needs & buffer_zero_host_accel) != from->needs) {
+        from++;
+    }
+    buffer_zero_accel = from;
+}
+
+static void __attribute__((constructor)) buffer_zero_init_accel(void)
+{
+    buffer_zero_host_accel = cpuid_vector_features();
+    buffer_zero_select_accel(buffer_zero_accels);
+}
+
+/*
+ * Checks if a buffer is all zeroes. There is no restriction on the
+ * alignment or length of the buffer.
+ */
+bool buffer_is_zero(const void *buf, size_t len)
+{
+    const unsigned char *b = buf;
+
+    if (len < BUFFER_ZERO_MIN_LEN) {
+        return buffer_zero_int(buf, len);
+    }
+
+    /*
+     * Buffers with data mostly have some in their first bytes: check
+     * them before anything else, they are needed anyway.
+     */
+    if (ldq_he_p(b) | ldq_he_p(b + 8) | ldq_he_p(b + 16) | ldq_he_p(b + 24)) {
+        return false;
+    }
+
+    return buffer_zero_accel->is_zero(buf, len);
+}
+
+const char *buffer_zero_accel_name(void)
+{
+    return buffer_zero_accel->name;
+}
+
+/*
+ * Falls back to the next slower version the host supports, so that tests
+ * can go through all of them. Returns false once on the last one.
+ */
+bool buffer_zero_next_accel(void)
+{
+    const BufferZeroAccel *last =
+        &buffer_zero_accels[ARRAY_SIZE(buffer_zero_accels) - 1];
+
+    if (buffer_zero_accel == last) {
+        return false;
+    }
+    buffer_zero_select_accel(buffer_zero_accel + 1);
+    return true;
+}
@@ -13,6 +13,8 @@
 #include <glib.h>
 #include <assert.h>
 #include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/bitmap.h"
 #include "qemu/hbitmap.h"
 #include "qemu/host-utils.h"
 #include "trace.h"
@@ -480,3 +482,106 @@ bool hbitmap_merge(HBitmap *a, const HBitmap *b)
 
     return true;
 }
+
+/* Set @mask in word @pos of @level, and propagate up while a word changes
+ * from zero to non-zero.  Other threads may be doing the same meanwhile.
+ */
+static void hb_set_word_atomic(HBitmap *hb, int level, uint64_t pos,
+                               unsigned long mask)
+{
+    /* The sentinel in level 0 always stops the loop.  */
+    for (;;) {
+        unsigned long *elem = &hb->levels[level][pos];
+
+        if ((atomic_read(elem) & mask) == mask ||
+            atomic_fetch_or(elem, mask) != 0) {
+            return;
+        }
+        mask = 1UL << (pos & (BITS_PER_LONG - 1));
+        pos >>= BITS_PER_LEVEL;
+        level--;
+    }
+}
+
+/* Move the bits of @mask from word @pos of @src into the last level.  */
+static uint64_t hb_merge_clear_word(HBitmap *hb, unsigned long *src,
+                                    uint64_t pos, unsigned long mask)
+{
+    unsigned long bits, old;
+
+    if (!(atomic_read(&src[pos]) & mask)) {
+        return 0;
+    }
+    bits = atomic_fetch_and(&src[pos], ~mask) & mask;
+    old = atomic_fetch_or(&hb->levels[HBITMAP_LEVELS - 1][pos], bits);
+    return ctpopl(bits & ~old);
+}
+
+/* Move [start, end) from @src into the last level, where both ends lie
+ * under the same word of the 2nd-last level.  Only the first and last
+ * words may be shared with another caller.
+ */
+static uint64_t hb_merge_clear_group(HBitmap *hb, unsigned long *src,
+                                     uint64_t start, uint64_t end)
+{
+    unsigned long *last_level = hb->levels[HBITMAP_LEVELS - 1];
+    uint64_t pos = start >> BITS_PER_LEVEL;
+    uint64_t lastpos = (end - 1) >> BITS_PER_LEVEL;
+    unsigned long mask = 0;
+    uint64_t count = 0;
+    uint64_t i;
+
+    if (pos == lastpos) {
+        count = hb_merge_clear_word(hb, src, pos,
+                                    BITMAP_FIRST_WORD_MASK(start) &
+                                    BITMAP_LAST_WORD_MASK(end));
+    } else {
+        uint64_t first = pos, last = lastpos;
+
+        if (start & (BITS_PER_LONG - 1)) {
+            count += hb_merge_clear_word(hb, src, first++,
+                                         BITMAP_FIRST_WORD_MASK(start));
+        }
+        if (end & (BITS_PER_LONG - 1)) {
+            count += hb_merge_clear_word(hb, src, last,
+                                         BITMAP_LAST_WORD_MASK(end));
+        } else {
+            last++;
+        }
+        count += bitmap_merge_clear(last_level + first, src + first,
+                                    (last - first) * BITS_PER_LONG);
+    }
+
+    if (!count) {
+        return 0;
+    }
+    for (i = pos; i <= lastpos; i++) {
+        if (atomic_read(&last_level[i])) {
+            mask |= 1UL << (i & (BITS_PER_LONG - 1));
+        }
+    }
+    hb_set_word_atomic(hb, HBITMAP_LEVELS - 2, pos >> BITS_PER_LEVEL, mask);
+    return count;
+}
+
+uint64_t hbitmap_merge_clear_flat(HBitmap *hb, unsigned long *src,
+                                  uint64_t start, uint64_t count)
+{
+    /* Bits under one word of the 2nd-last level.  */
+    const uint64_t group = (uint64_t)BITS_PER_LONG << BITS_PER_LEVEL;
+    uint64_t end = start + count;
+    uint64_t next, added = 0;
+
+    assert(hb->granularity == 0);
+    assert(end <= hb->size);
+
+    for (; start < end; start = next) {
+        next = MIN((start | (group - 1)) + 1, end);
+        added += hb_merge_clear_group(hb, src, start, next);
+    }
+
+    if (added) {
+        atomic_add(&hb->count, added);
+    }
+    return added;
+}